@@ -30,7 +30,7 @@ $(PKGDLL).dll:	$(OBJ)
 turtle.dll:	turtle.obj
 		$(LD) /dll /out:$@ $(LDFLAGS) turtle.obj $(PLLIB) $(LIBS)
 
-turtle.obj:	turtle.c turtle_chars.c
+turtle.obj:	turtle.c turtle_chars.c rdf_sink.h
 
 install:	idll ilib
 
@@ -669,7 +669,7 @@ destroy_atom_map(term_t handle)
     return FALSE;
 
   LOCK(m);
-  if ( m->defer.active )
+  if ( deferred_scanning(&m->defer) )
   { UNLOCK(m);
     return PL_permission_error("destroy", "atom_map", handle);
   }
@@ -677,6 +677,7 @@ destroy_atom_map(term_t handle)
   skiplist_destroy(&m->list);
   UNLOCK(m);
   simpleMutexDelete(&m->lock);
+  destroy_defer_free(&m->defer);
   free(m);
 
   return TRUE;
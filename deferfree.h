@@ -22,6 +22,7 @@
 
 #ifndef PL_DEFER_FREE_H_INCLUDED
 #define PL_DEFER_FREE_H_INCLUDED
+#include <string.h>
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 This header supports freeing data in   datastructures  that are designed
@@ -48,12 +49,23 @@ And, it demands writers to call the following rather than PL_free():
 		      (*finalizer)(void*mem, void*client_data),
 		      client_data)
 
-Actual freeing the  objects  is  deferred   until  there  are  no readers
-scanning the object.  Note  that  this   is  too  strong  a requirement.
-Ideally, we'd pick the free list  and   wait  until all threads have had
-some point where they finished all their scanning activities. I.e., this
-schema leads to long defers actually freeing  memory if there are almost
-continuously threads that batter a datastructure.
+Freeing is based on epochs.  Each   deferred  object  is stamped with a
+new value of the epoch counter of the  handle. Each Prolog thread has a
+slot in the handle.  The  outermost   enter_scan()  of a thread records
+the epoch at which it started in its  slot and exit_scan() clears it. An
+object can be freed if it was  stamped   before  all scans that are still
+active started: such scans cannot have seen  the object because it was
+unlinked before it was stamped. Objects are thus reclaimed as soon as the
+scans that might use them have   finished, regardless of other readers.
+Previously we waited until no thread was scanning, which may never happen
+for a datastructure that is constantly in use.
+
+exit_scan() of the outermost scan  of   a  thread tries to reclaim. Only
+one thread at a time does so; others leave the job to it.
+
+Threads that are not Prolog  threads  have   no  thread  id.  They use a
+shared counter instead. While such a  thread   is  scanning, no memory
+is reclaimed.
 
 TODO:
 
@@ -61,12 +73,6 @@ TODO:
   We should somehow clear up this list if it gets too big. This should
   be doable by atomically removing it from the free structure and
   deleting it.
-
-  - If we discover that we do not get into an inactive state for a long
-  time, we should somehow switch to a different technique. The different
-  technique may imply that we pick the free list and wait until all
-  threads have finished their scan.  Not sure there is a fairly elegant
-  way to switch between the two techniques.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 /* TODO: Use tagged pointers to have both finalized destruction and
@@ -78,13 +84,24 @@ typedef struct defer_cell
   void		    *mem;			/* guarded memory */
   void		   (*finalizer)(void*mem, void*client_data);
   void		    *client_data;
+  uint64_t	     epoch;			/* Epoch it was freed */
 } defer_cell;
 
+typedef struct defer_thread
+{ unsigned int	nesting;			/* Nested enter_scan() */
+  uint64_t	epoch;				/* Scan started; 0: idle */
+} defer_thread;
+
+#define DEFER_MAX_BLOCKS 20			/* allows for 2M threads */
+
 typedef struct defer_free
-{ unsigned int	active;				/* Active users */
+{ unsigned int	active;				/* Active users without slot */
   defer_cell   *free_cells;			/* List if free cells */
   defer_cell   *freed;				/* Freed objects */
   size_t	allocated;			/* Allocated free cells */
+  uint64_t	epoch;				/* Last epoch stamped */
+  int		reclaiming;			/* A thread is reclaiming */
+  defer_thread *threads[DEFER_MAX_BLOCKS];	/* Per-thread slots */
 } defer_free;
 
 
@@ -142,21 +159,29 @@ alloc_defer_cell(defer_free *df)
 }
 
 
+static void
+push_freed_list(defer_free *df, defer_cell *list, defer_cell *last)
+{ defer_cell *o;
+
+  do
+  { o = df->freed;
+    last->next = o;
+  } while ( !__sync_bool_compare_and_swap(&df->freed, o, list) );
+}
+
+
 /* TBD: what to do of alloc_defer_cell() return NULL?
 */
 
 static inline void
 deferred_free(defer_free *df, void *data)
 { defer_cell *c = alloc_defer_cell(df);
-  defer_cell *o;
 
   c->mem       = data;
   c->finalizer = NULL;
+  c->epoch     = __sync_add_and_fetch(&df->epoch, 1);
 
-  do
-  { o = df->freed;
-    c->next = o;
-  } while ( !__sync_bool_compare_and_swap(&df->freed, o, c) );
+  push_freed_list(df, c, c);
 }
 
 
@@ -165,46 +190,227 @@ deferred_finalize(defer_free *df, void *data,
 		 void (*finalizer)(void *data, void *client_data),
 		 void *client_data)
 { defer_cell *c = alloc_defer_cell(df);
-  defer_cell *o;
 
   c->mem	 = data;
   c->finalizer	 = finalizer;
   c->client_data = client_data;
+  c->epoch	 = __sync_add_and_fetch(&df->epoch, 1);
+
+  push_freed_list(df, c, c);
+}
+
+
+		 /*******************************
+		 *	   THREAD SLOTS		*
+		 *******************************/
+
+/* Slots are allocated in blocks that double in size, such that block
+   i holds threads 2^(i-1) ... 2^i-1.  Blocks are never released while
+   the handle is in use, so readers need no locks.
+*/
+
+#define DEFER_MSB(i)	  ((i) ? (32 - __builtin_clz(i)) : 0)
+#define DEFER_BLOCKLEN(i) ((i) ? (size_t)1<<((i)-1) : 1)
+
+static defer_thread *
+defer_thread_slot(defer_free *df, int tid)
+{ int idx = DEFER_MSB((unsigned int)tid);
+  defer_thread *block;
+
+  if ( idx >= DEFER_MAX_BLOCKS )
+    return NULL;
+  if ( !(block=df->threads[idx]) )
+  { size_t bs = DEFER_BLOCKLEN(idx);
+    defer_thread *new = malloc(bs*sizeof(*new));
+
+    if ( !new )
+      return NULL;
+    memset(new, 0, bs*sizeof(*new));
+    if ( __sync_bool_compare_and_swap(&df->threads[idx], NULL, new-bs) )
+      block = new-bs;
+    else
+    { free(new);
+      block = df->threads[idx];
+    }
+  }
+
+  return &block[tid];
+}
+
+
+/* load_epoch() and store_epoch() access an epoch.  Plain 64-bit
+   access is not atomic on 32-bit hardware.  A stale value is safe as
+   it only delays reclaiming.
+*/
+
+static inline uint64_t
+load_epoch(uint64_t *ep)
+{ if ( sizeof(void*) >= sizeof(uint64_t) )
+    return *ep;
+  else
+    return __sync_add_and_fetch(ep, 0);
+}
+
+static inline void
+store_epoch(uint64_t *ep, uint64_t e)
+{ if ( sizeof(void*) >= sizeof(uint64_t) )
+  { *ep = e;
+  } else
+  { uint64_t o;
+
+    do
+    { o = *ep;
+    } while ( !__sync_bool_compare_and_swap(ep, o, e) );
+  }
+}
+
+
+/* oldest_scan_epoch() returns the epoch at which the oldest active
+   scan started or UINT64_MAX if there are no active scans.
+*/
+
+static uint64_t
+oldest_scan_epoch(defer_free *df)
+{ uint64_t oldest = UINT64_MAX;
+  int idx;
+
+  if ( df->active )
+    return 0;
+
+  for(idx=1; idx<DEFER_MAX_BLOCKS; idx++)
+  { defer_thread *block = df->threads[idx];
+
+    if ( block )
+    { size_t tid, end = DEFER_BLOCKLEN(idx)*2;
+
+      for(tid=DEFER_BLOCKLEN(idx); tid<end; tid++)
+      { uint64_t e = load_epoch(&block[tid].epoch);
+
+	if ( e && e < oldest )
+	  oldest = e;
+      }
+    }
+  }
+
+  return oldest;
+}
+
+
+/* reclaim_deferred() frees all objects that were stamped before the
+   oldest active scan started and puts the others back.
+*/
+
+static void
+reclaim_deferred(defer_free *df)
+{ defer_cell *o, *next;
+  defer_cell *keep = NULL, *keep_last = NULL;
+  defer_cell *done = NULL, *done_last = NULL;
+  uint64_t oldest;
+
+  if ( !df->freed ||
+       !__sync_bool_compare_and_swap(&df->reclaiming, FALSE, TRUE) )
+    return;
 
   do
   { o = df->freed;
-    c->next = o;
-  } while ( !__sync_bool_compare_and_swap(&df->freed, o, c) );
-}
+  } while ( o && !__sync_bool_compare_and_swap(&df->freed, o, NULL) );
+  oldest = oldest_scan_epoch(df);
+
+  for(; o; o=next)
+  { next = o->next;
+
+    if ( o->epoch < oldest )
+    { if ( o->finalizer )
+	(*o->finalizer)(o->mem, o->client_data);
+      free(o->mem);
+      o->next = done;
+      done = o;
+      if ( !done_last )
+	done_last = o;
+    } else
+    { o->next = keep;
+      keep = o;
+      if ( !keep_last )
+	keep_last = o;
+    }
+  }
 
+  if ( done )
+    free_defer_list(df, done, done_last);
+  if ( keep )
+    push_freed_list(df, keep, keep_last);
+
+  __sync_synchronize();
+  df->reclaiming = FALSE;
+}
 
 
 static inline void
 enter_scan(defer_free *df)
-{ __sync_add_and_fetch(&df->active, 1);
+{ int tid = PL_thread_self();
+  defer_thread *dt;
+
+  if ( tid > 0 && (dt=defer_thread_slot(df, tid)) )
+  { if ( dt->nesting++ == 0 )
+    { store_epoch(&dt->epoch,		/* objects freed before are safe */
+		  load_epoch(&df->epoch)+1);
+      __sync_synchronize();
+    }
+  } else
+  { __sync_add_and_fetch(&df->active, 1);
+  }
 }
 
 
 static inline void
 exit_scan(defer_free *df)
-{ defer_cell *o = df->freed;
-
-  if ( __sync_sub_and_fetch(&df->active, 1) == 0 )
-  { if ( o && __sync_bool_compare_and_swap(&df->freed, o, NULL) )
-    { defer_cell *fl = o;
-
-      for(;;)
-      { if ( o->finalizer )
-	  (*o->finalizer)(o->mem, o->client_data);
-	free(o->mem);
-
-	if ( o->next )
-	{ o = o->next;
-	} else
-	{ free_defer_list(df, fl, o);
-	  break;
-	}
-      }
+{ int tid = PL_thread_self();
+  defer_thread *dt;
+
+  if ( tid > 0 && (dt=defer_thread_slot(df, tid)) && dt->nesting > 0 )
+  { if ( --dt->nesting == 0 )
+    { __sync_synchronize();
+      store_epoch(&dt->epoch, 0);
+      reclaim_deferred(df);
+    }
+  } else
+  { if ( __sync_sub_and_fetch(&df->active, 1) == 0 )
+      reclaim_deferred(df);
+  }
+}
+
+
+/* deferred_scanning() is true if some thread is inside enter_scan()
+   ... exit_scan()
+*/
+
+static inline int
+deferred_scanning(defer_free *df)
+{ return oldest_scan_epoch(df) != UINT64_MAX;
+}
+
+
+/* destroy_defer_free() releases all resources of df.  No thread may
+   use df.  Objects that are still deferred are freed.
+*/
+
+static inline void
+destroy_defer_free(defer_free *df)
+{ defer_cell *o, *next;
+  int idx;
+
+  for(o=df->freed; o; o=next)
+  { next = o->next;
+    if ( o->finalizer )
+      (*o->finalizer)(o->mem, o->client_data);
+    free(o->mem);
+  }
+  df->freed = NULL;
+
+  for(idx=1; idx<DEFER_MAX_BLOCKS; idx++)
+  { if ( df->threads[idx] )
+    { free(df->threads[idx]+DEFER_BLOCKLEN(idx));
+      df->threads[idx] = NULL;
     }
   }
 }
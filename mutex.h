@@ -37,6 +37,25 @@ controlled using the following macros:
 	simpleMutexTryLock(p)	Try Lock a simple mutex
 	simpleMutexUnlock(p)	unlock a simple mutex
 
+	type simpleCondition	Condition variable used with a simpleMutex
+
+	simpleConditionInit(c)	    Initialise a condition
+	simpleConditionDelete(c)    Delete a condition
+	simpleConditionWait(c, p)   Wait for c, releasing the locked mutex p
+	simpleConditionTimedWait(c, p, ms)
+				    As simpleConditionWait(), waiting at
+				    most ms milliseconds
+	simpleConditionBroadcast(c) Wake all threads waiting for c
+
+	type simpleRWLock	Non-recursive readers-writer lock
+
+	simpleRWLockInit(l)	    Initialise a readers-writer lock
+	simpleRWLockDelete(l)	    Delete a readers-writer lock
+	simpleRWLockShared(l)	    Lock for shared access
+	simpleRWUnlockShared(l)	    Unlock after shared access
+	simpleRWLockExclusive(l)    Lock for exclusive access
+	simpleRWUnlockExclusive(l)  Unlock after exclusive access
+
 This file is a modified copy  of SWI-Prolog's pl-mutex.h, providing only
 the simple mutexes.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
@@ -62,9 +81,28 @@ the simple mutexes.
 #define simpleMutexLock(p)	EnterCriticalSection(p)
 #define simpleMutexUnlock(p)	LeaveCriticalSection(p)
 
+#define simpleCondition CONDITION_VARIABLE
+
+#define simpleConditionInit(c)	    InitializeConditionVariable(c)
+#define simpleConditionDelete(c)    (void)0
+#define simpleConditionWait(c, p)   SleepConditionVariableCS(c, p, INFINITE)
+#define simpleConditionTimedWait(c, p, ms) \
+	SleepConditionVariableCS(c, p, ms)
+#define simpleConditionBroadcast(c) WakeAllConditionVariable(c)
+
+#define simpleRWLock SRWLOCK
+
+#define simpleRWLockInit(l)	    InitializeSRWLock(l)
+#define simpleRWLockDelete(l)	    (void)0
+#define simpleRWLockShared(l)	    AcquireSRWLockShared(l)
+#define simpleRWUnlockShared(l)	    ReleaseSRWLockShared(l)
+#define simpleRWLockExclusive(l)    AcquireSRWLockExclusive(l)
+#define simpleRWUnlockExclusive(l)  ReleaseSRWLockExclusive(l)
+
 #else /* USE_CRITICAL_SECTIONS */
 
 #include <pthread.h>
+#include <time.h>
 
 typedef pthread_mutex_t simpleMutex;
 
@@ -73,6 +111,37 @@ typedef pthread_mutex_t simpleMutex;
 #define simpleMutexLock(p)	pthread_mutex_lock(p)
 #define simpleMutexUnlock(p)	pthread_mutex_unlock(p)
 
+typedef pthread_cond_t simpleCondition;
+
+#define simpleConditionInit(c)	    pthread_cond_init(c, NULL)
+#define simpleConditionDelete(c)    pthread_cond_destroy(c)
+#define simpleConditionWait(c, p)   pthread_cond_wait(c, p)
+#define simpleConditionBroadcast(c) pthread_cond_broadcast(c)
+
+static inline int
+simpleConditionTimedWait(simpleCondition *c, simpleMutex *p, long ms)
+{ struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec  += ms/1000;
+  deadline.tv_nsec += (ms%1000)*1000000;
+  if ( deadline.tv_nsec >= 1000000000 )
+  { deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  return pthread_cond_timedwait(c, p, &deadline);
+}
+
+typedef pthread_rwlock_t simpleRWLock;
+
+#define simpleRWLockInit(l)	    pthread_rwlock_init(l, NULL)
+#define simpleRWLockDelete(l)	    pthread_rwlock_destroy(l)
+#define simpleRWLockShared(l)	    pthread_rwlock_rdlock(l)
+#define simpleRWUnlockShared(l)	    pthread_rwlock_unlock(l)
+#define simpleRWLockExclusive(l)    pthread_rwlock_wrlock(l)
+#define simpleRWUnlockExclusive(l)  pthread_rwlock_unlock(l)
+
 #endif /*USE_CRITICAL_SECTIONS*/
 
 #endif /*MUTEX_H_DEFINED*/
@@ -24,11 +24,21 @@
 #include <SWI-Stream.h>
 #include <SWI-Prolog.h>
 #include <string.h>
+#include <stdlib.h>
+#include <wchar.h>
+#include "rdf_sink.h"
 #include "turtle_chars.c"
 
 install_t install_ntriples(void);
 
 static atom_t ATOM_end_of_file;
+static atom_t ATOM_graph;
+static atom_t ATOM_anon_prefix;
+static atom_t ATOM_on_error;
+static atom_t ATOM_error;
+static atom_t ATOM_warning;
+static atom_t ATOM_count;
+static atom_t ATOM_error_count;
 
 static functor_t FUNCTOR_node1;
 static functor_t FUNCTOR_literal1;
@@ -765,6 +775,381 @@ next:
 }
 
 
+		 /*******************************
+		 *	   DIRECT LOADING	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ntriples_load_db/3 reads the lines of  an   N-Triples  or N-Quads stream
+and adds the triples directly to the RDF  store using the triple sink of
+rdf_db.so (see rdf_sink.h). Reading stops at  the first line that starts
+at or after a given byte offset. This allows rdf_ntriples.pl to split a
+large file into chunks that are loaded by multiple threads.
+
+Unlike read_ntriple/2, which may read  ahead   into  the next line after
+blank or comment lines, we must  never   look  beyond the end-of-line of
+the current statement to keep the chunks disjoint.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static rdf_sink_api *sink_api;
+
+static int
+get_sink_api(rdf_sink_api **api)
+{ if ( !sink_api )
+  { static predicate_t pred;
+    term_t av;
+    void *ptr;
+
+    if ( !pred )
+      pred = PL_predicate("rdf_sink_api_", 1, "rdf_db");
+
+    if ( !(av = PL_new_term_ref()) ||
+	 !PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, pred, av) ||
+	 !PL_get_pointer(av, &ptr) )
+      return FALSE;
+    if ( ((rdf_sink_api*)ptr)->version != RDF_SINK_API_VERSION )
+      return PL_existence_error("rdf_sink_api", av);
+
+    sink_api = ptr;
+  }
+
+  *api = sink_api;
+  return TRUE;
+}
+
+
+static int
+print_warning(term_t t)
+{ static predicate_t print_message2;
+  term_t av;
+
+  if ( !print_message2 )
+    print_message2 = PL_predicate("print_message", 2, "system");
+
+  if ( (av = PL_new_term_refs(2)) &&
+       PL_put_atom(av+0, ATOM_warning) &&
+       PL_put_term(av+1, t) )
+    return PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, print_message2, av);
+
+  return FALSE;
+}
+
+
+typedef struct load_state
+{ rdf_sink     *sink;			/* Where the triples go */
+  atom_t	graph;			/* Default graph */
+  wchar_t      *anon_prefix;		/* Prefix for node(Id) */
+  int		on_error;		/* ATOM_error or ATOM_warning */
+  size_t	count;			/* # triples loaded */
+  size_t	error_count;		/* # syntax errors */
+} load_state;
+
+
+/* get_node_atom() translates a resource as returned by read_subject()
+   and read_object() into an atom.  The returned atom is registered.
+*/
+
+static atom_t
+get_node_atom(load_state *ls, term_t t)
+{ atom_t a;
+
+  if ( PL_get_atom(t, &a) )
+  { PL_register_atom(a);
+    return a;
+  } else
+  { term_t id = PL_new_term_ref();
+    wchar_t *s;
+    size_t len;
+
+    _PL_get_arg(1, t, id);
+    if ( PL_get_wchars(id, &len, &s, CVT_ATOM|CVT_EXCEPTION) )
+    { size_t plen = wcslen(ls->anon_prefix);
+      wchar_t *name = malloc((plen+len)*sizeof(wchar_t));
+
+      if ( name )
+      { wcsncpy(name, ls->anon_prefix, plen);
+	wcsncpy(name+plen, s, len);
+	a = PL_new_atom_wchars(plen+len, name);
+	free(name);
+	return a;
+      }
+      PL_resource_error("memory");
+    }
+    return 0;
+  }
+}
+
+
+static int
+sink_ntriple(load_state *ls, term_t av, int has_graph)
+{ atom_t s = 0, p = 0, o = 0, lt = 0, g = 0;
+  int rc = FALSE;
+
+  if ( (s=get_node_atom(ls, av+0)) &&
+       (p=get_node_atom(ls, av+1)) &&
+       (!has_graph || (g=get_node_atom(ls, av+3))) )
+  { atom_t graph = (g ? g : ls->graph);
+
+    if ( PL_is_functor(av+2, FUNCTOR_literal1) )
+    { term_t a = PL_new_term_ref();
+      int qualifier = RDF_SINK_PLAIN;
+
+      _PL_get_arg(1, av+2, a);
+      if ( PL_is_functor(a, FUNCTOR_lang2) )
+	qualifier = RDF_SINK_LANG;
+      else if ( PL_is_functor(a, FUNCTOR_type2) )
+	qualifier = RDF_SINK_TYPE;
+      if ( qualifier != RDF_SINK_PLAIN )
+      { term_t q = PL_new_term_ref();
+
+	_PL_get_arg(1, a, q);
+	_PL_get_arg(2, a, a);
+	if ( !PL_get_atom(q, &lt) )
+	  goto out;
+      }
+      if ( PL_get_atom(a, &o) )
+	rc = sink_api->add_literal(ls->sink, s, p, o, qualifier, lt,
+				   graph, RDF_SINK_NO_LINE);
+      o = 0;				/* not registered */
+    } else if ( (o=get_node_atom(ls, av+2)) )
+    { rc = sink_api->add_resource(ls->sink, s, p, o,
+				  graph, RDF_SINK_NO_LINE);
+    }
+  }
+
+out:
+  if ( s ) PL_unregister_atom(s);
+  if ( p ) PL_unregister_atom(p);
+  if ( o ) PL_unregister_atom(o);
+  if ( g ) PL_unregister_atom(g);
+
+  return rc;
+}
+
+
+static int
+skip_eol_line(IOSTREAM *in, int *cp)
+{ if ( skip_ws(in, cp) )
+  { int c = *cp;
+
+    if ( c == '\n' || c == EOF )
+      return TRUE;
+    if ( c == '\r' )
+    { if ( Speekcode(in) == '\n' )
+	(void)Sgetcode(in);
+      return TRUE;
+    }
+    if ( c == '#' )
+    { do
+      { c = Sgetcode(in);
+      } while ( c != EOF && c != '\n' );
+      *cp = c;
+      return !Sferror(in);
+    }
+
+    return syntax_error(in, "end-of-line expected");
+  } else
+  { return FALSE;
+  }
+}
+
+
+/* load_ntriple() processes a single line.  Returns TRUE if a triple was
+   added, -1 on end-of-file and FALSE otherwise.
+*/
+
+static int
+load_ntriple(load_state *ls, IOSTREAM *in)
+{ int c = Sgetcode(in);
+
+  if ( !skip_ws(in, &c) )
+    return FALSE;
+
+  if ( c == EOF )
+  { return -1;
+  } else if ( c == '#' )
+  { do
+    { c = Sgetcode(in);
+    } while ( c != EOF && c != '\n' );
+    return FALSE;
+  } else if ( is_eol(c) )
+  { return FALSE;
+  } else
+  { term_t av = PL_new_term_refs(4);
+    int has_graph = FALSE;
+
+    if ( read_subject(in, av+0, &c) &&
+	 skip_ws(in, &c) &&
+	 read_predicate(in, av+1, &c) &&
+	 skip_ws(in, &c) &&
+	 read_object(in, av+2, &c) &&
+	 skip_ws(in, &c) )
+    { if ( c == '<' || c == '_' )		/* N-Quads graph label */
+      { if ( !(c == '<' ? read_uniref(in, av+3, &c)
+		        : read_node_id(in, av+3, &c)) ||
+	     !skip_ws(in, &c) )
+	  return FALSE;
+	has_graph = TRUE;
+      }
+
+      if ( check_full_stop(in, &c) &&
+	   skip_eol_line(in, &c) )
+	return sink_ntriple(ls, av, has_graph);
+    }
+
+    return FALSE;
+  }
+}
+
+
+static int
+get_load_options(term_t options, load_state *ls,
+		 term_t *count, term_t *error_count)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  while(PL_get_list_ex(tail, head, tail))
+  { atom_t name;
+    int arity;
+
+    if ( PL_get_name_arity(head, &name, &arity) && arity == 1 )
+    { _PL_get_arg(1, head, arg);
+
+      if ( name == ATOM_graph )
+      { if ( !PL_get_atom_ex(arg, &ls->graph) )
+	  return FALSE;
+      } else if ( name == ATOM_anon_prefix )
+      { wchar_t *s;
+
+	if ( !PL_get_wchars(arg, NULL, &s, CVT_ATOM|CVT_EXCEPTION) )
+	  return FALSE;
+	if ( ls->anon_prefix )
+	  free(ls->anon_prefix);
+	if ( !(ls->anon_prefix = malloc((wcslen(s)+1)*sizeof(wchar_t))) )
+	  return PL_resource_error("memory");
+	wcscpy(ls->anon_prefix, s);
+      } else if ( name == ATOM_on_error )
+      { atom_t a;
+
+	if ( !PL_get_atom_ex(arg, &a) )
+	  return FALSE;
+	if ( a != ATOM_error && a != ATOM_warning )
+	  return PL_domain_error("on_error_option", arg);
+	ls->on_error = a;
+      } else if ( name == ATOM_count )
+      { *count = PL_copy_term_ref(arg);
+      } else if ( name == ATOM_error_count )
+      { *error_count = PL_copy_term_ref(arg);
+      }
+    } else
+      return PL_type_error("option", head);
+  }
+
+  if ( !PL_get_nil_ex(tail) )
+    return FALSE;
+  if ( !ls->graph )
+    return PL_existence_error("graph_option", options);
+  if ( !ls->anon_prefix )
+    return PL_existence_error("anon_prefix_option", options);
+
+  return TRUE;
+}
+
+
+/** ntriples_load_db(+Stream, +End, +Options) is det.
+ *
+ * Load triples from Stream until we  reach   a  line that starts at or
+ * after the byte offset End.  If End is negative, load upto the end
+ * of the input.  Options:
+ *
+ *   - graph(+Graph)
+ *     Graph for triples (required).  N-Quads lines use their
+ *     own graph label.
+ *   - anon_prefix(+Prefix)
+ *     Prefix for blank nodes (required)
+ *   - on_error(+Mode)
+ *     One of `warning` (default) or `error`
+ *   - count(-Count)
+ *   - error_count(-Count)
+*/
+
+static foreign_t
+ntriples_load_db(term_t from, term_t end, term_t options)
+{ IOSTREAM *in;
+  rdf_sink_api *api;
+  load_state ls;
+  term_t count = 0, error_count = 0;
+  int64_t end_pos;
+  int rc = FALSE;
+
+  memset(&ls, 0, sizeof(ls));
+  ls.on_error = ATOM_warning;
+
+  if ( !PL_get_int64_ex(end, &end_pos) ||
+       !get_sink_api(&api) ||
+       !get_load_options(options, &ls, &count, &error_count) )
+  { if ( ls.anon_prefix )
+      free(ls.anon_prefix);
+    return FALSE;
+  }
+
+  if ( !PL_get_stream_handle(from, &in) )
+  { free(ls.anon_prefix);
+    return FALSE;
+  }
+
+  if ( (ls.sink = api->open()) )
+  { fid_t fid = PL_open_foreign_frame();
+
+    for(;;)
+    { int lrc;
+
+      if ( end_pos >= 0 )
+      { int64_t here = Stell64(in);
+
+	if ( here < 0 || here >= end_pos )
+	  break;
+      }
+
+      if ( (lrc=load_ntriple(&ls, in)) == -1 )
+	break;
+      if ( lrc == TRUE )
+      { if ( ++ls.count % 10000 == 0 && PL_handle_signals() < 0 )
+	  break;
+      } else if ( PL_exception(0) )
+      { term_t ex;
+
+	if ( ls.on_error == ATOM_error )
+	  break;
+	ex = PL_copy_term_ref(PL_exception(0));
+	PL_clear_exception();
+	ls.error_count++;
+	if ( !print_warning(ex) )
+	  break;
+      }
+
+      PL_rewind_foreign_frame(fid);
+    }
+
+    rc = !PL_exception(0);
+    PL_close_foreign_frame(fid);
+    if ( !api->close(ls.sink, rc) )
+      rc = FALSE;
+  } else
+  { PL_resource_error("memory");
+  }
+
+  free(ls.anon_prefix);
+  if ( !PL_release_stream(in) )
+    rc = FALSE;
+
+  return ( rc &&
+	   (!count || PL_unify_int64(count, ls.count)) &&
+	   (!error_count || PL_unify_int64(error_count, ls.error_count)) );
+}
+
+
 		 /*******************************
 		 *	       INSTALL		*
 		 *******************************/
@@ -775,6 +1160,13 @@ next:
 install_t
 install_ntriples(void)
 { ATOM_end_of_file = PL_new_atom("end_of_file");
+  ATOM_graph	   = PL_new_atom("graph");
+  ATOM_anon_prefix = PL_new_atom("anon_prefix");
+  ATOM_on_error	   = PL_new_atom("on_error");
+  ATOM_error	   = PL_new_atom("error");
+  ATOM_warning	   = PL_new_atom("warning");
+  ATOM_count	   = PL_new_atom("count");
+  ATOM_error_count = PL_new_atom("error_count");
 
   MKFUNCTOR(node,         1);
   MKFUNCTOR(literal,      1);
@@ -785,5 +1177,6 @@ install_ntriples(void)
   MKFUNCTOR(syntax_error, 1);
   MKFUNCTOR(stream,       4);
 
-  PL_register_foreign("read_ntriple", 2, read_ntriple, 0);
+  PL_register_foreign("read_ntriple",     2, read_ntriple,     0);
+  PL_register_foreign("ntriples_load_db", 3, ntriples_load_db, 0);
 }
@@ -101,7 +101,7 @@ gen_t
 oldest_query_geneneration(rdf_db *db, gen_t *reindex_gen)
 { int tid;
   gen_t gen = db->snapshots.keep;
-  gen_t ren = GEN_MAX;
+  gen_t ren = db->changes.reindex_keep;
   query_admin *qa = &db->queries;
   per_thread *td = &qa->query.per_thread;
 
@@ -112,6 +112,9 @@ oldest_query_geneneration(rdf_db *db, gen_t *reindex_gen)
 		   gen_name(db->snapshots.keep, buf));
 	});
 
+  if ( db->changes.keep < gen )		/* see rdf_changes_since/5 */
+    gen = db->changes.keep;
+
   for(tid=1; tid <= qa->query.thread_max; tid++)
   { thread_info **tis;
     thread_info *ti;
@@ -254,6 +257,7 @@ open_query(rdf_db *db)
     q->tr_gen = GEN_TBASE;
     q->wr_gen = GEN_UNDEF;
   }
+  q->drop_cache.graph_id = 0;
 
   push_query(db, q);
 
@@ -289,6 +293,7 @@ open_transaction(rdf_db *db,
   }
 
   q->wr_gen = q->tr_gen;
+  q->drop_cache.graph_id = 0;
   ti->queries.transaction = q;
 
   init_triple_buffer(added);
@@ -297,6 +302,11 @@ open_transaction(rdf_db *db,
   q->transaction_data.added = added;
   q->transaction_data.deleted = deleted;
   q->transaction_data.updated = updated;
+  q->transaction_data.serializable =
+	( q->transaction && q->transaction->transaction_data.serializable );
+  q->transaction_data.read_all = FALSE;
+  q->transaction_data.reads = NULL;
+  ATOMIC_INC(&db->queries.write.transactions);
 
   push_query(db, q);
 
@@ -330,6 +340,126 @@ init_query_admin(rdf_db *db)
   simpleMutexInit(&qa->query.lock);
   simpleMutexInit(&qa->write.lock);
   simpleMutexInit(&qa->write.generation_lock);
+  simpleRWLockInit(&qa->write.link);
+  simpleMutexInit(&qa->write.group.lock);
+  simpleConditionInit(&qa->write.group.done);
+}
+
+
+		 /*******************************
+		 *	   GROUP COMMIT		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Each modification that is not part of a   transaction steps the global
+generation under generation_lock and write.lock. With many threads that
+commit small transactions, these locks are the main point of contention.
+group_commit() queues the modification.  If  no   thread  is  applying a
+group, the caller becomes the leader: it  takes the queue, acquires the
+locks once and applies all queued  modifications   using  the same new
+generation.  Other  callers  wait  until  the  leader  has  applied their
+modification. Readers thus see either none or all of the group, which is
+a valid serialization as the modifications   were  committed concurrently.
+Each thread waits for its own commit,  so   the  order of commits of one
+thread is preserved.
+
+Modifications inside a transaction only step  the generation of their own
+transaction and are applied immediately.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef void (*commit_func)(query *q, gen_t gen, void *closure);
+
+typedef struct commit_request
+{ struct commit_request *next;		/* next in queue */
+  query	       *query;			/* Query that commits */
+  commit_func	func;			/* Apply modification */
+  void	       *closure;		/* Closure for func */
+  int		done;			/* Applied by the leader */
+  gen_t		gen;			/* Generation used */
+} commit_request;
+
+
+static gen_t
+apply_commit(query *q, commit_func func, void *closure)
+{ rdf_db *db = q->db;
+  gen_t gen;
+
+  simpleMutexLock(&db->queries.write.generation_lock);
+  simpleMutexLock(&db->queries.write.lock);
+  gen = queryWriteGen(q) + 1;
+  (*func)(q, gen, closure);
+  setWriteGen(q, gen);
+  simpleMutexUnlock(&db->queries.write.lock);
+  simpleMutexUnlock(&db->queries.write.generation_lock);
+
+  return gen;
+}
+
+
+static gen_t
+group_commit(query *q, commit_func func, void *closure)
+{ rdf_db *db = q->db;
+  commit_request r, *rq, *group;
+  size_t count = 0;
+  gen_t gen;
+
+  if ( q->transaction )
+    return apply_commit(q, func, closure);
+
+  r.next    = NULL;
+  r.query   = q;
+  r.func    = func;
+  r.closure = closure;
+  r.done    = FALSE;
+
+  simpleMutexLock(&db->queries.write.group.lock);
+  if ( db->queries.write.group.tail )
+    db->queries.write.group.tail->next = &r;
+  else
+    db->queries.write.group.head = &r;
+  db->queries.write.group.tail = &r;
+
+  while ( !r.done && db->queries.write.group.leader )
+    simpleConditionWait(&db->queries.write.group.done,
+			&db->queries.write.group.lock);
+  if ( r.done )
+  { simpleMutexUnlock(&db->queries.write.group.lock);
+    return r.gen;
+  }
+
+  db->queries.write.group.leader = TRUE;
+  group = db->queries.write.group.head;
+  db->queries.write.group.head = NULL;
+  db->queries.write.group.tail = NULL;
+  simpleMutexUnlock(&db->queries.write.group.lock);
+
+  simpleMutexLock(&db->queries.write.generation_lock);
+  simpleMutexLock(&db->queries.write.lock);
+  db->queries.write.commit_seq++;	/* see exact_count() */
+  MEMORY_BARRIER();
+  gen = queryWriteGen(q) + 1;
+  for(rq=group; rq; rq=rq->next)
+  { (*rq->func)(rq->query, gen, rq->closure);
+    count++;
+  }
+  setWriteGen(q, gen);
+  MEMORY_BARRIER();
+  db->queries.write.commit_seq++;
+  simpleMutexUnlock(&db->queries.write.lock);
+  simpleMutexUnlock(&db->queries.write.generation_lock);
+
+  simpleMutexLock(&db->queries.write.group.lock);
+  for(rq=group; rq; rq=rq->next)		/* waiters check under lock */
+  { rq->gen  = gen;
+    rq->done = TRUE;
+  }
+  db->queries.write.group.leader = FALSE;
+  db->queries.write.group.groups++;
+  db->queries.write.group.commits += count;
+  simpleConditionBroadcast(&db->queries.write.group.done);
+  simpleMutexUnlock(&db->queries.write.group.lock);
+
+  return gen;
 }
 
 
@@ -427,10 +557,10 @@ We have three basic triple manipulations:
   - Updated triples (expressed as deleting and adding)
 
 add_triples() adds an array of  triples   to  the database, stepping the
-database generation by 1. Calls to add triples must be synchronized with
-other addition calls, but not  with   read  nor  delete operations. This
-synchronization is needed because without we   cannot set the generation
-for new queries to a proper value.
+database generation by 1. The generation  update must be synchronized
+with other addition calls, but not  with   read  nor  delete operations.
+This synchronization is needed because without   we cannot set the
+generation for new queries to a proper value.
 
 To reduce the locked time, we perform this in multiple steps:
 
@@ -438,7 +568,8 @@ To reduce the locked time, we perform this in multiple steps:
     the database.
   - In the link-phase, we add the triples in packages of ADD_CHUNK_SIZE
     to the database, but addressed in the far future.  No reader sees
-    see what we are doing.
+    see what we are doing.  This does not need db->queries.write.lock,
+    so multiple threads can link concurrently (see link_triples()).
   - Next, we grab the generation_lock and update the triples to
     the next generation and increment the generation to make them
     visible.
@@ -447,10 +578,30 @@ To reduce the locked time, we perform this in multiple steps:
 
 #define ADD_CHUNK_SIZE 50
 
-int
-add_triples(query *q, triple **triples, size_t count)
+typedef struct triple_block
+{ triple **triples;
+  size_t   count;
+} triple_block;
+
+static void
+commit_add_triples(query *q, gen_t gen, void *closure)
+{ triple_block *tb = closure;
+  triple **tp, **ep = tb->triples+tb->count;
+
+  for(tp=tb->triples; tp < ep; tp++)
+  { triple *t = *tp;
+
+    t->lifespan.born = gen;
+    if ( !q->transaction )
+      commit_triple_gen(q->db, t, gen);
+  }
+}
+
+
+static void
+prepare_add_triples(query *q, triple **triples, size_t count)
 { rdf_db *db = q->db;
-  gen_t gen, gen_max;
+  gen_t gen_max;
   triple **ep = triples+count;
   triple **tp;
 
@@ -462,48 +613,120 @@ add_triples(query *q, triple **triples, size_t count)
 					/* Add the triples in the future */
   gen_max = query_max_gen(q);
   for(tp=triples; tp < ep; )
-  { triple **echunk = tp+50;
+  { triple **chunk = tp;
+    triple **echunk = tp+ADD_CHUNK_SIZE;
 
     if ( echunk > ep )
       echunk = ep;
 
-    simpleMutexLock(&db->queries.write.lock);
     for(; tp<echunk; tp++)
     { triple *t = *tp;
 
       t->lifespan.born = gen_max;
       t->lifespan.died = gen_max;
-      link_triple(db, t, q);
     }
-    simpleMutexUnlock(&db->queries.write.lock);
+    link_triples(db, chunk, echunk-chunk, q);
   }
+}
 
-					/* generation update */
-  simpleMutexLock(&db->queries.write.generation_lock);
-  gen = queryWriteGen(q)+1;
-  for(tp=triples; tp < ep; tp++)
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Batch monitors (rdf_monitor/2 using  the   batch  option)  receive one
+event per commit. The broadcast_*_batch() functions   collect  the triples
+that were changed by the commit: if  gen   is  not 0, only those that
+became visible at gen.  Triple events   that  are  not broadcasted per
+triple are broadcasted  in  batches,   so  a  monitor  never sees both.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+broadcast_added_batch(triple **triples, size_t count, gen_t gen)
+{ triple_buffer plain, loaded;
+  triple **tp, **ep = triples+count;
+  int rc = TRUE;
+
+  init_triple_buffer(&plain);
+  init_triple_buffer(&loaded);
+  for(tp=triples; rc && tp < ep; tp++)
   { triple *t = *tp;
 
-    t->lifespan.born = gen;
+    if ( !gen || t->lifespan.born == gen )
+      rc = buffer_triple(t->loaded ? &loaded : &plain, t);
   }
-  setWriteGen(q, gen);
-  simpleMutexUnlock(&db->queries.write.generation_lock);
 
-  if ( q->transaction )
-  { for(tp=triples; tp < ep; tp++)
-    { triple *t = *tp;
+  rc = ( rc &&
+	 rdf_broadcast_batch(EV_ASSERT, plain.base, plain.top-plain.base) &&
+	 rdf_broadcast_batch(EV_ASSERT_LOAD, loaded.base, loaded.top-loaded.base) );
+  free_triple_buffer(&plain);
+  free_triple_buffer(&loaded);
 
-      postlink_triple(db, t, q);
-      buffer_triple(q->transaction->transaction_data.added, t);
-    }
-  } else
-  { for(tp=triples; tp < ep; tp++)
-    { triple *t = *tp;
+  return rc;
+}
 
-      postlink_triple(db, t, q);
-    }
 
-    if ( rdf_is_broadcasting(EV_ASSERT|EV_ASSERT_LOAD) )
+static int
+broadcast_deleted_batch(rdf_db *db, triple **triples, size_t count, gen_t gen)
+{ triple_buffer deleted;
+  triple **tp, **ep = triples+count;
+  int rc = TRUE;
+
+  init_triple_buffer(&deleted);
+  for(tp=triples; rc && tp < ep; tp++)
+  { triple *t = deref_triple(db, *tp);
+
+    if ( !gen || t->lifespan.died == gen )
+      rc = buffer_triple(&deleted, t);
+  }
+
+  rc = ( rc &&
+	 rdf_broadcast_batch(EV_RETRACT, deleted.base,
+			     deleted.top-deleted.base) );
+  free_triple_buffer(&deleted);
+
+  return rc;
+}
+
+
+/* old[i*step] is updated to new[i*step].  new[] may contain NULL for
+   unmodified triples.
+*/
+
+static int
+broadcast_updated_batch(triple **old, triple **new, size_t count, int step,
+			gen_t gen)
+{ triple_buffer updated;
+  size_t i;
+  int rc = TRUE;
+
+  init_triple_buffer(&updated);
+  for(i=0; rc && i < count; i++)
+  { triple *to = old[i*step];
+    triple *tn = new[i*step];
+
+    if ( tn &&
+	 (!gen || (to->lifespan.died == gen && tn->lifespan.born == gen)) )
+      rc = ( buffer_triple(&updated, to) &&
+	     buffer_triple(&updated, tn) );
+  }
+
+  rc = ( rc &&
+	 rdf_broadcast_batch(EV_UPDATE, updated.base,
+			     updated.top-updated.base) );
+  free_triple_buffer(&updated);
+
+  return rc;
+}
+
+
+static int
+finish_add_triples(query *q, triple **triples, size_t count)
+{ triple **ep = triples+count;
+  triple **tp;
+
+  if ( q->transaction )
+  { for(tp=triples; tp < ep; tp++)
+      buffer_triple(q->transaction->transaction_data.added, *tp);
+  } else
+  { if ( rdf_is_broadcasting(EV_ASSERT|EV_ASSERT_LOAD) )
     { for(tp=triples; tp < ep; tp++)
       { triple *t = *tp;
 	broadcast_id id = t->loaded ? EV_ASSERT_LOAD : EV_ASSERT;
@@ -512,12 +735,28 @@ add_triples(query *q, triple **triples, size_t count)
 	  return FALSE;
       }
     }
+    if ( rdf_is_broadcasting_batch(EV_ASSERT|EV_ASSERT_LOAD) )
+      return broadcast_added_batch(triples, count, 0);
   }
 
   return TRUE;
 }
 
 
+int
+add_triples(query *q, triple **triples, size_t count)
+{ triple_block tb;
+
+  prepare_add_triples(q, triples, count);
+					/* generation update */
+  tb.triples = triples;
+  tb.count   = count;
+  group_commit(q, commit_add_triples, &tb);
+
+  return finish_add_triples(q, triples, count);
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 del_triples() deletes triples from the database.  There are two actions:
 
@@ -528,37 +767,43 @@ del_triples() deletes triples from the database.  There are two actions:
   - erase_triple() is called on the final commit and updates statistics.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+static void
+commit_del_triples(query *q, gen_t gen, void *closure)
+{ rdf_db *db = q->db;
+  triple_block *tb = closure;
+  triple **tp, **ep = tb->triples+tb->count;
+
+  for(tp=tb->triples; tp < ep; tp++)
+  { triple *t = deref_triple(db, *tp);
+
+    t->lifespan.died = gen;
+    del_triple_consequences(db, t, q);
+
+    if ( q->transaction )
+    { buffer_triple(q->transaction->transaction_data.deleted, t);
+    } else
+    { erase_triple(db, t, q);
+      commit_triple_gen(db, t, gen);
+    }
+  }
+}
+
+
 int
 del_triples(query *q, triple **triples, size_t count)
 { rdf_db *db = q->db;
-  gen_t gen;
   triple **ep = triples+count;
   triple **tp;
+  triple_block tb;
 
   if ( count == 0 )
     return TRUE;
   else
     rdf_create_gc_thread(db);
 
-  simpleMutexLock(&db->queries.write.generation_lock);
-  simpleMutexLock(&db->queries.write.lock);
-  gen = queryWriteGen(q) + 1;
-
-  for(tp=triples; tp < ep; tp++)
-  { triple *t = deref_triple(db, *tp);
-
-    t->lifespan.died = gen;
-    del_triple_consequences(db, t, q);
-
-    if ( q->transaction )
-      buffer_triple(q->transaction->transaction_data.deleted, t);
-    else
-      erase_triple(db, t, q);
-  }
-
-  setWriteGen(q, gen);
-  simpleMutexUnlock(&db->queries.write.lock);
-  simpleMutexUnlock(&db->queries.write.generation_lock);
+  tb.triples = triples;
+  tb.count   = count;
+  group_commit(q, commit_del_triples, &tb);
 
   if ( !q->transaction && rdf_is_broadcasting(EV_RETRACT) )
   { for(tp=triples; tp < ep; tp++)
@@ -568,44 +813,235 @@ del_triples(query *q, triple **triples, size_t count)
 	return FALSE;
     }
   }
+  if ( !q->transaction && rdf_is_broadcasting_batch(EV_RETRACT) )
+    return broadcast_deleted_batch(db, triples, count, 0);
 
   return TRUE;
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-update_triples() updates an array of triples.
+drop_graph() kills all triples of a graph in a single generation step.
+Rather than updating the lifespan of each  triple, it adds a graph_drop
+record to the graph that is  honoured   by  alive_triple(): triples born
+before the drop are dead for queries that  read at or after it. GC sets
+the lifespan of these triples, erases them and finally discards the drop
+record (see kill_dropped_triple()).  The  caller   must  ensure  we are
+not in a transaction and  the  graph   has  no  subPropertyOf triples as
+there are no per-triple consequences nor broadcasts.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+typedef struct drop_request
+{ graph	       *graph;			/* Graph to drop */
+  graph_drop   *drop;			/* New drop record */
+} drop_request;
+
+static void
+commit_graph_drop(rdf_db *db, graph *g, graph_drop *d, gen_t gen)
+{ d->gen   = gen;
+  d->older = g->drops;
+  MEMORY_BARRIER();
+  g->drops = d;
+  ATOMIC_INC(&db->graphs.dropped);
+  g->committed = gen;
+
+  if ( g->triple_count > 0 )		/* GC will reclaim them */
+  { db->erased    += g->triple_count;
+    db->committed -= g->triple_count;
+  }
+  g->triple_count = 0;
+#ifdef WITH_MD5
+  memset(g->digest, 0, sizeof(g->digest));
+#endif
+  db->queries.write.dropped  = gen;
+  db->queries.write.modified = gen;
+  log_graph_drop(db, g, gen);
+}
+
+
+static void
+commit_drop_graph(query *q, gen_t gen, void *closure)
+{ drop_request *dr = closure;
+
+  commit_graph_drop(q->db, dr->graph, dr->drop, gen);
+}
+
+
 int
-update_triples(query *q,
-	       triple **old, triple **new,
-	       size_t count)
+drop_graph(query *q, graph *g)
 { rdf_db *db = q->db;
-  gen_t gen, gen_max;
-  triple **eo = old+count;
-  triple **en = new+count;
-  triple **to, **tn;
-  size_t updated = 0;
+  drop_request dr;
 
-  if ( count == 0 )
-    return TRUE;
-  else
-    rdf_create_gc_thread(db);
+  assert(!q->transaction);
+  if ( !(dr.drop = rdf_malloc(db, sizeof(*dr.drop))) )
+    return PL_resource_error("memory");
+  dr.graph = g;
 
-  for(tn=new; tn < en; tn++)
-  { triple *t = *tn;
+  rdf_create_gc_thread(db);
+  group_commit(q, commit_drop_graph, &dr);
 
-    if ( t )
-      prelink_triple(db, t, q);
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+swap_graphs() makes copies visible  and   drops  two graphs in a single
+generation step. The copies are the triples   of both graphs, each with
+the graph of the other. As  drop_graph()   only  kills triples born before
+the drop, the copies born in the  same   generation  survive. The same
+restrictions as for drop_graph() apply.
+
+The copies are made from the  triples  visible   to  q.  If  one of the
+graphs was changed after q started, the   copies are incomplete and we
+do not commit.  The copies are killed   and  swap_graphs() returns -1,
+after which the caller must swap using a transaction.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct swap_request
+{ graph	       *graphs[2];		/* Graphs to drop */
+  graph_drop   *drops[2];		/* New drop records */
+  triple_block	added;			/* The copies */
+  int		conflict;		/* A graph was changed */
+} swap_request;
+
+/* kill_added_triples() kills triples linked by prepare_add_triples()
+   that will not be committed.  They were never visible and are not
+   registered with their predicate and graph.
+   MT: Caller must hold db->queries.write.lock
+*/
+
+static void
+kill_added_triples(rdf_db *db, triple_block *tb)
+{ triple **tp, **ep = tb->triples+tb->count;
+
+  for(tp=tb->triples; tp < ep; tp++)
+  { triple *t = *tp;
+
+    t->lifespan.died = GEN_PREHIST;
+    t->erased = TRUE;
+    if ( t->is_duplicate )
+      db->duplicates--;
+    db->erased++;
   }
+}
 
-  simpleMutexLock(&db->queries.write.generation_lock);
-  simpleMutexLock(&db->queries.write.lock);
-  gen = queryWriteGen(q) + 1;
-  gen_max = query_max_gen(q);
 
-  for(to=old,tn=new; to < eo; to++,tn++)
+/* The drops reset the triple count of the graphs, so they must come
+   before adding the copies, which registers them in their graph.
+*/
+
+static void
+commit_swap_graphs(query *q, gen_t gen, void *closure)
+{ swap_request *sr = closure;
+
+  if ( sr->graphs[0]->committed > q->rd_gen ||
+       sr->graphs[1]->committed > q->rd_gen )
+  { kill_added_triples(q->db, &sr->added);
+    sr->conflict = TRUE;
+    return;
+  }
+
+  commit_graph_drop(q->db, sr->graphs[0], sr->drops[0], gen);
+  commit_graph_drop(q->db, sr->graphs[1], sr->drops[1], gen);
+  commit_add_triples(q, gen, &sr->added);
+}
+
+
+int
+swap_graphs(query *q, graph *g1, graph *g2, triple **copies, size_t count)
+{ rdf_db *db = q->db;
+  swap_request sr;
+
+  assert(!q->transaction);
+  if ( !(sr.drops[0] = rdf_malloc(db, sizeof(graph_drop))) )
+    return PL_resource_error("memory");
+  if ( !(sr.drops[1] = rdf_malloc(db, sizeof(graph_drop))) )
+  { rdf_free(db, sr.drops[0], sizeof(graph_drop));
+    return PL_resource_error("memory");
+  }
+  sr.graphs[0]	   = g1;
+  sr.graphs[1]	   = g2;
+  sr.added.triples = copies;
+  sr.added.count   = count;
+  sr.conflict	   = FALSE;
+
+  rdf_create_gc_thread(db);
+  prepare_add_triples(q, copies, count);
+  group_commit(q, commit_swap_graphs, &sr);
+  if ( sr.conflict )
+  { rdf_free(db, sr.drops[0], sizeof(graph_drop));
+    rdf_free(db, sr.drops[1], sizeof(graph_drop));
+    return -1;
+  }
+
+  return finish_add_triples(q, copies, count);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+clone_graph() adds copies of the triples of  another graph to g if g is
+empty.  The test is part of the commit, so  no triples can be added to g
+between the test and adding the  copies.   Returns  -1  if g is not
+empty.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct clone_request
+{ graph	       *graph;			/* Graph we add to */
+  triple_block	added;			/* The copies */
+  int		conflict;		/* Graph is not empty */
+} clone_request;
+
+static void
+commit_clone_graph(query *q, gen_t gen, void *closure)
+{ clone_request *cr = closure;
+
+  if ( cr->graph->triple_count > 0 )
+  { kill_added_triples(q->db, &cr->added);
+    cr->conflict = TRUE;
+    return;
+  }
+
+  commit_add_triples(q, gen, &cr->added);
+}
+
+
+int
+clone_graph(query *q, graph *g, triple **copies, size_t count)
+{ clone_request cr;
+
+  cr.graph	   = g;
+  cr.added.triples = copies;
+  cr.added.count   = count;
+  cr.conflict	   = FALSE;
+
+  prepare_add_triples(q, copies, count);
+  group_commit(q, commit_clone_graph, &cr);
+  if ( cr.conflict )
+    return -1;
+
+  return finish_add_triples(q, copies, count);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+update_triples() updates an array of triples.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct update_block
+{ triple **old;
+  triple **new;
+  size_t   count;
+} update_block;
+
+static void
+commit_update_triples(query *q, gen_t gen, void *closure)
+{ rdf_db *db = q->db;
+  update_block *ub = closure;
+  triple **eo = ub->old+ub->count;
+  triple **to, **tn;
+  gen_t gen_max = query_max_gen(q);
+
+  for(to=ub->old,tn=ub->new; to < eo; to++,tn++)
   { if ( *tn )
     { triple *n = *tn;				/* new, cannot be reindexed */
       triple *o = deref_triple(db, *to);
@@ -620,37 +1056,52 @@ update_triples(query *q,
 	buffer_triple(q->transaction->transaction_data.updated, *tn);
       } else
       { erase_triple(db, *to, q);
+	commit_triple_gen(db, o, gen);
+	commit_triple_gen(db, n, gen);
       }
-
-      updated++;
     }
   }
+}
 
-  setWriteGen(q, gen);
-  simpleMutexUnlock(&db->queries.write.lock);
-  simpleMutexUnlock(&db->queries.write.generation_lock);
 
-  consider_triple_rehash(db, 1);
+int
+update_triples(query *q,
+	       triple **old, triple **new,
+	       size_t count)
+{ rdf_db *db = q->db;
+  triple **eo = old+count;
+  triple **en = new+count;
+  triple **to, **tn;
+  update_block ub;
 
-  if ( !q->transaction && rdf_is_broadcasting(EV_UPDATE) )
-  { for(to=old,tn=new; to < eo; to++,tn++)
-    { triple *t = *tn;
+  if ( count == 0 )
+    return TRUE;
+  else
+    rdf_create_gc_thread(db);
 
-      if ( t )
-      { postlink_triple(db, *tn, q);
+  for(tn=new; tn < en; tn++)
+  { triple *t = *tn;
 
-	if ( !rdf_broadcast(EV_UPDATE, *to, *tn) )
-	  return FALSE;
-      }
-    }
-  } else
-  { for(tn=new; tn < en; tn++)
-    { triple *t = *tn;
+    if ( t )
+      prelink_triple(db, t, q);
+  }
+
+  ub.old   = old;
+  ub.new   = new;
+  ub.count = count;
+  group_commit(q, commit_update_triples, &ub);
+
+  consider_triple_rehash(db, 1);
 
-      if ( t )
-	postlink_triple(db, t, q);
+  if ( !q->transaction && rdf_is_broadcasting(EV_UPDATE) )
+  { for(to=old,tn=new; to < eo; to++,tn++)
+    { if ( *tn && !rdf_broadcast(EV_UPDATE, *to, *tn) )
+	return FALSE;
     }
   }
+  if ( !q->transaction && rdf_is_broadcasting_batch(EV_UPDATE) &&
+       !broadcast_updated_batch(old, new, count, 1, 0) )
+    return FALSE;
 
   return TRUE;
 }
@@ -689,7 +1140,12 @@ close_transaction(query *q)
   free_triple_buffer(q->transaction_data.added);
   free_triple_buffer(q->transaction_data.deleted);
   free_triple_buffer(q->transaction_data.updated);
+  if ( q->transaction_data.reads )
+  { destroy_ptr_hash(q->transaction_data.reads);
+    q->transaction_data.reads = NULL;
+  }
   invalidate_lifespans_transaction(q);
+  ATOMIC_DEC(&q->db->queries.write.transactions);
 
   q->stack->transaction = q->transaction;
 
@@ -705,9 +1161,11 @@ commit_add(query *q, gen_t gen_max, gen_t gen, triple *t)
   { t->lifespan.born = gen;
     add_triple_consequences(q->db, t, q);
     if ( q->transaction )
-      buffer_triple(q->transaction->transaction_data.added, t);
-    else
-      t->lifespan.died = GEN_MAX;
+    { buffer_triple(q->transaction->transaction_data.added, t);
+    } else
+    { t->lifespan.died = GEN_MAX;
+      commit_triple_gen(q->db, t, gen);
+    }
   }
 }
 
@@ -723,21 +1181,133 @@ commit_del(query *q, gen_t gen, triple *t)
       buffer_triple(q->transaction->transaction_data.deleted, t);
     } else
     { erase_triple(q->db, t, q);
+      commit_triple_gen(q->db, t, gen);
     }
   }
 }
 
 
-int
-commit_transaction(query *q)
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Serializable transactions (rdf_transaction/3 using isolation(serializable))
+are validated just before they are committed, holding the write locks.
+The read set is kept at the granularity of   predicates: record_read()
+is called by the search predicates for  the predicate searched for, with
+`subprop` if rdfs:subPropertyOf is used  and   NULL  if the predicate is
+unbound or unknown. The read set of nested transactions is added to the
+outermost one. Commits outside  transactions   register  the  generation
+at which a predicate was last modified using commit_triple_gen().
+
+A transaction conflicts if
+
+  - A predicate it read was modified after the transaction started,
+    or for reads using subPropertyOf, any predicate in its cloud or
+    the subPropertyOf hierarchy was modified.
+  - A triple it deleted was deleted by another transaction.
+
+This is conservative: it may report conflicts for transactions that do
+not actually overlap.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define READ_SUBPROP 0x1		/* tag in transaction_data.reads */
+
+void
+record_read(query *q, predicate *p, int subprop)
+{ query *t;
+
+  if ( !(t=q->transaction) )
+    return;
+  while(t->transaction)
+    t = t->transaction;
+  if ( !t->transaction_data.serializable )
+    return;
+
+  if ( !p )
+  { t->transaction_data.read_all = TRUE;
+    return;
+  }
+  if ( !t->transaction_data.reads )
+    t->transaction_data.reads = new_ptr_hash(64);
+  add_ptr_hash(t->transaction_data.reads,
+	       (void*)((uintptr_t)p | (subprop ? READ_SUBPROP : 0)));
+}
+
+
+static int
+read_conflict(ptr_hash_node *node, void *closure)
+{ query *q = closure;
+  uintptr_t v = (uintptr_t)node->value;
+  predicate *p = (predicate*)(v & ~(uintptr_t)READ_SUBPROP);
+
+  if ( p->modified > q->rd_gen ||
+       q->db->queries.write.dropped > q->rd_gen )
+    return FALSE;
+  if ( (v & READ_SUBPROP) )
+  { predicate_cloud *pc = p->cloud;
+    size_t i;
+
+    if ( q->db->queries.write.hierarchy_modified > q->rd_gen )
+      return FALSE;
+    for(i=0; pc && i<pc->size; i++)
+    { if ( pc->members[i]->modified > q->rd_gen )
+	return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+static int
+deleted_conflict(query *q, triple *t)
+{ t = deref_triple(q->db, t);
+
+  if ( q->db->graphs.dropped && triple_drop_gen(q->db, t) != GEN_MAX )
+    return TRUE;			/* graph was dropped */
+
+  return !is_wr_transaction_gen(q, t->lifespan.died);
+}
+
+
+static int
+validate_transaction(query *q)
 { rdf_db *db = q->db;
   triple **tp;
-  gen_t gen, gen_max;
 
-  simpleMutexLock(&db->queries.write.generation_lock);
-  simpleMutexLock(&db->queries.write.lock);
-  gen = queryWriteGen(q) + 1;
-  gen_max = transaction_max_gen(q);
+  if ( q->transaction_data.read_all &&
+       db->queries.write.modified > q->rd_gen )
+    return FALSE;
+  if ( q->transaction_data.reads &&
+       !for_ptr_hash(q->transaction_data.reads, read_conflict, q) )
+    return FALSE;
+
+  for(tp=q->transaction_data.deleted->base;
+      tp<q->transaction_data.deleted->top;
+      tp++)
+  { if ( deleted_conflict(q, *tp) )
+      return FALSE;
+  }
+  for(tp=q->transaction_data.updated->base;
+      tp<q->transaction_data.updated->top;
+      tp += 2)
+  { if ( deleted_conflict(q, tp[0]) )
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+static void
+commit_transaction_data(query *q, gen_t gen, void *closure)
+{ triple **tp;
+  gen_t gen_max = transaction_max_gen(q);
+
+  if ( q->transaction_data.serializable && !q->transaction &&
+       !validate_transaction(q) )
+  { *(int*)closure = TRUE;		/* conflict */
+    return;
+  }
+
 					/* added triples */
   for(tp=q->transaction_data.added->base;
       tp<q->transaction_data.added->top;
@@ -761,10 +1331,18 @@ commit_transaction(query *q)
     commit_del(q, gen, to);
     commit_add(q, gen_max, gen, tn);
   }
+}
 
-  setWriteGen(q, gen);
-  simpleMutexUnlock(&db->queries.write.lock);
-  simpleMutexUnlock(&db->queries.write.generation_lock);
+
+int
+commit_transaction(query *q)
+{ triple **tp;
+  gen_t gen;
+  int conflict = FALSE;
+
+  gen = group_commit(q, commit_transaction_data, &conflict);
+  if ( conflict )
+    return -1;				/* caller must discard */
 
   q->stack->transaction = q->transaction; /* do not nest monitor calls */
 					  /* inside the transaction */
@@ -813,6 +1391,27 @@ commit_transaction(query *q)
 	}
       }
     }
+
+    if ( rdf_is_broadcasting_batch(EV_RETRACT) &&
+	 !broadcast_deleted_batch(q->db,
+				  q->transaction_data.deleted->base,
+				  q->transaction_data.deleted->top -
+				  q->transaction_data.deleted->base,
+				  gen) )
+      return FALSE;
+    if ( rdf_is_broadcasting_batch(EV_ASSERT|EV_ASSERT_LOAD) &&
+	 !broadcast_added_batch(q->transaction_data.added->base,
+				q->transaction_data.added->top -
+				q->transaction_data.added->base,
+				gen) )
+      return FALSE;
+    if ( rdf_is_broadcasting_batch(EV_UPDATE) &&
+	 !broadcast_updated_batch(q->transaction_data.updated->base,
+				  q->transaction_data.updated->base+1,
+				  (q->transaction_data.updated->top -
+				   q->transaction_data.updated->base)/2,
+				  2, gen) )
+      return FALSE;
   }
 
   close_transaction(q);
@@ -98,7 +98,14 @@ typedef struct query
     struct triple_buffer *updated;
     term_t	prolog_id;		/* Prolog transaction identifier */
     list	lifespans;		/* Lifespans that must be invalidated */
+    int		serializable;		/* Validate reads/writes at commit */
+    int		read_all;		/* Read without known predicate */
+    struct ptr_hash_table *reads;	/* Predicates read (serializable) */
   } transaction_data;
+  struct
+  { atom_id	graph_id;		/* Graph of the last drop check */
+    struct graph *graph;		/* Its graph or NULL */
+  } drop_cache;				/* See query_drop_gen() */
   union query_state
   { search_state	search;		/* State for normal searches */
     agenda		tr_search;	/* State for transitive searches */
@@ -147,6 +154,7 @@ COMMON(query *)	open_transaction(rdf_dbp db,
 				 snapshot *ss);
 COMMON(int)	empty_transaction(query *q);
 COMMON(int)	commit_transaction(query *q);
+COMMON(void)	record_read(query *q, predicate *p, int subprop);
 COMMON(void)	close_transaction(query *q);
 COMMON(int)	discard_transaction(query *q);
 
@@ -154,6 +162,13 @@ COMMON(int)	add_triples(query *q, triplep *triples, size_t count);
 COMMON(int)	del_triples(query *q, triplep *triples, size_t count);
 COMMON(int)	update_triples(query *q,
 			       triplep *old, triplep *new, size_t count);
+COMMON(int)	drop_graph(query *q, graph *g);
+COMMON(int)	swap_graphs(query *q, graph *g1, graph *g2,
+			    triplep *copies, size_t count);
+COMMON(int)	clone_graph(query *q, graph *g,
+			    triplep *copies, size_t count);
+COMMON(gen_t)	triple_drop_gen(rdf_db *db, triple *t);
+COMMON(gen_t)	query_drop_gen(query *q, triple *t);
 COMMON(int)	alive_lifespan(query *q, lifespan *span);
 COMMON(int)	born_lifespan(query *q, lifespan *lifespan);
 COMMON(char *)	gen_name(gen_t gen, char *buf);
@@ -184,7 +199,8 @@ deref_triple(rdf_db *db, triple *t)
 /* Find out whether a triple is alive and, if the triple is reindexed,
    return the current version.  Note that if the triple was reindexed
    before this query was started, we will find the reindexed one as
-   well, so we can discard this one.
+   well, so we can discard this one.  Triples of a graph dropped by
+   drop_graph() are dead until GC erases them.
 */
 
 static inline triple *
@@ -194,7 +210,12 @@ alive_triple(query *q, triple *t)
       return NULL;
   }
 
-  return alive_lifespan(q, &t->lifespan) ? t : (triple*)NULL;
+  if ( !alive_lifespan(q, &t->lifespan) )
+    return NULL;
+  if ( q->db->graphs.dropped && query_drop_gen(q, t) <= q->rd_gen )
+    return NULL;
+
+  return t;
 }
 
 
@@ -42,6 +42,14 @@
 #include "murmur.h"
 #include "memory.h"
 #include "buffer.h"
+#include "rdf_sink.h"
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifndef __WINDOWS__
+#include <time.h>
+#include <sys/time.h>
+#endif
 #ifdef WITH_MD5
 #include "md5.h"
 
@@ -75,10 +83,14 @@ static functor_t FUNCTOR_resources1;
 static functor_t FUNCTOR_predicates1;
 static functor_t FUNCTOR_duplicates1;
 static functor_t FUNCTOR_literals1;
+static functor_t FUNCTOR_triple_size2;
+static functor_t FUNCTOR_frozen_triples1;
+static functor_t FUNCTOR_group_commit2;
 static functor_t FUNCTOR_subject1;
 static functor_t FUNCTOR_predicate1;
 static functor_t FUNCTOR_object1;
 static functor_t FUNCTOR_graph1;
+static functor_t FUNCTOR_graph3;
 static functor_t FUNCTOR_indexed16;
 static functor_t FUNCTOR_hash_quality1;
 static functor_t FUNCTOR_hash3;
@@ -107,6 +119,13 @@ static functor_t FUNCTOR_lang2;
 static functor_t FUNCTOR_type2;
 
 static functor_t FUNCTOR_gc4;
+static functor_t FUNCTOR_buckets1;
+static functor_t FUNCTOR_time1;
+static functor_t FUNCTOR_gc_workers1;
+static functor_t FUNCTOR_added5;
+static functor_t FUNCTOR_deleted5;
+static functor_t FUNCTOR_dropped2;
+static functor_t FUNCTOR_max_changes1;
 static functor_t FUNCTOR_graphs1;
 
 static functor_t FUNCTOR_assert4;
@@ -118,7 +137,15 @@ static functor_t FUNCTOR_transaction2;
 static functor_t FUNCTOR_load2;
 static functor_t FUNCTOR_begin1;
 static functor_t FUNCTOR_end1;
+static functor_t FUNCTOR_abort1;
 static functor_t FUNCTOR_create_graph1;
+static functor_t FUNCTOR_batch2;
+static functor_t FUNCTOR_assert1;
+static functor_t FUNCTOR_rdf3;
+static functor_t FUNCTOR_rdf4;
+static functor_t FUNCTOR_update2;
+static functor_t FUNCTOR_lost1;
+static functor_t FUNCTOR_queue4;
 
 static atom_t   ATOM_user;
 static atom_t	ATOM_exact;
@@ -133,10 +160,23 @@ static atom_t	ATOM_end;
 static atom_t	ATOM_error;
 static atom_t	ATOM_infinite;
 static atom_t	ATOM_snapshot;
+static atom_t	ATOM_isolation;
+static atom_t	ATOM_serializable;
+static atom_t	ATOM_retry;
+static atom_t	ATOM_since;
+static atom_t	ATOM_compress;
 static atom_t	ATOM_true;
 static atom_t	ATOM_size;
 static atom_t	ATOM_optimize_threshold;
 static atom_t	ATOM_average_chain_len;
+static atom_t	ATOM_cpu_count;
+static atom_t	ATOM_assert;
+static atom_t	ATOM_retract;
+static atom_t	ATOM_update;
+static atom_t	ATOM_load;
+static atom_t	ATOM_block;
+static atom_t	ATOM_drop;
+static atom_t	ATOM_coalesce;
 
 static atom_t	ATOM_subPropertyOf;
 
@@ -156,9 +196,14 @@ static void lock_atoms(rdf_db *db, triple *t);
 static void unlock_atoms_literal(literal *lit);
 
 static size_t	triple_hash_key(triple *t, int which);
+static size_t	subject_hash(triple *t);
+static size_t	predicate_hash(predicate *p);
 static size_t	object_hash(triple *t);
 static void	mark_duplicate(rdf_db *db, triple *t, query *q);
 static void	link_triple_hash(rdf_db *db, triple *t);
+static void	link_triple_bucket(rdf_db *db, triple_hash *hash, size_t key,
+				   triple *t);
+static int	append_bulk_chain(bulk_chain *bc, triple *t);
 static void	free_triple(rdf_db *db, triple *t, int linger);
 
 static sub_p_matrix *create_reachability_matrix(rdf_db *db,
@@ -175,6 +220,13 @@ static int	unify_literal(term_t lit, literal *l);
 static int	check_predicate_cloud(predicate_cloud *c);
 static void	invalidate_is_leaf(predicate *p, query *q, int add);
 static void	create_triple_hashes(rdf_db *db, int count, int *ic);
+static graph   *existing_graph(rdf_db *db, atom_t name);
+static void	kill_frozen_triple(rdf_db *db, triple *t);
+static void	retire_frozen_graphs(rdf_db *db, gen_t gen);
+static lifespan *triple_lifespan(rdf_db *db, triple *t, lifespan *span);
+static void	log_change(rdf_db *db, int op, void *value, gen_t gen);
+static int	load_frozen_graph(rdf_db *db, graph *g,
+				  triple **triples, size_t count);
 
 
 		 /*******************************
@@ -187,6 +239,7 @@ INIT_LOCK(rdf_db *db)
   simpleMutexInit(&db->locks.misc);
   simpleMutexInit(&db->locks.gc);
   simpleMutexInit(&db->locks.duplicates);
+  simpleMutexInit(&db->locks.overflow);
 }
 
 static simpleMutex rdf_lock;
@@ -351,9 +404,28 @@ consistent.  To add an index:
     * Assign it a (consistent) position in index_col[]
     * If decide wich unindexed queries are best mapped
       to the new index and add them to alt_index[]
+
+Not all indexes are enabled. The enabled set is a property of the DB,
+set using rdf_set_indexes/1 while the DB is empty. DEFAULT_INDEXES
+lists the indexes that are enabled by default. set_index_set() computes
+db->indexes.alt[], the index used for a BY_* pattern, from the first
+enabled index in alt_index[].
+
+db->indexes.slot[] is the tp.next[] slot  used   by  an index. Using the
+COMPACT representation, slots are assigned when  an index is created and
+triples are allocated with the slots that   exist at that moment. Links
+for indexes created later are stored in triple_hash.overflow, which is
+indexed by the triple id.  GC relays out   such triples using the index
+optimization machinery (see relayout_triples()), after which the overflow
+arrays are released.  Without COMPACT, all enabled indexes have a slot.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 #define ICOL(i) (index_col[i])
+#ifdef COMPACT
+#define T_NEXT(db, t, icol) (*triple_link(db, t, icol))
+#else
+#define T_NEXT(db, t, icol) ((t)->tp.next[(db)->indexes.slot[icol]])
+#endif
 
 static const int index_col[16] =
 { 0,					/* BY_NONE */
@@ -361,17 +433,17 @@ static const int index_col[16] =
   2,					/* BY_P */
   3,					/* BY_SP */
   4,					/* BY_O */
-  ~0,					/* BY_SO */
+  10,					/* BY_SO */
   5,					/* BY_PO */
   6,					/* BY_SPO */
 
   7,					/* BY_G */
   8,					/* BY_SG */
   9,					/* BY_PG */
- ~0,					/* BY_SPG */
- ~0,					/* BY_OG */
+  11,					/* BY_SPG */
+  12,					/* BY_OG */
  ~0,					/* BY_SOG */
- ~0,					/* BY_POG */
+  13,					/* BY_POG */
  ~0					/* BY_SPOG */
 };
 
@@ -385,7 +457,11 @@ static int col_index[INDEX_TABLES] =
   BY_SPO,
   BY_G,
   BY_SG,
-  BY_PG
+  BY_PG,
+  BY_SO,
+  BY_SPG,
+  BY_OG,
+  BY_POG
 };
 
 static const char *col_name[INDEX_TABLES] =
@@ -398,7 +474,11 @@ static const char *col_name[INDEX_TABLES] =
   "spo",
   "g",
   "sg",
-  "pg"
+  "pg",
+  "so",
+  "spg",
+  "og",
+  "pog"
 };
 
 static const int col_avg_len[INDEX_TABLES] =
@@ -411,7 +491,11 @@ static const int col_avg_len[INDEX_TABLES] =
   2,	/*BY_SPO*/
   1,	/*BY_G*/
   2,	/*BY_SG*/
-  2	/*BY_PG*/
+  2,	/*BY_PG*/
+  2,	/*BY_SO*/
+  2,	/*BY_SPG*/
+  2,	/*BY_OG*/
+  2	/*BY_POG*/
 };
 
 static const int col_opt_threshold[INDEX_TABLES] =
@@ -424,29 +508,37 @@ static const int col_opt_threshold[INDEX_TABLES] =
   2,	/*BY_SPO*/
   2,	/*BY_G*/
   2,	/*BY_SG*/
-  2	/*BY_PG*/
+  2,	/*BY_PG*/
+  2,	/*BY_SO*/
+  2,	/*BY_SPG*/
+  2,	/*BY_OG*/
+  2	/*BY_POG*/
 };
 
-static const int alt_index[16] =
-{ BY_NONE,				/* BY_NONE */
-  BY_S,					/* BY_S */
-  BY_P,					/* BY_P */
-  BY_SP,				/* BY_SP */
-  BY_O,					/* BY_O */
-  BY_S,					/* BY_SO */
-  BY_PO,				/* BY_PO */
-  BY_SPO,				/* BY_SPO */
-
-  BY_G,					/* BY_G */
-  BY_SG,				/* BY_SG */
-  BY_PG,				/* BY_PG */
-  BY_SP,				/* BY_SPG */
-  BY_O,					/* BY_OG */
-  BY_S,					/* BY_SOG */
-  BY_PO,				/* BY_POG */
-  BY_SPO				/* BY_SPOG */
+#define MAX_ALT_INDEX 8
+
+static const int alt_index[16][MAX_ALT_INDEX] =
+{ { BY_NONE },						/* BY_NONE */
+  { BY_S },						/* BY_S */
+  { BY_P },						/* BY_P */
+  { BY_SP, BY_S, BY_P },				/* BY_SP */
+  { BY_O },						/* BY_O */
+  { BY_SO, BY_S, BY_O },				/* BY_SO */
+  { BY_PO, BY_O, BY_P },				/* BY_PO */
+  { BY_SPO, BY_SP, BY_SO, BY_PO, BY_S, BY_O, BY_P },	/* BY_SPO */
+
+  { BY_G },						/* BY_G */
+  { BY_SG, BY_S, BY_G },				/* BY_SG */
+  { BY_PG, BY_P, BY_G },				/* BY_PG */
+  { BY_SPG, BY_SP, BY_SG, BY_PG, BY_S, BY_P, BY_G },	/* BY_SPG */
+  { BY_OG, BY_O, BY_G },				/* BY_OG */
+  { BY_SO, BY_SG, BY_OG, BY_S, BY_O, BY_G },		/* BY_SOG */
+  { BY_POG, BY_PO, BY_OG, BY_PG, BY_O, BY_P, BY_G },	/* BY_POG */
+  { BY_SPO, BY_SPG, BY_POG, BY_SP, BY_SO, BY_PO, BY_S }	/* BY_SPOG */
 };
 
+#define DEFAULT_INDEXES ((1<<10)-1)	/* -, s, p, sp, o, po, spo, g, sg, pg */
+
 
 static void
 check_index_tables(void)
@@ -459,14 +551,60 @@ check_index_tables(void)
   }
 
   for(i=0; i<16; i++)
-  { int ai = alt_index[i];
+  { int j;
+
+    for(j=0; j<MAX_ALT_INDEX && alt_index[i][j]; j++)
+    { int ai = alt_index[i][j];
 
-    assert(index_col[ai] != ~0);
+      assert(index_col[ai] != ~0);
+      assert((ai & ~i) == 0);
+    }
   }
 
   for(i=0; i<INDEX_TABLES; i++)
   { ic = col_index[i];
-    assert(alt_index[ic] == ic);
+    assert(alt_index[ic][0] == ic);
+  }
+}
+
+
+/* set_index_set() sets the enabled indexes.  BY_NONE is always enabled
+   and always uses slot 0.
+   MT: Only to be called if the DB holds no triples.
+*/
+
+static void
+set_index_set(rdf_db *db, unsigned enabled)
+{ int i, slots = 1;
+
+  enabled |= 1<<ICOL(BY_NONE);
+  db->indexes.enabled = enabled;
+
+  db->indexes.slot[0] = 0;
+  for(i=1; i<INDEX_TABLES; i++)
+  {
+#ifndef COMPACT
+    if ( (enabled & (1<<i)) )
+    { db->indexes.slot[i] = slots++;
+      continue;
+    }
+#endif
+    db->indexes.slot[i] = -1;
+  }
+  db->indexes.slots = slots;
+
+  for(i=0; i<16; i++)
+  { int j;
+
+    db->indexes.alt[i] = BY_NONE;
+    for(j=0; j<MAX_ALT_INDEX && alt_index[i][j]; j++)
+    { int ai = alt_index[i][j];
+
+      if ( (enabled & (1<<ICOL(ai))) )
+      { db->indexes.alt[i] = ai;
+	break;
+      }
+    }
   }
 }
 
@@ -681,6 +819,20 @@ add_atomset(atomset *as, atom_t atom)
 }
 
 
+static int
+in_atomset(atomset *as, atom_t atom)
+{ size_t i = atom_hash(atom, MURMUR_SEED)&(as->size-1);
+  atom_cell *c;
+
+  for(c=as->entries[i]; c; c=c->next)
+  { if ( c->atom == atom )
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+
 static int
 for_atomset(atomset *as,
 	    int (*func)(atom_t a, void *closure),
@@ -770,7 +922,7 @@ rehash_triple_set(tripleset *ts)
 
 
 static int
-add_tripleset(search_state *state, tripleset *ts, triple *triple)
+add_tripleset(rdf_db *db, query *q, tripleset *ts, triple *triple)
 { size_t i;
   triple_cell *c;
 
@@ -779,9 +931,7 @@ add_tripleset(search_state *state, tripleset *ts, triple *triple)
 
   i = triple_hash_key(triple, BY_SPO)&(ts->size-1);
   for(c=ts->entries[i]; c; c=c->next)
-  { if ( match_triples(state->db,
-		       triple, c->triple,
-		       state->query, MATCH_DUPLICATE) )
+  { if ( match_triples(db, triple, c->triple, q, MATCH_DUPLICATE) )
       return 0;
   }
 
@@ -943,9 +1093,105 @@ finalize_triple(void *data, void *client)
 { unregister_triple(client, data);
 }
 
+/* triple_link() returns the location of the link of t in index icol.
+   This is a slot in t->tp.next[] if the index existed when the triple
+   was allocated and an entry in the overflow array of the hash otherwise.
+*/
+
+static inline triple_id *
+triple_link(rdf_db *db, triple *t, int icol)
+{ int slot = db->indexes.slot[icol];
+
+  if ( slot < (int)t->slots )
+    return &t->tp.next[slot];
+  else
+    return &db->hash[icol].overflow[MSB(t->id)][t->id];
+}
+
+/* size_overflow() makes sure that the overflow array of hash can hold
+   the link for id.  Slices are only added, so concurrent linkers that
+   find id < overflow_size can use the array without locking.
+   MT: Caller must hold db->locks.overflow or own the uncreated hash
+*/
+
+static void
+size_overflow(rdf_db *db, triple_hash *hash, triple_id id)
+{ while ( id >= hash->overflow_size )
+  { if ( hash->overflow_size == 0 )
+    { size_t bytes = TRIPLE_ARRAY_PREINIT*sizeof(triple_id);
+      triple_id *slice = malloc(bytes);
+      int i;
+
+      memset(slice, 0, bytes);
+      for(i=0; i<MSB(TRIPLE_ARRAY_PREINIT); i++)
+	hash->overflow[i] = slice;
+      hash->overflow_size = TRIPLE_ARRAY_PREINIT;
+    } else
+    { size_t bytes = hash->overflow_size*sizeof(triple_id);
+      triple_id *slice = malloc(bytes);
+
+      memset(slice, 0, bytes);
+      hash->overflow[MSB(hash->overflow_size)] = slice - hash->overflow_size;
+      MEMORY_BARRIER();
+      hash->overflow_size *= 2;
+    }
+  }
+}
+
+/* free_overflow() releases the overflow array of a hash.  If defer is
+   TRUE, queries may still be reading it.
+*/
+
+static void
+free_overflow(rdf_db *db, triple_hash *hash, int defer)
+{ if ( hash->overflow_size )
+  { triple_id *first = hash->overflow[0];
+    int i;
+
+    for(i=MSB(TRIPLE_ARRAY_PREINIT); i<MSB(hash->overflow_size); i++)
+    { triple_id *slice = hash->overflow[i] + ((size_t)1<<(i-1));
+
+      if ( defer )
+	deferred_free(&db->defer_triples, slice);
+      else
+	free(slice);
+    }
+    if ( defer )
+      deferred_free(&db->defer_triples, first);
+    else
+      free(first);
+
+    memset(hash->overflow, 0, sizeof(hash->overflow));
+    hash->overflow_size = 0;
+  }
+}
+
+/* prepare_link() must be called before linking t into index icol. If
+   the triple has no slot for the index it makes sure the overflow array
+   can hold the link.
+   MT: Caller must own t (it is not yet linked)
+*/
+
+static void
+prepare_link(rdf_db *db, int icol, triple *t)
+{ if ( db->indexes.slot[icol] >= (int)t->slots )
+  { triple_hash *hash = &db->hash[icol];
+
+    if ( t->id >= hash->overflow_size )
+    { simpleMutexLock(&db->locks.overflow);
+      size_overflow(db, hash, t->id);
+      simpleMutexUnlock(&db->locks.overflow);
+    }
+    if ( !t->overflow )
+    { t->overflow = TRUE;
+      ATOMIC_INC(&db->indexes.overflowed);
+    }
+  }
+}
+
 static triple *
 triple_follow_hash(rdf_db *db, triple *t, int icol)
-{ triple_id nid = t->tp.next[icol];
+{ triple_id nid = T_NEXT(db, t, icol);
 
   return fetch_triple(db, nid);
 }
@@ -958,7 +1204,8 @@ triple_follow_hash(rdf_db *db, triple *t, int icol)
 #define reset_triple_array(db) (void)0
 #define register_triple(db, t) (void)0
 #define unregister_triple(db, t) (void)0
-#define triple_follow_hash(db, t, icol) ((t)->tp.next[icol])
+#define triple_follow_hash(db, t, icol) T_NEXT(db, t, icol)
+#define prepare_link(db, icol, t) (void)0
 #define T_ID(t) (t)
 
 #endif /*COMPACT*/
@@ -982,28 +1229,70 @@ triple_follow_hash(rdf_db *db, triple *t, int icol)
   this in the next cycle.
 */
 
+#define FROZEN_WALK_NONE	0	/* No frozen phase (BY_NONE) */
+#define FROZEN_WALK_INIT	1	/* Frozen phase not yet started */
+#define FROZEN_WALK_BUSY	2	/* Walking frozen graphs */
+
+static void
+init_frozen_walk(triple_walker *tw, triple *pattern, int which,
+		 size_t object_hash)
+{ tw->frozen.state	 = (tw->icol == ICOL(BY_NONE) ? FROZEN_WALK_NONE
+						      : FROZEN_WALK_INIT);
+  tw->frozen.which	 = which;
+  tw->frozen.pattern	 = pattern;
+  tw->frozen.object_hash = object_hash;
+  tw->frozen.next	 = NULL;
+  tw->frozen.current	 = NULL;
+  tw->frozen.gen	 = tw->db->queries.generation;
+}
+
+
+/* During rdf_bulk_load/2, new triples are not added to the indexes, but
+   to db->bulk_load.chain (see link_triple_indexes()).  The walker walks
+   the index and finally the chain.  Indexes that are not yet created
+   are created by end_bulk_load(), so we must walk db->by_none, which
+   holds all triples.
+*/
+
+static void
+init_bulk_walk(triple_walker *tw)
+{ rdf_db *db = tw->db;
+
+  if ( !db->hash[tw->icol].created )
+    tw->icol = ICOL(BY_NONE);
+  tw->bulk.chain = (tw->icol == ICOL(BY_NONE) ? NULL : db->bulk_load.chain);
+  tw->bulk.here  = 0;
+}
+
+
 static void
 init_triple_walker(triple_walker *tw, rdf_db *db, triple *pattern, int which)
-{ tw->unbounded_hash = triple_hash_key(pattern, which);
+{ which = db->indexes.alt[which];	/* may be disabled */
+  tw->unbounded_hash = triple_hash_key(pattern, which);
   tw->current	     = NULL;
   tw->icol	     = ICOL(which);
   tw->db	     = db;
   if ( !tw->db->hash[tw->icol].created )
     create_triple_hashes(db, 1, &tw->icol);
+  init_bulk_walk(tw);
   tw->bcount	     = tw->db->hash[tw->icol].bucket_count_epoch;
+  init_frozen_walk(tw, pattern, which, 0);
 }
 
 
 static void
 init_triple_literal_walker(triple_walker *tw, rdf_db *db,
-			   triple *pattern, int which, unsigned int hash)
+			   triple *pattern, int which, unsigned int hash,
+			   size_t lhash)
 { tw->unbounded_hash = hash;
   tw->current	     = NULL;
   tw->icol	     = ICOL(which);
   tw->db	     = db;
   if ( !tw->db->hash[tw->icol].created )
     create_triple_hashes(db, 1, &tw->icol);
+  init_bulk_walk(tw);
   tw->bcount	     = tw->db->hash[tw->icol].bucket_count_epoch;
+  init_frozen_walk(tw, pattern, which, lhash);
 }
 
 
@@ -1011,6 +1300,232 @@ static void
 rewind_triple_walker(triple_walker *tw)
 { tw->bcount  = tw->db->hash[tw->icol].bucket_count_epoch;
   tw->current = NULL;
+  tw->bulk.here = 0;
+  if ( tw->frozen.state != FROZEN_WALK_NONE )
+  { tw->frozen.state   = FROZEN_WALK_INIT;
+    tw->frozen.next    = NULL;
+    tw->frozen.current = NULL;
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+After the hash chain, the walker enumerates  the matching triples of the
+frozen graphs (see freeze_graph()). The S,P,O parts of the index we use
+select the sort order and the length of  the key prefix that is bound.
+If the index includes G we only walk  the frozen graph of the pattern's
+graph. Otherwise we walk all frozen graphs.
+
+A walker uses the frozen graphs  that  were   published  before  it
+started (see publish_frozen_graph()). If a graph  is frozen while we
+walk, we find its triples in the hash chains: GC only unlinks them if
+no walker that started earlier can be active. In the hash chain we skip
+a frozen triple only if it is part of the frozen graph we use, so we
+never return a triple twice.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static const struct
+{ int	perm;				/* FROZEN_SPO, FROZEN_POS, FROZEN_OSP */
+  int	bound;				/* # bound keys */
+} frozen_plan[8] =
+{ { FROZEN_SPO, 0 },			/* BY_NONE */
+  { FROZEN_SPO, 1 },			/* BY_S */
+  { FROZEN_POS, 1 },			/* BY_P */
+  { FROZEN_SPO, 2 },			/* BY_SP */
+  { FROZEN_OSP, 1 },			/* BY_O */
+  { FROZEN_OSP, 2 },			/* BY_SO */
+  { FROZEN_POS, 2 },			/* BY_PO */
+  { FROZEN_SPO, 3 }			/* BY_SPO */
+};
+
+#define FROZEN_COL(perm, i) (((perm)+(i))%3)	/* key column of i-th key */
+
+static inline uint32_t
+frozen_position(const frozen_graph *fg, int perm, size_t i)
+{ return perm == FROZEN_SPO ? (uint32_t)i : fg->order[perm][i];
+}
+
+static inline int
+frozen_is_dead(const frozen_graph *fg, uint32_t pos)
+{ return (fg->dead[pos/32] & (1U<<(pos%32))) != 0;
+}
+
+static int
+compare_frozen_key(const frozen_graph *fg, int perm, int bound,
+		   uint32_t pos, const unsigned int *key)
+{ int i;
+
+  for(i=0; i<bound; i++)
+  { int col = FROZEN_COL(perm, i);
+    unsigned int k = fg->keys[col][pos];
+
+    if ( k < key[col] )
+      return -1;
+    if ( k > key[col] )
+      return 1;
+  }
+
+  return 0;
+}
+
+/* find the first position whose key is (above) the bound key */
+
+static size_t
+frozen_bound(const frozen_graph *fg, int perm, int bound,
+	     const unsigned int *key, int above)
+{ size_t low = 0, high = fg->count;
+
+  while ( low < high )
+  { size_t mid = low+(high-low)/2;
+    int c = compare_frozen_key(fg, perm, bound,
+			       frozen_position(fg, perm, mid), key);
+
+    if ( c < 0 || (above && c == 0) )
+      low = mid+1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+
+static void
+frozen_triple_keys(triple *t, unsigned int key[3])
+{ key[0] = (unsigned int)subject_hash(t);
+  key[1] = (unsigned int)predicate_hash(t->predicate.r);
+  key[2] = (unsigned int)object_hash(t);
+}
+
+
+/* frozen_member() is true if t is in fg.  If pos is not NULL, it is
+   filled with the SPO position of t.
+*/
+
+static int
+frozen_member(const frozen_graph *fg, triple *t, size_t *pos)
+{ unsigned int key[3];
+  size_t i, end;
+
+  frozen_triple_keys(t, key);
+  i   = frozen_bound(fg, FROZEN_SPO, 3, key, FALSE);
+  end = frozen_bound(fg, FROZEN_SPO, 3, key, TRUE);
+  for( ; i<end; i++ )
+  { if ( fg->triples[i] == T_ID(t) )
+    { if ( pos )
+	*pos = i;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+/* frozen_view() returns the version of fg that was published before
+   the walker started or NULL if there is no such version.
+*/
+
+static frozen_graph *
+frozen_view(const triple_walker *tw, frozen_graph *fg)
+{ while ( fg && fg->gen > tw->frozen.gen )
+    fg = fg->replaced;
+
+  return fg;
+}
+
+
+static int
+in_frozen_view(triple_walker *tw, triple *t)
+{ graph *g = existing_graph(tw->db, ID_ATOM(t->graph_id));
+  frozen_graph *fg;
+
+  return ( g && (fg=frozen_view(tw, g->frozen)) &&
+	   frozen_member(fg, t, NULL) );
+}
+
+
+static void
+enter_frozen_graph(triple_walker *tw, frozen_graph *fg)
+{ int sop = tw->frozen.which & BY_SPO;
+  int perm = frozen_plan[sop].perm;
+  int bound = frozen_plan[sop].bound;
+
+  tw->frozen.current = fg;
+  tw->frozen.perm    = perm;
+  if ( bound > 0 )
+  { tw->frozen.here = frozen_bound(fg, perm, bound, tw->frozen.key, FALSE);
+    tw->frozen.end  = frozen_bound(fg, perm, bound, tw->frozen.key, TRUE);
+  } else
+  { tw->frozen.here = 0;
+    tw->frozen.end  = fg->count;
+  }
+}
+
+
+static int
+start_frozen_walk(triple_walker *tw)
+{ rdf_db *db = tw->db;
+  triple *p = tw->frozen.pattern;
+  int which = tw->frozen.which;
+
+  tw->frozen.state = FROZEN_WALK_BUSY;
+  if ( !db->frozen.head )
+    return FALSE;
+
+  if ( (which&BY_G) )
+  { graph *g = existing_graph(db, ID_ATOM(p->graph_id));
+
+    if ( !g || !(tw->frozen.current = frozen_view(tw, g->frozen)) )
+      return FALSE;
+    tw->frozen.next = NULL;
+  } else
+  { tw->frozen.next = db->frozen.head;
+  }
+
+  if ( (which&BY_S) )
+    tw->frozen.key[0] = (unsigned int)subject_hash(p);
+  if ( (which&BY_P) )
+    tw->frozen.key[1] = (unsigned int)predicate_hash(p->predicate.r);
+  if ( (which&BY_O) )
+    tw->frozen.key[2] = (unsigned int)(tw->frozen.object_hash
+					 ? tw->frozen.object_hash
+					 : object_hash(p));
+
+  if ( tw->frozen.current )		/* only the graph of the pattern */
+    enter_frozen_graph(tw, tw->frozen.current);
+
+  return TRUE;
+}
+
+
+static triple *
+next_frozen_triple(triple_walker *tw)
+{ if ( tw->frozen.state != FROZEN_WALK_BUSY )
+  { if ( tw->frozen.state == FROZEN_WALK_NONE ||
+	 !start_frozen_walk(tw) )
+      return NULL;
+  }
+
+  for(;;)
+  { frozen_graph *fg;
+
+    if ( (fg=tw->frozen.current) )
+    { while ( tw->frozen.here < tw->frozen.end )
+      { uint32_t pos = frozen_position(fg, tw->frozen.perm, tw->frozen.here++);
+
+	if ( !frozen_is_dead(fg, pos) )
+	  return fetch_triple(tw->db, fg->triples[pos]);
+      }
+      tw->frozen.current = NULL;
+    }
+
+    if ( !(fg=tw->frozen.next) )
+      return NULL;
+    tw->frozen.next = fg->next;
+    if ( (fg=frozen_view(tw, fg)) )
+      enter_frozen_graph(tw, fg);
+  }
 }
 
 
@@ -1041,16 +1556,74 @@ next_hash_triple(triple_walker *tw)
 }
 
 
+/* in_bulk_chain() is true if t is a triple of the chain we walk.  Such
+   triples appear in the index while end_bulk_load() links them.  We
+   skip them there because next_bulk_triple() returns them.
+*/
+
+static int
+in_bulk_chain(const bulk_chain *bc, const triple *t)
+{ triple **sorted;
+  size_t low = 0, high;
+
+  if ( !bc || !bc->linked )
+    return FALSE;
+  if ( !(sorted=bc->sorted) )		/* no memory; see link_bulk_chain() */
+    return TRUE;
+
+  high = bc->count;
+  while ( low < high )
+  { size_t mid = low+(high-low)/2;
+
+    if ( sorted[mid] == t )
+      return TRUE;
+    if ( (uintptr_t)sorted[mid] < (uintptr_t)t )
+      low = mid+1;
+    else
+      high = mid;
+  }
+
+  return FALSE;
+}
+
+
+static triple *
+next_bulk_triple(triple_walker *tw)
+{ bulk_chain *bc = tw->bulk.chain;
+
+  if ( bc && tw->bulk.here < bc->count )
+  { size_t i = tw->bulk.here++;
+
+    return bc->blocks[MSB(i)][i];
+  }
+
+  return NULL;
+}
+
+
+/* Frozen triples are only in the hash chains until GC has unlinked
+   them.  We find them in the frozen graph if we use it.
+*/
+
 static inline triple *
 next_triple(triple_walker *tw)
 { triple *rc;
 
-  if ( (rc=tw->current) )
-  { tw->current = triple_follow_hash(tw->db, rc, tw->icol);
+  for(;;)
+  { if ( (rc=tw->current) )
+      tw->current = triple_follow_hash(tw->db, rc, tw->icol);
+    else if ( tw->frozen.state == FROZEN_WALK_BUSY ||
+	      !(rc=next_hash_triple(tw)) )
+    { if ( (rc=next_frozen_triple(tw)) )
+	return rc;
+      return next_bulk_triple(tw);
+    }
 
+    if ( rc->frozen && tw->icol != ICOL(BY_NONE) && in_frozen_view(tw, rc) )
+      continue;
+    if ( rc->unindexed && in_bulk_chain(tw->bulk.chain, rc) )
+      continue;
     return rc;
-  } else
-  { return next_hash_triple(tw);
   }
 }
 
@@ -1672,10 +2245,12 @@ matching_object_triple_until(rdf_db *db, triple *t, triple *p, query *q,
   if ( (t2=alive_triple(q, t)) )
   { if ( match_triples(db, t2, p, q, 0) &&
 	 !t2->object_is_literal )	/* object properties only */
-    { if ( t2->lifespan.died != query_max_gen(q) )
+    { lifespan span;
+
+      if ( triple_lifespan(db, t2, &span)->died != query_max_gen(q) )
       { DEBUG(1, Sdprintf("Limit lifespan due to dead: ");
 	      print_triple(t2, PRT_GEN|PRT_NL));
-	update_valid(valid, t2->lifespan.died);
+	update_valid(valid, span.died);
       }
 
       return t2;
@@ -2164,7 +2739,10 @@ update_predicate_counts(rdf_db *db, predicate *p, int which, query *q)
     init_atomset(&object_set);
     init_triple_walker(&tw, db, &t, t.indexed);
     while((byp=next_triple(&tw)))
-    { if ( byp->lifespan.died == GEN_MAX && !byp->is_duplicate )
+    { lifespan span;
+
+      if ( triple_lifespan(db, byp, &span)->died == GEN_MAX &&
+	   !byp->is_duplicate )
       { if ( byp->predicate.r == p ||
 	     (which != DISTINCT_DIRECT &&
 	      isSubPropertyOf(db, byp->predicate.r, p, q)) )
@@ -2385,8 +2963,13 @@ erase_graphs(rdf_db *db)
     db->graphs.blocks[MSB(i)][i] = NULL;
 
     for( ; g; g = n )
-    { n = g->next;
+    { graph_drop *d, *o;
 
+      n = g->next;
+      for(d=g->drops; d; d=o)
+      { o = d->older;
+	rdf_free(db, d, sizeof(*d));
+      }
       PL_unregister_atom(g->name);
       if ( g->source )
 	PL_unregister_atom(g->source);
@@ -2395,16 +2978,18 @@ erase_graphs(rdf_db *db)
   }
 
   db->graphs.count = 0;
+  db->graphs.dropped = 0;
   db->last_graph = NULL;
 }
 
 
-static void
-register_graph(rdf_db *db, triple *t)
-{ graph *src;
+/* triple_graph() returns the graph of t, caching the last one.
+   MT: Caller must hold db->queries.write.lock
+*/
 
-  if ( !t->graph_id )
-    return;
+static graph *
+triple_graph(rdf_db *db, triple *t)
+{ graph *src;
 
   if ( db->last_graph && db->last_graph->name == ID_ATOM(t->graph_id) )
   { src = db->last_graph;
@@ -2413,6 +2998,18 @@ register_graph(rdf_db *db, triple *t)
     db->last_graph = src;
   }
 
+  return src;
+}
+
+
+static void
+register_graph(rdf_db *db, triple *t)
+{ graph *src;
+
+  if ( !t->graph_id )
+    return;
+
+  src = triple_graph(db, t);
   src->triple_count++;
 #ifdef WITH_MD5
   if ( src->md5 )
@@ -2431,13 +3028,7 @@ unregister_graph(rdf_db *db, triple *t)
   if ( !t->graph_id )
     return;
 
-  if ( db->last_graph && db->last_graph->name == ID_ATOM(t->graph_id) )
-  { src = db->last_graph;
-  } else
-  { src = lookup_graph(db, ID_ATOM(t->graph_id));
-    db->last_graph = src;
-  }
-
+  src = triple_graph(db, t);
   src->triple_count--;
 #ifdef WITH_MD5
   if ( src->md5 )
@@ -2449,15 +3040,90 @@ unregister_graph(rdf_db *db, triple *t)
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-rdf_graph_(?Graph, ?TripleCount) is nondet.
+/* triple_drop_gen() returns the generation of the drop_graph() that
+   killed t or GEN_MAX.  This is the oldest drop of the graph after t
+   was born.  The drop records are ordered newest first.
+*/
 
-True when Graph is a current graph with TripleCount triples.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+static gen_t
+graph_drop_gen(graph *g, triple *t)
+{ graph_drop *d;
+  gen_t gen = GEN_MAX;
 
-typedef struct enum_graph
-{ graph *g;
-  int i;
+  for(d=g->drops; d && d->gen > t->lifespan.born; d=d->older)
+    gen = d->gen;
+
+  return gen;
+}
+
+
+gen_t
+triple_drop_gen(rdf_db *db, triple *t)
+{ graph *g;
+
+  if ( !t->graph_id ||
+       !(g=existing_graph(db, ID_ATOM(t->graph_id))) )
+    return GEN_MAX;
+
+  return graph_drop_gen(g, t);
+}
+
+
+/* query_drop_gen() is triple_drop_gen() for alive_triple().  Queries
+   typically test many triples of the same graph, so we cache the graph
+   of the previous test.  Drops that are visible to q are already in
+   g->drops when q is opened and the graph is not freed while q is
+   open.
+*/
+
+gen_t
+query_drop_gen(query *q, triple *t)
+{ graph *g;
+
+  if ( !t->graph_id )
+    return GEN_MAX;
+
+  if ( t->graph_id == q->drop_cache.graph_id )
+  { g = q->drop_cache.graph;
+  } else
+  { g = existing_graph(q->db, ID_ATOM(t->graph_id));
+    q->drop_cache.graph_id = t->graph_id;
+    q->drop_cache.graph    = g;
+  }
+
+  return g ? graph_drop_gen(g, t) : GEN_MAX;
+}
+
+
+/* triple_lifespan() returns the lifespan of t, ending it at the graph
+   drop that killed t.  Use this rather than t->lifespan if the lifespan
+   is used to decide on visibility without alive_triple().
+*/
+
+static lifespan *
+triple_lifespan(rdf_db *db, triple *t, lifespan *span)
+{ *span = t->lifespan;
+
+  if ( db->graphs.dropped )
+  { gen_t dg = triple_drop_gen(db, t);
+
+    if ( dg < span->died )
+      span->died = dg;
+  }
+
+  return span;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+rdf_graph_(?Graph, ?TripleCount) is nondet.
+
+True when Graph is a current graph with TripleCount triples.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct enum_graph
+{ graph *g;
+  int i;
 } enum_graph;
 
 
@@ -2650,6 +3316,79 @@ rdf_destroy_graph(term_t graph_name)
 }
 
 
+/* graph_has_subproperties() is true if g has visible rdfs:subPropertyOf
+   triples.  Erasing these must update the predicate hierarchy, which
+   drop_graph() does not do.
+*/
+
+static int
+graph_has_subproperties(query *q, graph *g)
+{ rdf_db *db = q->db;
+  predicate *p;
+  triple t, *byp;
+  triple_walker tw;
+  int rc = FALSE;
+
+  if ( !(p=existing_predicate(db, ATOM_subPropertyOf)) ||
+       p->triple_count == 0 )
+    return FALSE;
+
+  memset(&t, 0, sizeof(t));
+  t.predicate.r = p;
+  t.graph_id    = ATOM_ID(g->name);
+  t.indexed     = BY_PG;
+  init_triple_walker(&tw, db, &t, t.indexed);
+  while((byp=next_triple(&tw)))
+  { if ( byp->predicate.r == p &&
+	 byp->graph_id == t.graph_id &&
+	 alive_triple(q, byp) )
+    { rc = TRUE;
+      break;
+    }
+  }
+  destroy_triple_walker(db, &tw);
+
+  return rc;
+}
+
+
+/** rdf_drop_graph_(+Graph) is semidet.
+
+Kill all triples of Graph in one step   (see drop_graph()). Fails if this
+is not possible because we are inside a   transaction, Graph is frozen,
+Graph holds subPropertyOf triples or  someone   monitors  retract events,
+either per triple or in batches.  The caller must then retract the
+triples one by one.
+*/
+
+static foreign_t
+rdf_drop_graph(term_t graph_name)
+{ atom_t gn;
+  rdf_db *db = rdf_current_db();
+  graph *g;
+  query *q;
+  int rc;
+
+  if ( !PL_get_atom_ex(graph_name, &gn) )
+    return FALSE;
+  if ( !(g = existing_graph(db, gn)) )
+    return TRUE;
+  if ( g->frozen ||
+       rdf_is_broadcasting(EV_RETRACT) ||
+       rdf_is_broadcasting_batch(EV_RETRACT) )
+    return FALSE;
+
+  q = open_query(db);
+  if ( q->transaction || graph_has_subproperties(q, g) )
+    rc = FALSE;
+  else
+    rc = drop_graph(q, g);
+  close_query(q);
+
+  return rc;
+}
+
+
 #ifdef WITH_MD5
 /** rdf_graph_modified_(+Graph, -IsModified, -UnmodifiedHash)
 
@@ -2741,7 +3480,8 @@ new_literal(rdf_db *db)
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 FIXME: rdf_broadcast(EV_OLD_LITERAL,...) happens with   the literal lock
 helt. Needs better merging with  free_literal()   to  reduce locking and
-avoid this problem.
+avoid this problem. Async monitors  never   wait  for  this event (see
+EV_UNDER_LOCK).
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 static int
@@ -3109,11 +3849,13 @@ share_literal(rdf_db *db, literal *from)
 		 *******************************/
 
 static triple *
-alloc_triple(void)
-{ triple *t = malloc(sizeof(*t));
+alloc_triple(rdf_db *db)
+{ int slots = db->indexes.slots;
+  triple *t = malloc(TRIPLE_SIZE(slots));
 
   if ( t )
-  { memset(t, 0, sizeof(*t));
+  { memset(t, 0, TRIPLE_SIZE(slots));
+    t->slots = slots;
 #ifdef COMPACT
     t->id = TRIPLE_NO_ID;
 #endif
@@ -3171,15 +3913,14 @@ init_triple_hash(rdf_db *db, int index, size_t count)
 }
 
 
-static int
-size_triple_hash(rdf_db *db, int index, size_t size)
+/* MT: Caller must hold db->queries.write.lock
+*/
+
+static void
+grow_triple_hash(rdf_db *db, int index, size_t size)
 { triple_hash *hash = &db->hash[index];
   int extra;
 
-  if ( hash->created )
-    rdf_create_gc_thread(db);
-
-  simpleMutexLock(&db->queries.write.lock);
   extra = MSB(size) - MSB(hash->bucket_count);
   while( extra-- > 0 )
   { int i = MSB(hash->bucket_count);
@@ -3188,12 +3929,23 @@ size_triple_hash(rdf_db *db, int index, size_t size)
 
     memset(t, 0, bytes);
     hash->blocks[i] = t-hash->bucket_count;
+    MEMORY_BARRIER();			/* concurrent link_triple_hash() */
     hash->bucket_count *= 2;
     if ( !hash->created )
       hash->bucket_count_epoch = hash->bucket_count;
     DEBUG(1, Sdprintf("Resized triple index %s=%d to %ld at %d\n",
 		      col_name[index], index, (long)hash->bucket_count, i));
   }
+}
+
+
+static int
+size_triple_hash(rdf_db *db, int index, size_t size)
+{ if ( db->hash[index].created )
+    rdf_create_gc_thread(db);
+
+  simpleMutexLock(&db->queries.write.lock);
+  grow_triple_hash(db, index, size);
   simpleMutexUnlock(&db->queries.write.lock);
 
   return TRUE;
@@ -3371,8 +4123,12 @@ TBD: Can we omit linking all  the   hashes  when adding triples? Then we
 need to materialize on the first query.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-void
-consider_triple_rehash(rdf_db *db, size_t extra)
+/* If locked is TRUE, the caller holds db->queries.write.lock (see
+   end_bulk_load()).
+*/
+
+static void
+resize_triple_hashes(rdf_db *db, size_t extra, int locked)
 { size_t triples = db->created - db->erased;
   triple_hash *spo = &db->hash[ICOL(BY_SPO)];
 
@@ -3395,6 +4151,8 @@ consider_triple_rehash(rdf_db *db, size_t extra)
       { case BY_S:
 	case BY_SG:
 	case BY_SP:
+	case BY_SO:
+	case BY_SPG:
 	  while ( SCALE(db->resources.hash.count) > sizenow<<resize )
 	    resize++;
 	  break;
@@ -3404,6 +4162,8 @@ consider_triple_rehash(rdf_db *db, size_t extra)
 	  break;
 	case BY_O:
 	case BY_PO:
+	case BY_OG:
+	case BY_POG:
 	  while ( SCALE(db->resources.hash.count + db->literals.count) >
 		  sizenow<<resize )
 	    resize++;
@@ -3432,7 +4192,10 @@ consider_triple_rehash(rdf_db *db, size_t extra)
 
       if ( resize )
       { resized++;
-	size_triple_hash(db, i, sizenow<<resize);
+	if ( locked )
+	  grow_triple_hash(db, i, sizenow<<resize);
+	else
+	  size_triple_hash(db, i, sizenow<<resize);
       }
     }
 
@@ -3445,6 +4208,13 @@ consider_triple_rehash(rdf_db *db, size_t extra)
 }
 
 
+void
+consider_triple_rehash(rdf_db *db, size_t extra)
+{ if ( !db->bulk_load.active )
+    resize_triple_hashes(db, extra, FALSE);
+}
+
+
 static size_t
 distinct_hash_values(rdf_db *db, int icol)
 { triple *t;
@@ -3490,6 +4260,10 @@ initial_size_triple_hash(rdf_db *db, int icol)
     case BY_SG:
     case BY_SP:
     case BY_PG:
+    case BY_SO:
+    case BY_SPG:
+    case BY_OG:
+    case BY_POG:
       size = distinct_hash_values(db, icol);
       break;
     default:
@@ -3507,6 +4281,7 @@ init_tables(rdf_db *db)
 { int ic;
   triple_hash *by_none = &db->hash[ICOL(BY_NONE)];
 
+  set_index_set(db, DEFAULT_INDEXES);
   by_none->blocks[0] = &db->by_none;
   by_none->bucket_count_epoch = 1;
   by_none->bucket_count = 1;
@@ -3516,6 +4291,12 @@ init_tables(rdf_db *db)
   { if ( !init_triple_hash(db, ic, INITIAL_TABLE_SIZE) )
       return FALSE;
   }
+  for(ic=0; ic<INDEX_TABLES; ic++)
+  { int i;
+
+    for(i=0; i<LINK_STRIPES; i++)
+      simpleMutexInit(&db->hash[ic].stripes[i]);
+  }
 
   return (init_resource_db(db, &db->resources) &&
 	  init_pred_table(db) &&
@@ -3552,10 +4333,12 @@ will ignore this for now: triple ordering has no semantics.
 
 static void
 reindex_triple(rdf_db *db, triple *t)
-{ triple *t2 = alloc_triple();
+{ triple *t2 = alloc_triple(db);
 
-  *t2 = *t;
-  memset(&t2->tp, 0, sizeof(t2->tp));
+  memcpy(t2, t, offsetof(triple, tp));
+  t2->slots    = db->indexes.slots;	/* may relayout */
+  t2->overflow = FALSE;
+  t2->frozen   = FALSE;
   register_triple(db, t2);
   simpleMutexLock(&db->queries.write.lock);
   link_triple_hash(db, t2);
@@ -3633,6 +4416,7 @@ optimize_triple_hash(rdf_db *db, int icol, gen_t gen)
       for(t=fetch_triple(db, bucket->head); t; t=triple_follow_hash(db, t, icol))
       { if ( t->lifespan.died >= gen &&
 	     !t->reindexed &&		/* see (*) */
+	     !t->frozen && !t->unindexed &&
 	     triple_hash_key(t, col_index[icol]) % hash->bucket_count != b_no )
 	{ reindex_triple(db, t);
 	  copied++;
@@ -3671,6 +4455,194 @@ optimize_triple_hashes(rdf_db *db, gen_t gen)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+relayout_triples() is the second  half   of  creating  an index for the
+existing triples. These triples  keep  their   link  for  the new index
+in  the  overflow  array  of  the  hash  (see  triple_link()).  We  use
+reindex_triple() to replace them by a copy   that  has a slot for every
+index. The old version is  reclaimed  by   GC  after  all queries that
+might see it have finished. When   no  triple uses the overflow arrays,
+they are released.
+
+We only consider triples that were in  the   DB  when we started, which
+avoids visiting the copies. This is called from gc_db(), which ensures
+that no new indexes are created while we are working.
+
+db->indexes.relayout_done is the last triple  of db->by_none upto which
+all triples are handled. The next call starts after it, so only triples
+added since are visited. It is reset  by create_triple_hashes() and
+moved back by GC if it unlinks this triple (see gc_hash_chain()).
+Bulk-loaded triples are handled later (see end_bulk_load()), so we do
+not advance beyond them.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#ifdef COMPACT
+static int
+relayout_triples(rdf_db *db, gen_t gen)
+{ triple *t, *last, *done;
+  size_t copied = 0;
+  int pending = FALSE;
+
+  if ( db->indexes.overflowed == 0 )
+  { int icol;
+
+    for(icol=1; icol<INDEX_TABLES; icol++)
+    { triple_hash *hash = &db->hash[icol];
+
+      if ( hash->overflow_size )
+      { simpleMutexLock(&db->queries.write.lock);
+	if ( db->indexes.overflowed == 0 )
+	  free_overflow(db, hash, TRUE);
+	simpleMutexUnlock(&db->queries.write.lock);
+      }
+    }
+
+    return 0;
+  }
+
+  simpleMutexLock(&db->queries.write.lock);
+  last = fetch_triple(db, db->by_none.tail);
+  simpleMutexUnlock(&db->queries.write.lock);
+
+  enter_scan(&db->defer_all);
+  done = fetch_triple(db, db->indexes.relayout_done);
+  for(t=(done ? triple_follow_hash(db, done, ICOL(BY_NONE))
+	      : fetch_triple(db, db->by_none.head));
+      t;
+      t=triple_follow_hash(db, t, ICOL(BY_NONE)))
+  { if ( t->overflow &&
+	 !t->reindexed && !t->frozen &&
+	 t->lifespan.died >= gen )
+    { if ( t->unindexed )
+      { pending = TRUE;
+      } else
+      { reindex_triple(db, t);
+	if ( ++copied % 10000 == 0 && PL_handle_signals() < 0 )
+	{ if ( !pending )
+	    db->indexes.relayout_done = T_ID(t);
+	  exit_scan(&db->defer_all);
+	  return -1;
+	}
+      }
+    }
+    if ( !pending )
+      db->indexes.relayout_done = T_ID(t);
+    if ( t == last )
+      break;
+  }
+  exit_scan(&db->defer_all);
+
+  DEBUG(1, if ( copied )
+	     Sdprintf("Relayout: copied %ld triples\n", (long)copied));
+
+  return 0;
+}
+#else
+#define relayout_triples(db, gen) 0
+#endif
+
+
+		 /*******************************
+		 *	   WORKER THREADS	*
+		 *******************************/
+
+#define MAX_WORKERS		  16
+
+/* run_workers() calls func on count closures of size bytes, starting at
+   workers.  The calling thread handles the first.  If a thread cannot
+   be created we do its work ourselves.  See also worker_count().
+*/
+
+typedef void (*worker_func)(void *closure);
+
+typedef struct worker_thread
+{ worker_func	func;			/* Function to run */
+  void	       *closure;		/* Its argument */
+} worker_thread;
+
+#ifdef USE_CRITICAL_SECTIONS
+static DWORD WINAPI
+run_worker_thread(LPVOID closure)
+{ worker_thread *wt = closure;
+
+  (*wt->func)(wt->closure);
+
+  return 0;
+}
+#else
+static void *
+run_worker_thread(void *closure)
+{ worker_thread *wt = closure;
+
+  (*wt->func)(wt->closure);
+
+  return NULL;
+}
+#endif
+
+
+static void
+run_workers(worker_func func, void *workers, size_t size, int count)
+{ int i;
+#ifdef USE_CRITICAL_SECTIONS
+  HANDLE tid[MAX_WORKERS];
+#else
+  pthread_t tid[MAX_WORKERS];
+#endif
+  worker_thread wt[MAX_WORKERS];
+  int started[MAX_WORKERS];
+
+  assert(count <= MAX_WORKERS);
+
+  for(i=1; i<count; i++)
+  { wt[i].func    = func;
+    wt[i].closure = (char*)workers + i*size;
+#ifdef USE_CRITICAL_SECTIONS
+    started[i] = ((tid[i]=CreateThread(NULL, 0, run_worker_thread,
+				       &wt[i], 0, NULL)) != NULL);
+#else
+    started[i] = (pthread_create(&tid[i], NULL,
+				 run_worker_thread, &wt[i]) == 0);
+#endif
+  }
+
+  (*func)(workers);
+  for(i=1; i<count; i++)
+  { if ( started[i] )
+    {
+#ifdef USE_CRITICAL_SECTIONS
+      WaitForSingleObject(tid[i], INFINITE);
+      CloseHandle(tid[i]);
+#else
+      pthread_join(tid[i], NULL);
+#endif
+    } else
+    { (*func)(wt[i].closure);		/* could not start; do it ourselves */
+    }
+  }
+}
+
+
+/* worker_count() returns the number of threads to use for a job of
+   size work units if each thread should handle at least min units.
+   This is bounded by the Prolog flag cpu_count and MAX_WORKERS.
+*/
+
+static int
+worker_count(size_t work, size_t min)
+{ int64_t cpus;
+  int workers;
+
+  if ( !PL_current_prolog_flag(ATOM_cpu_count, PL_INTEGER, &cpus) || cpus < 1 )
+    cpus = 1;
+  workers = (cpus > MAX_WORKERS ? MAX_WORKERS : (int)cpus);
+  if ( work/min < (size_t)workers )
+    workers = (int)(work/min);
+
+  return workers > 0 ? workers : 1;
+}
+
+
 		 /*******************************
 		 *	GARBAGE COLLECTION	*
 		 *******************************/
@@ -3684,7 +4656,8 @@ generation gen.	 There are two thing we can do:
 
 (*) We must lock, to avoid a   conflict with link_triple_hash(), but the
 latter only puts things at the end of the chain, so we only need to lock
-if we remove a triple near the end.
+if we remove a triple near the end. We use the bucket lock of the linker
+(see link_triples()).
 
 We count `uncollectable' triples: erased triples that still have queries
 that depend on them. If no  such  triples   exist  there  is no point in
@@ -3706,111 +4679,514 @@ is_garbage_triple(triple *t, gen_t old_query_gen, gen_t old_reindex_gen)
 }
 
 
-static size_t
-gc_hash_chain(rdf_db *db, size_t bucket_no, int icol,
-	      gen_t gen, gen_t reindex_gen)
-{ triple_bucket *bucket = &db->hash[icol].blocks[MSB(bucket_no)][bucket_no];
-  triple *prev = NULL;
-  triple *t;
-  size_t collected = 0;
-  size_t uncollectable = 0;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+GC work is done in slices. A slice is   a single call to gc_db() and its
+size is limited by db->gc.budget, which is set using rdf_set_gc_budget/1.
+A GC cycle optimizes the indexes, collects the  triples of all indexes
+and finally collects the predicate clouds.  If   the  budget is exhausted
+while collecting an index, its position is  saved   in  the GC cursor of
+the triple_hash and the next slice continues from there.
+
+The cursor is the bucket and, if we  stopped halfway a chain, the last
+triple we kept. Only GC unlinks  triples   from  a  chain, so this triple
+remains in the chain. Other users of  gc_hash(), such as freeze_graph(),
+collect the whole index and reset the cursor.  Using a newer generation
+in a later slice is safe: it merely allows for collecting more.
+
+The budget counts buckets. Walking GC_CHAIN_STEP triples of a chain counts
+as a bucket, such that we can also stop in the long chain of db->by_none.
+A time budget checks the clock every GC_CLOCK_STEPS buckets.
+
+The indexes other than db->by_none may be collected by multiple workers
+(see gc_hash_parallel()).  The workers claim chunks of GC_WORKER_CHUNK
+buckets from a shared counter and always complete  a claimed chunk, so
+all buckets below the final counter are   done  and this is our cursor.
+As the buckets of one index hold  disjoint   sets  of triples, only one
+worker handles a triple, which keeps ->linked safe.  The workers are not
+Prolog threads and thus may not  release   atoms.  They only unlink and
+buffer the triples that are no longer linked.  These are freed and added
+to the reclaimed statistics by the GC thread after the workers are joined.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  for(t = fetch_triple(db, bucket->head); t; t=triple_follow_hash(db, t, icol))
-  { if ( is_garbage_triple(t, gen, reindex_gen) )
-    { int lock = !t->tp.next[icol];
+#define GC_CHAIN_STEP  256		/* Triples that count as a bucket */
+#define GC_CLOCK_STEPS 16		/* Buckets between clock checks */
+#define GC_WORKER_CHUNK 1024		/* Buckets claimed by a GC worker */
+#define GC_WORKER_MIN_BUCKETS 65536	/* Min buckets per GC worker */
 
-      if ( lock )
-	simpleMutexLock(&db->queries.write.lock); /* (*) */
+typedef struct gc_budget
+{ int		unit;			/* GC_BUDGET_* */
+  int64_t	buckets;		/* Buckets left */
+  int64_t	deadline;		/* Time budget ends (usec) */
+  int		steps;			/* Steps since checking the clock */
+} gc_budget;
 
-      if ( prev )
-	prev->tp.next[icol] = t->tp.next[icol];
-      else
-	bucket->head = t->tp.next[icol];
-      if ( T_ID(t) == bucket->tail )
-	bucket->tail = T_ID(prev);
+typedef struct gc_counts
+{ size_t	collected;		/* Unlinked from the chains */
+  size_t	reclaimed_triples;	/* Freed erased triples */
+  size_t	reclaimed_reindexed;	/* Freed reindexed triples */
+  triple_buffer *unlinked;		/* Workers: free these later */
+} gc_counts;
 
-      if ( lock )
-	simpleMutexUnlock(&db->queries.write.lock);
 
-      collected++;
+/* wall_usec() returns a monotonic time in microseconds.
+*/
 
-      if ( --t->linked == 0 )
-      { DEBUG(2, { char buf[2][64];
-		   Sdprintf("GC at gen=%s..%s: ",
-			    gen_name(t->lifespan.born, buf[0]),
-			    gen_name(t->lifespan.died, buf[1]));
-		   print_triple(t, PRT_NL);
-		 });
+static int64_t
+wall_usec(void)
+{
+#ifdef __WINDOWS__
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
 
-	if ( t->reindexed )
-	  db->gc.reclaimed_reindexed++;
-	else
-	  db->gc.reclaimed_triples++;
-	free_triple(db, t, TRUE);
-      }
-    } else
-    { prev=t;
-      if ( icol == 0 && t->erased && !t->reindexed &&
-	   t->lifespan.died >= gen )
-	uncollectable++;
-    }
-  }
+  if ( !freq.QuadPart )
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
 
-  if ( collected && icol > 0 )		/* concurrent with hashing new ones */
-    ATOMIC_SUB(&bucket->count, collected);
+  return (int64_t)((double)now.QuadPart*1000000.0/(double)freq.QuadPart);
+#elif defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
 
-  if ( icol == 0 )
-  { char buf[64];
+  clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    DEBUG(4, Sdprintf("At %s: %lld uncollectable\n",
-		      gen_name(gen, buf),
-		      uncollectable));
-    db->gc.uncollectable = uncollectable;
-  }
+  return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+#else
+  struct timeval tv;
 
-  return collected;
-}
+  gettimeofday(&tv, NULL);
 
-static size_t
-gc_hash(rdf_db *db, int icol, gen_t gen, gen_t reindex_gen)
-{ size_t mb = db->hash[icol].bucket_count;
-  size_t b;
-  size_t collected = 0;
+  return (int64_t)tv.tv_sec*1000000 + tv.tv_usec;
+#endif
+}
 
-  for(b=0; b<mb; b++)
-    collected += gc_hash_chain(db, b, icol, gen, reindex_gen);
 
-  return collected;
+static void
+init_gc_budget(rdf_db *db, gc_budget *b, int64_t start)
+{ b->unit     = db->gc.budget.unit;
+  b->buckets  = db->gc.budget.amount;
+  b->deadline = start + db->gc.budget.amount;
+  b->steps    = 0;
 }
 
 
+/* gc_budget_exhausted() is called after each bucket.  It returns TRUE
+   if the slice must stop.
+*/
+
 static int
-gc_hashes(rdf_db *db, gen_t gen, gen_t reindex_gen)
-{ size_t garbage = db->erased    - db->gc.reclaimed_triples;
-  size_t reindex = db->reindexed - db->gc.reclaimed_reindexed;
+gc_budget_exhausted(gc_budget *b)
+{ if ( !b )
+    return FALSE;
 
-  if ( garbage + reindex > 0 )
-  { int icol;
+  switch(b->unit)
+  { case GC_BUDGET_BUCKETS:
+      return --b->buckets <= 0;
+    case GC_BUDGET_TIME:
+      if ( ++b->steps < GC_CLOCK_STEPS )
+	return FALSE;
+      b->steps = 0;
+      return wall_usec() >= b->deadline;
+    default:
+      return FALSE;
+  }
+}
 
-    for(icol=0; icol<INDEX_TABLES; icol++)
-    { size_t collected;
 
-      if ( db->hash[icol].created )
-      { enter_scan(&db->defer_all);
-	collected = gc_hash(db, icol, gen, reindex_gen);
-	exit_scan(&db->defer_all);
+static void
+reset_gc_cursor(triple_hash *hash)
+{ hash->gc_bucket = 0;
+  hash->gc_prev   = 0;
+}
 
-	if ( PL_handle_signals() < 0 )
-	  return -1;
-      } else
-	collected = 0;
 
-      if ( icol == 0 && collected == 0 )
+/* kill_dropped_triple() erases a triple killed by drop_graph() if no
+   query can see it anymore.  drop_graph() already updated the graph and
+   db->erased.  This is called for db->by_none, which is collected first
+   and sequentially, so the other indexes see an ordinary dead triple.
+*/
+
+static void
+kill_dropped_triple(rdf_db *db, triple *t, gen_t gen)
+{ gen_t dg;
+
+  if ( t->erased || t->reindexed || t->frozen )
+    return;
+
+  if ( (dg=triple_drop_gen(db, t)) < gen )
+  { if ( dg < t->lifespan.died )
+      t->lifespan.died = dg;
+    t->erased = TRUE;
+    unregister_predicate(db, t);
+    if ( t->is_duplicate )
+      db->duplicates--;
+  }
+}
+
+
+/* retire_graph_drops() discards the drop records that are older than
+   gen after a GC cycle that started at gen completed.  This cycle has
+   erased all triples killed by these drops.
+*/
+
+static void
+retire_graph_drops(rdf_db *db, gen_t gen)
+{ size_t i;
+
+  if ( !db->graphs.dropped )
+    return;
+
+  LOCK_MISC(db);
+  for(i=0; i<db->graphs.bucket_count; i++)
+  { graph *g;
+
+    for(g=db->graphs.blocks[MSB(i)][i]; g; g=g->next)
+    { graph_drop **dp = &g->drops;
+      graph_drop *d;
+
+      while( *dp && (*dp)->gen >= gen )
+	dp = &(*dp)->older;
+      d = *dp;
+      *dp = NULL;
+      for(; d; d=d->older)
+      { ATOMIC_DEC(&db->graphs.dropped);
+	deferred_free(&db->defer_all, d);
+      }
+    }
+  }
+  UNLOCK_MISC(db);
+}
+
+
+static void
+reclaim_triple(rdf_db *db, triple *t, gc_counts *counts)
+{ DEBUG(2, { char buf[2][64];
+	     Sdprintf("GC at gen=%s..%s: ",
+		      gen_name(t->lifespan.born, buf[0]),
+		      gen_name(t->lifespan.died, buf[1]));
+	     print_triple(t, PRT_NL);
+	   });
+
+  if ( t->reindexed )
+    counts->reclaimed_reindexed++;
+  else
+    counts->reclaimed_triples++;
+  free_triple(db, t, TRUE);
+}
+
+
+/* unlink_frozen_triple() is true if GC may unlink the frozen triple t
+   from the indexes other than db->by_none.  This is the case if no
+   walker that started before gen uses an older version of the frozen
+   graph of t, where t may not be included.  See publish_frozen_graph().
+*/
+
+static int
+unlink_frozen_triple(rdf_db *db, triple *t, gen_t gen)
+{ graph *g = existing_graph(db, ID_ATOM(t->graph_id));
+  frozen_graph *fg;
+
+  return !g || !(fg=g->frozen) || fg->gen <= gen;
+}
+
+
+static void
+gc_hash_chain(rdf_db *db, size_t bucket_no, int icol,
+	      gen_t gen, gen_t reindex_gen, gc_budget *budget,
+	      gc_counts *counts)
+{ triple_hash *hash = &db->hash[icol];
+  triple_bucket *bucket = &hash->blocks[MSB(bucket_no)][bucket_no];
+  simpleMutex *stripe = &hash->stripes[bucket_no%LINK_STRIPES];
+  triple *prev = NULL;
+  triple *t;
+  size_t collected = 0;
+  size_t uncollectable = 0;
+  size_t steps = 0;
+
+  if ( hash->gc_prev )			/* resume in the chain */
+  { prev = fetch_triple(db, hash->gc_prev);
+    hash->gc_prev = 0;
+    t = triple_follow_hash(db, prev, icol);
+  } else
+  { t = fetch_triple(db, bucket->head);
+  }
+
+  for(; t; t=triple_follow_hash(db, t, icol))
+  { if ( icol == 0 && db->graphs.dropped )
+      kill_dropped_triple(db, t, gen);
+
+    if ( icol == 0 && t->unindexed && !db->bulk_load.chains )
+      t->unindexed = FALSE;		/* see end_bulk_load() */
+
+    int garbage = (is_garbage_triple(t, gen, reindex_gen) && !t->unindexed);
+
+    if ( garbage ||
+	 (t->frozen && icol > 0 && unlink_frozen_triple(db, t, gen)) )
+    { int lock = !T_NEXT(db, t, icol);
+
+      if ( counts->unlinked && t->linked == 1 &&
+	   !buffer_triple(counts->unlinked, t) )
+      { prev = t;			/* no memory; next GC cycle */
+	continue;
+      }
+
+      if ( lock )
+	simpleMutexLock(stripe);	/* (*) */
+
+      if ( prev )
+	T_NEXT(db, prev, icol) = T_NEXT(db, t, icol);
+      else
+	bucket->head = T_NEXT(db, t, icol);
+      if ( T_ID(t) == bucket->tail )
+	bucket->tail = T_ID(prev);
+#ifdef COMPACT
+      if ( icol == 0 && T_ID(t) == db->indexes.relayout_done )
+	db->indexes.relayout_done = T_ID(prev);	/* see relayout_triples() */
+#endif
+
+      if ( lock )
+	simpleMutexUnlock(stripe);
+
+      collected++;
+      if ( t->frozen && icol == 0 )
+	kill_frozen_triple(db, t);
+
+      if ( --t->linked == 0 && !counts->unlinked )
+	reclaim_triple(db, t, counts);
+      else if ( !garbage && t->linked == 1 && t->overflow )
+      { t->overflow = FALSE;		/* only in db->by_none */
+	ATOMIC_DEC(&db->indexes.overflowed);
+      }
+    } else
+    { prev=t;
+      if ( icol == 0 && t->erased && !t->reindexed &&
+	   t->lifespan.died >= gen )
+	uncollectable++;
+      if ( ++steps % GC_CHAIN_STEP == 0 &&
+	   T_NEXT(db, t, icol) &&
+	   gc_budget_exhausted(budget) )
+      { hash->gc_prev = T_ID(t);	/* continue here next slice */
 	break;
+      }
     }
   }
 
-  return 0;
+  if ( collected && icol > 0 )		/* concurrent with hashing new ones */
+    ATOMIC_SUB(&bucket->count, collected);
+
+  if ( icol == 0 )
+    db->gc.cycle.uncollectable += uncollectable;
+
+  counts->collected += collected;
+}
+
+
+typedef struct gc_worker
+{ rdf_db       *db;			/* Database we work on */
+  int		icol;			/* Index we collect */
+  gen_t		gen;			/* Oldest generation to keep */
+  gen_t		reindex_gen;		/* Oldest reindexed to keep */
+  size_t       *next;			/* Shared: next bucket to claim */
+  size_t	limit;			/* Do not claim beyond */
+  int64_t	deadline;		/* Stop claiming after (0: never) */
+  gc_counts	counts;			/* What this worker collected */
+  triple_buffer	unlinked;		/* Triples to free */
+} gc_worker;
+
+
+static void
+gc_hash_worker(void *closure)
+{ gc_worker *w = closure;
+
+  for(;;)
+  { size_t end, b;
+
+    if ( w->deadline && wall_usec() >= w->deadline )
+      break;
+    end = ATOMIC_ADD(w->next, GC_WORKER_CHUNK);
+    b = end - GC_WORKER_CHUNK;
+    if ( b >= w->limit )
+      break;
+    if ( end > w->limit )
+      end = w->limit;
+
+    for(; b<end; b++)
+      gc_hash_chain(w->db, b, w->icol, w->gen, w->reindex_gen,
+		    NULL, &w->counts);
+  }
+}
+
+
+/* gc_worker_count() returns the number of workers for collecting the
+   remaining buckets of an index.  Collection of db->by_none is never
+   split, which also keeps the uncollectable count simple.
+*/
+
+static int
+gc_worker_count(rdf_db *db, triple_hash *hash)
+{ int workers;
+
+  if ( hash->icol == 0 || hash->gc_prev || db->gc.workers == 1 )
+    return 1;
+
+  workers = worker_count(hash->bucket_count - hash->gc_bucket,
+			 GC_WORKER_MIN_BUCKETS);
+  if ( db->gc.workers > 0 && workers > db->gc.workers )
+    workers = db->gc.workers;
+
+  return workers;
+}
+
+
+/* gc_hash_parallel() collects the buckets from the GC cursor of the
+   index using workers threads.  See gc_hash() for the return value.
+*/
+
+static int
+gc_hash_parallel(rdf_db *db, int icol, gen_t gen, gen_t reindex_gen,
+		 gc_budget *budget, int workers, gc_counts *counts)
+{ triple_hash *hash = &db->hash[icol];
+  size_t mb = hash->bucket_count;
+  size_t next = hash->gc_bucket;
+  size_t limit = mb;
+  int64_t deadline = 0;
+  gc_worker w[MAX_WORKERS];
+  int i;
+
+  if ( budget )
+  { switch(budget->unit)
+    { case GC_BUDGET_BUCKETS:
+	if ( budget->buckets < (int64_t)(mb-next) )
+	  limit = next + (budget->buckets > 0 ? budget->buckets : 1);
+	break;
+      case GC_BUDGET_TIME:
+	deadline = budget->deadline;
+	break;
+    }
+  }
+
+  DEBUG(1, Sdprintf("GC %s using %d workers\n", col_name[icol], workers));
+  for(i=0; i<workers; i++)
+  { memset(&w[i], 0, sizeof(w[i]));
+    w[i].db	     = db;
+    w[i].icol	     = icol;
+    w[i].gen	     = gen;
+    w[i].reindex_gen = reindex_gen;
+    w[i].next	     = &next;
+    w[i].limit	     = limit;
+    w[i].deadline    = deadline;
+    init_triple_buffer(&w[i].unlinked);
+    w[i].counts.unlinked = &w[i].unlinked;
+  }
+  run_workers(gc_hash_worker, w, sizeof(w[0]), workers);
+
+  if ( next > limit )
+    next = limit;
+  for(i=0; i<workers; i++)
+  { triple **tp;
+
+    for(tp=w[i].unlinked.base; tp<w[i].unlinked.top; tp++)
+      reclaim_triple(db, *tp, counts);
+    free_triple_buffer(&w[i].unlinked);
+    counts->collected += w[i].counts.collected;
+  }
+  if ( budget && budget->unit == GC_BUDGET_BUCKETS )
+    budget->buckets -= (int64_t)(next - hash->gc_bucket);
+
+  if ( next >= mb )
+  { reset_gc_cursor(hash);
+    return TRUE;
+  }
+  hash->gc_bucket = next;
+
+  return FALSE;
+}
+
+
+/* gc_hash() collects index icol, starting at its GC cursor.  It returns
+   TRUE if the index is completed and FALSE if the budget is exhausted.
+   Without a budget the whole index is collected.
+*/
+
+static int
+gc_hash(rdf_db *db, int icol, gen_t gen, gen_t reindex_gen,
+	gc_budget *budget, size_t *collected)
+{ triple_hash *hash = &db->hash[icol];
+  size_t mb = hash->bucket_count;
+  gc_counts counts = {0};
+  int workers;
+  int rc = TRUE;
+  size_t b;
+
+  if ( !budget )
+    reset_gc_cursor(hash);
+
+  if ( (workers=gc_worker_count(db, hash)) > 1 )
+  { rc = gc_hash_parallel(db, icol, gen, reindex_gen, budget,
+			  workers, &counts);
+  } else
+  { for(b=hash->gc_bucket; b<mb; b++)
+    { gc_hash_chain(db, b, icol, gen, reindex_gen, budget, &counts);
+
+      if ( hash->gc_prev )
+      { hash->gc_bucket = b;
+	rc = FALSE;
+	break;
+      }
+      if ( b+1 < mb && gc_budget_exhausted(budget) )
+      { hash->gc_bucket = b+1;
+	rc = FALSE;
+	break;
+      }
+    }
+    if ( rc )
+      reset_gc_cursor(hash);
+  }
+
+  db->gc.reclaimed_triples   += counts.reclaimed_triples;
+  db->gc.reclaimed_reindexed += counts.reclaimed_reindexed;
+  *collected += counts.collected;
+
+  return rc;
+}
+
+
+/* gc_hashes() continues collecting the indexes of the current cycle.
+   Returns -1 if interrupted, FALSE if the budget is exhausted and TRUE
+   if all indexes are collected.
+*/
+
+static int
+gc_hashes(rdf_db *db, gen_t gen, gen_t reindex_gen, gc_budget *budget)
+{ int icol;
+
+  for(icol=db->gc.cycle.icol; icol<INDEX_TABLES; icol++)
+  { db->gc.cycle.icol = icol;
+
+    if ( db->hash[icol].created )
+    { size_t collected = 0;
+      int done;
+
+      enter_scan(&db->defer_all);
+      done = gc_hash(db, icol, gen, reindex_gen, budget, &collected);
+      exit_scan(&db->defer_all);
+      if ( icol == 0 )
+	db->gc.cycle.collected += collected;
+
+      if ( PL_handle_signals() < 0 )
+	return -1;
+      if ( !done )
+	return FALSE;
+    }
+
+    if ( icol == 0 )
+    { db->gc.uncollectable = db->gc.cycle.uncollectable;
+      if ( db->gc.cycle.collected == 0 &&
+	   !(db->frozen.unlink_gen && db->frozen.unlink_gen <= gen) )
+	break;				/* see publish_frozen_graph() */
+    }
+  }
+  db->gc.cycle.icol = INDEX_TABLES;
+
+  return TRUE;
 }
 
 
@@ -3835,24 +5211,84 @@ gc_clear_busy(rdf_db *db)
 }
 
 
+/* begin_gc_cycle() optimizes the hashes and starts collecting them.
+*/
+
+static int
+begin_gc_cycle(rdf_db *db, gen_t gen, gen_t reindex_gen)
+{ size_t garbage = db->erased    - db->gc.reclaimed_triples;
+  size_t reindex = db->reindexed - db->gc.reclaimed_reindexed;
+
+  if ( optimize_triple_hashes(db, gen) < 0 ||
+       relayout_triples(db, gen) < 0 )
+    return FALSE;
+
+  db->gc.cycle.active	     = TRUE;
+  db->gc.cycle.icol	     = ( garbage + reindex > 0 || db->graphs.dropped
+			       ? 0 : INDEX_TABLES );
+  db->gc.cycle.gen	     = gen;
+  db->gc.cycle.reindex_gen   = reindex_gen;
+  db->gc.cycle.collected     = 0;
+  db->gc.cycle.uncollectable = 0;
+
+  return TRUE;
+}
+
+
+static void
+record_gc_slice(rdf_db *db, int64_t usec)
+{ int bin = 0;
+
+  while( bin < GC_SLICE_BINS-1 && usec >= ((int64_t)1<<bin) )
+    bin++;
+  db->gc.slices[bin]++;
+  if ( usec > db->gc.max_slice )
+    db->gc.max_slice = usec;
+}
+
+
+/* gc_db() runs a GC slice.  It returns TRUE if the slice completed
+   normally, which does not imply the cycle is completed.
+*/
+
 static int
 gc_db(rdf_db *db, gen_t gen, gen_t reindex_gen)
 { char buf[64];
+  int64_t start = wall_usec();
+  gc_budget budget;
   int rc;
 
   if ( !gc_set_busy(db) )
     return FALSE;
   simpleMutexLock(&db->locks.gc);
   DEBUG(10, Sdprintf("RDF GC; gen = %s\n", gen_name(gen, buf)));
-  if ( optimize_triple_hashes(db, gen) >= 0 &&
-       gc_hashes(db, gen, reindex_gen) >= 0 &&
-       gc_clouds(db, gen) >= 0 )
-  { db->gc.count++;
-    db->gc.last_gen = gen;
-    db->gc.last_reindex_gen = reindex_gen;
-    rc = TRUE;
+  init_gc_budget(db, &budget, start);
+
+  if ( !db->gc.cycle.active && !begin_gc_cycle(db, gen, reindex_gen) )
+  { rc = FALSE;
   } else
-    rc = FALSE;
+  { switch( gc_hashes(db, gen, reindex_gen, &budget) )
+    { case TRUE:
+	if ( gc_clouds(db, gen) >= 0 )
+	{ retire_graph_drops(db, db->gc.cycle.gen);
+	  retire_frozen_graphs(db, db->gc.cycle.gen);
+	  db->gc.count++;
+	  db->gc.last_gen = db->gc.cycle.gen;
+	  db->gc.last_reindex_gen = db->gc.cycle.reindex_gen;
+	  db->gc.cycle.active = FALSE;
+	  rc = TRUE;
+	} else
+	  rc = FALSE;
+	break;
+      case FALSE:
+	rc = TRUE;
+	break;
+      default:
+	rc = FALSE;
+    }
+  }
+
+  record_gc_slice(db, wall_usec()-start);
   gc_clear_busy(db);
   simpleMutexUnlock(&db->locks.gc);
 
@@ -3863,6 +5299,7 @@ gc_db(rdf_db *db, gen_t gen, gen_t reindex_gen)
 static int
 suspend_gc(rdf_db *db)
 { int was_busy = db->gc.busy;
+  int icol;
 
   DEBUG(2, if ( was_busy )
 	     Sdprintf("Reset: GC in progress, waiting ...\n"));
@@ -3878,6 +5315,11 @@ suspend_gc(rdf_db *db)
   db->reindexed		     = 0;
   db->gc.uncollectable	     = 0;
   db->gc.last_gen	     = 0;
+  memset(&db->gc.cycle, 0, sizeof(db->gc.cycle));
+  memset(db->gc.slices, 0, sizeof(db->gc.slices));
+  db->gc.max_slice	     = 0;
+  for(icol=0; icol<INDEX_TABLES; icol++)
+    reset_gc_cursor(&db->hash[icol]);
   db->gc.busy		     = FALSE;
 
   return TRUE;
@@ -3943,10 +5385,63 @@ record with the following members:
   6. Oldest generation at last GC
   7. Oldest reindexed triple we must keep
   8. Oldest reindexed at last GC
+  9. `idle` or gc_cursor(Index, Bucket) if a GC cycle is in progress
+  10. gc_slices(Longest, Histogram), where Longest is the duration of
+      the longest GC slice in microseconds and Histogram is a list of
+      MaxUsec-Count.  The last bin has MaxUsec `infinite`; empty bins
+      are omitted.
 */
 
 #define INT_ARG(val) PL_INT64, (int64_t)(val)
 
+static int
+unify_gc_cursor(rdf_db *db, term_t t)
+{ if ( db->gc.cycle.active && db->gc.cycle.icol < INDEX_TABLES )
+  { int icol = db->gc.cycle.icol;
+
+    return PL_unify_term(t, PL_FUNCTOR_CHARS, "gc_cursor", 2,
+			      PL_CHARS, col_name[icol],
+			      INT_ARG(db->hash[icol].gc_bucket));
+  }
+
+  return PL_unify_atom_chars(t, "idle");
+}
+
+
+static int
+unify_gc_slices(rdf_db *db, term_t t)
+{ term_t list = PL_new_term_ref();
+  term_t tail = PL_copy_term_ref(list);
+  term_t head = PL_new_term_ref();
+  int i;
+
+  for(i=0; i<GC_SLICE_BINS; i++)
+  { size_t count = db->gc.slices[i];
+
+    if ( !count )
+      continue;
+    if ( !PL_unify_list(tail, head, tail) )
+      return FALSE;
+    if ( i == GC_SLICE_BINS-1 )
+    { if ( !PL_unify_term(head, PL_FUNCTOR_CHARS, "-", 2,
+				  PL_ATOM, ATOM_infinite,
+				  INT_ARG(count)) )
+	return FALSE;
+    } else
+    { if ( !PL_unify_term(head, PL_FUNCTOR_CHARS, "-", 2,
+				  INT_ARG((int64_t)1<<i),
+				  INT_ARG(count)) )
+	return FALSE;
+    }
+  }
+
+  return ( PL_unify_nil(tail) &&
+	   PL_unify_term(t, PL_FUNCTOR_CHARS, "gc_slices", 2,
+			      INT_ARG(db->gc.max_slice),
+			      PL_TERM, list) );
+}
+
+
 static foreign_t
 rdf_gc_info(term_t info)
 { rdf_db *db     = rdf_current_db();
@@ -3955,22 +5450,66 @@ rdf_gc_info(term_t info)
   size_t reindex = db->reindexed - db->gc.reclaimed_reindexed;
   gen_t keep_reindex;
   gen_t keep_gen = oldest_query_geneneration(db, &keep_reindex);
+  term_t av = PL_new_term_refs(2);
 
   if ( keep_gen == db->gc.last_gen )
   { garbage -= db->gc.uncollectable;
     assert((int64_t)garbage >= 0);
   }
 
-  return PL_unify_term(info,
-		       PL_FUNCTOR_CHARS, "gc_info", 8,
-		         INT_ARG(life),
-		         INT_ARG(garbage),
-		         INT_ARG(reindex),
-		         INT_ARG(optimizable_hashes(db)),
-		         INT_ARG(keep_gen),
-		         INT_ARG(db->gc.last_gen),
-		         INT_ARG(keep_reindex),
-		         INT_ARG(db->gc.last_reindex_gen));
+  return ( unify_gc_cursor(db, av+0) &&
+	   unify_gc_slices(db, av+1) &&
+	   PL_unify_term(info,
+			 PL_FUNCTOR_CHARS, "gc_info", 10,
+			   INT_ARG(life),
+			   INT_ARG(garbage),
+			   INT_ARG(reindex),
+			   INT_ARG(optimizable_hashes(db)),
+			   INT_ARG(keep_gen),
+			   INT_ARG(db->gc.last_gen),
+			   INT_ARG(keep_reindex),
+			   INT_ARG(db->gc.last_reindex_gen),
+			   PL_TERM, av+0,
+			   PL_TERM, av+1) );
+}
+
+
+/** rdf_set_gc_budget_(+Budget) is det.
+
+Set the amount of work done by a single call to rdf_gc_/0. Budget is
+one of `infinite`, buckets(Count) or time(Microseconds).
+*/
+
+static foreign_t
+rdf_set_gc_budget(term_t budget)
+{ rdf_db *db = rdf_current_db();
+  atom_t a;
+  int unit;
+  int64_t amount = 0;
+
+  if ( PL_get_atom(budget, &a) && a == ATOM_infinite )
+  { unit = GC_BUDGET_NONE;
+  } else if ( PL_is_functor(budget, FUNCTOR_buckets1) ||
+	      PL_is_functor(budget, FUNCTOR_time1) )
+  { term_t arg = PL_new_term_ref();
+
+    _PL_get_arg(1, budget, arg);
+    if ( !PL_get_int64_ex(arg, &amount) )
+      return FALSE;
+    if ( amount <= 0 )
+      return PL_domain_error("positive_integer", arg);
+    unit = ( PL_is_functor(budget, FUNCTOR_time1) ? GC_BUDGET_TIME
+						   : GC_BUDGET_BUCKETS );
+  } else
+  { return PL_type_error("rdf_gc_budget", budget);
+  }
+
+  simpleMutexLock(&db->locks.gc);
+  db->gc.budget.unit   = unit;
+  db->gc.budget.amount = amount;
+  simpleMutexUnlock(&db->locks.gc);
+
+  return TRUE;
 }
 
 
@@ -4012,6 +5551,8 @@ new_db(void)
 
   db->duplicate_admin_threshold = DUPLICATE_ADMIN_THRESHOLD;
   db->snapshots.keep = GEN_MAX;
+  db->changes.keep = GEN_MAX;
+  db->changes.reindex_keep = GEN_MAX;
   db->queries.generation = GEN_EPOCH;
 
   return db;
@@ -4036,8 +5577,10 @@ rdf_current_db(void)
 
 static triple *
 new_triple(rdf_db *db)
-{ triple *t = alloc_triple();
-  t->allocated = TRUE;
+{ triple *t = alloc_triple(db);
+
+  if ( t )
+    t->allocated = TRUE;
 
   return t;
 }
@@ -4063,6 +5606,8 @@ free_triple(rdf_db *db, triple *t, int linger)
   }
   if ( t->match == STR_MATCH_BETWEEN )
     free_literal_value(db, &t->tp.end);
+  if ( t->overflow )
+    ATOMIC_DEC(&db->indexes.overflowed);
 
   if ( t->allocated )
     unalloc_triple(db, t, linger);
@@ -4173,8 +5718,9 @@ static int by_inverse[8] =
 
 static inline void
 append_triple_bucket(rdf_db *db, triple_bucket *bucket, int icol, triple *t)
-{ if ( bucket->tail )
-  { fetch_triple(db, bucket->tail)->tp.next[icol] = T_ID(t);
+{ T_NEXT(db, t, icol) = 0;		/* overflow links may be reused */
+  if ( bucket->tail )
+  { T_NEXT(db, fetch_triple(db, bucket->tail), icol) = T_ID(t);
   } else
   { bucket->head = T_ID(t);
   }
@@ -4184,80 +5730,313 @@ append_triple_bucket(rdf_db *db, triple_bucket *bucket, int icol, triple *t)
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-(*) ->linked is decremented in gc_hash_chain() for garbage triples. This
-can conflict. We must use some sort   of  synchronization with GC if the
-died generation is not the maximum and the triple might thus be garbage.
+create_triple_hashes() creates indexes for   the existing triples. This is
+done in three steps:
+
+  1. Under db->queries.write.lock and exclusive db->queries.write.link,
+     take a snapshot of db->by_none.  New triples are only linked into
+     hashes that are `created', so the remainder of the database does
+     not touch the new hashes.
+  2. Without holding the write lock, link the snapshot into the new
+     hashes using multiple threads.  Worker N handles the N-th range of
+     the snapshot and appends to the buckets using the bucket locks, so
+     triples of different ranges may be interleaved in a bucket.  After
+     each chunk of INDEX_LINK_CHUNK triples, the worker takes the write
+     lock to update ->linked and ->overflow of the chunk.  These
+     bit-fields share their word with ->erased, which is modified under
+     the write lock.
+  3. Link the triples that were added after the snapshot.  As long as
+     triples keep coming we do so in chunks under the write lock only,
+     like (2).  If no triples were added since the previous round or
+     after INDEX_CATCHUP_ROUNDS rounds, we link the remainder under the
+     same locks as (1) and mark the hashes `created'.
+
+The snapshot triples have no tp.next[]  slot   for  the new indexes and
+use the overflow arrays, which are allocated in step 1.
+
+We hold db->locks.gc during the whole   process. This prevents GC from
+unlinking triples from db->by_none  and   decrementing  ->linked while we
+are working. It also serialises concurrent attempts to create indexes.
+Frozen triples are not added (see freeze_graph()).
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static void
-create_triple_hashes(rdf_db *db, int count, int *ic)
-{ triple_hash *hashes[16];
-  int i, mx=0;
+#define INDEX_WORKER_MIN_TRIPLES  100000	/* Min triples per worker */
+#define INDEX_LINK_CHUNK	   10000	/* Triples per write lock */
+#define INDEX_CATCHUP_ROUNDS	       4	/* Rounds before we block writers */
 
+typedef struct index_worker
+{ rdf_db       *db;			/* Database we work on */
+  triple_hash **hashes;			/* Hashes to fill */
+  int		count;			/* # hashes */
+  triple       *head;			/* First triple of our range */
+  triple       *last;			/* Last triple of our range */
+} index_worker;
+
+
+static void
+link_index_range(index_worker *w)
+{ rdf_db *db = w->db;
+  triple *next = w->head;
+
+  while ( next )
+  { triple *chunk = next;
+    triple *t;
+    size_t n;
+    int i;
+
+    for(n=0; next && n<INDEX_LINK_CHUNK; n++)
+    { t = next;
+      next = (t == w->last ? NULL : triple_follow_hash(db, t, ICOL(BY_NONE)));
+
+      for(i=0; i<w->count && !t->frozen; i++)
+      { triple_hash *hash = w->hashes[i];
+	size_t key = triple_hash_key(t, col_index[hash->icol]) % hash->bucket_count;
+
+	link_triple_bucket(db, hash, key, t);
+      }
+    }
+
+    simpleMutexLock(&db->queries.write.lock);
+    for(t=chunk; n-- > 0; t=triple_follow_hash(db, t, ICOL(BY_NONE)))
+    { if ( !t->frozen )
+      { t->linked += w->count;
+	for(i=0; i<w->count; i++)
+	  prepare_link(db, w->hashes[i]->icol, t);
+      }
+    }
+    simpleMutexUnlock(&db->queries.write.lock);
+  }
+}
+
+
+static void
+link_index_worker(void *closure)
+{ link_index_range(closure);
+}
+
+
+/* split_index_snapshot() divides the snapshot head..last into ranges of
+   about the same size for the workers.  Returns the number of ranges.
+*/
+
+static int
+split_index_snapshot(rdf_db *db, index_worker *w, int workers,
+		     triple *head, triple *last)
+{ size_t size = (db->created - db->erased)/workers + 1;
+  size_t n = 0;
+  int i = 0;
+  triple *t;
+
+  w[0].head = head;
+  for(t=head; t != last; t=triple_follow_hash(db, t, ICOL(BY_NONE)))
+  { if ( ++n == size && i+1 < workers )
+    { w[i].last = t;
+      w[++i].head = triple_follow_hash(db, t, ICOL(BY_NONE));
+      n = 0;
+    }
+  }
+  w[i].last = last;
+
+  return i+1;
+}
+
+
+/* link_index_segment() links the triples after `after' upto and including
+   `last' into the new hashes.  If locked is FALSE we take the write lock
+   for each chunk of INDEX_LINK_CHUNK triples.  Otherwise the caller
+   holds the locks of step (1).
+*/
+
+static void
+link_index_segment(rdf_db *db, triple_hash **hashes, int count,
+		   triple *after, triple *last, int locked)
+{ triple *t = (after ? triple_follow_hash(db, after, ICOL(BY_NONE))
+		     : fetch_triple(db, db->by_none.head));
+
+  while ( t )
+  { size_t n;
+
+    if ( !locked )
+      simpleMutexLock(&db->queries.write.lock);
+    for(n=0; t && n<INDEX_LINK_CHUNK; n++)
+    { int i;
+
+      for(i=0; i<count && !t->frozen; i++)
+      { triple_hash *hash = hashes[i];
+	size_t key = triple_hash_key(t, col_index[hash->icol]) % hash->bucket_count;
+	triple_bucket *bucket = &hash->blocks[MSB(key)][key];
+
+	prepare_link(db, hash->icol, t);
+	append_triple_bucket(db, bucket, hash->icol, t);
+	t->linked++;
+      }
+      t = (t == last ? NULL : triple_follow_hash(db, t, ICOL(BY_NONE)));
+    }
+    if ( !locked )
+      simpleMutexUnlock(&db->queries.write.lock);
+  }
+}
+
+
+static void
+create_triple_hashes(rdf_db *db, int count, int *ic)
+{ triple_hash *hashes[16];
+  int i, mx=0;
+
+  if ( db->bulk_load.active )
+  { simpleMutexLock(&db->queries.write.lock);
+    if ( db->bulk_load.active )		/* created by end_bulk_load() */
+    { for(i=0; i<count; i++)
+	db->bulk_load.requested |= 1<<ic[i];
+      simpleMutexUnlock(&db->queries.write.lock);
+      return;
+    }
+    simpleMutexUnlock(&db->queries.write.lock);
+  }
+
+  for(i=0; i<count; i++)
+  { if ( !db->hash[ic[i]].created && (db->indexes.enabled & (1<<ic[i])) )
+      break;
+  }
+  if ( i == count )
+    return;
+
+  simpleMutexLock(&db->locks.gc);
   for(i=0; i<count; i++)
-  { hashes[mx] = &db->hash[ic[i]];
-    if ( !hashes[mx]->created )
-    { initial_size_triple_hash(db, hashes[mx]->icol);
-      mx++;
+  { triple_hash *hash = &db->hash[ic[i]];
+
+    if ( !hash->created && (db->indexes.enabled & (1<<ic[i])) )
+    { DEBUG(1, Sdprintf("Creating hash %s\n", col_name[hash->icol]));
+      initial_size_triple_hash(db, hash->icol);
+      hashes[mx++] = hash;
     }
   }
   hashes[mx] = NULL;
 
   if ( mx > 0 )
-  { simpleMutexLock(&db->queries.write.lock);
+  { index_worker w[MAX_WORKERS];
+    triple *head, *last, *tail;
+    int rounds;
 
-    for(i=0; i<mx; i++)
-    { if ( hashes[i]->created )
-      { mx--;
-	memmove(&hashes[i], &hashes[i+1], sizeof(hashes[0])*(mx-i));
-      } else
-      { DEBUG(1, Sdprintf("Creating hash %s\n", col_name[hashes[i]->icol]));
+    simpleMutexLock(&db->queries.write.lock);
+    simpleRWLockExclusive(&db->queries.write.link);
+#ifdef COMPACT
+    { int slots = db->indexes.slots;	/* new triples get a slot */
+
+      for(i=0; i<mx; i++)
+      { if ( db->indexes.slot[hashes[i]->icol] < 0 )
+	  db->indexes.slot[hashes[i]->icol] = slots++;
       }
+      MEMORY_BARRIER();
+      db->indexes.slots = slots;
     }
+#endif
+    head = fetch_triple(db, db->by_none.head);
+    last = fetch_triple(db, db->by_none.tail);
+#ifdef COMPACT
+    for(i=0; i<mx; i++)			/* existing triples use overflow */
+      size_overflow(db, hashes[i], (triple_id)(db->triple_array.size-1));
+    db->indexes.relayout_done = 0;	/* see relayout_triples() */
+#endif
+    simpleRWUnlockExclusive(&db->queries.write.link);
+    simpleMutexUnlock(&db->queries.write.lock);
 
-    if ( mx > 0 )
-    { triple *t;
+    if ( head )
+    { int workers = worker_count(db->created - db->erased,
+				 INDEX_WORKER_MIN_TRIPLES);
 
-      for(t=fetch_triple(db, db->by_none.head);
-	  t;
-	  t=triple_follow_hash(db, t, ICOL(BY_NONE)))
-      { for(i=0; i<mx; i++)
-	{ triple_hash *hash = hashes[i];
-	  int i = col_index[hash->icol];
-	  int key = triple_hash_key(t, i) % hash->bucket_count;
-	  triple_bucket *bucket = &hash->blocks[MSB(key)][key];
-
-	  append_triple_bucket(db, bucket, hash->icol, t);
-	  t->linked++;				/* (*) atomic? */
-	}
+      workers = split_index_snapshot(db, w, workers, head, last);
+      DEBUG(1, Sdprintf("Using %d workers\n", workers));
+      for(i=0; i<workers; i++)
+      { w[i].db     = db;
+	w[i].hashes = hashes;
+	w[i].count  = mx;
       }
+      run_workers(link_index_worker, w, sizeof(w[0]), workers);
+    }
 
-      for(i=0; i<mx; i++)
-      { triple_hash *hash = hashes[i];
-	hash->created = TRUE;
-      }
+    for(rounds=0; ; rounds++)
+    { simpleMutexLock(&db->queries.write.lock);
+      simpleRWLockExclusive(&db->queries.write.link);
+      tail = fetch_triple(db, db->by_none.tail);
+      if ( tail == last || rounds == INDEX_CATCHUP_ROUNDS )
+	break;
+      simpleRWUnlockExclusive(&db->queries.write.link);
+      simpleMutexUnlock(&db->queries.write.lock);
+
+      link_index_segment(db, hashes, mx, last, tail, FALSE);
+      last = tail;
     }
+
+    if ( tail != last )
+      link_index_segment(db, hashes, mx, last, tail, TRUE);
+    for(i=0; i<mx; i++)
+      hashes[i]->created = TRUE;
+    simpleRWUnlockExclusive(&db->queries.write.link);
     simpleMutexUnlock(&db->queries.write.lock);
   }
+  simpleMutexUnlock(&db->locks.gc);
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+New triples are linked while they are  not yet visible. This requires
+either db->queries.write.lock or  holding   db->queries.write.link  in
+shared mode, which allows multiple threads   to link triples concurrently
+(see link_triples()):
+
+  - Bucket N of an index is guarded by hash->stripes[N%LINK_STRIPES].
+    The lock is held to append a single triple.  GC takes the same
+    lock if it unlinks the last triple of a chain (see gc_hash_chain()).
+  - The bucket count of an index is read once.  If the index is resized
+    concurrently we use a bucket for the old size, which is where the
+    triple walker looks as well.
+  - Code that must see all linked triples, such as create_triple_hashes()
+    and end_bulk_load(), holds db->queries.write.link exclusively in
+    addition to db->queries.write.lock.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 static void
-link_triple_hash(rdf_db *db, triple *t)
+link_triple_bucket(rdf_db *db, triple_hash *hash, size_t key, triple *t)
+{ triple_bucket *bucket = &hash->blocks[MSB(key)][key];
+  simpleMutex *stripe = &hash->stripes[key%LINK_STRIPES];
+
+  simpleMutexLock(stripe);
+  append_triple_bucket(db, bucket, hash->icol, t);
+  simpleMutexUnlock(stripe);
+}
+
+
+/* link_triple_indexes() links t into all created indexes except for
+   db->by_none and sets t->linked.
+*/
+
+static void
+link_triple_indexes(rdf_db *db, triple *t)
 { int ic;
   int linked = 1;
 
-  append_triple_bucket(db, &db->by_none, ICOL(BY_NONE), t);
+  if ( t->frozen )			/* see load_frozen_graph() */
+  { t->linked = linked;
+    return;
+  }
+  if ( db->bulk_load.active && db->bulk_load.chain )
+  { t->unindexed = TRUE;
+    if ( append_bulk_chain(db->bulk_load.chain, t) )
+    { t->linked = linked;
+      return;
+    }
+    t->unindexed = FALSE;		/* no memory: link normally */
+  }
 
   for(ic=1; ic<INDEX_TABLES; ic++)
   { triple_hash *hash = &db->hash[ic];
 
     if ( hash->created )
-    { int i = col_index[ic];
-      int key = triple_hash_key(t, i) % hash->bucket_count;
-      triple_bucket *bucket = &hash->blocks[MSB(key)][key];
+    { size_t key = triple_hash_key(t, col_index[ic]) % hash->bucket_count;
 
-      append_triple_bucket(db, bucket, ic, t);
+      prepare_link(db, ic, t);
+      link_triple_bucket(db, hash, key, t);
       linked++;
     }
   }
@@ -4266,20 +6045,31 @@ link_triple_hash(rdf_db *db, triple *t)
 }
 
 
+static void
+link_triple_hash(rdf_db *db, triple *t)
+{ link_triple_bucket(db, &db->hash[ICOL(BY_NONE)], 0, t);
+  link_triple_indexes(db, t);
+}
+
+
 /* prelink_triple() performs that part of the triple loading that does
    not require locking.
 */
 
 int
 prelink_triple(rdf_db *db, triple *t, query *q)
-{ register_triple(db, t);
+{
+#ifdef COMPACT
+  if ( t->id == TRIPLE_NO_ID )		/* see load_frozen_graph() */
+#endif
+    register_triple(db, t);
   if ( t->resolve_pred )
   { t->predicate.r = lookup_predicate(db, t->predicate.u_a);
     t->resolve_pred = FALSE;
   }
   if ( t->object_is_literal )
     t->object.literal = share_literal(db, t->object.literal);
-  if ( db->maintain_duplicates )
+  if ( db->maintain_duplicates && !db->bulk_load.active )
     mark_duplicate(db, t, q);
 
   return TRUE;
@@ -4312,18 +6102,61 @@ link_triple(rdf_db *db, triple *t, query *q)
 
   link_triple_hash(db, t);
   add_triple_consequences(db, t, q);
-  db->created++;
+  ATOMIC_INC(&db->created);
 
   return TRUE;
 }
 
 
-int
-postlink_triple(rdf_db *db, triple *t, query *q)
-{ register_predicate(db, t);
-  register_graph(db, t);
+/* link_triples() links count triples that are not yet visible without
+   holding db->queries.write.lock.  The triples are chained privately
+   and appended to db->by_none at once, so its lock is taken once per
+   call.  subPropertyOf triples modify the predicate hierarchy, which
+   requires the write lock.  We add them after releasing our shared lock
+   because write lock holders may wait for exclusive access.
+*/
 
-  return TRUE;
+void
+link_triples(rdf_db *db, triple **triples, size_t count, query *q)
+{ triple_hash *by_none = &db->hash[ICOL(BY_NONE)];
+  triple **ep = triples+count;
+  triple **tp;
+  int hierarchy = FALSE;
+
+  if ( count == 0 )
+    return;
+
+  simpleRWLockShared(&db->queries.write.link);
+  for(tp=triples; tp < ep; tp++)
+  { triple *t = *tp;
+
+    assert(!t->linked);
+    T_NEXT(db, t, ICOL(BY_NONE)) = (tp+1 < ep ? T_ID(tp[1]) : 0);
+    link_triple_indexes(db, t);
+    if ( t->predicate.r->name == ATOM_subPropertyOf &&
+	 t->object_is_literal == FALSE )
+      hierarchy = TRUE;
+  }
+
+  simpleMutexLock(&by_none->stripes[0]);
+  if ( db->by_none.tail )
+    T_NEXT(db, fetch_triple(db, db->by_none.tail), ICOL(BY_NONE)) =
+      T_ID(triples[0]);
+  else
+    db->by_none.head = T_ID(triples[0]);
+  db->by_none.tail = T_ID(ep[-1]);
+  ATOMIC_ADD(&db->by_none.count, count);
+  simpleMutexUnlock(&by_none->stripes[0]);
+  simpleRWUnlockShared(&db->queries.write.link);
+
+  ATOMIC_ADD(&db->created, count);
+
+  if ( hierarchy )
+  { simpleMutexLock(&db->queries.write.lock);
+    for(tp=triples; tp < ep; tp++)
+      add_triple_consequences(db, *tp, q);
+    simpleMutexUnlock(&db->queries.write.lock);
+  }
 }
 
 
@@ -4341,16 +6174,67 @@ del_triple_consequences(rdf_db *db, triple *t, query *q)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+commit_triple_gen() is called when a change to  t becomes visible to
+all queries at generation gen.  It  maintains   the  data  used to
+validate serializable transactions (see record_read())  and,  if there
+are subscribers, the change log (see rdf_changes_since/5). For added
+triples it updates the triple counts of   the database, predicate and
+graph and the MD5 of the graph.  Doing  so in the commit serialises
+this with drop_graph(), which resets the  graph count, and keeps the
+counts consistent with the generation (see exact_count()).
+graph->committed is used by swap_graphs() to  detect  concurrent
+changes to the graphs it swaps.
+
+A triple that is added and deleted   inside the same transaction never
+became visible. Its born generation is still a transaction generation
+and we do not log its deletion.
+
+MT: Caller must be hold db->queries.write.lock
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+void
+commit_triple_gen(rdf_db *db, triple *t, gen_t gen)
+{ t->predicate.r->modified = gen;
+  if ( t->predicate.r->name == ATOM_subPropertyOf )
+    db->queries.write.hierarchy_modified = gen;
+  db->queries.write.modified = gen;
+
+  if ( t->lifespan.died != gen )
+  { db->committed++;
+    register_predicate(db, t);		/* Updates count */
+    register_graph(db, t);		/* Updates count and MD5 */
+  }
+  if ( t->graph_id )
+    triple_graph(db, t)->committed = gen;
+
+  if ( db->changes.subscribers )
+  { if ( t->lifespan.died != gen )
+      log_change(db, CHANGE_ADD, t, gen);
+    else if ( t->lifespan.born < gen )
+      log_change(db, CHANGE_DELETE, t, gen);
+  }
+}
+
+
 void
 erase_triple(rdf_db *db, triple *t, query *q)
 { if ( !t->erased )
-  { t->erased = TRUE;
+  { int committed = (t->lifespan.born < GEN_TBASE);
+
+    t->erased = TRUE;
 
-    unregister_graph(db, t);		/* Updates count and MD5 */
-    unregister_predicate(db, t);	/* Updates count */
+    if ( !db->graphs.dropped || triple_drop_gen(db, t) == GEN_MAX )
+    { if ( committed )			/* see commit_triple_gen() */
+      { db->committed--;
+	unregister_graph(db, t);	/* Updates count and MD5 */
+      }
+      db->erased++;
+    }					/* else done by drop_graph() */
+    if ( committed )
+      unregister_predicate(db, t);	/* Updates count */
     if ( t->is_duplicate )
       db->duplicates--;
-    db->erased++;
   }
 }
 
@@ -4898,8 +6782,8 @@ save_literal(rdf_db *db, IOSTREAM *out, literal *lit, save_context *ctx)
 
 
 static void
-write_triple(rdf_db *db, IOSTREAM *out, triple *t, save_context *ctx)
-{ Sputc('T', out);
+write_triple(rdf_db *db, IOSTREAM *out, triple *t, save_context *ctx, int op)
+{ Sputc(op, out);
 
   save_atom(db, out, ID_ATOM(t->subject_id), ctx);
   save_predicate(db, out, t->predicate.r, ctx);
@@ -4944,8 +6828,25 @@ write_md5(rdf_db *db, IOSTREAM *out, atom_t src)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If save_db() is given a snapshot, it saves  a delta: the triples that
+are visible now but not in the snapshot   are saved as 'T' and those that
+are visible in the snapshot but no  longer   now  are saved as 'D'. The
+snapshot keeps GC from reclaiming the deleted  triples. We compare the
+lifespan of each triple rather than using alive_triple() because both
+the old and new version of a reindexed triple must be considered. The
+MD5 is not saved as loading the delta updates the digest of the graph
+incrementally.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+snapshot_lifespan(snapshot *ss, lifespan *span)
+{ return ss->rd_gen >= span->born && ss->rd_gen < span->died;
+}
+
+
 static int
-save_db(query *q, IOSTREAM *out, atom_t src, int version)
+save_db(query *q, IOSTREAM *out, atom_t src, int version, snapshot *since)
 { rdf_db *db = q->db;
   triple *t, p;
   save_context ctx;
@@ -4960,7 +6861,8 @@ save_db(query *q, IOSTREAM *out, atom_t src, int version)
   { Sputc('S', out);			/* start of graph header */
     save_atom(db, out, src, &ctx);
     write_source(db, out, src, &ctx);
-    write_md5(db, out, src);
+    if ( !since )
+      write_md5(db, out, src);
     p.graph_id = ATOM_ID(src);
     p.indexed = BY_G;
   } else
@@ -4973,9 +6875,23 @@ save_db(query *q, IOSTREAM *out, atom_t src, int version)
   while((t=next_triple(&tw)))
   { triple *t2;
 
-    if ( (t2=alive_triple(q, t)) &&
-	 (!src || ID_ATOM(t2->graph_id) == src) )
-    { write_triple(db, out, t2, &ctx);
+    if ( since )
+    { lifespan span;
+      int now, then;
+
+      if ( src && ID_ATOM(t->graph_id) != src )
+	continue;
+      triple_lifespan(db, t, &span);
+      now  = alive_lifespan(q, &span);
+      then = snapshot_lifespan(since, &span);
+      if ( now != then )
+      { write_triple(db, out, t, &ctx, now ? 'T' : 'D');
+	if ( Sferror(out) )
+	  return FALSE;
+      }
+    } else if ( (t2=alive_triple(q, t)) &&
+		(!src || ID_ATOM(t2->graph_id) == src) )
+    { write_triple(db, out, t2, &ctx, 'T');
       if ( Sferror(out) )
 	return FALSE;
     }
@@ -4990,32 +6906,97 @@ save_db(query *q, IOSTREAM *out, atom_t src, int version)
 }
 
 
+static int	save_db4(query *q, IOSTREAM *out, atom_t src, int compress);
+
+/** rdf_save_db_(+Stream, ?Graph, +Version, +Options)
+ *
+ * Options:
+ *
+ *   - compress(+Bool)
+ *     Compress the triple blocks.  Requires Version 4 and zlib.
+ *   - since(+Snapshot)
+ *     Save the delta to Snapshot (see save_db()).  Requires Version 3
+ *     and a snapshot that was not created inside a transaction.
+*/
+
 static foreign_t
-rdf_save_db(term_t stream, term_t graph, term_t version)
+rdf_save_db4(term_t stream, term_t graph, term_t version, term_t options)
 { rdf_db *db = rdf_current_db();
   query *q;
   IOSTREAM *out;
   atom_t src;
+  snapshot *since = NULL;
   int rc;
-  int v;
+  int v, zip = FALSE;
 
-  if ( !PL_get_stream_handle(stream, &out) )
-    return PL_type_error("stream", stream);
   if ( !get_atom_or_var_ex(graph, &src) )
     return FALSE;
   if ( !PL_get_integer(version, &v) )
     return FALSE;
-  if ( v < 2 || v > 3 )
+  if ( v < 2 || v > 4 )
+    return PL_domain_error("rdf_db_save_version", version);
+  if ( options )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg  = PL_new_term_ref();
+
+    while( PL_get_list(tail, head, tail) )
+    { atom_t name;
+      int arity;
+
+      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+	return PL_type_error("option", head);
+      _PL_get_arg(1, head, arg);
+
+      if ( name == ATOM_compress )
+      { if ( !PL_get_bool_ex(arg, &zip) )
+	  return FALSE;
+      } else if ( name == ATOM_since )
+      { switch(get_snapshot(arg, &since))
+	{ case TRUE:
+	    if ( snapshot_thread(since) )
+	      return PL_permission_error("save_delta", "rdf-snapshot", arg);
+	    break;
+	  case -1:
+	    return PL_existence_error("rdf_snapshot", arg);
+	  default:
+	    return PL_type_error("rdf_snapshot", arg);
+	}
+      }
+    }
+    if ( !PL_get_nil_ex(tail) )
+      return FALSE;
+  }
+  if ( zip )
+  {
+#ifdef HAVE_LIBZ
+    if ( v != 4 )
+      return PL_domain_error("rdf_db_save_version", version);
+#else
+    return PL_warning("rdf_save_db/3: compression requires zlib");
+#endif
+  }
+  if ( since && v != 3 )			/* load_db() needs 'D' */
     return PL_domain_error("rdf_db_save_version", version);
 
+  if ( !PL_get_stream_handle(stream, &out) )
+    return PL_type_error("stream", stream);
+
   q = open_query(db);
-  rc = save_db(q, out, src, v);
+  rc = (v == 4 ? save_db4(q, out, src, zip)
+	       : save_db(q, out, src, v, since));
   close_query(q);
 
   return rc;
 }
 
 
+static foreign_t
+rdf_save_db(term_t stream, term_t graph, term_t version)
+{ return rdf_save_db4(stream, graph, version, 0);
+}
+
+
 static int64_t
 load_int(IOSTREAM *fd)
 { int64_t first = Sgetc(fd);
@@ -5085,6 +7066,12 @@ typedef struct ld_array
   void	      **loaded_objects;
 } ld_array;
 
+typedef struct ld_frozen
+{ atom_t	graph;			/* Graph to freeze */
+  size_t	offset;			/* First triple in triples */
+  size_t	count;			/* # triples */
+} ld_frozen;
+
 typedef struct ld_context
 { ld_array	atoms;
   ld_array	predicates;
@@ -5098,6 +7085,10 @@ typedef struct ld_context
   md5_byte_t    digest[16];
   atomset       graph_table;		/* multi-graph file */
   triple_buffer	triples;
+  triple_buffer	deleted;		/* 'D' patterns of a delta */
+  ld_frozen    *frozen;			/* Graphs to freeze (version 4) */
+  size_t	frozen_count;
+  atomset      *only;			/* Only load these graphs */
 } ld_context;
 
 
@@ -5337,7 +7328,8 @@ load_triple(rdf_db *db, IOSTREAM *in, ld_context *ctx)
   }
   t->graph_id = ATOM_ID(load_atom(db, in, ctx));
   t->line  = (unsigned long)load_int(in);
-  if ( !ctx->graph )
+  if ( !ctx->graph &&
+       (!ctx->only || in_atomset(ctx->only, ID_ATOM(t->graph_id))) )
     add_atomset(&ctx->graph_table, ID_ATOM(t->graph_id));
 
   return t;
@@ -5357,3363 +7349,8115 @@ load_magic(IOSTREAM *in)
 }
 
 
+		 /*******************************
+		 *	  SAVE FORMAT 4		*
+		 *******************************/
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Note that we have two types  of   saved  states.  One holding many named
-graphs and one holding the content of exactly one named graph.
+Version 4 of the triple format  stores   tables  rather  than an opcode
+stream. Its purpose is the graph directory,   which  allows for loading
+selected graphs and for reading graph  properties without loading, and
+the optionally compressed triple blocks.   Uncompressed files are larger
+than version 3 and loading creates  and   indexes  all triples as usual.
+The file cannot be mapped into memory  as   triples  are heap objects
+that refer to process-local atom handles.
+
+Each section is read using a single  read   and  the triples are decoded
+from fixed size records.  All numbers are   little endian.  After the
+magic and version, the file is padded to   a  multiple of SAVE4_ALIGN
+bytes.  The header and sections follow,  where each section starts at a
+multiple of SAVE4_ALIGN.
+
+	<file>		::= <magic> <version> <padding>
+			    <header>
+			    {<padding> <section>}
+
+	<header>	::= "RDF4" <flags:32> <nsections:32> <reserved:32>
+			    {<type:32> <reserved:32>
+			     <offset:64> <size:64> <count:64>}
+
+The sections appear in this order:
+
+  - SAVE4_ATOMS
+    <count>+1 64-bit offsets into the text that follows.  Each text is
+    'A' followed by ISO Latin-1 bytes or 'W' followed by 32-bit code
+    points.
+  - SAVE4_PREDICATES
+    The 32-bit atom index of each predicate.
+  - SAVE4_LITERALS
+    24 byte records: <objtype:8> <qualifier:8> <reserved:16>
+    <type_or_lang:32> <value:64> <length:64>.  type_or_lang is an atom
+    index plus one (0: none).  The value is an atom index (OBJ_STRING),
+    integer, IEEE double or offset in SAVE4_TERMS (OBJ_TERM).
+  - SAVE4_TERMS
+    The records of the OBJ_TERM literals.
+  - SAVE4_GRAPHS
+    The graph directory.  64 byte records: <name:32> <source:32>
+    <flags:32> <reserved:32> <modified:64> <md5:128> <triples:64>
+    <first_block:64> <blocks:64>.  source is an atom index plus one
+    (0: none).  The triples of a graph are stored in the given range of
+    SAVE4_BLOCKS.  Graphs appear in the order of their blocks.
+  - SAVE4_BLOCKS
+    The block index: 32 byte records <first:64> <count:64> <offset:64>
+    <size:64> that split the triples into consecutive blocks of at most
+    SAVE4_BLOCK_TRIPLES triples of a single graph.  Offset and size
+    locate the block in SAVE4_TRIPLES.  load_db4() only reads the blocks
+    of the graphs it loads and divides them over threads that decode
+    them in parallel (see load_triple_blocks()).
+  - SAVE4_TRIPLES
+    The blocks.  Each holds 20 byte records: <subject:32> <predicate:32>
+    <object:32> <graph:32> <line:32>.  If SAVE4_IS_LITERAL is set in
+    object, the remainder is a literal index.  Otherwise it is an atom
+    index.  Graph is an index in SAVE4_GRAPHS.  If SAVE4_COMPRESSED is
+    set, each block is compressed independently using zlib.
+
+If SAVE4_SINGLE is set the file  was  created by rdf_save_db/2 and holds
+exactly one graph.  Its source, modified time and MD5 digest are restored
+when loaded.
+Graphs that were frozen (see freeze_graph())   are  flagged SAVE4_FROZEN
+and are frozen again when loaded into an empty graph.  The frozen index
+itself is not saved because it  is  ordered   on  the  hash of the atom
+handles, which differs between processes.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static int
-load_db(rdf_db *db, IOSTREAM *in, ld_context *ctx)
-{ int c;
+#define SAVE4_ALIGN	   8		/* Alignment of header and sections */
+#define SAVE4_SEEK	   4096		/* Seek rather than read to skip */
+#define SAVE4_SECTIONS	   7
+
+#define SAVE4_ATOMS	   0		/* Section types */
+#define SAVE4_PREDICATES   1
+#define SAVE4_LITERALS	   2
+#define SAVE4_TERMS	   3
+#define SAVE4_GRAPHS	   4
+#define SAVE4_BLOCKS	   5
+#define SAVE4_TRIPLES	   6
+
+#define SAVE4_SINGLE	   0x1		/* Header flags */
+#define SAVE4_COMPRESSED   0x2
+#define SAVE4_MD5	   0x1		/* Graph flags */
+#define SAVE4_FROZEN	   0x2
+
+#define SAVE4_HEADER_SIZE  (16+SAVE4_SECTIONS*32)
+#define SAVE4_LITERAL_SIZE 24
+#define SAVE4_GRAPH_SIZE   64
+#define SAVE4_TRIPLE_SIZE  20
+#define SAVE4_BLOCK_SIZE   32
+#define SAVE4_BLOCK_TRIPLES 65536
+#define SAVE4_IS_LITERAL   0x80000000
+
+typedef struct save4_section
+{ uint64_t	offset;			/* Start in the file */
+  uint64_t	size;			/* Size in bytes */
+  uint64_t	count;			/* # objects */
+} save4_section;
+
+typedef struct save4_context
+{ save_context	saved;			/* object --> index */
+  saved_table	graph_index;		/* graph name --> index */
+  ld_array	atoms;			/* index --> atom */
+  ld_array	predicates;		/* index --> predicate */
+  ld_array	literals;		/* index --> literal */
+  ld_array	graphs;			/* index --> graph name */
+} save4_context;
 
-  if ( !load_magic(in) )
-    return FALSE;
-  ctx->version = (int)load_int(in);
-  if ( ctx->version < 2 || ctx->version > 3 )
-  { term_t v = PL_new_term_ref();
 
-    if ( PL_put_integer(v, ctx->version) )
-      return PL_domain_error("rdf_db_save_version", v);
-    else
-      return FALSE;
-  }
+static void
+save_uint32(IOSTREAM *out, uint32_t v)
+{ int i;
 
-  while((c=Sgetc(in)) != EOF)
-  { switch(c)
-    { case 'T':
-      { triple *t;
+  for(i=0; i<4; i++)
+    Sputc((int)((v>>(i*8))&0xff), out);
+}
 
-	if ( !(t=load_triple(db, in, ctx)) )
-	  return FALSE;
-	t->loaded = TRUE;
-	buffer_triple(&ctx->triples, t);
-        break;
-      }
-					/* file holding exactly one graph */
-      case 'S':				/* name of the graph */
-      { ctx->graph_name = load_atom(db, in, ctx);
-        break;
-      }
-      case 'M':				/* MD5 of the graph */
-      { int i;
+static void
+save_uint64(IOSTREAM *out, uint64_t v)
+{ save_uint32(out, (uint32_t)v);
+  save_uint32(out, (uint32_t)(v>>32));
+}
 
-	for(i=0; i<16; i++)
-	  ctx->digest[i] = Sgetc(in);
-	ctx->has_digest = TRUE;
+static void
+save_padding(IOSTREAM *out, uint64_t *pos, uint64_t upto)
+{ for( ; *pos < upto; (*pos)++ )
+    Sputc(0, out);
+}
 
-	break;
-      }
-      case 'F':				/* file of the graph */
-	ctx->graph_source = load_atom(db, in, ctx);
-	break;				/* end of one-graph handling */
-      case 't':
-	load_double(in, &ctx->modified);
-        break;
-      case 'E':				/* end of file */
-	return TRUE;
-      default:
-	break;
-    }
-  }
+static inline uint32_t
+get_uint32(const unsigned char *p)
+{ return ( (uint32_t)p[0]     | (uint32_t)p[1]<<8 |
+	   (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24 );
+}
 
-  return PL_warning("Illegal RDF triple file");
+static inline uint64_t
+get_uint64(const unsigned char *p)
+{ return (uint64_t)get_uint32(p) | (uint64_t)get_uint32(p+4)<<32;
 }
 
+static uint64_t
+save4_align(uint64_t pos)
+{ return (pos+SAVE4_ALIGN-1) & ~(uint64_t)(SAVE4_ALIGN-1);
+}
 
-static int
-prepare_loaded_triples(rdf_db *db, ld_context *ctx)
-{ triple **t;
 
-  if ( ctx->graph_name )			/* lookup named graph */
-  { ctx->graph = lookup_graph(db, ctx->graph_name);
-    if ( ctx->graph_source && ctx->graph->source != ctx->graph_source )
-    { if ( ctx->graph->source )
-	PL_unregister_atom(ctx->graph->source);
-      ctx->graph->source = ctx->graph_source;
-      PL_register_atom(ctx->graph->source);
-      ctx->graph->modified = ctx->modified;
-    }
+static uint32_t
+save4_atom(rdf_db *db, save4_context *ctx, atom_t a)
+{ saved *s;
 
-    if ( ctx->has_digest )
-    { if ( ctx->graph->md5 )
-      { ctx->graph->md5 = FALSE;		/* kill repetitive MD5 update */
-      } else
-      { ctx->has_digest = FALSE;
-      }
-    }
-  } else
-  { ctx->graph = NULL;
+  if ( !(s=lookup_saved_atom(&ctx->saved, a)) )
+  { s = add_saved_atom(db, &ctx->saved, a);
+    add_object(db, (void*)a, &ctx->atoms);
   }
 
-  for(t=ctx->triples.base; t<ctx->triples.top; t++)
-    lock_atoms(db, *t);
-
-  return TRUE;
+  return (uint32_t)s->as;
 }
 
+static uint32_t
+save4_predicate(rdf_db *db, save4_context *ctx, predicate *p)
+{ saved *s;
 
-static void
-destroy_load_context(rdf_db *db, ld_context *ctx, int delete_triples)
-{ if ( delete_triples )
-  { triple **tp;
-
-    for(tp=ctx->triples.base;
-	tp<ctx->triples.top;
-	tp++)
-    { triple *t = *tp;
-
-      free_triple(db, t, FALSE);
-    }
+  if ( !(s=lookup_saved_predicate(&ctx->saved, p)) )
+  { s = add_saved_predicate(db, &ctx->saved, p);
+    add_object(db, p, &ctx->predicates);
+    save4_atom(db, ctx, p->name);
   }
 
-  free_triple_buffer(&ctx->triples);
-
-  if ( ctx->atoms.loaded_objects )
-  { atom_t *ap, *ep;
+  return (uint32_t)s->as;
+}
 
-    for( ap=(atom_t*)ctx->atoms.loaded_objects, ep=ap+ctx->atoms.loaded_id;
-	 ap<ep;
-	 ap++)
-    { PL_unregister_atom(*ap);
-    }
+static uint32_t
+save4_literal(rdf_db *db, save4_context *ctx, literal *lit)
+{ saved *s;
 
-    free(ctx->atoms.loaded_objects);
+  if ( !(s=lookup_saved_literal(&ctx->saved, lit)) )
+  { s = add_saved_literal(db, &ctx->saved, lit);
+    add_object(db, lit, &ctx->literals);
+    if ( lit->qualifier )
+      save4_atom(db, ctx, lit->type_or_lang);
+    if ( lit->objtype == OBJ_STRING )
+      save4_atom(db, ctx, lit->value.string);
   }
-  if ( ctx->predicates.loaded_objects )
-    free(ctx->predicates.loaded_objects);
-  if ( ctx->literals.loaded_objects )
-    free(ctx->literals.loaded_objects);
+
+  return (uint32_t)s->as;
 }
 
-typedef struct
-{ term_t tail;
-  term_t head;
-} add_graph_context;
+static uint32_t
+save4_graph(rdf_db *db, save4_context *ctx, atom_t name)
+{ saved *s;
 
-static int
-append_graph_to_list(atom_t graph, void *closure)
-{ add_graph_context *ctx = closure;
+  if ( !(s=lookup_saved(&ctx->graph_index, (void*)name)) )
+  { s = add_saved(db, &ctx->graph_index, (void*)name);
+    add_object(db, (void*)name, &ctx->graphs);
+    save4_atom(db, ctx, name);
+  }
 
-  return ( PL_unify_list(ctx->tail, ctx->head, ctx->tail) &&
-	   PL_unify_atom(ctx->head, graph)
-	 );
+  return (uint32_t)s->as;
 }
 
 
-static foreign_t
-rdf_load_db(term_t stream, term_t id, term_t graphs)
-{ ld_context ctx;
-  rdf_db *db = rdf_current_db();
-  IOSTREAM *in;
-  int rc;
-  term_t ba_arg2;
+static size_t
+save4_atom_size(atom_t a)
+{ size_t len;
 
-  if ( !(ba_arg2 = PL_new_term_ref()) )
-    return FALSE;
+  if ( PL_atom_nchars(a, &len) )
+    return 1+len;
+  if ( PL_atom_wchars(a, &len) )
+    return 1+len*4;
 
-  if ( !PL_get_stream_handle(stream, &in) )
-    return PL_type_error("stream", stream);
+  return 1;
+}
 
-  memset(&ctx, 0, sizeof(ctx));
-  init_atomset(&ctx.graph_table);
-  init_triple_buffer(&ctx.triples);
-  rc = load_db(db, in, &ctx);
-  PL_release_stream(in);
+static void
+save4_atom_text(IOSTREAM *out, atom_t a)
+{ const char *chars;
+  const wchar_t *wchars;
+  size_t len, i;
 
-  if ( !rc ||
-       !PL_put_atom(ba_arg2, ATOM_begin) ||
-       !rdf_broadcast(EV_LOAD, (void*)id, (void*)ba_arg2) )
-  { destroy_load_context(db, &ctx, TRUE);
-    return FALSE;
+  if ( (chars = PL_atom_nchars(a, &len)) )
+  { Sputc('A', out);
+    for(i=0; i<len; i++)
+      Sputc(chars[i]&0xff, out);
+  } else if ( (wchars = PL_atom_wchars(a, &len)) )
+  { Sputc('W', out);
+    for(i=0; i<len; i++)
+      save_uint32(out, (uint32_t)wchars[i]);
+  } else
+  { Sputc('A', out);			/* cannot happen */
   }
+}
 
-  if ( (rc=prepare_loaded_triples(db, &ctx)) )
-  { add_graph_context gctx;
-
-    gctx.tail = PL_copy_term_ref(graphs);
-    gctx.head = PL_new_term_ref();
-
-    rc = ( for_atomset(&ctx.graph_table, append_graph_to_list, &gctx) &&
-	   PL_unify_nil(gctx.tail) );
 
-    destroy_atomset(&ctx.graph_table);
+static void
+save4_literal_record(rdf_db *db, IOSTREAM *out, save4_context *ctx,
+		     literal *lit, uint64_t *term_offset)
+{ uint64_t value = 0, len = 0;
+
+  Sputc(lit->objtype, out);
+  Sputc(lit->qualifier, out);
+  Sputc(0, out);
+  Sputc(0, out);
+  save_uint32(out, lit->qualifier ? save4_atom(db, ctx, lit->type_or_lang)+1
+				  : 0);
+  switch(lit->objtype)
+  { case OBJ_STRING:
+      value = save4_atom(db, ctx, lit->value.string);
+      break;
+    case OBJ_INTEGER:
+      value = (uint64_t)lit->value.integer;
+      break;
+    case OBJ_DOUBLE:
+      memcpy(&value, &lit->value.real, sizeof(value));
+      break;
+    case OBJ_TERM:
+      value = *term_offset;
+      len   = lit->value.term.len;
+      *term_offset += len;
+      break;
+    default:
+      assert(0);
   }
+  save_uint64(out, value);
+  save_uint64(out, len);
+}
 
-  if ( rc )
-  { query *q = open_query(db);
 
-    add_triples(q, ctx.triples.base, ctx.triples.top - ctx.triples.base);
-    close_query(q);
-    if ( ctx.graph )
-    { if ( ctx.has_digest )
-      { sum_digest(ctx.graph->digest, ctx.digest);
-	ctx.graph->md5 = TRUE;
-      }
-      clear_modified(ctx.graph);
-    }
-    if ( (rc=PL_cons_functor(ba_arg2, FUNCTOR_end1, graphs)) )
-      rc = rdf_broadcast(EV_LOAD, (void*)id, (void*)ba_arg2);
-    destroy_load_context(db, &ctx, FALSE);
-  } else
-  { rdf_broadcast(EV_LOAD, (void*)id, (void*)ATOM_error);
-    destroy_load_context(db, &ctx, TRUE);
-  }
+static void
+save4_graph_record(rdf_db *db, IOSTREAM *out, save4_context *ctx,
+		   atom_t name, uint64_t count,
+		   uint64_t first_block, uint64_t blocks)
+{ graph *g = existing_graph(db, name);
+  uint32_t flags = 0;
+  uint64_t modified = 0;
+  double m = 0.0;
+  int i;
 
-  return rc;
+  if ( g )
+    flags |= SAVE4_MD5;
+  if ( g && g->frozen )
+    flags |= SAVE4_FROZEN;
+  if ( g )
+    m = g->modified;
+  memcpy(&modified, &m, sizeof(modified));
+
+  save_uint32(out, save4_atom(db, ctx, name));
+  save_uint32(out, g && g->source ? save4_atom(db, ctx, g->source)+1 : 0);
+  save_uint32(out, flags);
+  save_uint32(out, 0);
+  save_uint64(out, modified);
+  for(i=0; i<16; i++)
+    Sputc((flags&SAVE4_MD5) ? g->digest[i] : 0, out);
+  save_uint64(out, count);
+  save_uint64(out, first_block);
+  save_uint64(out, blocks);
 }
 
 
-#ifdef WITH_MD5
-		 /*******************************
-		 *	     MD5 SUPPORT	*
-		 *******************************/
-
-/* md5_type is used to keep the MD5 independent from the internal
-   numbers
-*/
-static const char md5_type[] =
-{ 0x0,					/* OBJ_UNKNOWN */
-  0x3,					/* OBJ_INTEGER */
-  0x4,					/* OBJ_DOUBLE */
-  0x2,					/* OBJ_STRING */
-  0x5					/* OBJ_TERM */
-};
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If SAVE4_COMPRESSED is set, each  block   of  SAVE4_TRIPLES is compressed
+independently using zlib's compress2().  The  blocks   are  (de)compressed
+by up to cpu_count threads using zip_blocks().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+typedef struct save4_block
+{ uint64_t	first;			/* First triple in plain records */
+  uint64_t	count;			/* # triples */
+  uint64_t	offset;			/* Offset in SAVE4_TRIPLES */
+  uint64_t	size;			/* Size in SAVE4_TRIPLES */
+  uint32_t	graph;			/* Graph index (loading) */
+  unsigned char *data;			/* Stored data */
+} save4_block;
+
+typedef struct zip_worker
+{ save4_block  *blocks;			/* Blocks to process */
+  size_t	from;			/* First block */
+  size_t	to;			/* Last block+1 */
+  unsigned char *plain;			/* Uncompressed records */
+  int		rc;			/* Result */
+} zip_worker;
+
+
+#ifdef HAVE_LIBZ
 static void
-md5_triple(triple *t, md5_byte_t *digest)
-{ md5_state_t state;
-  size_t len;
-  md5_byte_t tmp[2];
-  const char *s;
-  literal *lit;
-
-  md5_init(&state);
-  s = PL_blob_data(ID_ATOM(t->subject_id), &len, NULL);
-  md5_append(&state, (const md5_byte_t *)s, (int)len);
-  md5_append(&state, (const md5_byte_t *)"P", 1);
-  s = PL_blob_data(t->predicate.r->name, &len, NULL);
-  md5_append(&state, (const md5_byte_t *)s, (int)len);
-  tmp[0] = 'O';
-  if ( t->object_is_literal )
-  { lit = t->object.literal;
-    tmp[1] = md5_type[lit->objtype];
-
-    switch(lit->objtype)
-    { case OBJ_STRING:
-	s = PL_blob_data(lit->value.string, &len, NULL);
-	break;
-      case OBJ_INTEGER:			/* TBD: byte order issues */
-	s = (const char *)&lit->value.integer;
-	len = sizeof(lit->value.integer);
-	break;
-      case OBJ_DOUBLE:
-	s = (const char *)&lit->value.real;
-	len = sizeof(lit->value.real);
-	break;
-      case OBJ_TERM:
-	s = (const char *)lit->value.term.record;
-	len = lit->value.term.len;
-	break;
-      default:
-	assert(0);
-    }
-  } else
-  { s = PL_blob_data(t->object.resource, &len, NULL);
-    tmp[1] = 0x1;			/* old OBJ_RESOURCE */
-    lit = NULL;
-  }
-  md5_append(&state, tmp, 2);
-  md5_append(&state, (const md5_byte_t *)s, (int)len);
-  if ( lit && lit->qualifier )
-  { assert(lit->type_or_lang);
-    md5_append(&state,
-	       (const md5_byte_t *)(lit->qualifier == Q_LANG ? "l" : "t"),
-	       1);
-    s = PL_blob_data(lit->type_or_lang, &len, NULL);
-    md5_append(&state, (const md5_byte_t *)s, (int)len);
-  }
-  if ( t->graph_id )
-  { md5_append(&state, (const md5_byte_t *)"S", 1);
-    s = PL_blob_data(ID_ATOM(t->graph_id), &len, NULL);
-    md5_append(&state, (const md5_byte_t *)s, (int)len);
+deflate_blocks(void *closure)
+{ zip_worker *w = closure;
+  size_t i;
+
+  for(i=w->from; i<w->to; i++)
+  { save4_block *b = &w->blocks[i];
+    uLong plain = (uLong)(b->count*SAVE4_TRIPLE_SIZE);
+    uLongf len = compressBound(plain);
+
+    if ( !(b->data = malloc(len)) ||
+	 compress2(b->data, &len, w->plain+b->first*SAVE4_TRIPLE_SIZE, plain,
+		   Z_DEFAULT_COMPRESSION) != Z_OK )
+      return;
+    b->size = len;
   }
 
-  md5_finish(&state, digest);
+  w->rc = TRUE;
 }
 
 
 static void
-sum_digest(md5_byte_t *digest, md5_byte_t *add)
-{ md5_byte_t *p, *q;
-  int n;
-
-  for(p=digest, q=add, n=16; --n>=0; )
-    *p++ += *q++;
-}
+inflate_blocks(void *closure)
+{ zip_worker *w = closure;
+  size_t i;
 
+  for(i=w->from; i<w->to; i++)
+  { save4_block *b = &w->blocks[i];
+    uLongf len = (uLongf)(b->count*SAVE4_TRIPLE_SIZE);
 
-static void
-dec_digest(md5_byte_t *digest, md5_byte_t *add)
-{ md5_byte_t *p, *q;
-  int n;
+    if ( uncompress(w->plain+b->first*SAVE4_TRIPLE_SIZE, &len,
+		    b->data, (uLong)b->size) != Z_OK ||
+	 len != b->count*SAVE4_TRIPLE_SIZE )
+      return;
+  }
 
-  for(p=digest, q=add, n=16; --n>=0; )
-    *p++ -= *q++;
+  w->rc = TRUE;
 }
 
 
 static int
-md5_unify_digest(term_t t, md5_byte_t digest[16])
-{ char hex_output[16*2];
-  int di;
-  char *pi;
-  static char hexd[] = "0123456789abcdef";
+zip_blocks(worker_func func, save4_block *blocks, size_t nblocks,
+	   unsigned char *plain, size_t ntriples)
+{ zip_worker w[MAX_WORKERS];
+  int workers = worker_count(ntriples, SAVE4_BLOCK_TRIPLES);
+  int i;
 
-  for(pi=hex_output, di = 0; di < 16; ++di)
-  { *pi++ = hexd[(digest[di] >> 4) & 0x0f];
-    *pi++ = hexd[digest[di] & 0x0f];
+  if ( (size_t)workers > nblocks )
+    workers = (nblocks > 0 ? (int)nblocks : 1);
+  for(i=0; i<workers; i++)
+  { w[i].blocks = blocks;
+    w[i].from   = nblocks*i/workers;
+    w[i].to     = nblocks*(i+1)/workers;
+    w[i].plain  = plain;
+    w[i].rc     = FALSE;
   }
 
-  return PL_unify_atom_nchars(t, 16*2, hex_output);
-}
+  run_workers(func, w, sizeof(w[0]), workers);
 
+  for(i=0; i<workers; i++)
+  { if ( !w[i].rc )
+      return FALSE;
+  }
 
-static foreign_t
-rdf_md5(term_t graph_name, term_t md5)
-{ atom_t src;
-  int rc;
-  rdf_db *db = rdf_current_db();
+  return TRUE;
+}
+#endif /*HAVE_LIBZ*/
 
-  if ( !get_atom_or_var_ex(graph_name, &src) )
-    return FALSE;
 
-  if ( src )
-  { graph *s;
+static void
+put_uint32(unsigned char *p, uint32_t v)
+{ p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v>>8);
+  p[2] = (unsigned char)(v>>16);
+  p[3] = (unsigned char)(v>>24);
+}
 
-    if ( (s = existing_graph(db, src)) && !s->erased )
-    { rc = md5_unify_digest(md5, s->digest);
-    } else
-    { md5_byte_t digest[16];
 
-      memset(digest, 0, sizeof(digest));
-      rc = md5_unify_digest(md5, digest);
-    }
+static int
+save_db4(query *q, IOSTREAM *out, atom_t src, int compress)
+{ rdf_db *db = q->db;
+  save4_context ctx;
+  save4_section sect[SAVE4_SECTIONS];
+  triple_buffer triples;
+  triple_walker tw;
+  triple *t, p;
+  uint32_t *rec = NULL;
+  uint64_t *gcount = NULL, *gstart = NULL;
+  size_t *order = NULL;
+  unsigned char *plain = NULL;
+  save4_block *blocks = NULL;
+  size_t count, i, ng, nblocks = 0;
+  uint64_t pos, text, term_size = 0;
+  int s, rc = FALSE;
+
+  memset(&ctx, 0, sizeof(ctx));
+  memset(&p, 0, sizeof(p));
+  init_saved(db, &ctx.saved, 3);
+  init_saved_table(db, &ctx.graph_index, &ctx.saved.store);
+  init_triple_buffer(&triples);
+
+  if ( src )
+  { save4_graph(db, &ctx, src);		/* index 0, also if empty */
+    p.graph_id = ATOM_ID(src);
+    p.indexed = BY_G;
   } else
-  { md5_byte_t digest[16];
-    int i;
+  { p.indexed = BY_NONE;
+  }
 
-    memset(&digest, 0, sizeof(digest));
-    for(i=0; i<db->graphs.bucket_count; i++)
-    { graph *g = db->graphs.blocks[MSB(i)][i];
+  init_triple_walker(&tw, db, &p, p.indexed);
+  while((t=next_triple(&tw)))
+  { triple *t2;
 
-      for( ; g; g = g->next )
-	sum_digest(digest, g->digest);
+    if ( (t2=alive_triple(q, t)) &&
+	 (!src || ID_ATOM(t2->graph_id) == src) )
+    { if ( !buffer_triple(&triples, t2) )
+      { destroy_triple_walker(db, &tw);
+	goto nomem;
+      }
     }
+  }
+  destroy_triple_walker(db, &tw);
 
-    return md5_unify_digest(md5, digest);
+					/* assign indexes */
+  count = triples.top - triples.base;
+  if ( count > 0 &&
+       !(rec = malloc(count*5*sizeof(uint32_t))) )
+    goto nomem;
+  for(i=0; i<count; i++)
+  { uint32_t *r = &rec[i*5];
+
+    t = triples.base[i];
+    r[0] = save4_atom(db, &ctx, ID_ATOM(t->subject_id));
+    r[1] = save4_predicate(db, &ctx, t->predicate.r);
+    if ( t->object_is_literal )
+      r[2] = save4_literal(db, &ctx, t->object.literal)|SAVE4_IS_LITERAL;
+    else
+      r[2] = save4_atom(db, &ctx, t->object.resource);
+    r[3] = save4_graph(db, &ctx, ID_ATOM(t->graph_id));
+    r[4] = t->line;
+  }
+  ng = ctx.graphs.loaded_id;
+  for(i=0; i<ng; i++)
+  { graph *g = existing_graph(db, (atom_t)ctx.graphs.loaded_objects[i]);
+
+    if ( g && g->source )
+      save4_atom(db, &ctx, g->source);
+  }
+					/* order the triples by graph */
+  if ( !(gcount = calloc(ng+1, sizeof(*gcount))) ||
+       !(gstart = calloc(ng+1, sizeof(*gstart))) ||
+       (count > 0 && !(order = malloc(count*sizeof(*order)))) ||
+       !(plain = malloc(count > 0 ? count*SAVE4_TRIPLE_SIZE : 1)) )
+    goto nomem;
+  for(i=0; i<count; i++)
+    gcount[rec[i*5+3]]++;
+  for(i=1; i<ng; i++)
+    gstart[i] = gstart[i-1]+gcount[i-1];
+  for(i=0; i<count; i++)
+    order[gstart[rec[i*5+3]]++] = i;
+  for(i=0; i<count; i++)
+  { uint32_t *r = &rec[order[i]*5];
+    int f;
+
+    for(f=0; f<5; f++)
+      put_uint32(plain+i*SAVE4_TRIPLE_SIZE+f*4, r[f]);
+  }
+  free(rec);
+  rec = NULL;
+
+					/* split the graphs into blocks */
+  for(i=0; i<ng; i++)
+    nblocks += (gcount[i]+SAVE4_BLOCK_TRIPLES-1)/SAVE4_BLOCK_TRIPLES;
+  if ( !(blocks = calloc(nblocks+1, sizeof(*blocks))) )
+    goto nomem;
+  { uint64_t first = 0;
+    size_t b = 0;
+
+    for(i=0; i<ng; i++)
+    { uint64_t done;
+
+      gstart[i] = b;			/* now the first block */
+      for(done=0; done<gcount[i]; done += blocks[b++].count)
+      { blocks[b].first = first+done;
+	blocks[b].count = (gcount[i]-done < SAVE4_BLOCK_TRIPLES ?
+			   gcount[i]-done : SAVE4_BLOCK_TRIPLES);
+	blocks[b].size  = blocks[b].count*SAVE4_TRIPLE_SIZE;
+	blocks[b].data  = plain+blocks[b].first*SAVE4_TRIPLE_SIZE;
+      }
+      first += gcount[i];
+    }
+  }
+  if ( compress )
+  {
+#ifdef HAVE_LIBZ
+    for(i=0; i<nblocks; i++)
+      blocks[i].data = NULL;
+    if ( !zip_blocks(deflate_blocks, blocks, nblocks, plain, count) )
+      goto nomem;
+#else
+    assert(0);				/* checked by rdf_save_db() */
+#endif
   }
+  text = 0;
+  for(i=0; i<nblocks; i++)
+  { blocks[i].offset = text;
+    text += blocks[i].size;
+  }
+
+					/* compute the layout */
+  sect[SAVE4_TRIPLES].count	= count;
+  sect[SAVE4_TRIPLES].size	= text;
+  text = 0;
+  for(i=0; i<ctx.atoms.loaded_id; i++)
+    text += save4_atom_size((atom_t)ctx.atoms.loaded_objects[i]);
+  for(i=0; i<ctx.literals.loaded_id; i++)
+  { literal *lit = ctx.literals.loaded_objects[i];
+
+    if ( lit->objtype == OBJ_TERM )
+      term_size += lit->value.term.len;
+  }
+  sect[SAVE4_ATOMS].count	= ctx.atoms.loaded_id;
+  sect[SAVE4_ATOMS].size	= (ctx.atoms.loaded_id+1)*8 + text;
+  sect[SAVE4_PREDICATES].count	= ctx.predicates.loaded_id;
+  sect[SAVE4_PREDICATES].size	= ctx.predicates.loaded_id*4;
+  sect[SAVE4_LITERALS].count	= ctx.literals.loaded_id;
+  sect[SAVE4_LITERALS].size	= ctx.literals.loaded_id*SAVE4_LITERAL_SIZE;
+  sect[SAVE4_TERMS].count	= term_size;
+  sect[SAVE4_TERMS].size	= term_size;
+  sect[SAVE4_GRAPHS].count	= ng;
+  sect[SAVE4_GRAPHS].size	= ng*SAVE4_GRAPH_SIZE;
+  sect[SAVE4_BLOCKS].count	= nblocks;
+  sect[SAVE4_BLOCKS].size	= nblocks*SAVE4_BLOCK_SIZE;
+  pos = save4_align(strlen(SAVE_MAGIC)+1) + SAVE4_HEADER_SIZE;
+  for(s=0; s<SAVE4_SECTIONS; s++)
+  { sect[s].offset = save4_align(pos);
+    pos = sect[s].offset + sect[s].size;
+  }
+
+					/* write the file */
+  Sfprintf(out, "%s", SAVE_MAGIC);
+  save_int(out, 4);
+  pos = strlen(SAVE_MAGIC)+1;
+  save_padding(out, &pos, save4_align(pos));
+  Sfwrite("RDF4", 1, 4, out);
+  save_uint32(out, (src ? SAVE4_SINGLE : 0)|(compress ? SAVE4_COMPRESSED : 0));
+  save_uint32(out, SAVE4_SECTIONS);
+  save_uint32(out, 0);
+  for(s=0; s<SAVE4_SECTIONS; s++)
+  { save_uint32(out, s);
+    save_uint32(out, 0);
+    save_uint64(out, sect[s].offset);
+    save_uint64(out, sect[s].size);
+    save_uint64(out, sect[s].count);
+  }
+  pos += SAVE4_HEADER_SIZE;
+
+  save_padding(out, &pos, sect[SAVE4_ATOMS].offset);
+  text = 0;
+  for(i=0; i<=ctx.atoms.loaded_id; i++)
+  { save_uint64(out, text);
+    if ( i < ctx.atoms.loaded_id )
+      text += save4_atom_size((atom_t)ctx.atoms.loaded_objects[i]);
+  }
+  for(i=0; i<ctx.atoms.loaded_id; i++)
+    save4_atom_text(out, (atom_t)ctx.atoms.loaded_objects[i]);
+  pos += sect[SAVE4_ATOMS].size;
+
+  save_padding(out, &pos, sect[SAVE4_PREDICATES].offset);
+  for(i=0; i<ctx.predicates.loaded_id; i++)
+  { predicate *pred = ctx.predicates.loaded_objects[i];
+
+    save_uint32(out, save4_atom(db, &ctx, pred->name));
+  }
+  pos += sect[SAVE4_PREDICATES].size;
+
+  save_padding(out, &pos, sect[SAVE4_LITERALS].offset);
+  term_size = 0;
+  for(i=0; i<ctx.literals.loaded_id; i++)
+    save4_literal_record(db, out, &ctx, ctx.literals.loaded_objects[i],
+			 &term_size);
+  pos += sect[SAVE4_LITERALS].size;
+
+  save_padding(out, &pos, sect[SAVE4_TERMS].offset);
+  for(i=0; i<ctx.literals.loaded_id; i++)
+  { literal *lit = ctx.literals.loaded_objects[i];
+
+    if ( lit->objtype == OBJ_TERM )
+      Sfwrite(lit->value.term.record, 1, lit->value.term.len, out);
+  }
+  pos += sect[SAVE4_TERMS].size;
+
+  save_padding(out, &pos, sect[SAVE4_GRAPHS].offset);
+  for(i=0; i<ng; i++)
+    save4_graph_record(db, out, &ctx, (atom_t)ctx.graphs.loaded_objects[i],
+		       gcount[i], gstart[i],
+		       (gcount[i]+SAVE4_BLOCK_TRIPLES-1)/SAVE4_BLOCK_TRIPLES);
+  pos += sect[SAVE4_GRAPHS].size;
+
+  save_padding(out, &pos, sect[SAVE4_BLOCKS].offset);
+  for(i=0; i<nblocks; i++)
+  { save_uint64(out, blocks[i].first);
+    save_uint64(out, blocks[i].count);
+    save_uint64(out, blocks[i].offset);
+    save_uint64(out, blocks[i].size);
+  }
+  pos += sect[SAVE4_BLOCKS].size;
+
+  save_padding(out, &pos, sect[SAVE4_TRIPLES].offset);
+  for(i=0; i<nblocks; i++)
+    Sfwrite(blocks[i].data, 1, (size_t)blocks[i].size, out);
+
+  rc = !Sferror(out);
+
+out:
+  if ( blocks )
+  { if ( compress )
+    { for(i=0; i<nblocks; i++)
+      { if ( blocks[i].data )
+	  free(blocks[i].data);
+      }
+    }
+    free(blocks);
+  }
+  if ( plain ) free(plain);
+  if ( rec ) free(rec);
+  if ( order ) free(order);
+  if ( gcount ) free(gcount);
+  if ( gstart ) free(gstart);
+  if ( ctx.atoms.loaded_objects ) free(ctx.atoms.loaded_objects);
+  if ( ctx.predicates.loaded_objects ) free(ctx.predicates.loaded_objects);
+  if ( ctx.literals.loaded_objects ) free(ctx.literals.loaded_objects);
+  if ( ctx.graphs.loaded_objects ) free(ctx.graphs.loaded_objects);
+  free_triple_buffer(&triples);
+  destroy_saved_table(db, &ctx.graph_index);
+  destroy_saved(db, &ctx.saved);
 
   return rc;
+
+nomem:
+  rc = PL_resource_error("memory");
+  goto out;
 }
 
 
-static foreign_t
-rdf_atom_md5(term_t text, term_t times, term_t md5)
-{ char *s;
-  int n, i;
-  size_t len;
-  md5_byte_t digest[16];
+/* load_db4() loads the body of a version 4 file.  The magic and version
+   have been read.  Each section is read using a single Sfread() call.
+   skip_to() uses Sseek64() if possible to skip over triple blocks of
+   graphs we do not load.
+*/
 
-  if ( !PL_get_nchars(text, &len, &s, CVT_ALL|REP_UTF8|CVT_EXCEPTION) )
-    return FALSE;
-  if ( !PL_get_integer_ex(times, &n) )
-    return FALSE;
-  if ( n < 1 )
-    return PL_domain_error("positive_integer", times);
+static int
+skip_to(IOSTREAM *in, uint64_t *pos, uint64_t upto)
+{ if ( upto > *pos+SAVE4_SEEK &&
+       Sseek64(in, (int64_t)(upto-*pos), SIO_SEEK_CUR) == 0 )
+  { *pos = upto;
+    return TRUE;
+  }
 
-  for(i=0; i<n; i++)
-  { md5_state_t state;
-    md5_init(&state);
-    md5_append(&state, (const md5_byte_t *)s, (int)len);
-    md5_finish(&state, digest);
-    s = (char *)digest;
-    len = sizeof(digest);
+  for( ; *pos < upto; (*pos)++ )
+  { if ( Sgetc(in) == EOF )
+      return FALSE;
   }
 
-  return md5_unify_digest(md5, digest);
+  return TRUE;
 }
 
 
+static int
+load4_header(IOSTREAM *in, uint64_t *pos, save4_section *sect,
+	     uint32_t *flags)
+{ unsigned char hdr[SAVE4_HEADER_SIZE];
+  uint64_t end;
+  int s;
+
+  if ( !skip_to(in, pos, save4_align(*pos)) ||
+       Sfread(hdr, 1, sizeof(hdr), in) != sizeof(hdr) ||
+       memcmp(hdr, "RDF4", 4) != 0 ||
+       get_uint32(hdr+8) != SAVE4_SECTIONS )
+    return FALSE;
+  *pos += sizeof(hdr);
+  *flags = get_uint32(hdr+4);
 
-#endif /*WITH_MD5*/
+  end = *pos;
+  for(s=0; s<SAVE4_SECTIONS; s++)
+  { const unsigned char *e = hdr+16+s*32;
 
+    if ( get_uint32(e) != (uint32_t)s )
+      return FALSE;
+    sect[s].offset = get_uint64(e+8);
+    sect[s].size   = get_uint64(e+16);
+    sect[s].count  = get_uint64(e+24);
+    if ( sect[s].offset < end ||
+	 sect[s].size > (uint64_t)-1 - sect[s].offset )
+      return FALSE;
+    end = sect[s].offset + sect[s].size;
+  }
 
-		 /*******************************
-		 *	       ATOMS		*
-		 *******************************/
+  return ( sect[SAVE4_ATOMS].count < sect[SAVE4_ATOMS].size/8 &&
+	   sect[SAVE4_PREDICATES].size == sect[SAVE4_PREDICATES].count*4 &&
+	   sect[SAVE4_LITERALS].size ==
+			sect[SAVE4_LITERALS].count*SAVE4_LITERAL_SIZE &&
+	   sect[SAVE4_GRAPHS].size ==
+			sect[SAVE4_GRAPHS].count*SAVE4_GRAPH_SIZE &&
+	   sect[SAVE4_BLOCKS].size ==
+			sect[SAVE4_BLOCKS].count*SAVE4_BLOCK_SIZE &&
+	   (!(*flags&SAVE4_SINGLE) || sect[SAVE4_GRAPHS].count == 1) );
+}
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Lock atoms in triple against AGC. Note that the predicate name is locked
-in the predicate structure.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static void
-lock_atoms(rdf_db *db, triple *t)
-{ if ( !t->atoms_locked )
-  { t->atoms_locked = TRUE;
+static int
+load4_section(IOSTREAM *in, uint64_t *pos, save4_section *sect,
+	      unsigned char **data)
+{ if ( !skip_to(in, pos, sect->offset) ||
+       !(*data = malloc(sect->size ? (size_t)sect->size : 1)) ||
+       Sfread(*data, 1, (size_t)sect->size, in) != sect->size )
+    return FALSE;
+  *pos += sect->size;
 
-    register_resource(&db->resources, ID_ATOM(t->subject_id));
-    if ( t->object_is_literal )
-    { lock_atoms_literal(t->object.literal);
-    } else
-    { register_resource(&db->resources, t->object.resource);
-    }
-  }
+  return TRUE;
 }
 
 
-static void
-unlock_atoms(rdf_db *db, triple *t)
-{ if ( t->atoms_locked )
-  { t->atoms_locked = FALSE;
+/* load4_atoms() creates the atoms of SAVE4_ATOMS in ctx.  Returns -1 if
+   the section is invalid.
+*/
 
-    unregister_resource(&db->resources, ID_ATOM(t->subject_id));
-    if ( t->object_is_literal )
-    { if ( !t->object.literal->shared )
-	unlock_atoms_literal(t->object.literal);
+static int
+load4_atoms(rdf_db *db, ld_context *ctx,
+	    const unsigned char *data, save4_section *sect)
+{ const unsigned char *text = data + (sect->count+1)*8;
+  uint64_t tsize = sect->size - (sect->count+1)*8;
+  uint64_t i;
+
+  for(i=0; i<sect->count; i++)
+  { uint64_t start = get_uint64(data+i*8);
+    uint64_t end   = get_uint64(data+i*8+8);
+    size_t len;
+    atom_t a;
+
+    if ( start >= end || end > tsize )
+      return -1;
+    len = (size_t)(end-start-1);
+    if ( text[start] == 'A' )
+    { a = PL_new_atom_nchars(len, (const char*)text+start+1);
+    } else if ( text[start] == 'W' && len%4 == 0 )
+    { wchar_t buf[1024];
+      wchar_t *w;
+      size_t j;
+
+      len /= 4;
+      w = (len <= 1024 ? buf : rdf_malloc(db, len*sizeof(wchar_t)));
+      for(j=0; j<len; j++)
+	w[j] = (wchar_t)get_uint32(text+start+1+j*4);
+      a = PL_new_atom_wchars(len, w);
+      if ( w != buf )
+	rdf_free(db, w, len*sizeof(wchar_t));
     } else
-    { unregister_resource(&db->resources, t->object.resource);
+      return -1;
+
+    if ( !add_atom(db, a, ctx) )
+    { PL_unregister_atom(a);
+      return FALSE;
     }
   }
+
+  return TRUE;
 }
 
 
-		 /*******************************
-		 *      PROLOG CONVERSION	*
-		 *******************************/
+static literal *
+load4_literal(rdf_db *db, ld_context *ctx, size_t idx, unsigned int uses,
+	      unsigned char **data, save4_section *sect)
+{ literal *lit;
+  const unsigned char *r;
+  uint32_t tl;
+  uint64_t value, len;
+  atom_t a = 0;
+
+  r     = data[SAVE4_LITERALS] + idx*SAVE4_LITERAL_SIZE;
+  tl    = get_uint32(r+4);
+  value = get_uint64(r+8);
+  len   = get_uint64(r+16);
+  if ( r[1] > Q_LANG || (r[1] != Q_NONE) != (tl != 0) ||
+       (tl && !fetch_atom(ctx, tl-1)) )
+    return NULL;
+  switch(r[0])
+  { case OBJ_STRING:
+      if ( !(a=fetch_atom(ctx, (size_t)value)) )
+	return NULL;
+      break;
+    case OBJ_INTEGER:
+    case OBJ_DOUBLE:
+      break;
+    case OBJ_TERM:
+      if ( value > sect[SAVE4_TERMS].size ||
+	   len > sect[SAVE4_TERMS].size - value )
+	return NULL;
+      break;
+    default:
+      return NULL;
+  }
 
-#define LIT_TYPED	0x1
-#define LIT_NOERROR	0x2
-#define LIT_PARTIAL	0x4
+  if ( !(lit=new_literal(db)) )
+    return NULL;
+  lit->objtype	 = r[0];
+  lit->qualifier = r[1];
+  if ( tl )
+    lit->type_or_lang = fetch_atom(ctx, tl-1);
+  switch(lit->objtype)
+  { case OBJ_STRING:
+      lit->value.string = a;
+      break;
+    case OBJ_INTEGER:
+      lit->value.integer = (int64_t)value;
+      break;
+    case OBJ_DOUBLE:
+      memcpy(&lit->value.real, &value, sizeof(value));
+      break;
+    case OBJ_TERM:
+      lit->value.term.len = (size_t)len;
+      lit->value.term.record = rdf_malloc(db, (size_t)len);
+      memcpy(lit->value.term.record, data[SAVE4_TERMS]+value, (size_t)len);
+      lit->term_loaded = TRUE;		/* see free_literal() */
+      break;
+  }
 
-static int
-get_lit_atom_ex(term_t t, atom_t *a, int flags)
-{ if ( PL_get_atom(t, a) )
-    return TRUE;
-  if ( (flags & LIT_PARTIAL) && PL_is_variable(t) )
-  { *a = 0L;
-    return TRUE;
+  lock_atoms_literal(lit);
+  lit = share_literal(db, lit);
+  if ( uses > 1 )
+  { simpleMutexLock(&db->locks.literal);
+    lit->references += uses-1;
+    simpleMutexUnlock(&db->locks.literal);
   }
+  ctx->literals.loaded_objects[idx] = lit;
 
-  return PL_type_error("atom", t);
+  return lit;
 }
 
 
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-get_literal() processes the argument  of  a   literal/1  term  passes as
-object.
+load_triple_blocks() creates the triples  of   a  version 4 file.  The
+blocks are divided over at most cpu_count threads, each decoding a
+consecutive range into its own triple   buffer.  The buffers are appended
+to ctx->triples in order, so the triples   keep the order of the file.
+This is needed for the frozen graph ranges. The records have been
+validated and all literals have been created by the caller with one
+reference per use, so the workers only read ctx.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static int
-get_literal(rdf_db *db, term_t litt, literal *lit, int flags)
-{ if ( PL_get_atom(litt, &lit->value.string) )
-  { lit->objtype = OBJ_STRING;
-  } else if ( PL_is_integer(litt) && PL_get_int64(litt, &lit->value.integer) )
-  { lit->objtype = OBJ_INTEGER;
-  } else if ( PL_get_float(litt, &lit->value.real) )
-  { lit->objtype = OBJ_DOUBLE;
-  } else if ( PL_is_functor(litt, FUNCTOR_lang2) )
-  { term_t a = PL_new_term_ref();
-
-    _PL_get_arg(1, litt, a);
-    if ( !get_lit_atom_ex(a, &lit->type_or_lang, flags) )
-      return FALSE;
-    _PL_get_arg(2, litt, a);
-    if ( !get_lit_atom_ex(a, &lit->value.string, flags) )
-      return FALSE;
+typedef struct load_worker
+{ rdf_db       *db;			/* Database we load into */
+  ld_context   *ctx;			/* Load context */
+  const unsigned char *records;		/* Plain triple records */
+  atom_t       *graphs;			/* Graph index --> name */
+  size_t	first;			/* First triple to create */
+  size_t	end;			/* Last triple+1 */
+  size_t	done;			/* Next record if out of memory */
+  triple       *pending;		/* Created but not buffered */
+  triple_buffer triples;		/* Created triples */
+  int		rc;			/* Result */
+} load_worker;
 
-    lit->qualifier = Q_LANG;
-    lit->objtype = OBJ_STRING;
-  } else if ( PL_is_functor(litt, FUNCTOR_type2) &&
-	      !(flags & LIT_TYPED) )	/* avoid recursion */
-  { term_t a = PL_new_term_ref();
 
-    _PL_get_arg(1, litt, a);
-    if ( !get_lit_atom_ex(a, &lit->type_or_lang, flags) )
-      return FALSE;
-    lit->qualifier = Q_TYPE;
-    _PL_get_arg(2, litt, a);
+static void
+load_triple_range(void *closure)
+{ load_worker *w = closure;
+  ld_context *ctx = w->ctx;
+  size_t i;
+
+  for(i=w->first; i<w->end; i++)
+  { const unsigned char *r = w->records + i*SAVE4_TRIPLE_SIZE;
+    uint32_t object = get_uint32(r+8);
+    triple *t;
 
-    return get_literal(db, a, lit, LIT_TYPED|flags);
-  } else if ( !PL_is_ground(litt) )
-  { if ( !(flags & LIT_PARTIAL) )
-      return PL_type_error("rdf_object", litt);
-    if ( !PL_is_variable(litt) )
-      lit->objtype = OBJ_TERM;
-  } else
-  { lit->value.term.record = PL_record_external(litt, &lit->value.term.len);
-    lit->objtype = OBJ_TERM;
+    if ( !(t=new_triple(w->db)) )
+    { w->done = i;
+      return;
+    }
+    t->subject_id  = ATOM_ID(fetch_atom(ctx, get_uint32(r)));
+    t->predicate.r = fetch_predicate(ctx, get_uint32(r+4));
+    if ( (object&SAVE4_IS_LITERAL) )
+    { t->object_is_literal = TRUE;
+      t->object.literal = ctx->literals.loaded_objects[object&~SAVE4_IS_LITERAL];
+    } else
+    { t->object.resource = fetch_atom(ctx, object);
+    }
+    t->graph_id = ATOM_ID(w->graphs[get_uint32(r+12)]);
+    t->line     = get_uint32(r+16);
+    t->loaded   = TRUE;
+    if ( !buffer_triple(&w->triples, t) )
+    { w->pending = t;
+      w->done = i+1;
+      return;
+    }
   }
 
-  return TRUE;
+  w->rc = TRUE;
 }
 
 
 static int
-get_object(rdf_db *db, term_t object, triple *t)
-{ if ( PL_get_atom(object, &t->object.resource) )
-  { assert(!t->object_is_literal);
-  } else if ( PL_is_functor(object, FUNCTOR_literal1) )
-  { term_t a = PL_new_term_ref();
+load_triple_blocks(rdf_db *db, ld_context *ctx,
+		   const unsigned char *records, atom_t *graphs,
+		   save4_block *blocks, size_t nblocks)
+{ load_worker w[MAX_WORKERS];
+  size_t ntriples = 0;
+  int workers, i;
+  int rc = TRUE;
 
-    _PL_get_arg(1, object, a);
-    alloc_literal_triple(db, t);
-    return get_literal(db, a, t->object.literal, 0);
-  } else
-    return PL_type_error("rdf_object", object);
+  if ( nblocks > 0 )
+    ntriples = (size_t)(blocks[nblocks-1].first + blocks[nblocks-1].count);
+  workers = worker_count(ntriples, SAVE4_BLOCK_TRIPLES);
+  if ( (size_t)workers > nblocks )
+    workers = (nblocks > 0 ? (int)nblocks : 1);
 
-  return TRUE;
-}
+  for(i=0; i<workers; i++)
+  { size_t b0 = nblocks*i/workers;
+    size_t b1 = nblocks*(i+1)/workers;
 
+    memset(&w[i], 0, sizeof(w[i]));
+    w[i].db	 = db;
+    w[i].ctx	 = ctx;
+    w[i].records = records;
+    w[i].graphs  = graphs;
+    w[i].first	 = (b0 < nblocks ? (size_t)blocks[b0].first : ntriples);
+    w[i].end	 = (b1 < nblocks ? (size_t)blocks[b1].first : ntriples);
+    init_triple_buffer(&w[i].triples);
+  }
 
-static int
-get_src(term_t src, triple *t)
-{ if ( src && !PL_is_variable(src) )
-  { atom_t at;
+  run_workers(load_triple_range, w, sizeof(w[0]), workers);
 
-    if ( PL_get_atom(src, &at) )
-    { t->graph_id = ATOM_ID(at);
-      t->line = NO_LINE;
-    } else if ( PL_is_functor(src, FUNCTOR_colon2) )
-    { term_t a = PL_new_term_ref();
-      long line;
+  for(i=0; i<workers; i++)
+  { triple **tp;
 
-      _PL_get_arg(1, src, a);
-      if ( !get_atom_or_var_ex(a, &at) )
-	return FALSE;
-      t->graph_id = ATOM_ID(at);
-      _PL_get_arg(2, src, a);
-      if ( PL_get_long(a, &line) )
-	t->line = line;
-      else if ( !PL_is_variable(a) )
-	return PL_type_error("integer", a);
-    } else
-      return PL_type_error("rdf_graph", src);
+    for(tp=w[i].triples.base; tp<w[i].triples.top; tp++)
+    { if ( !buffer_triple(&ctx->triples, *tp) )
+      { free_triple(db, *tp, FALSE);
+	rc = FALSE;
+      }
+    }
+    free_triple_buffer(&w[i].triples);
+
+    if ( !w[i].rc )			/* release the unused references */
+    { size_t r;
+
+      if ( w[i].pending )
+	free_triple(db, w[i].pending, FALSE);
+      for(r=w[i].done; r<w[i].end; r++)
+      { uint32_t object = get_uint32(records+r*SAVE4_TRIPLE_SIZE+8);
+
+	if ( (object&SAVE4_IS_LITERAL) )
+	  free_literal(db, ctx->literals.loaded_objects[object&~SAVE4_IS_LITERAL]);
+      }
+      rc = FALSE;
+    }
   }
 
-  return TRUE;
+  return rc ? TRUE : PL_resource_error("memory");
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Return values:
-	-1: exception
-	 0: no predicate
-	 1: the predicate
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
 
 static int
-get_existing_predicate(rdf_db *db, term_t t, predicate **p)
-{ atom_t name;
+load_db4(rdf_db *db, IOSTREAM *in, ld_context *ctx)
+{ save4_section sect[SAVE4_SECTIONS];
+  unsigned char *data[SAVE4_SECTIONS] = {NULL};
+  atom_t *gnames = NULL;
+  unsigned int *uses = NULL;		/* # triples per literal */
+  save4_block *blocks = NULL;		/* Blocks we load */
+  unsigned char *zdata = NULL;		/* Their compressed data */
+  size_t nblocks = 0, ntriples = 0;
+  uint64_t pos = strlen(SAVE_MAGIC)+1;	/* version 4 is one byte */
+  uint64_t i, b, zsize = 0;
+  uint32_t flags;
+  int s, rc = FALSE;
+
+  if ( !load4_header(in, &pos, sect, &flags) )
+    goto bad;
+  for(s=0; s<SAVE4_TRIPLES; s++)
+  { if ( !load4_section(in, &pos, &sect[s], &data[s]) )
+      goto bad;
+  }
+#ifndef HAVE_LIBZ
+  if ( (flags&SAVE4_COMPRESSED) )
+  { rc = PL_warning("RDF triple file is compressed (no zlib support)");
+    goto out;
+  }
+#endif
 
-  if ( !PL_get_atom(t, &name ) )
-  { if ( PL_is_functor(t, FUNCTOR_literal1) )
-      return 0;				/* rdf(_, literal(_), _) */
-    return PL_type_error("atom", t);
+  switch(load4_atoms(db, ctx, data[SAVE4_ATOMS], &sect[SAVE4_ATOMS]))
+  { case -1:
+      goto bad;
+    case FALSE:
+      goto nomem;
+  }
+
+					/* predicates */
+  for(i=0; i<sect[SAVE4_PREDICATES].count; i++)
+  { atom_t a = fetch_atom(ctx, get_uint32(data[SAVE4_PREDICATES]+i*4));
+    predicate *p;
+
+    if ( !a )
+      goto bad;
+    if ( !(p=lookup_predicate(db, a)) || !add_predicate(db, p, ctx) )
+      goto nomem;
+  }
+
+					/* literals are created below */
+  for(i=0; i<sect[SAVE4_LITERALS].count; i++)
+  { if ( !add_object(db, NULL, &ctx->literals) )
+      goto nomem;
+  }
+
+					/* graphs and their blocks */
+  if ( !(gnames = malloc((size_t)(sect[SAVE4_GRAPHS].count+1)*sizeof(atom_t))) ||
+       !(ctx->frozen = malloc((size_t)(sect[SAVE4_GRAPHS].count+1) *
+			      sizeof(*ctx->frozen))) ||
+       !(blocks = malloc((size_t)(sect[SAVE4_BLOCKS].count+1) *
+			 sizeof(*blocks))) )
+    goto nomem;
+  b = 0;
+  for(i=0; i<sect[SAVE4_GRAPHS].count; i++)
+  { const unsigned char *r = data[SAVE4_GRAPHS] + i*SAVE4_GRAPH_SIZE;
+    atom_t name = fetch_atom(ctx, get_uint32(r));
+    uint32_t source = get_uint32(r+4);
+    uint32_t gflags = get_uint32(r+8);
+    uint64_t triples = get_uint64(r+40);
+    uint64_t nblk = get_uint64(r+56);
+    uint64_t first = ntriples;
+    uint64_t gtriples = 0;
+    int load;
+
+    if ( !name || (source && !fetch_atom(ctx, source-1)) ||
+	 get_uint64(r+48) != b ||
+	 nblk > sect[SAVE4_BLOCKS].count - b )
+      goto bad;
+    gnames[i] = name;
+    load = (!ctx->only || in_atomset(ctx->only, name));
+
+    for( ; nblk > 0; nblk--, b++ )
+    { const unsigned char *br = data[SAVE4_BLOCKS] + b*SAVE4_BLOCK_SIZE;
+      save4_block *blk = &blocks[nblocks];
+      uint64_t offset = get_uint64(br+16);
+      uint64_t size = get_uint64(br+24);
+
+      if ( b > 0 && offset < get_uint64(br-SAVE4_BLOCK_SIZE+16) +
+			     get_uint64(br-SAVE4_BLOCK_SIZE+24) )
+	goto bad;			/* blocks must be in file order */
+      if ( offset > sect[SAVE4_TRIPLES].size ||
+	   size > sect[SAVE4_TRIPLES].size - offset ||
+	   get_uint64(br+8) == 0 ||
+	   get_uint64(br+8) > SAVE4_BLOCK_TRIPLES ||
+	   (!(flags&SAVE4_COMPRESSED) &&
+	    size != get_uint64(br+8)*SAVE4_TRIPLE_SIZE) )
+	goto bad;
+      gtriples += get_uint64(br+8);
+      if ( load )
+      { blk->first  = ntriples;
+	blk->count  = get_uint64(br+8);
+	blk->offset = offset;
+	blk->size   = size;
+	blk->graph  = (uint32_t)i;
+	ntriples += (size_t)blk->count;
+	zsize += size;
+	nblocks++;
+      }
+    }
+    if ( gtriples != triples )
+      goto bad;
+    if ( !load )
+      continue;
+
+    if ( (flags&SAVE4_SINGLE) )
+    { uint64_t modified = get_uint64(r+16);
+
+      ctx->graph_name = name;
+      if ( source )
+      { ctx->graph_source = fetch_atom(ctx, source-1);
+	memcpy(&ctx->modified, &modified, sizeof(ctx->modified));
+      }
+      if ( (gflags&SAVE4_MD5) )
+      { memcpy(ctx->digest, r+24, 16);
+	ctx->has_digest = TRUE;
+      }
+    }
+    if ( triples > 0 )
+      add_atomset(&ctx->graph_table, name);
+    if ( (gflags&SAVE4_FROZEN) && triples > 0 )
+    { ld_frozen *f = &ctx->frozen[ctx->frozen_count++];
+
+      f->graph  = name;
+      f->offset = (size_t)first;
+      f->count  = (size_t)triples;
+    }
   }
+  if ( b != sect[SAVE4_BLOCKS].count )
+    goto bad;
 
-  if ( (*p = existing_predicate(db, name)) )
-    return 1;
+					/* read the blocks */
+  if ( !(data[SAVE4_TRIPLES] = malloc(ntriples > 0 ? ntriples*SAVE4_TRIPLE_SIZE
+						  : 1)) ||
+       ((flags&SAVE4_COMPRESSED) && !(zdata = malloc(zsize > 0 ? zsize : 1))) )
+    goto nomem;
+  zsize = 0;
+  for(b=0; b<nblocks; b++)
+  { save4_block *blk = &blocks[b];
 
-  DEBUG(5, Sdprintf("No predicate %s\n", PL_atom_chars(name)));
-  return 0;				/* no predicate */
-}
+    if ( (flags&SAVE4_COMPRESSED) )
+    { blk->data = zdata+zsize;
+      zsize += blk->size;
+    } else
+    { blk->data = data[SAVE4_TRIPLES]+blk->first*SAVE4_TRIPLE_SIZE;
+    }
+    if ( !skip_to(in, &pos, sect[SAVE4_TRIPLES].offset+blk->offset) ||
+	 Sfread(blk->data, 1, (size_t)blk->size, in) != blk->size )
+      goto bad;
+    pos += blk->size;
+  }
+#ifdef HAVE_LIBZ
+  if ( (flags&SAVE4_COMPRESSED) &&
+       !zip_blocks(inflate_blocks, blocks, nblocks,
+		   data[SAVE4_TRIPLES], ntriples) )
+    goto bad;
+#endif
 
+					/* validate the triples */
+  if ( !(uses = calloc((size_t)sect[SAVE4_LITERALS].count+1, sizeof(*uses))) )
+    goto nomem;
+  for(b=0; b<nblocks; b++)
+  { save4_block *blk = &blocks[b];
+
+    for(i=blk->first; i<blk->first+blk->count; i++)
+    { const unsigned char *r = data[SAVE4_TRIPLES] + i*SAVE4_TRIPLE_SIZE;
+      uint32_t object = get_uint32(r+8);
+
+      if ( !fetch_atom(ctx, get_uint32(r)) ||
+	   !fetch_predicate(ctx, get_uint32(r+4)) ||
+	   get_uint32(r+12) != blk->graph )
+	goto bad;
+      if ( (object&SAVE4_IS_LITERAL) )
+      { if ( (object&~SAVE4_IS_LITERAL) >= sect[SAVE4_LITERALS].count )
+	  goto bad;
+	uses[object&~SAVE4_IS_LITERAL]++;
+      } else if ( !fetch_atom(ctx, object) )
+	goto bad;
+    }
+  }
+
+					/* literals */
+  for(i=0; i<sect[SAVE4_LITERALS].count; i++)
+  { if ( uses[i] && !load4_literal(db, ctx, (size_t)i, uses[i], data, sect) )
+    { while( i-- > 0 )		/* release the created literals */
+      { for( ; uses[i] > 0; uses[i]-- )
+	  free_literal(db, ctx->literals.loaded_objects[i]);
+      }
+      goto bad;
+    }
+  }
 
-static int
-get_predicate(rdf_db *db, term_t t, predicate **p, query *q)
-{ atom_t name;
+					/* triples */
+  if ( !load_triple_blocks(db, ctx, data[SAVE4_TRIPLES], gnames,
+			   blocks, nblocks) )
+    goto out;
 
-  if ( !PL_get_atom_ex(t, &name ) )
-    return FALSE;
+  rc = TRUE;
 
-  *p = lookup_predicate(db, name);
-  return TRUE;
+out:
+  for(s=0; s<SAVE4_SECTIONS; s++)
+  { if ( data[s] )
+      free(data[s]);
+  }
+  if ( gnames )
+    free(gnames);
+  if ( uses )
+    free(uses);
+  if ( blocks )
+    free(blocks);
+  if ( zdata )
+    free(zdata);
+
+  return rc;
+
+bad:
+  rc = PL_warning("Illegal RDF triple file");
+  goto out;
+nomem:
+  rc = PL_resource_error("memory");
+  goto out;
 }
 
 
-static int
-get_triple(rdf_db *db,
-	   term_t subject, term_t predicate, term_t object,
-	   triple *t, query *q)
-{ atom_t at;
+/* load_frozen_triples() freezes the graphs that were frozen when the
+   file was saved.  See load_frozen_graph().
+*/
 
-  if ( !PL_get_atom_ex(subject, &at) ||
-       !get_predicate(db, predicate, &t->predicate.r, q) ||
-       !get_object(db, object, t) )
-    return FALSE;
+static void
+load_frozen_triples(rdf_db *db, ld_context *ctx)
+{ size_t i;
 
-  t->subject_id = ATOM_ID(at);
+  for(i=0; i<ctx->frozen_count; i++)
+  { ld_frozen *f = &ctx->frozen[i];
 
-  return TRUE;
+    load_frozen_graph(db, lookup_graph(db, f->graph),
+		      ctx->triples.base+f->offset, f->count);
+  }
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-get_partial_triple() creates a triple  for   matching  purposes.  It can
-return FALSE for  two  reasons.  Mostly   (type)  errors,  but  also  if
-resources are accessed that do not   exist  and therefore the subsequent
-matching will always fail. This  is   notably  the  case for predicates,
-which are first class citizens to this library.
-
-Return values:
-	1: ok
-	0: no predicate
-       -1: error
+Note that we have two types  of   saved  states.  One holding many named
+graphs and one holding the content of exactly one named graph.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 static int
-get_partial_triple(rdf_db *db,
-		   term_t subject, term_t predicate, term_t object,
-		   term_t src, triple *t)
-{ int rc;
-  int ipat = 0;
+load_db(rdf_db *db, IOSTREAM *in, ld_context *ctx)
+{ int c;
 
-  if ( subject )
-  { atom_t at;
+  if ( !load_magic(in) )
+    return FALSE;
+  ctx->version = (int)load_int(in);
+  if ( ctx->version == 4 )
+    return load_db4(db, in, ctx);
+  if ( ctx->version < 2 || ctx->version > 3 )
+  { term_t v = PL_new_term_ref();
 
-    if ( !get_resource_or_var_ex(subject, &at) )
+    if ( PL_put_integer(v, ctx->version) )
+      return PL_domain_error("rdf_db_save_version", v);
+    else
       return FALSE;
-    t->subject_id = ATOM_ID(at);
   }
-  if ( !PL_is_variable(predicate) &&
-       (rc=get_existing_predicate(db, predicate, &t->predicate.r)) != 1 )
-    return rc;
-					/* the object */
-  if ( object && !PL_is_variable(object) )
-  { if ( PL_get_atom(object, &t->object.resource) )
-    { assert(!t->object_is_literal);
-    } else if ( PL_is_functor(object, FUNCTOR_literal1) )
-    { term_t a = PL_new_term_ref();
-
-      _PL_get_arg(1, object, a);
-      alloc_literal_triple(db, t);
-      if ( !get_literal(db, a, t->object.literal, LIT_PARTIAL) )
-	return FALSE;
-    } else if ( PL_is_functor(object, FUNCTOR_literal2) )
-    { term_t a = PL_new_term_ref();
-      literal *lit;
-
-      alloc_literal_triple(db, t);
-      lit = t->object.literal;
 
-      _PL_get_arg(1, object, a);
-      if ( PL_is_functor(a, FUNCTOR_exact1) )
-	t->match = STR_MATCH_EXACT;
-      else if ( PL_is_functor(a, FUNCTOR_plain1) )
-	t->match = STR_MATCH_PLAIN;
-      else if ( PL_is_functor(a, FUNCTOR_substring1) )
-	t->match = STR_MATCH_SUBSTRING;
-      else if ( PL_is_functor(a, FUNCTOR_word1) )
-	t->match = STR_MATCH_WORD;
-      else if ( PL_is_functor(a, FUNCTOR_prefix1) )
-	t->match = STR_MATCH_PREFIX;
-      else if ( PL_is_functor(a, FUNCTOR_like1) )
-	t->match = STR_MATCH_LIKE;
-      else if ( PL_is_functor(a, FUNCTOR_le1) )
-	t->match = STR_MATCH_LE;
-      else if ( PL_is_functor(a, FUNCTOR_ge1) )
-	t->match = STR_MATCH_GE;
-      else if ( PL_is_functor(a, FUNCTOR_between2) )
-      { term_t e = PL_new_term_ref();
+  while((c=Sgetc(in)) != EOF)
+  { switch(c)
+    { case 'T':
+      { triple *t;
 
-	_PL_get_arg(2, a, e);
-	memset(&t->tp.end, 0, sizeof(t->tp.end));
-	if ( !get_literal(db, e, &t->tp.end, 0) )
+	if ( !(t=load_triple(db, in, ctx)) )
 	  return FALSE;
-	t->match = STR_MATCH_BETWEEN;
-      } else
-	return PL_domain_error("match_type", a);
+	if ( ctx->only && !in_atomset(ctx->only, ID_ATOM(t->graph_id)) )
+	{ free_triple(db, t, FALSE);
+	  break;
+	}
+	t->loaded = TRUE;
+	buffer_triple(&ctx->triples, t);
+        break;
+      }
+      case 'D':				/* deleted since base (delta) */
+      { triple *t;
 
-      _PL_get_arg(1, a, a);
-      if ( t->match >= STR_MATCH_LE )
-      { if ( !get_literal(db, a, lit, 0) )
-	  return FALSE;
-      } else
-      { if ( !PL_get_atom_ex(a, &lit->value.string) )
+	if ( ctx->version < 3 || !(t=load_triple(db, in, ctx)) )
 	  return FALSE;
-	lit->objtype = OBJ_STRING;
+	if ( ctx->only && !in_atomset(ctx->only, ID_ATOM(t->graph_id)) )
+	{ free_triple(db, t, FALSE);
+	  break;
+	}
+	buffer_triple(&ctx->deleted, t);
+	break;
       }
-    } else
-      return PL_type_error("rdf_object", object);
-  }
-					/* the graph */
-  if ( !get_src(src, t) )
-    return FALSE;
+					/* file holding exactly one graph */
+      case 'S':				/* name of the graph */
+      { ctx->graph_name = load_atom(db, in, ctx);
+        break;
+      }
+      case 'M':				/* MD5 of the graph */
+      { int i;
 
-  if ( t->subject_id )
-    ipat |= BY_S;
-  if ( t->predicate.r )
-    ipat |= BY_P;
-  if ( t->object_is_literal )
-  { literal *lit = t->object.literal;
+	for(i=0; i<16; i++)
+	  ctx->digest[i] = Sgetc(in);
+	ctx->has_digest = TRUE;
 
-    switch( lit->objtype )
-    { case OBJ_UNTYPED:
 	break;
-      case OBJ_STRING:
-	if ( lit->objtype == OBJ_STRING )
-	{ if ( lit->value.string &&
-	       t->match <= STR_MATCH_EXACT )
-	    ipat |= BY_O;
-	}
-        break;
-      case OBJ_INTEGER:
-      case OBJ_DOUBLE:
-	ipat |= BY_O;
-        break;
-      case OBJ_TERM:
-	if ( PL_is_ground(object) )
-	  ipat |= BY_O;
+      }
+      case 'F':				/* file of the graph */
+	ctx->graph_source = load_atom(db, in, ctx);
+	break;				/* end of one-graph handling */
+      case 't':
+	load_double(in, &ctx->modified);
         break;
+      case 'E':				/* end of file */
+	if ( ctx->only && ctx->graph_name &&
+	     !in_atomset(ctx->only, ctx->graph_name) )
+	  ctx->graph_name = 0;
+	return TRUE;
       default:
-	assert(0);
+	break;
     }
-  } else if ( t->object.resource )
-  { ipat |= BY_O;
   }
-  if ( t->graph_id )
-    ipat |= BY_G;
 
-  db->indexed[ipat]++;			/* statistics */
-  t->indexed = alt_index[ipat];
-
-  return TRUE;
+  return PL_warning("Illegal RDF triple file");
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-inverse_partial_triple(triple *t) inverses a triple   by swapping object
-and subject and replacing the predicate with its inverse.
-
-TBD: In many cases we can  compute   the  hash  more efficiently than by
-simply recomputing it:
-
-  - Change predicate: x-or with old and new predicate hash
-  - swap S<->O if the other is known is a no-op wrt the hash.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-
 static int
-inverse_partial_triple(triple *t)
-{ predicate *i;
-
-  if ( !t->inversed &&
-       (!(i=t->predicate.r) || (i=t->predicate.r->inverse_of)) &&
-       !t->object_is_literal )
-  { atom_t o = t->object.resource;
-
-    t->object.resource = ID_ATOM(t->subject_id);
-    t->subject_id = ATOM_ID(o);
+prepare_loaded_triples(rdf_db *db, ld_context *ctx)
+{ triple **t;
 
-    if ( t->predicate.r )
-      t->predicate.r = i;
-
-    t->indexed  = by_inverse[t->indexed];
-    t->inversed = TRUE;
+  if ( ctx->graph_name )			/* lookup named graph */
+  { ctx->graph = lookup_graph(db, ctx->graph_name);
+    if ( ctx->graph_source && ctx->graph->source != ctx->graph_source )
+    { if ( ctx->graph->source )
+	PL_unregister_atom(ctx->graph->source);
+      ctx->graph->source = ctx->graph_source;
+      PL_register_atom(ctx->graph->source);
+      ctx->graph->modified = ctx->modified;
+    }
 
-    return TRUE;
+    if ( ctx->has_digest )
+    { if ( ctx->graph->md5 )
+      { ctx->graph->md5 = FALSE;		/* kill repetitive MD5 update */
+      } else
+      { ctx->has_digest = FALSE;
+      }
+    }
+  } else
+  { ctx->graph = NULL;
   }
 
-  return FALSE;
-}
-
+  for(t=ctx->triples.base; t<ctx->triples.top; t++)
+    lock_atoms(db, *t);
 
-static int
-get_graph(term_t src, triple *t)
-{ atom_t at;
+  return TRUE;
+}
 
-  if ( PL_get_atom(src, &at) )
-  { t->line = NO_LINE;
-    t->graph_id = ATOM_ID(at);
-    return TRUE;
-  }
 
-  if ( PL_is_functor(src, FUNCTOR_colon2) )
-  { term_t a = PL_new_term_ref();
-    long line;
+static void
+destroy_load_context(rdf_db *db, ld_context *ctx, int delete_triples)
+{ triple **tp;
 
-    _PL_get_arg(1, src, a);
-    if ( !PL_get_atom_ex(a, &at) )
-      return FALSE;
-    t->graph_id = ATOM_ID(at);
-    _PL_get_arg(2, src, a);
-    if ( !PL_get_long_ex(a, &line) )
-      return FALSE;
-    t->line = line;
+  if ( delete_triples )
+  { for(tp=ctx->triples.base;
+	tp<ctx->triples.top;
+	tp++)
+    { triple *t = *tp;
 
-    return TRUE;
+      free_triple(db, t, FALSE);
+    }
   }
 
-  return PL_type_error("rdf_graph", src);
-}
+  free_triple_buffer(&ctx->triples);
+  for(tp=ctx->deleted.base; tp<ctx->deleted.top; tp++)
+    free_triple(db, *tp, FALSE);
+  free_triple_buffer(&ctx->deleted);
 
+  if ( ctx->atoms.loaded_objects )
+  { atom_t *ap, *ep;
 
-static int
-unify_graph(term_t src, triple *t)
-{ switch( PL_term_type(src) )
-  { case PL_VARIABLE:
-    { if ( t->line == NO_LINE )
-	return PL_unify_atom(src, ID_ATOM(t->graph_id));
-      else
-	goto full_term;
-    }
-    case PL_ATOM:
-    { atom_t a;
-      return (PL_get_atom(src, &a) &&
-	      a == ID_ATOM(t->graph_id));
-    }
-    case PL_TERM:
-    { if ( t->line == NO_LINE )
-      { return PL_unify_term(src,
-			     PL_FUNCTOR, FUNCTOR_colon2,
-			       PL_ATOM, ID_ATOM(t->graph_id),
-			       PL_VARIABLE);
-      } else
-      { full_term:
-	return PL_unify_term(src,
-			     PL_FUNCTOR, FUNCTOR_colon2,
-			       PL_ATOM,  ID_ATOM(t->graph_id),
-			       PL_INT64, (int64_t)t->line); /* line is uint32_t */
-      }
+    for( ap=(atom_t*)ctx->atoms.loaded_objects, ep=ap+ctx->atoms.loaded_id;
+	 ap<ep;
+	 ap++)
+    { PL_unregister_atom(*ap);
     }
-    default:
-      return PL_type_error("rdf_graph", src);
+
+    free(ctx->atoms.loaded_objects);
   }
+  if ( ctx->predicates.loaded_objects )
+    free(ctx->predicates.loaded_objects);
+  if ( ctx->literals.loaded_objects )
+    free(ctx->literals.loaded_objects);
+  if ( ctx->frozen )
+    free(ctx->frozen);
 }
 
+typedef struct
+{ term_t tail;
+  term_t head;
+} add_graph_context;
 
 static int
-same_graph(triple *t1, triple *t2)
-{ return t1->line     == t2->line &&
-         t1->graph_id == t2->graph_id;
-}
+append_graph_to_list(atom_t graph, void *closure)
+{ add_graph_context *ctx = closure;
 
+  return ( PL_unify_list(ctx->tail, ctx->head, ctx->tail) &&
+	   PL_unify_atom(ctx->head, graph)
+	 );
+}
 
 
 static int
-put_literal_value(term_t v, literal *lit)
-{ switch(lit->objtype)
-  { case OBJ_STRING:
-      PL_put_atom(v, lit->value.string);
-      break;
-    case OBJ_INTEGER:
-      PL_put_variable(v);
-      return PL_unify_int64(v, lit->value.integer);
-    case OBJ_DOUBLE:
-      return PL_put_float(v, lit->value.real);
-    case OBJ_TERM:
-      return PL_recorded_external(lit->value.term.record, v);
-    default:
-      assert(0);
-      return FALSE;
-  }
+load_db_stream(rdf_db *db, term_t stream, term_t id, term_t graphs,
+	       atomset *only);
 
-  return TRUE;
-}
+/** rdf_load_db_(+Stream, +Id, -Graphs, +Only)
+ *
+ * As rdf_load_db_/3, but only load the triples of the graphs in the
+ * list Only.  Version 4 files skip the blocks of the other graphs.
+*/
 
+static foreign_t
+rdf_load_db4(term_t stream, term_t id, term_t graphs, term_t only)
+{ rdf_db *db = rdf_current_db();
+  atomset set;
+  term_t tail = PL_copy_term_ref(only);
+  term_t head = PL_new_term_ref();
+  int rc;
 
-static int
-unify_literal(term_t lit, literal *l)
-{ term_t v = PL_new_term_ref();
+  init_atomset(&set);
+  while( PL_get_list(tail, head, tail) )
+  { atom_t a;
 
-  if ( !put_literal_value(v, l) )
+    if ( !PL_get_atom_ex(head, &a) )
+    { destroy_atomset(&set);
+      return FALSE;
+    }
+    add_atomset(&set, a);
+  }
+  if ( !PL_get_nil_ex(tail) )
+  { destroy_atomset(&set);
     return FALSE;
+  }
 
-  if ( l->qualifier )
-  { functor_t qf;
+  rc = load_db_stream(db, stream, id, graphs, &set);
+  destroy_atomset(&set);
 
-    assert(l->type_or_lang);
+  return rc;
+}
 
-    if ( l->qualifier == Q_LANG )
-      qf = FUNCTOR_lang2;
-    else
-      qf = FUNCTOR_type2;
 
-    if ( PL_unify_term(lit, PL_FUNCTOR, qf,
-			 PL_ATOM, l->type_or_lang,
-			 PL_TERM, v) )
-      return TRUE;
+static foreign_t
+rdf_load_db(term_t stream, term_t id, term_t graphs)
+{ return load_db_stream(rdf_current_db(), stream, id, graphs, NULL);
+}
 
-    if ( PL_exception(0) )
-      return FALSE;
 
-    return PL_unify(lit, v);		/* allow rdf(X, Y, literal(foo)) */
-  } else if ( PL_unify(lit, v) )
-  { return TRUE;
-  } else if ( PL_is_functor(lit, FUNCTOR_lang2) &&
-	      l->objtype == OBJ_STRING )
-  { term_t a = PL_new_term_ref();
-    _PL_get_arg(2, lit, a);
-    return PL_unify(a, v);
-  } else if ( PL_is_functor(lit, FUNCTOR_type2) )
-  { term_t a = PL_new_term_ref();
-    _PL_get_arg(2, lit, a);
-    return PL_unify(a, v);
-  } else
-    return FALSE;
-}
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+delete_loaded_triples() applies the 'D' records of   a delta file: each
+pattern deletes one visible triple that is  exactly the same, including
+the graph and line. The hash avoids   deleting the same triple twice if
+the delta holds multiple copies of a triple.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+static void
+delete_loaded_triples(query *q, ld_context *ctx)
+{ rdf_db *db = q->db;
+  size_t count = ctx->deleted.top - ctx->deleted.base;
+  ptr_hash_table *seen;
+  triple_buffer found;
+  triple **dp;
 
+  if ( count == 0 )
+    return;
 
-static int
-unify_object(term_t object, triple *t)
-{ if ( t->object_is_literal )
-  { term_t lit = PL_new_term_ref();
+  seen = new_ptr_hash(count > 1024 ? 1024 : (int)count);
+  init_triple_buffer(&found);
+  for(dp=ctx->deleted.base; dp<ctx->deleted.top; dp++)
+  { triple *d = *dp;
+    triple_walker tw;
+    triple *t;
 
-    if ( PL_unify_functor(object, FUNCTOR_literal1) )
-      _PL_get_arg(1, object, lit);
-    else if ( PL_is_functor(object, FUNCTOR_literal2) )
-      _PL_get_arg(2, object, lit);
-    else
-      return FALSE;
+    d->indexed = BY_SPO;
+    init_triple_walker(&tw, db, d, BY_SPO);
+    while((t=next_triple(&tw)))
+    { lifespan span;
 
-    return unify_literal(lit, t->object.literal);
-  } else
-  { return PL_unify_atom(object, t->object.resource);
+      if ( alive_lifespan(q, triple_lifespan(db, t, &span)) &&
+	   match_triples(db, t, d, q, MATCH_EXACT|MATCH_SRC) &&
+	   add_ptr_hash(seen, t) )
+      { buffer_triple(&found, t);
+	break;
+      }
+    }
+    free_triple(db, d, FALSE);
   }
-}
+  ctx->deleted.top = ctx->deleted.base;
 
+  del_triples(q, found.base, found.top - found.base);
+  free_triple_buffer(&found);
+  destroy_ptr_hash(seen);
+}
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-TRUE:  ok
-FALSE: failure
-ERROR: error
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 static int
-unify_triple(term_t subject, term_t pred, term_t object,
-	     term_t src, triple *t, int inversed)
-{ predicate *p = t->predicate.r;
-  fid_t fid = PL_open_foreign_frame();
+load_db_stream(rdf_db *db, term_t stream, term_t id, term_t graphs,
+	       atomset *only)
+{ ld_context ctx;
+  IOSTREAM *in;
   int rc;
+  term_t ba_arg2;
 
-  if ( inversed )
-  { term_t tmp = object;
-    object = subject;
-    subject = tmp;
+  if ( !(ba_arg2 = PL_new_term_ref()) )
+    return FALSE;
 
-    rc = !pred || PL_unify_term(pred,
-				PL_FUNCTOR, FUNCTOR_inverse_of1,
-				  PL_ATOM, p->name);
-  } else
-  { rc = !pred || PL_unify_atom(pred, p->name);
-  }
+  if ( !PL_get_stream_handle(stream, &in) )
+    return PL_type_error("stream", stream);
 
-  if ( !rc ||
-       !PL_unify_atom(subject, ID_ATOM(t->subject_id)) ||
-       !unify_object(object, t) ||
-       (src && !unify_graph(src, t)) )
-  { if ( PL_exception(0) )
-    { PL_close_foreign_frame(fid);
-      return ERROR;
-    }
+  memset(&ctx, 0, sizeof(ctx));
+  init_atomset(&ctx.graph_table);
+  init_triple_buffer(&ctx.triples);
+  init_triple_buffer(&ctx.deleted);
+  ctx.only = only;
+  rc = load_db(db, in, &ctx);
+  PL_release_stream(in);
 
-    PL_discard_foreign_frame(fid);
+  if ( !rc ||
+       !PL_put_atom(ba_arg2, ATOM_begin) ||
+       !rdf_broadcast(EV_LOAD, (void*)id, (void*)ba_arg2) )
+  { destroy_load_context(db, &ctx, TRUE);
     return FALSE;
-  } else
-  { PL_close_foreign_frame(fid);
-    return TRUE;
   }
-}
-
 
-		 /*******************************
-		 *	DUPLICATE HANDLING	*
-		 *******************************/
-
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-According to the RDF specs, duplicate triples  have no meaning, but they
-slow down search and often produce   duplicate results in search. Worse,
-some coding styles proposed in the  OWL documents introduce huge amounts
-of duplicate triples. We cannot  simply  ignore   a  triple  if  it is a
-duplicate as a subsequent retract  would   delete  the final triple. For
-example, after loading two  files  that   contain  the  same  triple and
-unloading one of these files the database would be left without triples.
-
-mark_duplicate() searches the DB for  a   duplicate  triple and sets the
-flag is_duplicate on both. This flag is   used by rdf/3, where duplicate
-triples are stored into a  temporary  table   to  be  filtered  from the
-results by new_answer().
-
-(*) We pick the write generation of the current query. This may still be
-set higher, but that  that  may  only   lead  to  triples  being  marked
-duplicates that are not. By use this   conservatie approach, we can move
-mark_duplicate() into prelink_triple().
+  if ( (rc=prepare_loaded_triples(db, &ctx)) )
+  { add_graph_context gctx;
 
-TBD: Duplicate marks may be removed by   GC:  walk over all triples that
-are marked as duplicates and try to find the duplicate.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+    gctx.tail = PL_copy_term_ref(graphs);
+    gctx.head = PL_new_term_ref();
 
-static void
-mark_duplicate(rdf_db *db, triple *t, query *q)
-{ triple_walker tw;
-  triple *d;
-  const int indexed = BY_SPO;
-  lifespan qls;
-  lifespan *ls;
+    rc = ( for_atomset(&ctx.graph_table, append_graph_to_list, &gctx) &&
+	   PL_unify_nil(gctx.tail) );
 
-  if ( q )
-  { qls.born = queryWriteGen(q) + 1;		/* (*) */
-    qls.died = query_max_gen(q);
-    ls = &qls;
-  } else
-  { ls = &t->lifespan;
+    destroy_atomset(&ctx.graph_table);
   }
 
-  init_triple_walker(&tw, db, t, indexed);
-  while((d=next_triple(&tw)) && d != t)
-  { d = deref_triple(db, d);
-    DEBUG(3, Sdprintf("Possible duplicate: ");
-	     print_triple(d, PRT_NL|PRT_ADR));
-
-    if ( !overlap_lifespan(&d->lifespan, ls) )
-      continue;
+  if ( rc )
+  { query *q = open_query(db);
 
-    if ( match_triples(db, d, t, q, MATCH_DUPLICATE) )
-    { if ( !t->is_duplicate )
-      { t->is_duplicate = TRUE;
-	db->duplicates++;
-      }
-      if ( !d->is_duplicate )
-      { d->is_duplicate = TRUE;
-	db->duplicates++;
+    if ( !q->transaction )
+      load_frozen_triples(db, &ctx);
+    delete_loaded_triples(q, &ctx);
+    add_triples(q, ctx.triples.base, ctx.triples.top - ctx.triples.base);
+    close_query(q);
+    if ( ctx.graph )
+    { if ( ctx.has_digest )
+      { sum_digest(ctx.graph->digest, ctx.digest);
+	ctx.graph->md5 = TRUE;
       }
+      clear_modified(ctx.graph);
     }
+    if ( (rc=PL_cons_functor(ba_arg2, FUNCTOR_end1, graphs)) )
+      rc = rdf_broadcast(EV_LOAD, (void*)id, (void*)ba_arg2);
+    destroy_load_context(db, &ctx, FALSE);
+  } else
+  { rdf_broadcast(EV_LOAD, (void*)id, (void*)ATOM_error);
+    destroy_load_context(db, &ctx, TRUE);
   }
-  destroy_triple_walker(db, &tw);
-}
 
+  return rc;
+}
 
-static int
-update_duplicates(rdf_db *db)
-{ triple *t;
-  int count = 0;
 
-  simpleMutexLock(&db->locks.duplicates);
-  db->duplicates_up_to_date = FALSE;
-  db->maintain_duplicates = FALSE;
+/** rdf_db_file_graphs_(+Stream, -Graphs) is det.
+ *
+ * Read the graph directory of a version 4 file.  Graphs is a list of
+ * graph(Name, Triples, MD5), where MD5 is [] if the digest is not
+ * stored.  Only the header, atoms and graphs sections are read.
+*/
 
-  if ( db->duplicates )
-  { for(t=fetch_triple(db, db->by_none.head);
-	t;
-	t=triple_follow_hash(db, t, ICOL(BY_NONE)))
-    { if ( ++count % 10240 == 0 &&
-	   (PL_handle_signals() < 0 || db->resetting) )
+static foreign_t
+rdf_db_file_graphs(term_t stream, term_t graphs)
+{ rdf_db *db = rdf_current_db();
+  IOSTREAM *in;
+  ld_context ctx;
+  save4_section sect[SAVE4_SECTIONS];
+  unsigned char *atoms = NULL, *gdata = NULL;
+  uint64_t pos = strlen(SAVE_MAGIC)+1;
+  uint32_t flags;
+  int version;
+  int rc = FALSE;
 
-      { simpleMutexUnlock(&db->locks.duplicates);
-	return FALSE;			/* aborted */
-      }
-      t->is_duplicate = FALSE;
-    }
+  if ( !PL_get_stream_handle(stream, &in) )
+    return PL_type_error("stream", stream);
 
-    db->duplicates = 0;
+  memset(&ctx, 0, sizeof(ctx));
+  if ( !load_magic(in) )
+  { rc = PL_warning("Illegal RDF triple file");
+    goto out;
   }
+  if ( (version=(int)load_int(in)) != 4 )
+  { term_t v;
 
-  db->maintain_duplicates = TRUE;
+    rc = ( (v=PL_new_term_ref()) &&
+	   PL_put_integer(v, version) &&
+	   PL_domain_error("rdf_db_save_version", v) );
+    goto out;
+  }
+  if ( !load4_header(in, &pos, sect, &flags) ||
+       !load4_section(in, &pos, &sect[SAVE4_ATOMS], &atoms) ||
+       !load4_section(in, &pos, &sect[SAVE4_GRAPHS], &gdata) )
+  { rc = PL_warning("Illegal RDF triple file");
+    goto out;
+  }
+  switch(load4_atoms(db, &ctx, atoms, &sect[SAVE4_ATOMS]))
+  { case -1:
+      rc = PL_warning("Illegal RDF triple file");
+      goto out;
+    case FALSE:
+      rc = PL_resource_error("memory");
+      goto out;
+  }
 
-  for(t=fetch_triple(db, db->by_none.head);
-      t;
-      t=triple_follow_hash(db, t, ICOL(BY_NONE)))
-  { if ( ++count % 1024 == 0 &&
-	 PL_handle_signals() < 0 )
-    { db->maintain_duplicates = FALSE;		/* no point anymore */
-      simpleMutexUnlock(&db->locks.duplicates);
-      return FALSE;
+  { term_t tail = PL_copy_term_ref(graphs);
+    term_t head = PL_new_term_ref();
+    term_t md5  = PL_new_term_ref();
+    uint64_t i;
+
+    for(i=0; i<sect[SAVE4_GRAPHS].count; i++)
+    { const unsigned char *r = gdata + i*SAVE4_GRAPH_SIZE;
+      atom_t name = fetch_atom(&ctx, get_uint32(r));
+
+      PL_put_variable(md5);
+      if ( !name ||
+	   !PL_unify_list(tail, head, tail) ||
+	   !PL_unify_term(head,
+			  PL_FUNCTOR, FUNCTOR_graph3,
+			    PL_ATOM, name,
+			    PL_INT64, (int64_t)get_uint64(r+40),
+			    PL_TERM, md5) ||
+	   !( (get_uint32(r+8)&SAVE4_MD5)
+		? md5_unify_digest(md5, (md5_byte_t*)(r+24))
+		: PL_unify_nil(md5) ) )
+	goto out;
     }
-    mark_duplicate(db, t, NULL);
+    rc = PL_unify_nil(tail);
   }
 
-  db->duplicates_up_to_date = TRUE;
-  simpleMutexUnlock(&db->locks.duplicates);
+out:
+  PL_release_stream(in);
+  if ( atoms )
+    free(atoms);
+  if ( gdata )
+    free(gdata);
+  destroy_load_context(db, &ctx, FALSE);
 
-  return TRUE;
+  return rc;
 }
 
 
-static void
-start_duplicate_admin(rdf_db *db)
-{ db->maintain_duplicates = TRUE;
+		 /*******************************
+		 *	     TRIPLE SINK	*
+		 *******************************/
 
-  PL_call_predicate(NULL, PL_Q_NORMAL,
-		    PL_predicate("rdf_update_duplicates_thread", 0, "rdf_db"), 0);
-}
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Implementation of the C API defined in rdf_sink.h.  Triples are created
+as by rdf_assert/4 and collected in a buffer that is handed to
+add_triples() if it is full and when the sink is closed.  Adding a large
+batch avoids grabbing the write locks and stepping the generation for
+each triple.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+#define SINK_CHUNK_SIZE 10000
 
+struct rdf_sink
+{ rdf_db       *db;			/* Database we add to */
+  size_t	count;			/* # triples in buffer */
+  triple       *triples[SINK_CHUNK_SIZE];
+};
+
+
+static rdf_sink *
+sink_open(void)
+{ rdf_sink *s = malloc(sizeof(*s));
+
+  if ( s )
+  { s->db    = rdf_current_db();
+    s->count = 0;
+  }
+
+  return s;
+}
 
-		 /*******************************
-		 *	    TRANSACTIONS	*
-		 *******************************/
 
 static int
-put_begin_end(term_t t, functor_t be, int level)
-{ term_t av;
+sink_flush(rdf_sink *s)
+{ int rc = TRUE;
 
-  return ( (av = PL_new_term_ref()) &&
-	   PL_put_integer(av, level) &&
-	   PL_cons_functor_v(t, be, av) );
+  if ( s->count > 0 )
+  { query *q = open_query(s->db);
+
+    rc = add_triples(q, s->triples, s->count);
+    close_query(q);
+    s->count = 0;
+  }
+
+  return rc;
 }
 
 
-/** rdf_transaction(:Goal, +Id, +Options)
+static int
+sink_add(rdf_sink *s, triple *t, atom_t subject, atom_t predicate,
+	 atom_t graph, unsigned long line)
+{ rdf_db *db = s->db;
+
+  t->subject_id	 = ATOM_ID(subject);
+  t->predicate.r = lookup_predicate(db, predicate);
+  t->graph_id	 = ATOM_ID(graph);
+  t->line	 = line;
+  lock_atoms(db, t);
 
-Options:
+  s->triples[s->count++] = t;
+  if ( s->count == SINK_CHUNK_SIZE )
+    return sink_flush(s);
 
-  * generation(+Generation)
-  Determines query generation
-*/
+  return TRUE;
+}
 
-static foreign_t
-rdf_transaction(term_t goal, term_t id, term_t options)
-{ int rc;
-  rdf_db *db = rdf_current_db();
-  query *q;
-  triple_buffer added;
-  triple_buffer deleted;
-  triple_buffer updated;
-  snapshot *ss = NULL;
 
-  if ( !PL_get_nil(options) )
-  { term_t tail = PL_copy_term_ref(options);
-    term_t head = PL_new_term_ref();
-    term_t arg = PL_new_term_ref();
+static int
+sink_add_resource(rdf_sink *s,
+		  atom_t subject, atom_t predicate, atom_t object,
+		  atom_t graph, unsigned long line)
+{ triple *t = new_triple(s->db);
 
-    while( PL_get_list(tail, head, tail) )
-    { int arity;
-      atom_t name;
+  t->object.resource = object;
 
-      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
-	return PL_type_error("option", head);
-      _PL_get_arg(1, head, arg);
+  return sink_add(s, t, subject, predicate, graph, line);
+}
 
-      if ( name == ATOM_snapshot )
-      { if ( get_snapshot(arg, &ss) )
-	{ int ss_tid = snapshot_thread(ss);
 
-	  if ( ss_tid && ss_tid != PL_thread_self() )
-	    PL_permission_error("access", "rdf-snapshot", arg);
-	} else
-	{ atom_t a;
+static int
+sink_add_literal(rdf_sink *s,
+		 atom_t subject, atom_t predicate,
+		 atom_t value, int qualifier, atom_t lang_or_type,
+		 atom_t graph, unsigned long line)
+{ triple *t = new_triple(s->db);
+  literal *lit;
 
-	  if ( PL_get_atom(arg, &a) && a == ATOM_true )
-	    ss = SNAPSHOT_ANONYMOUS;
-	  else
-	    return PL_type_error("rdf_snapshot", arg);
-	}
-      }
-    }
-    if ( !PL_get_nil_ex(tail) )
-      return FALSE;
+  alloc_literal_triple(s->db, t);
+  lit = t->object.literal;
+  lit->objtype	    = OBJ_STRING;
+  lit->value.string = value;
+  if ( qualifier != Q_NONE )
+  { lit->qualifier    = qualifier;
+    lit->type_or_lang = lang_or_type;
   }
 
-  q = open_transaction(db, &added, &deleted, &updated, ss);
-  q->transaction_data.prolog_id = id;
-  rc = PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, PRED_call1, goal);
-
-  if ( rc )
-  { if ( !empty_transaction(q) )
-    { if ( ss )
-      { discard_transaction(q);
-      } else
-      { term_t be;
+  return sink_add(s, t, subject, predicate, graph, line);
+}
 
-	if ( !(be=PL_new_term_ref()) ||
-	     !put_begin_end(be, FUNCTOR_begin1, 0) ||
-	     !rdf_broadcast(EV_TRANSACTION, (void*)id, (void*)be) ||
-	     !put_begin_end(be, FUNCTOR_end1, 0) )
-	  return FALSE;
 
-	commit_transaction(q);
+static int
+sink_close(rdf_sink *s, int flush)
+{ int rc = TRUE;
 
-	if ( !rdf_broadcast(EV_TRANSACTION, (void*)id, (void*)be) )
-	  return FALSE;
-      }
-    } else
-    { close_transaction(q);
-    }
+  if ( flush )
+  { rc = sink_flush(s);
   } else
-  { discard_transaction(q);
+  { size_t i;
+
+    for(i=0; i<s->count; i++)
+      free_triple(s->db, s->triples[i], FALSE);
   }
 
+  free(s);
+
   return rc;
 }
 
-		 /*******************************
-		 *	     PREDICATES		*
-		 *******************************/
 
-/** rdf_active_transactions_(-List)
+static rdf_sink_api sink_api =
+{ RDF_SINK_API_VERSION,
+  sink_open,
+  sink_add_resource,
+  sink_add_literal,
+  sink_close
+};
 
-Provides list of parent transactions in the calling thread
+
+/** rdf_sink_api_(-Address) is det.
+ *
+ * Unify Address with the address of the rdf_sink_api structure.
 */
 
 static foreign_t
-rdf_active_transactions(term_t list)
-{ rdf_db *db = rdf_current_db();
-  query *q = open_query(db);
-  term_t tail = PL_copy_term_ref(list);
-  term_t head = PL_new_term_ref();
-  query *t;
+rdf_sink_api_(term_t address)
+{ return PL_unify_pointer(address, &sink_api);
+}
 
-  for(t = q->transaction; t; t=t->transaction)
-  { if ( !PL_unify_list(tail, head, tail) ||
-         !PL_unify(head, t->transaction_data.prolog_id) )
-    { close_query(q);
-      return FALSE;
-    }
-  }
-
-  close_query(q);
 
-  return PL_unify_nil(tail);
-}
+#ifdef WITH_MD5
+		 /*******************************
+		 *	     MD5 SUPPORT	*
+		 *******************************/
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-(*) rdf_assert(S,P,O,G) adds a triple, but does not do so if exactly the
-same quintuple is visible and not  yet   erased.  Adding  would not make
-sense as this would be a complete duplicate that cannot be distinguished
-from the original and rdf_retractall/4 will erase both.
+/* md5_type is used to keep the MD5 independent from the internal
+   numbers
+*/
+static const char md5_type[] =
+{ 0x0,					/* OBJ_UNKNOWN */
+  0x3,					/* OBJ_INTEGER */
+  0x4,					/* OBJ_DOUBLE */
+  0x2,					/* OBJ_STRING */
+  0x5					/* OBJ_TERM */
+};
 
-Note that full duplicates are  quite  common   as  a  result  of forward
-reasoning.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+static void
+md5_triple(triple *t, md5_byte_t *digest)
+{ md5_state_t state;
+  size_t len;
+  md5_byte_t tmp[2];
+  const char *s;
+  literal *lit;
 
-static foreign_t
-rdf_assert4(term_t subject, term_t predicate, term_t object, term_t src)
-{ rdf_db *db = rdf_current_db();
-  triple *t = new_triple(db);
-  query *q = open_query(db);
-  triple *d;
-  triple_walker tw;
+  md5_init(&state);
+  s = PL_blob_data(ID_ATOM(t->subject_id), &len, NULL);
+  md5_append(&state, (const md5_byte_t *)s, (int)len);
+  md5_append(&state, (const md5_byte_t *)"P", 1);
+  s = PL_blob_data(t->predicate.r->name, &len, NULL);
+  md5_append(&state, (const md5_byte_t *)s, (int)len);
+  tmp[0] = 'O';
+  if ( t->object_is_literal )
+  { lit = t->object.literal;
+    tmp[1] = md5_type[lit->objtype];
 
-  if ( !get_triple(db, subject, predicate, object, t, q) )
-  { error:
-    free_triple(db, t, FALSE);
-    close_query(q);
-    return FALSE;
-  }
-  if ( src )
-  { if ( !get_graph(src, t) )
-      goto error;
+    switch(lit->objtype)
+    { case OBJ_STRING:
+	s = PL_blob_data(lit->value.string, &len, NULL);
+	break;
+      case OBJ_INTEGER:			/* TBD: byte order issues */
+	s = (const char *)&lit->value.integer;
+	len = sizeof(lit->value.integer);
+	break;
+      case OBJ_DOUBLE:
+	s = (const char *)&lit->value.real;
+	len = sizeof(lit->value.real);
+	break;
+      case OBJ_TERM:
+	s = (const char *)lit->value.term.record;
+	len = lit->value.term.len;
+	break;
+      default:
+	assert(0);
+    }
   } else
-  { t->graph_id = ATOM_ID(ATOM_user);
-    t->line = NO_LINE;
+  { s = PL_blob_data(t->object.resource, &len, NULL);
+    tmp[1] = 0x1;			/* old OBJ_RESOURCE */
+    lit = NULL;
   }
-
-  init_triple_walker(&tw, db, t, BY_SPO);
-  while((d=next_triple(&tw)))
-  { if ( (d=alive_triple(q, d)) && !d->erased )		/* (*) */
-    { if ( match_triples(db, d, t, q, MATCH_DUPLICATE|MATCH_SRC) &&
-	   d->line == t->line )
-      { destroy_triple_walker(db, &tw);
-	free_triple(db, t, FALSE);
-	close_query(q);
-
-	return TRUE;
-      }
-    }
+  md5_append(&state, tmp, 2);
+  md5_append(&state, (const md5_byte_t *)s, (int)len);
+  if ( lit && lit->qualifier )
+  { assert(lit->type_or_lang);
+    md5_append(&state,
+	       (const md5_byte_t *)(lit->qualifier == Q_LANG ? "l" : "t"),
+	       1);
+    s = PL_blob_data(lit->type_or_lang, &len, NULL);
+    md5_append(&state, (const md5_byte_t *)s, (int)len);
+  }
+  if ( t->graph_id )
+  { md5_append(&state, (const md5_byte_t *)"S", 1);
+    s = PL_blob_data(ID_ATOM(t->graph_id), &len, NULL);
+    md5_append(&state, (const md5_byte_t *)s, (int)len);
   }
-  destroy_triple_walker(db, &tw);
 
-  lock_atoms(db, t);
+  md5_finish(&state, digest);
+}
 
-  add_triples(q, &t, 1);
-  close_query(q);
 
-  return TRUE;
+static void
+sum_digest(md5_byte_t *digest, md5_byte_t *add)
+{ md5_byte_t *p, *q;
+  int n;
+
+  for(p=digest, q=add, n=16; --n>=0; )
+    *p++ += *q++;
 }
 
 
-static foreign_t
-rdf_assert3(term_t subject, term_t predicate, term_t object)
-{ return rdf_assert4(subject, predicate, object, 0);
-}
+static void
+dec_digest(md5_byte_t *digest, md5_byte_t *add)
+{ md5_byte_t *p, *q;
+  int n;
 
+  for(p=digest, q=add, n=16; --n>=0; )
+    *p++ -= *q++;
+}
 
-static void	free_search_state(search_state *state);
 
 static int
-init_cursor_from_literal(search_state *state, literal *cursor)
-{ triple *p = &state->pattern;
-  size_t iv;
-
-  DEBUG(3,
-	Sdprintf("Trying literal search for ");
-	print_literal(cursor);
-	Sdprintf("\n"));
+md5_unify_digest(term_t t, md5_byte_t digest[16])
+{ char hex_output[16*2];
+  int di;
+  char *pi;
+  static char hexd[] = "0123456789abcdef";
 
-  p->indexed |= BY_O;
-  p->indexed &= ~BY_G;			/* No graph indexing supported */
-  if ( p->indexed == BY_SO )
-  { p->indexed = BY_S;			/* we do not have index BY_SO */
-    init_triple_walker(&state->cursor, state->db, p, p->indexed);
-    return FALSE;
+  for(pi=hex_output, di = 0; di < 16; ++di)
+  { *pi++ = hexd[(digest[di] >> 4) & 0x0f];
+    *pi++ = hexd[digest[di] & 0x0f];
   }
 
-  iv = literal_hash(cursor);		/* see also triple_hash_key() */
-  if ( p->indexed&BY_S ) iv ^= subject_hash(p);
-  if ( p->indexed&BY_P ) iv ^= predicate_hash(p->predicate.r);
-
-  init_triple_literal_walker(&state->cursor, state->db, p, p->indexed, iv);
-  state->has_literal_state = TRUE;
-  state->literal_cursor = cursor;
-
-  return TRUE;
+  return PL_unify_atom_nchars(t, 16*2, hex_output);
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-init_search_state(search_state *state, query *q)
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
-
-static int
-init_search_state(search_state *state, query *query)
-{ triple *p = &state->pattern;
+static foreign_t
+rdf_md5(term_t graph_name, term_t md5)
+{ atom_t src;
+  int rc;
+  rdf_db *db = rdf_current_db();
 
-  if ( get_partial_triple(state->db,
-			  state->subject, state->predicate, state->object,
-			  state->src, p) != TRUE )
-  { free_triple(state->db, p, FALSE);
+  if ( !get_atom_or_var_ex(graph_name, &src) )
     return FALSE;
-  }
 
-  if ( (p->match == STR_MATCH_PREFIX ||	p->match == STR_MATCH_LIKE) &&
-       p->indexed != BY_SP &&
-       (state->prefix = first_atom(p->object.literal->value.string, p->match)))
-  { literal lit;
-    literal **rlitp;
+  if ( src )
+  { graph *s;
 
-    lit = *p->object.literal;
-    lit.value.string = state->prefix;
-    state->lit_ex.literal = &lit;
-    prepare_literal_ex(&state->lit_ex);
-    rlitp = skiplist_find_first(&state->db->literals,
-				&state->lit_ex, &state->literal_state);
-    if ( rlitp )
-    { if ( init_cursor_from_literal(state, *rlitp) )
-      { state->restart_lit = *rlitp;
-	state->restart_lit_state = state->literal_state;
-      }
+    if ( (s = existing_graph(db, src)) && !s->erased )
+    { rc = md5_unify_digest(md5, s->digest);
     } else
-    { free_search_state(state);
-      return FALSE;
+    { md5_byte_t digest[16];
+
+      memset(digest, 0, sizeof(digest));
+      rc = md5_unify_digest(md5, digest);
     }
-  } else if ( p->indexed != BY_SP && p->match >= STR_MATCH_LE )
-  { literal **rlitp;
+  } else
+  { md5_byte_t digest[16];
+    int i;
 
-    state->lit_ex.literal = p->object.literal;
-    prepare_literal_ex(&state->lit_ex);
+    memset(&digest, 0, sizeof(digest));
+    for(i=0; i<db->graphs.bucket_count; i++)
+    { graph *g = db->graphs.blocks[MSB(i)][i];
 
-    switch(p->match)
-    { case STR_MATCH_LE:
-	rlitp = skiplist_find_first(&state->db->literals,
-				    NULL, &state->literal_state);
-        break;
-      case STR_MATCH_GE:
-	rlitp = skiplist_find_first(&state->db->literals,
-				    &state->lit_ex, &state->literal_state);
-        break;
-      case STR_MATCH_BETWEEN:
-	rlitp = skiplist_find_first(&state->db->literals,
-				    &state->lit_ex, &state->literal_state);
-        state->lit_ex.literal = &p->tp.end;
-	prepare_literal_ex(&state->lit_ex);
-        break;
-      default:
-	assert(0);
-        return FALSE;
+      for( ; g; g = g->next )
+	sum_digest(digest, g->digest);
     }
 
-    if ( rlitp )
-    { if ( init_cursor_from_literal(state, *rlitp) )
-      {	state->restart_lit = *rlitp;
-	state->restart_lit_state = state->literal_state;
-      }
-    } else
-    { free_search_state(state);
-      return FALSE;
-    }
-  } else
-  { init_triple_walker(&state->cursor, state->db, p, p->indexed);
+    return md5_unify_digest(md5, digest);
   }
 
-  return TRUE;
+  return rc;
 }
 
 
-static void
-free_search_state(search_state *state)
-{ if ( state->query )
-    close_query(state->query);
-
-  free_triple(state->db, &state->pattern, FALSE);
-  destroy_triple_walker(state->db, &state->cursor);
-  if ( !state->db->maintain_duplicates &&
-       state->dup_answers.count > state->db->duplicate_admin_threshold )
-    start_duplicate_admin(state->db);
-  destroy_tripleset(&state->dup_answers);
+static foreign_t
+rdf_atom_md5(term_t text, term_t times, term_t md5)
+{ char *s;
+  int n, i;
+  size_t len;
+  md5_byte_t digest[16];
 
-  if ( state->prefix )
-    PL_unregister_atom(state->prefix);
-}
+  if ( !PL_get_nchars(text, &len, &s, CVT_ALL|REP_UTF8|CVT_EXCEPTION) )
+    return FALSE;
+  if ( !PL_get_integer_ex(times, &n) )
+    return FALSE;
+  if ( n < 1 )
+    return PL_domain_error("positive_integer", times);
 
+  for(i=0; i<n; i++)
+  { md5_state_t state;
+    md5_init(&state);
+    md5_append(&state, (const md5_byte_t *)s, (int)len);
+    md5_finish(&state, digest);
+    s = (char *)digest;
+    len = sizeof(digest);
+  }
 
-static foreign_t
-allow_retry_state(search_state *state)
-{ PL_retry_address(state);
+  return md5_unify_digest(md5, digest);
 }
 
 
-static int
-new_answer(search_state *state, triple *t)
-{ if ( !t->is_duplicate && state->db->duplicates_up_to_date )
-    return TRUE;
 
-  return add_tripleset(state, &state->dup_answers, t);
+#endif /*WITH_MD5*/
+
+
+		 /*******************************
+		 *	       ATOMS		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Lock atoms in triple against AGC. Note that the predicate name is locked
+in the predicate structure.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+lock_atoms(rdf_db *db, triple *t)
+{ if ( !t->atoms_locked )
+  { t->atoms_locked = TRUE;
+
+    register_resource(&db->resources, ID_ATOM(t->subject_id));
+    if ( t->object_is_literal )
+    { lock_atoms_literal(t->object.literal);
+    } else
+    { register_resource(&db->resources, t->object.resource);
+    }
+  }
 }
 
 
-static triple *
-is_candidate(search_state *state, triple *t)
-{ if ( !(t=alive_triple(state->query, t)) )
-    return NULL;
-					/* hash-collision, skip */
-  if ( state->has_literal_state )
-  { if ( !(t->object_is_literal &&
-	   t->object.literal == state->literal_cursor) )
-      return NULL;
+static void
+unlock_atoms(rdf_db *db, triple *t)
+{ if ( t->atoms_locked )
+  { t->atoms_locked = FALSE;
+
+    unregister_resource(&db->resources, ID_ATOM(t->subject_id));
+    if ( t->object_is_literal )
+    { if ( !t->object.literal->shared )
+	unlock_atoms_literal(t->object.literal);
+    } else
+    { unregister_resource(&db->resources, t->object.resource);
+    }
   }
+}
 
-  if ( !match_triples(state->db, t, &state->pattern, state->query, state->flags) )
-    return NULL;
 
-  if ( !state->src )				/* with source, we report */
-  { if ( !new_answer(state, t) )		/* duplicates */
-      return NULL;
+		 /*******************************
+		 *      PROLOG CONVERSION	*
+		 *******************************/
+
+#define LIT_TYPED	0x1
+#define LIT_NOERROR	0x2
+#define LIT_PARTIAL	0x4
+
+static int
+get_lit_atom_ex(term_t t, atom_t *a, int flags)
+{ if ( PL_get_atom(t, a) )
+    return TRUE;
+  if ( (flags & LIT_PARTIAL) && PL_is_variable(t) )
+  { *a = 0L;
+    return TRUE;
   }
 
-  return t;
+  return PL_type_error("atom", t);
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-next_sub_property() advances the triple-walker to walk over an alternate
-hash of the cloud.
-
-  - If the cloud doesn't have ->alt_hashes, all related predicates have
-    the same hash, and we are done.
-  - If the cloud does have ->alt_hashes, we must walk the
-    alt-hashes.  We do not need to walk hashes that do not use
-    sub-properties of the target.  This is implemented using
-    hash_holds_candidates().
-
-TBD: How expensive is hash_holds_candidates(). Maybe  we should only try
-that if there are many candidates  in the hash-chains? Alternatively, we
-can keep a list of predicates that uses  a particular alt-hash, so we do
-not have to scan the whole cloud each time.
+get_literal() processes the argument  of  a   literal/1  term  passes as
+object.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
 static int
-hash_holds_candidates(rdf_db *db, unsigned int hash,
-		      predicate *p, predicate_cloud *pc,
-		      query *q)
-{ predicate **pp  = pc->members;
-  predicate **end = &pp[pc->size];
+get_literal(rdf_db *db, term_t litt, literal *lit, int flags)
+{ if ( PL_get_atom(litt, &lit->value.string) )
+  { lit->objtype = OBJ_STRING;
+  } else if ( PL_is_integer(litt) && PL_get_int64(litt, &lit->value.integer) )
+  { lit->objtype = OBJ_INTEGER;
+  } else if ( PL_get_float(litt, &lit->value.real) )
+  { lit->objtype = OBJ_DOUBLE;
+  } else if ( PL_is_functor(litt, FUNCTOR_lang2) )
+  { term_t a = PL_new_term_ref();
 
-  for(; pp<end; pp++)
-  { predicate *p2 = *pp;
+    _PL_get_arg(1, litt, a);
+    if ( !get_lit_atom_ex(a, &lit->type_or_lang, flags) )
+      return FALSE;
+    _PL_get_arg(2, litt, a);
+    if ( !get_lit_atom_ex(a, &lit->value.string, flags) )
+      return FALSE;
 
-    if ( p2->hash == hash && isSubPropertyOf(db, p2, p, q) )
-    { DEBUG(1, Sdprintf("\thash 0x%x: <%s rdfs:subPropertyOf %s>\n",
-			hash, pname(p2), pname(p)));
-      return TRUE;
-    }
+    lit->qualifier = Q_LANG;
+    lit->objtype = OBJ_STRING;
+  } else if ( PL_is_functor(litt, FUNCTOR_type2) &&
+	      !(flags & LIT_TYPED) )	/* avoid recursion */
+  { term_t a = PL_new_term_ref();
+
+    _PL_get_arg(1, litt, a);
+    if ( !get_lit_atom_ex(a, &lit->type_or_lang, flags) )
+      return FALSE;
+    lit->qualifier = Q_TYPE;
+    _PL_get_arg(2, litt, a);
+
+    return get_literal(db, a, lit, LIT_TYPED|flags);
+  } else if ( !PL_is_ground(litt) )
+  { if ( !(flags & LIT_PARTIAL) )
+      return PL_type_error("rdf_object", litt);
+    if ( !PL_is_variable(litt) )
+      lit->objtype = OBJ_TERM;
+  } else
+  { lit->value.term.record = PL_record_external(litt, &lit->value.term.len);
+    lit->objtype = OBJ_TERM;
   }
 
-  return FALSE;
+  return TRUE;
 }
 
 
 static int
-next_sub_property(search_state *state)
-{ if ( (state->flags & MATCH_SUBPROPERTY) )
-  { triple *p = &state->pattern;
-    triple_walker *tw = &state->cursor;
-    predicate_cloud *pc;
-
-    if ( !(pc=state->p_cloud) )
-    { if ( !p->predicate.r )		/* no pred on rdf_has(?,-,?) */
-	return FALSE;
+get_object(rdf_db *db, term_t object, triple *t)
+{ if ( PL_get_atom(object, &t->object.resource) )
+  { assert(!t->object_is_literal);
+  } else if ( PL_is_functor(object, FUNCTOR_literal1) )
+  { term_t a = PL_new_term_ref();
 
-      if ( is_leaf_predicate(state->db, p->predicate.r, state->query) )
-	return FALSE;
+    _PL_get_arg(1, object, a);
+    alloc_literal_triple(db, t);
+    return get_literal(db, a, t->object.literal, 0);
+  } else
+    return PL_type_error("rdf_object", object);
 
-      if ( p->predicate.r->cloud->alt_hash_count )
-      { pc = state->p_cloud = p->predicate.r->cloud;
+  return TRUE;
+}
 
-	DEBUG(1, Sdprintf("%d alt hashes; first was 0x%x\n",
-			  p->predicate.r->cloud->alt_hash_count,
-			  predicate_hash(p->predicate.r)));
-	tw->unbounded_hash ^= predicate_hash(p->predicate.r);
-	state->alt_hash_cursor = 0;
-      } else
-	return FALSE;			/* Cloud has only one hash */
-    } else
-    { tw->unbounded_hash ^= pc->alt_hashes[state->alt_hash_cursor];
-      state->alt_hash_cursor++;
-    }
 
-    for( ; state->alt_hash_cursor < pc->alt_hash_count; state->alt_hash_cursor++)
-    { unsigned new_hash = pc->alt_hashes[state->alt_hash_cursor];
+static int
+get_src(term_t src, triple *t)
+{ if ( src && !PL_is_variable(src) )
+  { atom_t at;
 
-      if ( new_hash != predicate_hash(p->predicate.r) &&
-	   hash_holds_candidates(state->db, new_hash,
-				 p->predicate.r, pc, state->query) )
-      { DEBUG(1, Sdprintf("Retrying with alt-hash %d (0x%x)\n",
-			  state->alt_hash_cursor, new_hash));
-	tw->unbounded_hash ^= new_hash;
-	rewind_triple_walker(tw);
+    if ( PL_get_atom(src, &at) )
+    { t->graph_id = ATOM_ID(at);
+      t->line = NO_LINE;
+    } else if ( PL_is_functor(src, FUNCTOR_colon2) )
+    { term_t a = PL_new_term_ref();
+      long line;
 
-	return TRUE;
-      }
-    }
+      _PL_get_arg(1, src, a);
+      if ( !get_atom_or_var_ex(a, &at) )
+	return FALSE;
+      t->graph_id = ATOM_ID(at);
+      _PL_get_arg(2, src, a);
+      if ( PL_get_long(a, &line) )
+	t->line = line;
+      else if ( !PL_is_variable(a) )
+	return PL_type_error("integer", a);
+    } else
+      return PL_type_error("rdf_graph", src);
   }
 
-  return FALSE;
+  return TRUE;
 }
 
 
-/* next_pattern() advances the pattern for the next query.  This is done
-   for matches that deal with matching inverse properties and matches
-   that deal with literal ranges (prefix, between, etc.)
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Return values:
+	-1: exception
+	 0: no predicate
+	 1: the predicate
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-   Note that inverse and literal enumeration are mutually exclusive (as
-   long as we do not have literal subjects ...).
+static int
+get_existing_predicate(rdf_db *db, term_t t, predicate **p)
+{ atom_t name;
+
+  if ( !PL_get_atom(t, &name ) )
+  { if ( PL_is_functor(t, FUNCTOR_literal1) )
+      return 0;				/* rdf(_, literal(_), _) */
+    return PL_type_error("atom", t);
+  }
+
+  if ( (*p = existing_predicate(db, name)) )
+    return 1;
+
+  DEBUG(5, Sdprintf("No predicate %s\n", PL_atom_chars(name)));
+  return 0;				/* no predicate */
+}
+
+
+static int
+get_predicate(rdf_db *db, term_t t, predicate **p, query *q)
+{ atom_t name;
+
+  if ( !PL_get_atom_ex(t, &name ) )
+    return FALSE;
+
+  *p = lookup_predicate(db, name);
+  return TRUE;
+}
+
+
+static int
+get_triple(rdf_db *db,
+	   term_t subject, term_t predicate, term_t object,
+	   triple *t, query *q)
+{ atom_t at;
+
+  if ( !PL_get_atom_ex(subject, &at) ||
+       !get_predicate(db, predicate, &t->predicate.r, q) ||
+       !get_object(db, object, t) )
+    return FALSE;
+
+  t->subject_id = ATOM_ID(at);
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+get_partial_triple() creates a triple  for   matching  purposes.  It can
+return FALSE for  two  reasons.  Mostly   (type)  errors,  but  also  if
+resources are accessed that do not   exist  and therefore the subsequent
+matching will always fail. This  is   notably  the  case for predicates,
+which are first class citizens to this library.
+
+Return values:
+	1: ok
+	0: no predicate
+       -1: error
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+get_partial_triple(rdf_db *db,
+		   term_t subject, term_t predicate, term_t object,
+		   term_t src, triple *t)
+{ int rc;
+  int ipat = 0;
+
+  if ( subject )
+  { atom_t at;
+
+    if ( !get_resource_or_var_ex(subject, &at) )
+      return FALSE;
+    t->subject_id = ATOM_ID(at);
+  }
+  if ( !PL_is_variable(predicate) &&
+       (rc=get_existing_predicate(db, predicate, &t->predicate.r)) != 1 )
+    return rc;
+					/* the object */
+  if ( object && !PL_is_variable(object) )
+  { if ( PL_get_atom(object, &t->object.resource) )
+    { assert(!t->object_is_literal);
+    } else if ( PL_is_functor(object, FUNCTOR_literal1) )
+    { term_t a = PL_new_term_ref();
+
+      _PL_get_arg(1, object, a);
+      alloc_literal_triple(db, t);
+      if ( !get_literal(db, a, t->object.literal, LIT_PARTIAL) )
+	return FALSE;
+    } else if ( PL_is_functor(object, FUNCTOR_literal2) )
+    { term_t a = PL_new_term_ref();
+      literal *lit;
+
+      alloc_literal_triple(db, t);
+      lit = t->object.literal;
+
+      _PL_get_arg(1, object, a);
+      if ( PL_is_functor(a, FUNCTOR_exact1) )
+	t->match = STR_MATCH_EXACT;
+      else if ( PL_is_functor(a, FUNCTOR_plain1) )
+	t->match = STR_MATCH_PLAIN;
+      else if ( PL_is_functor(a, FUNCTOR_substring1) )
+	t->match = STR_MATCH_SUBSTRING;
+      else if ( PL_is_functor(a, FUNCTOR_word1) )
+	t->match = STR_MATCH_WORD;
+      else if ( PL_is_functor(a, FUNCTOR_prefix1) )
+	t->match = STR_MATCH_PREFIX;
+      else if ( PL_is_functor(a, FUNCTOR_like1) )
+	t->match = STR_MATCH_LIKE;
+      else if ( PL_is_functor(a, FUNCTOR_le1) )
+	t->match = STR_MATCH_LE;
+      else if ( PL_is_functor(a, FUNCTOR_ge1) )
+	t->match = STR_MATCH_GE;
+      else if ( PL_is_functor(a, FUNCTOR_between2) )
+      { term_t e = PL_new_term_ref();
+
+	_PL_get_arg(2, a, e);
+	memset(&t->tp.end, 0, sizeof(t->tp.end));
+	if ( !get_literal(db, e, &t->tp.end, 0) )
+	  return FALSE;
+	t->match = STR_MATCH_BETWEEN;
+      } else
+	return PL_domain_error("match_type", a);
+
+      _PL_get_arg(1, a, a);
+      if ( t->match >= STR_MATCH_LE )
+      { if ( !get_literal(db, a, lit, 0) )
+	  return FALSE;
+      } else
+      { if ( !PL_get_atom_ex(a, &lit->value.string) )
+	  return FALSE;
+	lit->objtype = OBJ_STRING;
+      }
+    } else
+      return PL_type_error("rdf_object", object);
+  }
+					/* the graph */
+  if ( !get_src(src, t) )
+    return FALSE;
+
+  if ( t->subject_id )
+    ipat |= BY_S;
+  if ( t->predicate.r )
+    ipat |= BY_P;
+  if ( t->object_is_literal )
+  { literal *lit = t->object.literal;
+
+    switch( lit->objtype )
+    { case OBJ_UNTYPED:
+	break;
+      case OBJ_STRING:
+	if ( lit->objtype == OBJ_STRING )
+	{ if ( lit->value.string &&
+	       t->match <= STR_MATCH_EXACT )
+	    ipat |= BY_O;
+	}
+        break;
+      case OBJ_INTEGER:
+      case OBJ_DOUBLE:
+	ipat |= BY_O;
+        break;
+      case OBJ_TERM:
+	if ( PL_is_ground(object) )
+	  ipat |= BY_O;
+        break;
+      default:
+	assert(0);
+    }
+  } else if ( t->object.resource )
+  { ipat |= BY_O;
+  }
+  if ( t->graph_id )
+    ipat |= BY_G;
+
+  db->indexed[ipat]++;			/* statistics */
+  t->indexed = db->indexes.alt[ipat];
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+inverse_partial_triple(triple *t) inverses a triple   by swapping object
+and subject and replacing the predicate with its inverse.
+
+TBD: In many cases we can  compute   the  hash  more efficiently than by
+simply recomputing it:
+
+  - Change predicate: x-or with old and new predicate hash
+  - swap S<->O if the other is known is a no-op wrt the hash.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+inverse_partial_triple(triple *t)
+{ predicate *i;
+
+  if ( !t->inversed &&
+       (!(i=t->predicate.r) || (i=t->predicate.r->inverse_of)) &&
+       !t->object_is_literal )
+  { atom_t o = t->object.resource;
+
+    t->object.resource = ID_ATOM(t->subject_id);
+    t->subject_id = ATOM_ID(o);
+
+    if ( t->predicate.r )
+      t->predicate.r = i;
+
+    t->indexed  = by_inverse[t->indexed];
+    t->inversed = TRUE;
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+static int
+get_graph(term_t src, triple *t)
+{ atom_t at;
+
+  if ( PL_get_atom(src, &at) )
+  { t->line = NO_LINE;
+    t->graph_id = ATOM_ID(at);
+    return TRUE;
+  }
+
+  if ( PL_is_functor(src, FUNCTOR_colon2) )
+  { term_t a = PL_new_term_ref();
+    long line;
+
+    _PL_get_arg(1, src, a);
+    if ( !PL_get_atom_ex(a, &at) )
+      return FALSE;
+    t->graph_id = ATOM_ID(at);
+    _PL_get_arg(2, src, a);
+    if ( !PL_get_long_ex(a, &line) )
+      return FALSE;
+    t->line = line;
+
+    return TRUE;
+  }
+
+  return PL_type_error("rdf_graph", src);
+}
+
+
+static int
+unify_graph(term_t src, triple *t)
+{ switch( PL_term_type(src) )
+  { case PL_VARIABLE:
+    { if ( t->line == NO_LINE )
+	return PL_unify_atom(src, ID_ATOM(t->graph_id));
+      else
+	goto full_term;
+    }
+    case PL_ATOM:
+    { atom_t a;
+      return (PL_get_atom(src, &a) &&
+	      a == ID_ATOM(t->graph_id));
+    }
+    case PL_TERM:
+    { if ( t->line == NO_LINE )
+      { return PL_unify_term(src,
+			     PL_FUNCTOR, FUNCTOR_colon2,
+			       PL_ATOM, ID_ATOM(t->graph_id),
+			       PL_VARIABLE);
+      } else
+      { full_term:
+	return PL_unify_term(src,
+			     PL_FUNCTOR, FUNCTOR_colon2,
+			       PL_ATOM,  ID_ATOM(t->graph_id),
+			       PL_INT64, (int64_t)t->line); /* line is uint32_t */
+      }
+    }
+    default:
+      return PL_type_error("rdf_graph", src);
+  }
+}
+
+
+static int
+same_graph(triple *t1, triple *t2)
+{ return t1->line     == t2->line &&
+         t1->graph_id == t2->graph_id;
+}
+
+
+
+static int
+put_literal_value(term_t v, literal *lit)
+{ switch(lit->objtype)
+  { case OBJ_STRING:
+      PL_put_atom(v, lit->value.string);
+      break;
+    case OBJ_INTEGER:
+      PL_put_variable(v);
+      return PL_unify_int64(v, lit->value.integer);
+    case OBJ_DOUBLE:
+      return PL_put_float(v, lit->value.real);
+    case OBJ_TERM:
+      return PL_recorded_external(lit->value.term.record, v);
+    default:
+      assert(0);
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+static int
+unify_literal(term_t lit, literal *l)
+{ term_t v = PL_new_term_ref();
+
+  if ( !put_literal_value(v, l) )
+    return FALSE;
+
+  if ( l->qualifier )
+  { functor_t qf;
+
+    assert(l->type_or_lang);
+
+    if ( l->qualifier == Q_LANG )
+      qf = FUNCTOR_lang2;
+    else
+      qf = FUNCTOR_type2;
+
+    if ( PL_unify_term(lit, PL_FUNCTOR, qf,
+			 PL_ATOM, l->type_or_lang,
+			 PL_TERM, v) )
+      return TRUE;
+
+    if ( PL_exception(0) )
+      return FALSE;
+
+    return PL_unify(lit, v);		/* allow rdf(X, Y, literal(foo)) */
+  } else if ( PL_unify(lit, v) )
+  { return TRUE;
+  } else if ( PL_is_functor(lit, FUNCTOR_lang2) &&
+	      l->objtype == OBJ_STRING )
+  { term_t a = PL_new_term_ref();
+    _PL_get_arg(2, lit, a);
+    return PL_unify(a, v);
+  } else if ( PL_is_functor(lit, FUNCTOR_type2) )
+  { term_t a = PL_new_term_ref();
+    _PL_get_arg(2, lit, a);
+    return PL_unify(a, v);
+  } else
+    return FALSE;
+}
+
+
+
+static int
+unify_object(term_t object, triple *t)
+{ if ( t->object_is_literal )
+  { term_t lit = PL_new_term_ref();
+
+    if ( PL_unify_functor(object, FUNCTOR_literal1) )
+      _PL_get_arg(1, object, lit);
+    else if ( PL_is_functor(object, FUNCTOR_literal2) )
+      _PL_get_arg(2, object, lit);
+    else
+      return FALSE;
+
+    return unify_literal(lit, t->object.literal);
+  } else
+  { return PL_unify_atom(object, t->object.resource);
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+TRUE:  ok
+FALSE: failure
+ERROR: error
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+unify_triple(term_t subject, term_t pred, term_t object,
+	     term_t src, triple *t, int inversed)
+{ predicate *p = t->predicate.r;
+  fid_t fid = PL_open_foreign_frame();
+  int rc;
+
+  if ( inversed )
+  { term_t tmp = object;
+    object = subject;
+    subject = tmp;
+
+    rc = !pred || PL_unify_term(pred,
+				PL_FUNCTOR, FUNCTOR_inverse_of1,
+				  PL_ATOM, p->name);
+  } else
+  { rc = !pred || PL_unify_atom(pred, p->name);
+  }
+
+  if ( !rc ||
+       !PL_unify_atom(subject, ID_ATOM(t->subject_id)) ||
+       !unify_object(object, t) ||
+       (src && !unify_graph(src, t)) )
+  { if ( PL_exception(0) )
+    { PL_close_foreign_frame(fid);
+      return ERROR;
+    }
+
+    PL_discard_foreign_frame(fid);
+    return FALSE;
+  } else
+  { PL_close_foreign_frame(fid);
+    return TRUE;
+  }
+}
+
+
+		 /*******************************
+		 *	DUPLICATE HANDLING	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+According to the RDF specs, duplicate triples  have no meaning, but they
+slow down search and often produce   duplicate results in search. Worse,
+some coding styles proposed in the  OWL documents introduce huge amounts
+of duplicate triples. We cannot  simply  ignore   a  triple  if  it is a
+duplicate as a subsequent retract  would   delete  the final triple. For
+example, after loading two  files  that   contain  the  same  triple and
+unloading one of these files the database would be left without triples.
+
+mark_duplicate() searches the DB for  a   duplicate  triple and sets the
+flag is_duplicate on both. This flag is   used by rdf/3, where duplicate
+triples are stored into a  temporary  table   to  be  filtered  from the
+results by new_answer().
+
+(*) We pick the write generation of the current query. This may still be
+set higher, but that  that  may  only   lead  to  triples  being  marked
+duplicates that are not. By use this   conservatie approach, we can move
+mark_duplicate() into prelink_triple().
+
+TBD: Duplicate marks may be removed by   GC:  walk over all triples that
+are marked as duplicates and try to find the duplicate.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static void
+mark_duplicate(rdf_db *db, triple *t, query *q)
+{ triple_walker tw;
+  triple *d;
+  const int indexed = BY_SPO;
+  lifespan qls;
+  lifespan *ls;
+
+  if ( q )
+  { qls.born = queryWriteGen(q) + 1;		/* (*) */
+    qls.died = query_max_gen(q);
+    ls = &qls;
+  } else
+  { ls = &t->lifespan;
+  }
+
+  init_triple_walker(&tw, db, t, indexed);
+  while((d=next_triple(&tw)) && d != t)
+  { d = deref_triple(db, d);
+    DEBUG(3, Sdprintf("Possible duplicate: ");
+	     print_triple(d, PRT_NL|PRT_ADR));
+
+    if ( !overlap_lifespan(&d->lifespan, ls) )
+      continue;
+
+    if ( match_triples(db, d, t, q, MATCH_DUPLICATE) )
+    { if ( !t->is_duplicate )
+      { t->is_duplicate = TRUE;
+	db->duplicates++;
+      }
+      if ( !d->is_duplicate )
+      { d->is_duplicate = TRUE;
+	db->duplicates++;
+      }
+    }
+  }
+  destroy_triple_walker(db, &tw);
+}
+
+
+static int
+update_duplicates(rdf_db *db)
+{ triple *t;
+  int count = 0;
+
+  simpleMutexLock(&db->locks.duplicates);
+  db->duplicates_up_to_date = FALSE;
+  db->maintain_duplicates = FALSE;
+
+  if ( db->duplicates )
+  { for(t=fetch_triple(db, db->by_none.head);
+	t;
+	t=triple_follow_hash(db, t, ICOL(BY_NONE)))
+    { if ( ++count % 10240 == 0 &&
+	   (PL_handle_signals() < 0 || db->resetting) )
+
+      { simpleMutexUnlock(&db->locks.duplicates);
+	return FALSE;			/* aborted */
+      }
+      t->is_duplicate = FALSE;
+    }
+
+    db->duplicates = 0;
+  }
+
+  db->maintain_duplicates = TRUE;
+
+  for(t=fetch_triple(db, db->by_none.head);
+      t;
+      t=triple_follow_hash(db, t, ICOL(BY_NONE)))
+  { if ( ++count % 1024 == 0 &&
+	 PL_handle_signals() < 0 )
+    { db->maintain_duplicates = FALSE;		/* no point anymore */
+      simpleMutexUnlock(&db->locks.duplicates);
+      return FALSE;
+    }
+    mark_duplicate(db, t, NULL);
+  }
+
+  db->duplicates_up_to_date = TRUE;
+  simpleMutexUnlock(&db->locks.duplicates);
+
+  return TRUE;
+}
+
+
+static void
+start_duplicate_admin(rdf_db *db)
+{ db->maintain_duplicates = TRUE;
+
+  PL_call_predicate(NULL, PL_Q_NORMAL,
+		    PL_predicate("rdf_update_duplicates_thread", 0, "rdf_db"), 0);
+}
+
+
+
+		 /*******************************
+		 *	    TRANSACTIONS	*
+		 *******************************/
+
+static int
+put_begin_end(term_t t, functor_t be, int level)
+{ term_t av;
+
+  return ( (av = PL_new_term_ref()) &&
+	   PL_put_integer(av, level) &&
+	   PL_cons_functor_v(t, be, av) );
+}
+
+
+/** rdf_transaction(:Goal, +Id, +Options)
+
+Options:
+
+  * snapshot(+Snapshot)
+  Determines query generation
+  * isolation(+Level)
+  One of `snapshot` (default) or `serializable`.  The latter
+  validates the transaction at commit (see validate_transaction())
+  * retry(+Count)
+  Run Goal again up to Count times if a serializable transaction
+  conflicts.
+*/
+
+static foreign_t
+rdf_transaction(term_t goal, term_t id, term_t options)
+{ int rc;
+  rdf_db *db = rdf_current_db();
+  query *q;
+  triple_buffer added;
+  triple_buffer deleted;
+  triple_buffer updated;
+  snapshot *ss = NULL;
+  int serializable = FALSE;
+  int retries = 0;
+  fid_t fid;
+
+  if ( !PL_get_nil(options) )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg = PL_new_term_ref();
+
+    while( PL_get_list(tail, head, tail) )
+    { int arity;
+      atom_t name;
+
+      if ( !PL_get_name_arity(head, &name, &arity) || arity != 1 )
+	return PL_type_error("option", head);
+      _PL_get_arg(1, head, arg);
+
+      if ( name == ATOM_snapshot )
+      { if ( get_snapshot(arg, &ss) )
+	{ int ss_tid = snapshot_thread(ss);
+
+	  if ( ss_tid && ss_tid != PL_thread_self() )
+	    PL_permission_error("access", "rdf-snapshot", arg);
+	} else
+	{ atom_t a;
+
+	  if ( PL_get_atom(arg, &a) && a == ATOM_true )
+	    ss = SNAPSHOT_ANONYMOUS;
+	  else
+	    return PL_type_error("rdf_snapshot", arg);
+	}
+      } else if ( name == ATOM_isolation )
+      { atom_t a;
+
+	if ( !PL_get_atom_ex(arg, &a) )
+	  return FALSE;
+	if ( a == ATOM_serializable )
+	  serializable = TRUE;
+	else if ( a == ATOM_snapshot )
+	  serializable = FALSE;
+	else
+	  return PL_domain_error("rdf_isolation", arg);
+      } else if ( name == ATOM_retry )
+      { if ( !PL_get_integer_ex(arg, &retries) )
+	  return FALSE;
+	if ( retries < 0 )
+	  return PL_domain_error("not_less_than_zero", arg);
+      }
+    }
+    if ( !PL_get_nil_ex(tail) )
+      return FALSE;
+  }
+
+  if ( !(fid = PL_open_foreign_frame()) )
+    return FALSE;
+
+retry:
+  q = open_transaction(db, &added, &deleted, &updated, ss);
+  q->transaction_data.prolog_id = id;
+  if ( serializable )
+    q->transaction_data.serializable = TRUE;
+  rc = PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, PRED_call1, goal);
+
+  if ( rc )
+  { if ( !empty_transaction(q) )
+    { if ( ss )
+      { discard_transaction(q);
+      } else
+      { term_t be;
+	int crc;
+
+	if ( !(be=PL_new_term_ref()) ||
+	     !put_begin_end(be, FUNCTOR_begin1, 0) ||
+	     !rdf_broadcast(EV_TRANSACTION, (void*)id, (void*)be) )
+	  return FALSE;
+
+	if ( (crc=commit_transaction(q)) == -1 )
+	  discard_transaction(q);	/* serializable conflict */
+
+	if ( !put_begin_end(be, crc == -1 ? FUNCTOR_abort1 : FUNCTOR_end1, 0) ||
+	     !rdf_broadcast(EV_TRANSACTION, (void*)id, (void*)be) )
+	  return FALSE;
+
+	if ( crc == -1 )
+	{ if ( retries-- > 0 )
+	  { PL_rewind_foreign_frame(fid);
+	    goto retry;
+	  }
+	  rc = FALSE;
+	}
+      }
+    } else
+    { close_transaction(q);
+    }
+  } else
+  { discard_transaction(q);
+  }
+
+  PL_close_foreign_frame(fid);
+  return rc;
+}
+
+		 /*******************************
+		 *	     PREDICATES		*
+		 *******************************/
+
+/** rdf_active_transactions_(-List)
+
+Provides list of parent transactions in the calling thread
+*/
+
+static foreign_t
+rdf_active_transactions(term_t list)
+{ rdf_db *db = rdf_current_db();
+  query *q = open_query(db);
+  term_t tail = PL_copy_term_ref(list);
+  term_t head = PL_new_term_ref();
+  query *t;
+
+  for(t = q->transaction; t; t=t->transaction)
+  { if ( !PL_unify_list(tail, head, tail) ||
+         !PL_unify(head, t->transaction_data.prolog_id) )
+    { close_query(q);
+      return FALSE;
+    }
+  }
+
+  close_query(q);
+
+  return PL_unify_nil(tail);
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+(*) rdf_assert(S,P,O,G) adds a triple, but does not do so if exactly the
+same quintuple is visible and not  yet   erased.  Adding  would not make
+sense as this would be a complete duplicate that cannot be distinguished
+from the original and rdf_retractall/4 will erase both.
+
+Note that full duplicates are  quite  common   as  a  result  of forward
+reasoning.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+rdf_assert4(term_t subject, term_t predicate, term_t object, term_t src)
+{ rdf_db *db = rdf_current_db();
+  triple *t = new_triple(db);
+  query *q = open_query(db);
+  triple *d;
+  triple_walker tw;
+
+  if ( !get_triple(db, subject, predicate, object, t, q) )
+  { error:
+    free_triple(db, t, FALSE);
+    close_query(q);
+    return FALSE;
+  }
+  if ( src )
+  { if ( !get_graph(src, t) )
+      goto error;
+  } else
+  { t->graph_id = ATOM_ID(ATOM_user);
+    t->line = NO_LINE;
+  }
+
+  init_triple_walker(&tw, db, t, BY_SPO);
+  while((d=next_triple(&tw)))
+  { if ( (d=alive_triple(q, d)) && !d->erased )		/* (*) */
+    { if ( match_triples(db, d, t, q, MATCH_DUPLICATE|MATCH_SRC) &&
+	   d->line == t->line )
+      { destroy_triple_walker(db, &tw);
+	free_triple(db, t, FALSE);
+	close_query(q);
+
+	return TRUE;
+      }
+    }
+  }
+  destroy_triple_walker(db, &tw);
+
+  lock_atoms(db, t);
+
+  add_triples(q, &t, 1);
+  close_query(q);
+
+  return TRUE;
+}
+
+
+static foreign_t
+rdf_assert3(term_t subject, term_t predicate, term_t object)
+{ return rdf_assert4(subject, predicate, object, 0);
+}
+
+
+static void	free_search_state(search_state *state);
+
+static int
+init_cursor_from_literal(search_state *state, literal *cursor)
+{ triple *p = &state->pattern;
+  size_t iv;
+
+  DEBUG(3,
+	Sdprintf("Trying literal search for ");
+	print_literal(cursor);
+	Sdprintf("\n"));
+
+  p->indexed |= BY_O;
+  p->indexed &= ~BY_G;			/* No graph indexing supported */
+  p->indexed = state->db->indexes.alt[p->indexed];
+  if ( !(p->indexed&BY_O) )		/* no index on the object */
+  { init_triple_walker(&state->cursor, state->db, p, p->indexed);
+    return FALSE;
+  }
+
+  iv = literal_hash(cursor);		/* see also triple_hash_key() */
+  if ( p->indexed&BY_S ) iv ^= subject_hash(p);
+  if ( p->indexed&BY_P ) iv ^= predicate_hash(p->predicate.r);
+
+  init_triple_literal_walker(&state->cursor, state->db, p, p->indexed, iv,
+			     literal_hash(cursor));
+  state->has_literal_state = TRUE;
+  state->literal_cursor = cursor;
+
+  return TRUE;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+init_search_state(search_state *state, query *q)
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+init_search_state(search_state *state, query *query)
+{ triple *p = &state->pattern;
+  int rc;
+
+  if ( (rc=get_partial_triple(state->db,
+			      state->subject, state->predicate, state->object,
+			      state->src, p)) != TRUE )
+  { if ( rc == 0 )			/* unknown predicate */
+      record_read(query, NULL, FALSE);
+    free_triple(state->db, p, FALSE);
+    return FALSE;
+  }
+  record_read(query, p->predicate.r,
+	      (state->flags & MATCH_SUBPROPERTY));
+
+  if ( (p->match == STR_MATCH_PREFIX ||	p->match == STR_MATCH_LIKE) &&
+       p->indexed != BY_SP &&
+       (state->prefix = first_atom(p->object.literal->value.string, p->match)))
+  { literal lit;
+    literal **rlitp;
+
+    lit = *p->object.literal;
+    lit.value.string = state->prefix;
+    state->lit_ex.literal = &lit;
+    prepare_literal_ex(&state->lit_ex);
+    rlitp = skiplist_find_first(&state->db->literals,
+				&state->lit_ex, &state->literal_state);
+    if ( rlitp )
+    { if ( init_cursor_from_literal(state, *rlitp) )
+      { state->restart_lit = *rlitp;
+	state->restart_lit_state = state->literal_state;
+      }
+    } else
+    { free_search_state(state);
+      return FALSE;
+    }
+  } else if ( p->indexed != BY_SP && p->match >= STR_MATCH_LE )
+  { literal **rlitp;
+
+    state->lit_ex.literal = p->object.literal;
+    prepare_literal_ex(&state->lit_ex);
+
+    switch(p->match)
+    { case STR_MATCH_LE:
+	rlitp = skiplist_find_first(&state->db->literals,
+				    NULL, &state->literal_state);
+        break;
+      case STR_MATCH_GE:
+	rlitp = skiplist_find_first(&state->db->literals,
+				    &state->lit_ex, &state->literal_state);
+        break;
+      case STR_MATCH_BETWEEN:
+	rlitp = skiplist_find_first(&state->db->literals,
+				    &state->lit_ex, &state->literal_state);
+        state->lit_ex.literal = &p->tp.end;
+	prepare_literal_ex(&state->lit_ex);
+        break;
+      default:
+	assert(0);
+        return FALSE;
+    }
+
+    if ( rlitp )
+    { if ( init_cursor_from_literal(state, *rlitp) )
+      {	state->restart_lit = *rlitp;
+	state->restart_lit_state = state->literal_state;
+      }
+    } else
+    { free_search_state(state);
+      return FALSE;
+    }
+  } else
+  { init_triple_walker(&state->cursor, state->db, p, p->indexed);
+  }
+
+  return TRUE;
+}
+
+
+static void
+free_search_state(search_state *state)
+{ if ( state->query )
+    close_query(state->query);
+
+  free_triple(state->db, &state->pattern, FALSE);
+  destroy_triple_walker(state->db, &state->cursor);
+  if ( !state->db->maintain_duplicates &&
+       state->dup_answers.count > state->db->duplicate_admin_threshold )
+    start_duplicate_admin(state->db);
+  destroy_tripleset(&state->dup_answers);
+
+  if ( state->prefix )
+    PL_unregister_atom(state->prefix);
+}
+
+
+static foreign_t
+allow_retry_state(search_state *state)
+{ PL_retry_address(state);
+}
+
+
+static int
+new_answer(search_state *state, triple *t)
+{ if ( !t->is_duplicate && state->db->duplicates_up_to_date )
+    return TRUE;
+
+  return add_tripleset(state->db, state->query, &state->dup_answers, t);
+}
+
+
+static triple *
+is_candidate(search_state *state, triple *t)
+{ if ( !(t=alive_triple(state->query, t)) )
+    return NULL;
+					/* hash-collision, skip */
+  if ( state->has_literal_state )
+  { if ( !(t->object_is_literal &&
+	   t->object.literal == state->literal_cursor) )
+      return NULL;
+  }
+
+  if ( !match_triples(state->db, t, &state->pattern, state->query, state->flags) )
+    return NULL;
+
+  if ( !state->src )				/* with source, we report */
+  { if ( !new_answer(state, t) )		/* duplicates */
+      return NULL;
+  }
+
+  return t;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+next_sub_property() advances the triple-walker to walk over an alternate
+hash of the cloud.
+
+  - If the cloud doesn't have ->alt_hashes, all related predicates have
+    the same hash, and we are done.
+  - If the cloud does have ->alt_hashes, we must walk the
+    alt-hashes.  We do not need to walk hashes that do not use
+    sub-properties of the target.  This is implemented using
+    hash_holds_candidates().
+
+TBD: How expensive is hash_holds_candidates(). Maybe  we should only try
+that if there are many candidates  in the hash-chains? Alternatively, we
+can keep a list of predicates that uses  a particular alt-hash, so we do
+not have to scan the whole cloud each time.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+hash_holds_candidates(rdf_db *db, unsigned int hash,
+		      predicate *p, predicate_cloud *pc,
+		      query *q)
+{ predicate **pp  = pc->members;
+  predicate **end = &pp[pc->size];
+
+  for(; pp<end; pp++)
+  { predicate *p2 = *pp;
+
+    if ( p2->hash == hash && isSubPropertyOf(db, p2, p, q) )
+    { DEBUG(1, Sdprintf("\thash 0x%x: <%s rdfs:subPropertyOf %s>\n",
+			hash, pname(p2), pname(p)));
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+static int
+next_sub_property(search_state *state)
+{ if ( (state->flags & MATCH_SUBPROPERTY) )
+  { triple *p = &state->pattern;
+    triple_walker *tw = &state->cursor;
+    predicate_cloud *pc;
+
+    if ( !(pc=state->p_cloud) )
+    { if ( !p->predicate.r )		/* no pred on rdf_has(?,-,?) */
+	return FALSE;
+
+      if ( is_leaf_predicate(state->db, p->predicate.r, state->query) )
+	return FALSE;
+
+      if ( p->predicate.r->cloud->alt_hash_count )
+      { pc = state->p_cloud = p->predicate.r->cloud;
+
+	DEBUG(1, Sdprintf("%d alt hashes; first was 0x%x\n",
+			  p->predicate.r->cloud->alt_hash_count,
+			  predicate_hash(p->predicate.r)));
+	tw->unbounded_hash ^= predicate_hash(p->predicate.r);
+	state->alt_hash_cursor = 0;
+      } else
+	return FALSE;			/* Cloud has only one hash */
+    } else
+    { tw->unbounded_hash ^= pc->alt_hashes[state->alt_hash_cursor];
+      state->alt_hash_cursor++;
+    }
+
+    for( ; state->alt_hash_cursor < pc->alt_hash_count; state->alt_hash_cursor++)
+    { unsigned new_hash = pc->alt_hashes[state->alt_hash_cursor];
+
+      if ( new_hash != predicate_hash(p->predicate.r) &&
+	   hash_holds_candidates(state->db, new_hash,
+				 p->predicate.r, pc, state->query) )
+      { DEBUG(1, Sdprintf("Retrying with alt-hash %d (0x%x)\n",
+			  state->alt_hash_cursor, new_hash));
+	tw->unbounded_hash ^= new_hash;
+	rewind_triple_walker(tw);
+
+	return TRUE;
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+
+/* next_pattern() advances the pattern for the next query.  This is done
+   for matches that deal with matching inverse properties and matches
+   that deal with literal ranges (prefix, between, etc.)
+
+   Note that inverse and literal enumeration are mutually exclusive (as
+   long as we do not have literal subjects ...).
 
    If we enumerate (sub)properties, we must enumerate the carthesian
    product of the sub properties and the inverse/literal search.
 */
 
 static int
-next_pattern(search_state *state)
-{ triple_walker *tw = &state->cursor;
-  triple *p = &state->pattern;
+next_pattern(search_state *state)
+{ triple_walker *tw = &state->cursor;
+  triple *p = &state->pattern;
+
+  if ( state->has_literal_state )
+  { literal **litp;
+
+    if ( (litp = skiplist_find_next(&state->literal_state)) )
+    { literal *lit = *litp;
+
+      DEBUG(2, Sdprintf("next: ");
+	       print_literal(lit);
+	       Sdprintf("\n"));
+
+      switch(state->pattern.match)
+      { case STR_MATCH_PREFIX:
+	{ if ( !match_atoms(STR_MATCH_PREFIX, state->prefix, lit->value.string) )
+	  { DEBUG(1,
+		  Sdprintf("PREFIX: terminated literal iteration from ");
+		  print_literal(lit);
+		  Sdprintf("\n"));
+	    return FALSE;			/* no longer a prefix */
+	  }
+
+	  break;
+	}
+	case STR_MATCH_LE:
+	case STR_MATCH_BETWEEN:
+	{ if ( compare_literals(&state->lit_ex, lit) < 0 )
+	  { DEBUG(1,
+		  Sdprintf("LE/BETWEEN(");
+		  print_literal(state->lit_ex.literal);
+		  Sdprintf("): terminated literal iteration from ");
+		  print_literal(lit);
+		  Sdprintf("\n"));
+	    return FALSE;			/* no longer a prefix */
+	  }
+
+	  break;
+	}
+      }
+
+      init_cursor_from_literal(state, lit);
+      return TRUE;
+    }
+  }
+
+  if ( next_sub_property(state) )	/* redo search with alternative hash */
+  { if ( state->restart_lit )
+    { state->literal_state = state->restart_lit_state;
+      init_cursor_from_literal(state, state->restart_lit);
+    }
+
+    return TRUE;
+  }
+
+  if ( (state->flags&MATCH_INVERSE) &&
+       inverse_partial_triple(p) )
+  { DEBUG(1, Sdprintf("Retrying inverse: "); print_triple(p, PRT_NL));
+    state->p_cloud = NULL;
+    init_triple_walker(tw, state->db, p, p->indexed);
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+static int
+next_search_state(search_state *state)
+{ triple *t, *t2;
+  triple_walker *tw = &state->cursor;
+  triple *p = &state->pattern;
+  term_t retpred;
+
+  if ( (state->flags & MATCH_SUBPROPERTY) )
+  { retpred = state->realpred;
+    if ( retpred )
+    { if ( PL_is_variable(state->predicate) )
+      { if ( !PL_unify(state->predicate, retpred) )
+	  return FALSE;
+      }
+    } else
+    { if ( PL_is_variable(state->predicate) )
+	retpred = state->predicate;
+    }
+  } else
+  { retpred = state->predicate;
+  }
+
+  if ( (t2=state->prefetched) )
+  { state->prefetched = NULL;		/* retrying; to need to check */
+    goto retry;
+  }
+
+  do
+  { while( (t = next_triple(tw)) )
+    { DEBUG(3, Sdprintf("Search: ");
+	       print_triple(t, PRT_SRC|PRT_GEN|PRT_NL|PRT_ADR));
+
+      if ( (t2=is_candidate(state, t)) )
+      { int rc;
+
+      retry:
+	if ( (rc=unify_triple(state->subject, retpred, state->object,
+			      state->src, t2, p->inversed)) == FALSE )
+	  continue;
+	if ( rc == ERROR )
+	  return FALSE;			/* makes rdf/3 return FALSE */
+
+	do
+	{ while( (t = next_triple(tw)) )
+	  { DEBUG(3, Sdprintf("Search (prefetch): ");
+		  print_triple(t, PRT_SRC|PRT_GEN|PRT_NL|PRT_ADR));
+
+	    if ( (t2=is_candidate(state, t)) )
+	    { state->prefetched = t2;
+
+	      return TRUE;		/* non-deterministic */
+	    }
+	  }
+	} while(next_pattern(state));
+
+	return TRUE;			/* deterministic */
+      }
+    }
+  } while(next_pattern(state));
+
+  return FALSE;
+}
+
+
+
+static foreign_t
+rdf(term_t subject, term_t predicate, term_t object,
+    term_t src, term_t realpred, control_t h, unsigned flags)
+{ rdf_db *db = rdf_current_db();
+  search_state *state;
+
+  switch(PL_foreign_control(h))
+  { case PL_FIRST_CALL:
+    { query *q = open_query(db);
+
+      state = &q->state.search;
+      state->query     = q;
+      state->db	       = db;
+      state->subject   = subject;
+      state->object    = object;
+      state->predicate = predicate;
+      state->src       = src;
+      state->realpred  = realpred;
+      state->flags     = flags;
+						/* clear the rest */
+      memset(&state->cursor, 0,
+	     (char*)&state->lit_ex - (char*)&state->cursor);
+      state->dup_answers.entries = NULL;	/* see add_tripleset() */
+
+      if ( !init_search_state(state, q) )
+      { free_search_state(state);
+	return FALSE;
+      }
+
+      goto search;
+    }
+    case PL_REDO:
+    { int rc;
+
+      state = PL_foreign_context_address(h);
+      assert(state->subject == subject);
+
+    search:
+      if ( (rc=next_search_state(state)) )
+      { if ( state->prefetched )
+	  return allow_retry_state(state);
+      }
+
+      free_search_state(state);
+      return rc;
+    }
+    case PL_PRUNED:
+    { state = PL_foreign_context_address(h);
+
+      free_search_state(state);
+      return TRUE;
+    }
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+rdf(Subject, Predicate, Object)
+
+Search specifications:
+
+	Predicate:
+
+		subPropertyOf(X) = P
+
+	Object:
+
+		literal(substring(X), L)
+		literal(word(X), L)
+		literal(exact(X), L)
+		literal(prefix(X), L)
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+
+static foreign_t
+rdf3(term_t subject, term_t predicate, term_t object, control_t h)
+{ return rdf(subject, predicate, object, 0, 0, h,
+	     MATCH_EXACT);
+}
+
+static foreign_t
+rdf4(term_t subject, term_t predicate, term_t object,
+     term_t src, control_t h)
+{ return rdf(subject, predicate, object, src, 0, h,
+	     MATCH_EXACT|MATCH_SRC);
+}
+
+
+static foreign_t
+rdf_has3(term_t subject, term_t predicate, term_t object, control_t h)
+{ return rdf(subject, predicate, object, 0, 0, h,
+	     MATCH_SUBPROPERTY|MATCH_INVERSE);
+}
+
+
+static foreign_t
+rdf_has4(term_t subject, term_t predicate, term_t object,
+	term_t realpred, control_t h)
+{ return rdf(subject, predicate, object, 0, realpred, h,
+	     MATCH_SUBPROPERTY|MATCH_INVERSE);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+rdf_triples(+Pattern, +Max, -Triples) is the batch version of rdf/3 and
+rdf/4. Pattern is rdf(S,P,O) or rdf(S,P,O,G), accepting the same search
+specifications. Each solution unifies Triples with  a list of at most Max
+matching triples as ground terms of the same arity. The search_state is
+the resumable cursor and backtracking fetches the next batch.  As with
+rdf/3, one triple is prefetched  to  make   the  last  batch  deterministic.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+add_search_batch(term_t tail, term_t head, triple *t, int arity)
+{ fid_t fid;
+  term_t av;
+  int rc;
+
+  if ( !(fid = PL_open_foreign_frame()) )
+    return FALSE;
+  rc = ( PL_unify_list(tail, head, tail) &&
+	 (av = PL_new_term_refs(5)) &&
+	 PL_put_atom(av+0, ID_ATOM(t->subject_id)) &&
+	 PL_put_atom(av+1, t->predicate.r->name) &&
+	 unify_object(av+2, t) &&
+	 (arity == 3 || unify_graph(av+3, t)) &&
+	 PL_cons_functor_v(av+4, arity == 3 ? FUNCTOR_rdf3 : FUNCTOR_rdf4, av) &&
+	 PL_unify(head, av+4) );
+  PL_close_foreign_frame(fid);
+
+  return rc;
+}
+
+
+static int
+next_search_batch(search_state *state, size_t max, term_t triples, int arity)
+{ triple_walker *tw = &state->cursor;
+  term_t tail = PL_copy_term_ref(triples);
+  term_t head = PL_new_term_ref();
+  size_t count = 0;
+  triple *t, *t2;
+
+  if ( (t2=state->prefetched) )
+  { state->prefetched = NULL;
+    if ( !add_search_batch(tail, head, t2, arity) )
+      return FALSE;
+    count++;
+  }
+
+  do
+  { while( (t = next_triple(tw)) )
+    { if ( (t2=is_candidate(state, t)) )
+      { if ( count == max )
+	{ state->prefetched = t2;	/* non-deterministic */
+	  return PL_unify_nil(tail);
+	}
+	if ( !add_search_batch(tail, head, t2, arity) )
+	  return FALSE;
+	count++;
+      }
+    }
+  } while(next_pattern(state));
+
+  return count > 0 && PL_unify_nil(tail);
+}
+
+
+static foreign_t
+rdf_triples(term_t pattern, term_t max, term_t triples, control_t h)
+{ rdf_db *db = rdf_current_db();
+  search_state *state;
+  int64_t n;
+  int arity;
+  int rc;
+
+  if ( PL_is_functor(pattern, FUNCTOR_rdf3) )
+    arity = 3;
+  else if ( PL_is_functor(pattern, FUNCTOR_rdf4) )
+    arity = 4;
+  else
+    return PL_type_error("rdf_pattern", pattern);
+
+  switch(PL_foreign_control(h))
+  { case PL_FIRST_CALL:
+    { query *q;
+      term_t a;
+
+      if ( !PL_get_int64_ex(max, &n) )
+	return FALSE;
+      if ( n <= 0 )
+	return PL_domain_error("positive_integer", max);
+
+      if ( !(a = PL_new_term_refs(4)) )
+	return FALSE;
+      _PL_get_arg(1, pattern, a+0);
+      _PL_get_arg(2, pattern, a+1);
+      _PL_get_arg(3, pattern, a+2);
+      if ( arity == 4 )
+	_PL_get_arg(4, pattern, a+3);
+
+      q = open_query(db);
+      state = &q->state.search;
+      state->query     = q;
+      state->db	       = db;
+      state->subject   = a+0;
+      state->predicate = a+1;
+      state->object    = a+2;
+      state->src       = (arity == 4 ? a+3 : 0);
+      state->realpred  = 0;
+      state->flags     = (arity == 4 ? MATCH_EXACT|MATCH_SRC : MATCH_EXACT);
+						/* clear the rest */
+      memset(&state->cursor, 0,
+	     (char*)&state->lit_ex - (char*)&state->cursor);
+      state->dup_answers.entries = NULL;	/* see add_tripleset() */
+
+      if ( !init_search_state(state, q) )
+      { free_search_state(state);
+	return FALSE;
+      }
+
+      goto search;
+    }
+    case PL_REDO:
+    { state = PL_foreign_context_address(h);
+      if ( !PL_get_int64_ex(max, &n) )
+      { free_search_state(state);
+	return FALSE;
+      }
+
+    search:
+      if ( (rc=next_search_batch(state, (size_t)n, triples, arity)) )
+      { if ( state->prefetched )
+	  return allow_retry_state(state);
+      }
+
+      free_search_state(state);
+      return rc;
+    }
+    case PL_PRUNED:
+    { state = PL_foreign_context_address(h);
+
+      free_search_state(state);
+      return TRUE;
+    }
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+estimate_triples() estimates the number of triples  that must be scanned
+for the pattern t from the bucket counts of the index used by t.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static size_t
+estimate_triples(rdf_db *db, triple *t)
+{ size_t c;
+
+  if ( t->indexed == BY_NONE )
+  { c = db->created - db->erased;		/* = totale triple count */
+#if 0
+  } else if ( t->indexed == BY_P )
+  { c = t->predicate.r->triple_count;		/* must sum over children */
+#endif
+  } else
+  { size_t key = triple_hash_key(t, t->indexed);
+    int icol = ICOL(t->indexed);
+    triple_hash *hash = &db->hash[icol];
+    bulk_chain *bc;
+    size_t count;
+
+    if ( !db->hash[icol].created )
+    { create_triple_hashes(db, 1, &icol);
+      if ( !hash->created )			/* bulk load: see end_bulk_load() */
+	return db->created - db->erased;
+    }
+
+    c = 0;
+    for(count=hash->bucket_count_epoch; count <= hash->bucket_count; count *= 2)
+    { int entry = key%count;
+      triple_bucket *bucket = &hash->blocks[MSB(entry)][entry];
+
+      c += bucket->count;		/* TBD: compensate for resize */
+    }
+    if ( (bc=db->bulk_load.chain) )		/* see init_bulk_walk() */
+      c += bc->count;
+  }
+
+  return c;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+rdf_estimate_complexity(+S,+P,+O,-C)
+
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+rdf_estimate_complexity(term_t subject, term_t predicate, term_t object,
+		        term_t complexity)
+{ triple t;
+  size_t c;
+  rdf_db *db = rdf_current_db();
+  int rc;
+
+  memset(&t, 0, sizeof(t));
+  if ( (rc=get_partial_triple(db, subject, predicate, object, 0, &t)) != TRUE )
+  { if ( rc == -1 )
+    { return FALSE;			/* error */
+    } else
+    { return PL_unify_integer(complexity, 0);	/* no predicate */
+    }
+  }
+
+  c = estimate_triples(db, &t);
+  rc = PL_unify_int64(complexity, c);
+  free_triple(db, &t, FALSE);
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+rdf_count(?S, ?P, ?O, -Count) counts the answers of rdf(S,P,O).
+
+If the index bucket for the pattern is  empty, the count is 0. We only
+use indexes that exist: a count  should   not  create  a hash table (see
+create_triple_hashes()). If the pattern   only  specifies the predicate
+or nothing at all,  we  use   the  predicate  triple_count  or
+db->committed. These counts are maintained   by commit_triple_gen() and
+erase_triple() inside group_commit(), which  makes commit_seq odd while
+it applies a group. We do not  take   the  write lock, but use commit_seq
+as a sequence lock: the counts are valid if commit_seq is even and did
+not change while we read them and our read generation is the current one.
+They are exact if we are not in  a   transaction,  there are no pending
+graph drops (whose triples remain in the  predicate counts until GC), no
+frozen triples (which are not in the hash buckets) and no duplicates
+(which rdf/3 suppresses).  Otherwise  we  walk   the  index  as  rdf/3,
+but without unifying the answers.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+exact_count(search_state *state, size_t *count)
+{ rdf_db *db = state->db;
+  query *q = state->query;
+  triple *p = &state->pattern;
+  size_t seq, c;
+
+  if ( state->has_literal_state || db->bulk_load.active ||
+       db->frozen.triples )
+    return FALSE;
+
+  if ( p->indexed != BY_NONE && db->hash[ICOL(p->indexed)].created &&
+       estimate_triples(db, p) == 0 )
+  { *count = 0;
+    return TRUE;
+  }
+
+  if ( p->subject_id || p->object_is_literal || p->object.resource ||
+       p->graph_id )
+    return FALSE;
+  if ( q->transaction )
+    return FALSE;
+
+  seq = db->queries.write.commit_seq;
+  MEMORY_BARRIER();
+  if ( (seq&1) || q->rd_gen != db->queries.generation ||
+       db->graphs.dropped ||
+       !db->duplicates_up_to_date || db->duplicates )
+    return FALSE;
+  if ( p->predicate.r )
+    c = p->predicate.r->triple_count;
+  else
+    c = db->committed;
+  MEMORY_BARRIER();
+  if ( db->queries.write.commit_seq != seq )
+    return FALSE;
+
+  *count = c;
+  return TRUE;
+}
+
+
+static size_t
+walk_count(search_state *state)
+{ size_t count = 0;
+  triple *t;
+
+  do
+  { while( (t = next_triple(&state->cursor)) )
+    { if ( is_candidate(state, t) )
+	count++;
+    }
+  } while(next_pattern(state));
+
+  return count;
+}
+
+
+static foreign_t
+rdf_count(term_t subject, term_t predicate, term_t object, term_t count)
+{ rdf_db *db = rdf_current_db();
+  query *q = open_query(db);
+  search_state *state = &q->state.search;
+  size_t c;
+
+  state->query     = q;
+  state->db	   = db;
+  state->subject   = subject;
+  state->object    = object;
+  state->predicate = predicate;
+  state->src       = 0;
+  state->realpred  = 0;
+  state->flags     = MATCH_EXACT;
+					/* clear the rest */
+  memset(&state->cursor, 0,
+	 (char*)&state->lit_ex - (char*)&state->cursor);
+  state->dup_answers.entries = NULL;	/* see add_tripleset() */
+
+  if ( !init_search_state(state, q) )
+  { free_search_state(state);
+    if ( PL_exception(0) )
+      return FALSE;
+    return PL_unify_integer(count, 0);	/* no predicate */
+  }
+
+  if ( !exact_count(state, &c) )
+    c = walk_count(state);
+  free_search_state(state);
+
+  return PL_unify_int64(count, c);
+}
+
+
+		 /*******************************
+		 *	BASIC GRAPH PATTERNS	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+rdf_query_(+Patterns, +Vars, -Rows) evaluates a  conjunction of rdf/3 and
+rdf/4 patterns that share the variables  in   Vars.  Rows is unified to a
+list of solutions, where each solution is a list holding the values for
+Vars. Each pattern argument must be a variable or ground.
+
+The join order is computed greedily: at  each step we take the cheapest
+pattern that shares a variable with the patterns  that are already placed.
+The cost starts with estimate_triples() for the  constant part and is
+reduced for arguments bound by earlier steps   using  the branch factors
+of the predicate.  A step is normally   executed  as an index nested loop
+join: the bound values are added  to  the   pattern  and  we  walk the
+best index.  If the  number  of  probes   exceeds  the  size of the
+constant part, the constant part is  materialized   once  in  a  hash
+table keyed on the join values (hash join).
+
+Values are compared by  identity:  resources,   predicates  and graphs are
+atoms and literals are shared, so the literal pointer is a key too.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define BGP_S 0				/* argument positions */
+#define BGP_P 1
+#define BGP_O 2
+#define BGP_G 3
+
+#define BGP_CONST 0			/* constant or no argument */
+#define BGP_BIND  1			/* first occurrence of a variable */
+#define BGP_JOIN  2			/* variable bound by an earlier step */
+#define BGP_SAME  3			/* variable bound earlier in this step */
+
+#define BGP_NESTED_LOOP 0
+#define BGP_HASH_JOIN   1
+
+#define BGP_SELECTIVITY     16.0	/* guess for a bound arg without stats */
+#define BGP_HASH_MIN_PROBES 64.0	/* do not hash-join for fewer probes */
+
+typedef struct bgp_value
+{ uintptr_t	value;			/* atom_t or literal* */
+  int		is_literal;		/* value is a literal* */
+} bgp_value;
+
+typedef struct bgp_pattern
+{ triple	pattern;		/* the constant part */
+  int		arity;			/* 3 or 4 */
+  int		var[4];			/* variable index or -1 */
+  int		role[4];		/* BGP_CONST, BGP_BIND, ... */
+  int		planned;		/* placed in the join order */
+  int		method;			/* BGP_NESTED_LOOP or BGP_HASH_JOIN */
+  size_t	estimate;		/* estimate_triples() of constant part */
+  struct
+  { triple    **triples;		/* materialized constant part */
+    size_t     *next;			/* collision chains (index+1) */
+    size_t     *buckets;		/* bucket heads (index+1) */
+    size_t	count;			/* # materialized triples */
+    size_t	size;			/* # buckets (power of 2) */
+    int		created;		/* table is filled */
+  } hash;
+} bgp_pattern;
+
+typedef struct bgp_query
+{ rdf_db       *db;			/* the database */
+  query	       *query;			/* query we run in */
+  size_t	count;			/* # patterns */
+  bgp_pattern  *patterns;		/* the patterns */
+  bgp_pattern **plan;			/* patterns in execution order */
+  size_t	nvars;			/* # variables */
+  bgp_value    *values;			/* current bindings */
+  int	       *bound;			/* planning: step that binds var */
+  term_t	tail;			/* list of rows */
+  term_t	head;
+} bgp_query;
+
+
+static int
+get_bgp_pattern(bgp_query *bq, term_t t, term_t varv, bgp_pattern *p)
+{ term_t a = PL_new_term_refs(4);
+  int i;
+
+  if ( PL_is_functor(t, FUNCTOR_rdf3) )
+    p->arity = 3;
+  else if ( PL_is_functor(t, FUNCTOR_rdf4) )
+    p->arity = 4;
+  else
+  { PL_type_error("rdf_pattern", t);
+    return -1;
+  }
+
+  for(i=0; i<4; i++)
+  { p->var[i] = -1;
+    if ( i >= p->arity )
+      continue;
+
+    _PL_get_arg(i+1, t, a+i);
+    if ( PL_is_variable(a+i) )
+    { size_t v;
+
+      for(v=0; v<bq->nvars; v++)
+      { if ( PL_compare(a+i, varv+v) == 0 )
+	{ p->var[i] = (int)v;
+	  break;
+	}
+      }
+      if ( p->var[i] < 0 )
+      { PL_domain_error("rdf_query_variable", a+i);
+	return -1;
+      }
+    } else if ( !PL_is_ground(a+i) )
+    { PL_instantiation_error(a+i);
+      return -1;
+    }
+  }
+
+  switch( get_partial_triple(bq->db, a+0, a+1, a+2,
+			     p->arity == 4 ? a+3 : 0, &p->pattern) )
+  { case TRUE:
+      return TRUE;
+    case FALSE:
+      return PL_exception(0) ? -1 : FALSE;
+    default:
+      return -1;
+  }
+}
+
+
+/* bgp_index() computes the index for a walker pattern from the
+   arguments that are filled.  This mirrors get_partial_triple().
+*/
+
+static int
+bgp_index(triple *t)
+{ int ipat = 0;
+
+  if ( t->subject_id )
+    ipat |= BY_S;
+  if ( t->predicate.r )
+    ipat |= BY_P;
+  if ( t->object_is_literal )
+  { literal *lit = t->object.literal;
+
+    if ( t->match <= STR_MATCH_EXACT )
+    { switch( lit->objtype )
+      { case OBJ_STRING:
+	  if ( lit->value.string )
+	    ipat |= BY_O;
+	  break;
+	case OBJ_INTEGER:
+	case OBJ_DOUBLE:
+	case OBJ_TERM:
+	  ipat |= BY_O;
+	  break;
+      }
+    }
+  } else if ( t->object.resource )
+  { ipat |= BY_O;
+  }
+  if ( t->graph_id )
+    ipat |= BY_G;
+
+  return ipat;
+}
+
+
+static uintptr_t
+bgp_triple_value(triple *t, int pos, int *is_literal)
+{ *is_literal = FALSE;
+
+  switch(pos)
+  { case BGP_S:
+      return ID_ATOM(t->subject_id);
+    case BGP_P:
+      return t->predicate.r->name;
+    case BGP_O:
+      if ( t->object_is_literal )
+      { *is_literal = TRUE;
+	return (uintptr_t)t->object.literal;
+      }
+      return t->object.resource;
+    case BGP_G:
+    default:
+      return ID_ATOM(t->graph_id);
+  }
+}
+
+
+/* bgp_match() verifies the variable arguments of t against the current
+   bindings and binds the variables that appear first in this step.
+*/
+
+static int
+bgp_match(bgp_query *bq, bgp_pattern *p, triple *t)
+{ int pos;
+
+  for(pos=0; pos<p->arity; pos++)
+  { bgp_value *v;
+    uintptr_t value;
+    int is_literal;
+
+    if ( p->role[pos] == BGP_CONST )
+      continue;
+
+    v = &bq->values[p->var[pos]];
+    value = bgp_triple_value(t, pos, &is_literal);
+    if ( p->role[pos] == BGP_BIND )
+    { v->value = value;
+      v->is_literal = is_literal;
+    } else if ( v->value != value || v->is_literal != is_literal )
+    { return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+static unsigned int
+bgp_join_key(bgp_query *bq, bgp_pattern *p, triple *t)
+{ uintptr_t key[4];
+  int pos, n = 0;
+
+  for(pos=0; pos<p->arity; pos++)
+  { if ( p->role[pos] == BGP_JOIN )
+    { if ( t )
+      { int is_literal;
+
+	key[n++] = bgp_triple_value(t, pos, &is_literal);
+      } else
+      { key[n++] = bq->values[p->var[pos]].value;
+      }
+    }
+  }
+
+  return rdf_murmer_hash(key, (int)(n*sizeof(key[0])), MURMUR_SEED);
+}
+
+
+static unsigned
+bgp_match_flags(bgp_pattern *p)
+{ return p->arity == 4 ? MATCH_EXACT|MATCH_SRC : MATCH_EXACT;
+}
+
+
+static int
+bgp_candidate(bgp_query *bq, bgp_pattern *p, triple *t, tripleset *dups)
+{ rdf_db *db = bq->db;
+
+  if ( !match_triples(db, t, &p->pattern, bq->query, bgp_match_flags(p)) )
+    return FALSE;
+  if ( p->arity == 3 &&			/* rdf/3 does not report duplicates */
+       (t->is_duplicate || !db->duplicates_up_to_date) &&
+       !add_tripleset(db, bq->query, dups, t) )
+    return FALSE;
+
+  return TRUE;
+}
+
+
+static int
+bgp_build_hash(bgp_query *bq, bgp_pattern *p)
+{ rdf_db *db = bq->db;
+  triple_walker tw;
+  tripleset dups;
+  triple *t;
+  size_t allocated = 0;
+  size_t i;
+
+  dups.entries = NULL;
+  init_triple_walker(&tw, db, &p->pattern, p->pattern.indexed);
+  while((t=next_triple(&tw)))
+  { if ( !(t=alive_triple(bq->query, t)) ||
+	 !bgp_candidate(bq, p, t, &dups) )
+      continue;
+
+    if ( p->hash.count == allocated )
+    { size_t size = allocated ? allocated*2 : 256;
+      triple **new = realloc(p->hash.triples, size*sizeof(triple*));
+
+      if ( !new )
+      { destroy_triple_walker(db, &tw);
+	destroy_tripleset(&dups);
+	return PL_resource_error("memory");
+      }
+      p->hash.triples = new;
+      allocated = size;
+    }
+    p->hash.triples[p->hash.count++] = t;
+  }
+  destroy_triple_walker(db, &tw);
+  destroy_tripleset(&dups);
+
+  for(p->hash.size=16; p->hash.size < p->hash.count; p->hash.size *= 2)
+    ;
+  p->hash.buckets = calloc(p->hash.size, sizeof(size_t));
+  p->hash.next = malloc((p->hash.count+1)*sizeof(size_t));
+  if ( !p->hash.buckets || !p->hash.next )
+    return PL_resource_error("memory");
+
+  for(i=0; i<p->hash.count; i++)
+  { size_t k = bgp_join_key(bq, p, p->hash.triples[i]) & (p->hash.size-1);
+
+    p->hash.next[i] = p->hash.buckets[k];
+    p->hash.buckets[k] = i+1;
+  }
+  p->hash.created = TRUE;
+
+  return TRUE;
+}
+
+
+static int
+bgp_unify_value(term_t t, bgp_value *v)
+{ if ( v->is_literal )
+  { term_t a = PL_new_term_ref();
+
+    if ( !PL_unify_functor(t, FUNCTOR_literal1) )
+      return FALSE;
+    _PL_get_arg(1, t, a);
+
+    return unify_literal(a, (literal*)v->value);
+  }
+
+  return PL_unify_atom(t, (atom_t)v->value);
+}
+
+
+static int
+bgp_emit(bgp_query *bq)
+{ fid_t fid;
+  term_t row, cell;
+  size_t i;
+  int rc = TRUE;
+
+  if ( !PL_unify_list(bq->tail, bq->head, bq->tail) )
+    return FALSE;
+
+  if ( !(fid = PL_open_foreign_frame()) )
+    return FALSE;
+  row  = PL_copy_term_ref(bq->head);
+  cell = PL_new_term_ref();
+  for(i=0; i<bq->nvars && rc; i++)
+  { rc = ( PL_unify_list(row, cell, row) &&
+	   bgp_unify_value(cell, &bq->values[i]) );
+  }
+  rc = rc && PL_unify_nil(row);
+  PL_close_foreign_frame(fid);
+
+  return rc;
+}
+
+
+static int
+bgp_solve(bgp_query *bq, size_t step)
+{ rdf_db *db = bq->db;
+  bgp_pattern *p;
+  int rc = TRUE;
+
+  if ( step == bq->count )
+    return bgp_emit(bq);
+  p = bq->plan[step];
+
+  if ( p->method == BGP_HASH_JOIN )
+  { size_t i;
+
+    if ( !p->hash.created && !bgp_build_hash(bq, p) )
+      return FALSE;
+
+    i = p->hash.buckets[bgp_join_key(bq, p, NULL) & (p->hash.size-1)];
+    for(; i && rc; i = p->hash.next[i-1])
+    { if ( bgp_match(bq, p, p->hash.triples[i-1]) )
+	rc = bgp_solve(bq, step+1);
+    }
+  } else
+  { triple pattern = p->pattern;
+    triple_walker tw;
+    tripleset dups;
+    triple *t;
+    int pos;
+
+    for(pos=0; pos<p->arity; pos++)
+    { bgp_value *v;
+
+      if ( p->role[pos] != BGP_JOIN )
+	continue;
+
+      v = &bq->values[p->var[pos]];
+      switch(pos)
+      { case BGP_S:
+	  if ( v->is_literal )
+	    return TRUE;
+	  pattern.subject_id = ATOM_ID((atom_t)v->value);
+	  break;
+	case BGP_P:
+	  if ( v->is_literal ||
+	       !(pattern.predicate.r = existing_predicate(db, v->value)) )
+	    return TRUE;
+	  break;
+	case BGP_O:
+	  if ( (pattern.object_is_literal = v->is_literal) )
+	    pattern.object.literal = (literal*)v->value;
+	  else
+	    pattern.object.resource = (atom_t)v->value;
+	  break;
+	case BGP_G:
+	  if ( v->is_literal )
+	    return TRUE;
+	  pattern.graph_id = ATOM_ID((atom_t)v->value);
+	  break;
+      }
+    }
+
+    dups.entries = NULL;
+    init_triple_walker(&tw, db, &pattern, bgp_index(&pattern));
+    while( rc && (t=next_triple(&tw)) )
+    { if ( !(t=alive_triple(bq->query, t)) ||
+	   !bgp_match(bq, p, t) ||
+	   !bgp_candidate(bq, p, t, &dups) )
+	continue;
+
+      rc = bgp_solve(bq, step+1);
+    }
+    destroy_triple_walker(db, &tw);
+    destroy_tripleset(&dups);
+  }
+
+  return rc;
+}
+
+
+static double
+bgp_estimate(bgp_query *bq, bgp_pattern *p)
+{ predicate *pred = p->pattern.predicate.r;
+  double est = (double)p->estimate;
+  int pos;
+
+  for(pos=0; pos<p->arity; pos++)
+  { int v = p->var[pos];
+    double bf;
+
+    if ( v < 0 || !bq->bound[v] )
+      continue;
+
+    if ( pos == BGP_S && pred )
+      bf = subject_branch_factor(bq->db, pred, bq->query, DISTINCT_DIRECT);
+    else if ( pos == BGP_O && pred )
+      bf = object_branch_factor(bq->db, pred, bq->query, DISTINCT_DIRECT);
+    else
+      bf = est/BGP_SELECTIVITY;
+
+    if ( bf < est )
+      est = bf;
+  }
+
+  if ( est < 1.0 && p->estimate > 0 )
+    est = 1.0;
+
+  return est;
+}
+
+
+static int
+bgp_connected(bgp_query *bq, bgp_pattern *p)
+{ int pos, vars = FALSE;
+
+  for(pos=0; pos<p->arity; pos++)
+  { int v = p->var[pos];
+
+    if ( v >= 0 )
+    { if ( bq->bound[v] )
+	return TRUE;
+      vars = TRUE;
+    }
+  }
+
+  return !vars;				/* ground patterns are cheap filters */
+}
+
+
+static void
+bgp_plan(bgp_query *bq)
+{ double rows = 1.0;
+  size_t step, i;
+
+  for(step=0; step<bq->count; step++)
+  { bgp_pattern *best = NULL;
+    double best_cost = 0.0;
+    int best_connected = FALSE;
+    int pos, joins = FALSE;
+
+    for(i=0; i<bq->count; i++)
+    { bgp_pattern *p = &bq->patterns[i];
+      int connected;
+      double cost;
+
+      if ( p->planned )
+	continue;
+      connected = bgp_connected(bq, p);
+      cost = bgp_estimate(bq, p);
+
+      if ( !best ||
+	   (connected && !best_connected) ||
+	   (connected == best_connected && cost < best_cost) )
+      { best = p;
+	best_cost = cost;
+	best_connected = connected;
+      }
+    }
+
+    best->planned = TRUE;
+    bq->plan[step] = best;
+
+    for(pos=0; pos<best->arity; pos++)
+    { int v = best->var[pos];
+
+      if ( v < 0 )
+      { best->role[pos] = BGP_CONST;
+      } else if ( !bq->bound[v] )
+      { best->role[pos] = BGP_BIND;
+	bq->bound[v] = (int)step+1;
+      } else if ( bq->bound[v] == (int)step+1 )
+      { best->role[pos] = BGP_SAME;
+      } else
+      { best->role[pos] = BGP_JOIN;
+	joins = TRUE;
+      }
+    }
+
+    if ( joins && rows >= BGP_HASH_MIN_PROBES &&
+	 (double)best->estimate < rows*best_cost )
+      best->method = BGP_HASH_JOIN;
+    else
+      best->method = BGP_NESTED_LOOP;
+
+    DEBUG(1, Sdprintf("BGP step %d: pattern %d, cost %.1f, %s\n",
+		      (int)step, (int)(best-bq->patterns), best_cost,
+		      best->method == BGP_HASH_JOIN ? "hash" : "nested loop"));
+
+    rows *= best_cost;
+  }
+}
+
+
+static void
+free_bgp_query(bgp_query *bq)
+{ size_t i;
+
+  for(i=0; i<bq->count; i++)
+  { bgp_pattern *p = &bq->patterns[i];
+
+    free_triple(bq->db, &p->pattern, FALSE);
+    if ( p->hash.triples ) free(p->hash.triples);
+    if ( p->hash.next )    free(p->hash.next);
+    if ( p->hash.buckets ) free(p->hash.buckets);
+  }
+
+  if ( bq->patterns ) free(bq->patterns);
+  if ( bq->plan )     free(bq->plan);
+  if ( bq->values )   free(bq->values);
+  if ( bq->bound )    free(bq->bound);
+}
+
+
+static foreign_t
+rdf_query(term_t patterns, term_t vars, term_t rows)
+{ rdf_db *db = rdf_current_db();
+  bgp_query bq;
+  term_t varv, tail, head;
+  size_t len, i;
+  int rc = TRUE;
+
+  memset(&bq, 0, sizeof(bq));
+  bq.db = db;
+
+  if ( PL_skip_list(patterns, 0, &bq.count) != PL_LIST )
+    return PL_type_error("list", patterns);
+  if ( PL_skip_list(vars, 0, &len) != PL_LIST )
+    return PL_type_error("list", vars);
+
+  bq.nvars = len;
+  varv = PL_new_term_refs((int)len);
+  tail = PL_copy_term_ref(vars);
+  for(i=0; PL_get_list(tail, varv+i, tail); i++)
+    ;
+
+  bq.patterns = calloc(bq.count+1, sizeof(*bq.patterns));
+  bq.plan     = calloc(bq.count+1, sizeof(*bq.plan));
+  bq.values   = calloc(bq.nvars+1, sizeof(*bq.values));
+  bq.bound    = calloc(bq.nvars+1, sizeof(*bq.bound));
+  if ( !bq.patterns || !bq.plan || !bq.values || !bq.bound )
+  { free_bgp_query(&bq);
+    return PL_resource_error("memory");
+  }
+
+  bq.query = open_query(db);
+  tail = PL_copy_term_ref(patterns);
+  head = PL_new_term_ref();
+  for(i=0; PL_get_list(tail, head, tail); i++)
+  { bgp_pattern *p = &bq.patterns[i];
+
+    if ( (rc=get_bgp_pattern(&bq, head, varv, p)) != TRUE )
+      break;
+    record_read(bq.query, p->pattern.predicate.r, FALSE);
+    p->estimate = estimate_triples(db, &p->pattern);
+  }
+
+  if ( rc == TRUE )
+  { bgp_plan(&bq);
+    bq.tail = PL_copy_term_ref(rows);
+    bq.head = PL_new_term_ref();
+    rc = bgp_solve(&bq, 0) && PL_unify_nil(bq.tail);
+  } else if ( rc == FALSE )		/* unknown predicate */
+  { record_read(bq.query, NULL, FALSE);
+    rc = PL_unify_nil(rows);
+  } else
+  { rc = FALSE;
+  }
+
+  close_query(bq.query);
+  free_bgp_query(&bq);
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+current_literal(?Literals)
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static foreign_t
+rdf_current_literal(term_t t, control_t h)
+{ rdf_db *db = rdf_current_db();
+  literal **data;
+  skiplist_enum *state;
+  int rc;
+
+  switch(PL_foreign_control(h))
+  { case PL_FIRST_CALL:
+      if ( PL_is_variable(t) )
+      { state = rdf_malloc(db, sizeof(*state));
+
+	data = skiplist_find_first(&db->literals, NULL, state);
+	goto next;
+      } else
+      { return FALSE;			/* TBD */
+      }
+    case PL_REDO:
+      state = PL_foreign_context_address(h);
+      data  = skiplist_find_next(state);
+    next:
+      for(; data; data=skiplist_find_next(state))
+      { literal *lit = *data;
+
+	if ( unify_literal(t, lit) )
+	{ PL_retry_address(state);
+	}
+      }
+
+      rc = FALSE;
+      goto cleanup;
+    case PL_PRUNED:
+      rc = TRUE;
+
+    cleanup:
+      state = PL_foreign_context_address(h);
+      rdf_free(db, state, sizeof(*state));
+
+      return rc;
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+static int
+update_triple(rdf_db *db, term_t action, triple *t, triple **updated, query *q)
+{ term_t a = PL_new_term_ref();
+  triple tmp, *new;
+					/* Create copy in local memory */
+  memcpy(&tmp, t, offsetof(triple, tp));
+
+  if ( !PL_get_arg(1, action, a) )
+    return PL_type_error("rdf_action", action);
+
+  if ( PL_is_functor(action, FUNCTOR_subject1) )
+  { atom_t s;
+
+    if ( !PL_get_atom_ex(a, &s) )
+      return FALSE;
+    if ( tmp.subject_id == ATOM_ID(s) )
+      return TRUE;			/* no change */
+
+    tmp.subject_id = ATOM_ID(s);
+  } else if ( PL_is_functor(action, FUNCTOR_predicate1) )
+  { predicate *p;
+
+    if ( !get_predicate(db, a, &p, q) )
+      return FALSE;
+    if ( tmp.predicate.r == p )
+      return TRUE;			/* no change */
+
+    tmp.predicate.r = p;
+  } else if ( PL_is_functor(action, FUNCTOR_object1) )
+  { triple t2;
+
+    memset(&t2, 0, sizeof(t2));
+
+    if ( !get_object(db, a, &t2) )
+    { free_triple(db, &t2, FALSE);
+      return FALSE;
+    }
+    if ( match_object(&t2, &tmp, MATCH_QUAL) )
+    { free_triple(db, &t2, FALSE);
+      return TRUE;
+    }
+
+    if ( (tmp.object_is_literal = t2.object_is_literal) )
+    { tmp.object.literal = t2.object.literal;
+    } else
+    { tmp.object.resource = t2.object.resource;
+    }
+  } else if ( PL_is_functor(action, FUNCTOR_graph1) )
+  { triple t2;
+
+    if ( !get_graph(a, &t2) )
+      return FALSE;
+    if ( t2.graph_id == t->graph_id && t2.line == t->line )
+    { *updated = NULL;
+      return TRUE;
+    }
+
+    tmp.graph_id = t2.graph_id;
+    tmp.line = t2.line;
+  } else
+    return PL_domain_error("rdf_action", action);
+
+  new = new_triple(db);
+  new->subject_id	 = tmp.subject_id;
+  new->predicate.r	 = tmp.predicate.r;
+  if ( (new->object_is_literal = tmp.object_is_literal) )
+  { if ( tmp.object.literal->shared )
+    { simpleMutexLock(&db->locks.literal);
+      new->object.literal = copy_literal(db, tmp.object.literal);
+      simpleMutexUnlock(&db->locks.literal);
+    } else
+    { new->object.literal = tmp.object.literal;
+    }
+  } else
+  { new->object.resource = tmp.object.resource;
+  }
+  new->graph_id		 = tmp.graph_id;
+  new->line		 = tmp.line;
+
+  lock_atoms(db, new);
+
+  *updated = new;
+
+  return TRUE;
+}
+
+
+/** rdf_update(+Subject, +Predicate, +Object, +Action) is det.
+
+Update a triple. Please note this is actually erase+assert
+*/
+
+static foreign_t
+rdf_update5(term_t subject, term_t predicate, term_t object, term_t src,
+	    term_t action)
+{ triple t, *p;
+  int indexed = BY_SPO;
+  rdf_db *db = rdf_current_db();
+  int rc = TRUE;
+  size_t count;
+  triple_walker tw;
+  triple_buffer matches;
+  query *q = open_query(db);
+
+  memset(&t, 0, sizeof(t));
+
+  if ( !get_src(src, &t) ||
+       !get_triple(db, subject, predicate, object, &t, q) )
+  { close_query(q);
+    return FALSE;
+  }
+  record_read(q, t.predicate.r, FALSE);
+
+  init_triple_buffer(&matches);
+  init_triple_walker(&tw, db, &t, indexed);
+  while((p=next_triple(&tw)))
+  { if ( !(p=alive_triple(q, p)) )
+      continue;
+
+    if ( match_triples(db, p, &t, q, MATCH_EXACT) )
+      buffer_triple(&matches, p);
+  }
+
+  if ( !is_empty_buffer(&matches) )
+  { triple_buffer replacements;
+    triple *new, **tp;
+
+    count = matches.top-matches.base;
+    init_triple_buffer(&replacements);
+    for(tp=matches.base; tp<matches.top; tp++)
+    { new = NULL;
+      if ( !update_triple(db, action, *tp, &new, q) )
+      { rc = FALSE;
+	free_triple_buffer(&replacements);
+	goto out;
+      }
+
+      buffer_triple(&replacements, new);
+    }
+
+    update_triples(q, matches.base, replacements.base, count);
+    free_triple_buffer(&replacements);
+  } else
+  { count = 0;
+  }
+
+out:
+  close_query(q);
+  free_triple_buffer(&matches);
+  free_triple(db, &t, FALSE);
+
+  return (rc && count > 0) ? TRUE : FALSE;
+}
+
+
+static foreign_t
+rdf_update(term_t subject, term_t predicate, term_t object, term_t action)
+{ return rdf_update5(subject, predicate, object, 0, action);
+}
+
+
+static foreign_t
+rdf_retractall4(term_t subject, term_t predicate, term_t object, term_t src)
+{ triple t, *p;
+  rdf_db *db = rdf_current_db();
+  triple_walker tw;
+  triple_buffer buf;
+  query *q;
+
+  memset(&t, 0, sizeof(t));
+  switch( get_partial_triple(db, subject, predicate, object, src, &t) )
+  { case 0:				/* no such predicate */
+      return TRUE;
+    case -1:				/* error */
+      return FALSE;
+  }
+
+  if ( t.graph_id )		/* speedup for rdf_retractall(_,_,_,DB) */
+  { graph *gr = existing_graph(db, ID_ATOM(t.graph_id));
+
+    if ( !gr || gr->triple_count == 0 )
+      return TRUE;
+  }
+
+  init_triple_buffer(&buf);
+  q = open_query(db);
+  record_read(q, t.predicate.r, FALSE);
+  init_triple_walker(&tw, db, &t, t.indexed);
+  while((p=next_triple(&tw)))
+  { if ( !(p=alive_triple(q, p)) )
+      continue;
+
+    if ( match_triples(db, p, &t, q, MATCH_EXACT|MATCH_SRC) )
+    { if ( t.object_is_literal && t.object.literal->objtype == OBJ_TERM )
+      { fid_t fid = PL_open_foreign_frame();
+	int rc = unify_object(object, p);
+	PL_discard_foreign_frame(fid);
+	if ( !rc )
+	  continue;
+      }
+
+      buffer_triple(&buf, p);
+    }
+  }
+  free_triple(db, &t, FALSE);
+  del_triples(q, buf.base, buf.top-buf.base);
+  close_query(q);
+  free_triple_buffer(&buf);
+
+
+  return TRUE;
+}
+
+
+static foreign_t
+rdf_retractall3(term_t subject, term_t predicate, term_t object)
+{ return rdf_retractall4(subject, predicate, object, 0);
+}
+
+
+		 /*******************************
+		 *	 CLONE AND SWAP		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+rdf_clone_graph/2 and rdf_swap_graphs_/3 copy  the triples of a graph to
+another graph. A triple cannot be moved  to   or  shared with another
+graph because ->graph_id is part of the  index keys. The copies share the
+literal and resources with the original, so  copying is much cheaper than
+asserting the triples.  It is still linear  in   the  size of the graphs
+and the originals of a swap use memory until GC reclaims them, which
+requires all queries that started before the swap to have finished.
+
+rdf_swap_graphs_/3 in fast mode uses swap_graphs() to make the copies
+visible and drop the originals in a   single generation step. If that is
+not possible or one of  the  graphs   was  changed  while  we made the
+copies, it fails and rdf_swap_graphs/2 calls it in copy mode inside a
+transaction, where we use del_triples() and add_triples().
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static triple *
+copy_triple_to_graph(rdf_db *db, triple *t, atom_t graph_name)
+{ triple *new = new_triple(db);
+
+  if ( !new )
+    return NULL;
+
+  new->subject_id  = t->subject_id;
+  new->predicate.r = t->predicate.r;
+  if ( (new->object_is_literal = t->object_is_literal) )
+  { simpleMutexLock(&db->locks.literal);
+    new->object.literal = copy_literal(db, t->object.literal);
+    simpleMutexUnlock(&db->locks.literal);
+  } else
+  { new->object.resource = t->object.resource;
+  }
+  new->graph_id = ATOM_ID(graph_name);
+  new->line     = t->line;
+  lock_atoms(db, new);
+
+  return new;
+}
+
+
+/* graph_triples() adds the triples of g that are visible to q to buf.
+   A triple that is reindexed while we walk may be found twice.
+*/
+
+static void
+graph_triples(query *q, graph *g, triple_buffer *buf)
+{ rdf_db *db = q->db;
+  triple t, *p;
+  triple_walker tw;
+  triple_buffer found;
+  ptr_hash_table *seen;
+  triple **tp;
+
+  if ( g->triple_count <= 0 )
+    return;
+
+  memset(&t, 0, sizeof(t));
+  t.graph_id = ATOM_ID(g->name);
+  t.indexed  = BY_G;
+  init_triple_buffer(&found);
+  init_triple_walker(&tw, db, &t, t.indexed);
+  while((p=next_triple(&tw)))
+  { if ( p->graph_id == t.graph_id && (p=alive_triple(q, p)) )
+      buffer_triple(&found, p);
+  }
+  destroy_triple_walker(db, &tw);
+
+  seen = new_ptr_hash(g->triple_count > 1024*1024 ? 1024*1024
+					       : g->triple_count);
+  for(tp=found.base; tp<found.top; tp++)
+  { triple *t2 = deref_triple(db, *tp);
+
+    if ( add_ptr_hash(seen, t2) )
+      buffer_triple(buf, t2);
+  }
+  destroy_ptr_hash(seen);
+  free_triple_buffer(&found);
+}
+
+
+/* copy_triples() adds a copy of the triples from..to in graph to buf.
+*/
+
+static int
+copy_triples(rdf_db *db, triple **from, triple **to,
+	     atom_t graph_name, triple_buffer *buf)
+{ for(; from < to; from++)
+  { triple *t2;
+
+    if ( !(t2 = copy_triple_to_graph(db, *from, graph_name)) ||
+	 !buffer_triple(buf, t2) )
+    { if ( t2 )
+	free_triple(db, t2, FALSE);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+static void
+free_copies(rdf_db *db, triple_buffer *copies)
+{ triple **tp;
+
+  for(tp=copies->base; tp<copies->top; tp++)
+    free_triple(db, *tp, FALSE);
+}
+
+
+/** rdf_clone_graph(+From, +To) is det.
+
+Add a copy of all triples of From to To.  To must be empty.  The first
+test avoids copying if it is not.  clone_graph() tests again as part
+of the commit.
+*/
+
+static foreign_t
+rdf_clone_graph(term_t from, term_t to)
+{ rdf_db *db = rdf_current_db();
+  atom_t fn, tn;
+  graph *gf, *gt;
+  triple_buffer triples, copies;
+  query *q;
+  int rc = TRUE;
+
+  if ( !PL_get_atom_ex(from, &fn) ||
+       !PL_get_atom_ex(to, &tn) )
+    return FALSE;
+  if ( (gt = existing_graph(db, tn)) && gt->triple_count > 0 )
+    return PL_permission_error("clone_to", "rdf_graph", to);
+  if ( !(gt = lookup_graph(db, tn)) )
+    return FALSE;
+  if ( !(gf = existing_graph(db, fn)) || fn == tn )
+    return TRUE;
+
+  init_triple_buffer(&triples);
+  init_triple_buffer(&copies);
+  q = open_query(db);
+  graph_triples(q, gf, &triples);
+  if ( copy_triples(db, triples.base, triples.top, tn, &copies) )
+  { if ( (rc=clone_graph(q, gt, copies.base, copies.top-copies.base)) == -1 )
+      rc = PL_permission_error("clone_to", "rdf_graph", to);
+  } else
+  { free_copies(db, &copies);
+    rc = PL_resource_error("memory");
+  }
+  close_query(q);
+  free_triple_buffer(&triples);
+  free_triple_buffer(&copies);
+
+  return rc;
+}
+
+
+/* swap_graph_properties() exchanges the properties of two graphs that
+   describe their content.
+*/
+
+static void
+swap_graph_properties(rdf_db *db, graph *g1, graph *g2)
+{ atom_t source;
+  double modified;
+
+  LOCK_MISC(db);
+  source = g1->source;     g1->source   = g2->source;   g2->source   = source;
+  modified = g1->modified; g1->modified = g2->modified; g2->modified = modified;
+#ifdef WITH_MD5
+  { md5_byte_t digest[16];
+
+    memcpy(digest, g1->unmodified_digest, sizeof(digest));
+    memcpy(g1->unmodified_digest, g2->unmodified_digest, sizeof(digest));
+    memcpy(g2->unmodified_digest, digest, sizeof(digest));
+  }
+#endif
+  UNLOCK_MISC(db);
+}
+
+
+/** rdf_swap_graphs_(+Graph1, +Graph2, +Fast) is semidet.
+
+Exchange the triples of Graph1 and Graph2.  If Fast is `true`, do so in
+a single generation step or fail if this is not possible.  Else, we
+must be called inside a transaction.
+*/
+
+static foreign_t
+rdf_swap_graphs(term_t graph1, term_t graph2, term_t fast)
+{ rdf_db *db = rdf_current_db();
+  atom_t gn1, gn2;
+  graph *g1, *g2;
+  int is_fast;
+  triple_buffer triples, copies;
+  size_t count1;
+  query *q;
+  int rc;
+
+  if ( !PL_get_atom_ex(graph1, &gn1) ||
+       !PL_get_atom_ex(graph2, &gn2) ||
+       !PL_get_bool_ex(fast, &is_fast) )
+    return FALSE;
+  if ( gn1 == gn2 )
+    return TRUE;
+  if ( !(g1 = lookup_graph(db, gn1)) ||
+       !(g2 = lookup_graph(db, gn2)) )
+    return FALSE;
+
+  q = open_query(db);
+  if ( is_fast )
+  { if ( q->transaction ||
+	 g1->frozen || g2->frozen ||
+	 rdf_is_broadcasting(EV_RETRACT) ||
+	 rdf_is_broadcasting_batch(EV_RETRACT) ||
+	 graph_has_subproperties(q, g1) ||
+	 graph_has_subproperties(q, g2) )
+    { close_query(q);
+      return FALSE;
+    }
+  } else if ( !q->transaction )
+  { close_query(q);
+    return PL_permission_error("swap", "rdf_graph", graph1);
+  }
+
+  init_triple_buffer(&triples);
+  init_triple_buffer(&copies);
+  graph_triples(q, g1, &triples);
+  count1 = triples.top - triples.base;
+  graph_triples(q, g2, &triples);
+
+  if ( copy_triples(db, triples.base, triples.base+count1, gn2, &copies) &&
+       copy_triples(db, triples.base+count1, triples.top, gn1, &copies) )
+  { if ( is_fast )
+    { if ( (rc=swap_graphs(q, g1, g2,
+			   copies.base, copies.top-copies.base)) == -1 )
+	rc = FALSE;			/* concurrent change */
+    } else
+    { rc = ( del_triples(q, triples.base, triples.top-triples.base) &&
+	     add_triples(q, copies.base, copies.top-copies.base) );
+    }
+    if ( rc )
+      swap_graph_properties(db, g1, g2);
+  } else
+  { free_copies(db, &copies);
+    rc = PL_resource_error("memory");
+  }
+  close_query(q);
+  free_triple_buffer(&triples);
+  free_triple_buffer(&copies);
+
+  return rc;
+}
+
+
+		 /*******************************
+		 *	     MONITOR		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Monitors registered with the batch  option   (MONITOR_BATCH)  receive the
+triple events (EV_TRIPLES) not per  triple,   but  as  a single event
+batch(Event, Batch) per commit, where Batch is a handle to the affected
+triples (see rdf_broadcast_batch()). joined_mask  holds the events that
+must be broadcasted per triple, batch_mask the  events that must be
+broadcasted per batch.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define MONITOR_BATCH	0x10000		/* See monitor_mask/2 in rdf_db.pl */
+#define EV_TRIPLES	(EV_ASSERT|EV_ASSERT_LOAD|EV_RETRACT|EV_UPDATE)
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Monitors registered with the async(Size)  option   have  a queue.  The
+writer records the event into  the  queue's   ring  buffer  and a Prolog
+thread (see rdf_monitor/2) takes  them   out  using rdf_monitor_next_/2
+and calls the monitor. If the  queue  is   full,  the  policy decides:
+QUEUE_BLOCK waits for the monitor  thread,   QUEUE_DROP  discards the
+event and QUEUE_COALESCE merges it with the   youngest queued event into
+a single lost(Count) event. The events in EV_UNDER_LOCK are broadcast
+while holding a lock of the store, which the monitor thread may need to
+make progress. For these, QUEUE_BLOCK coalesces rather than waits.
+
+Setting the mask of an async monitor  to   0  closes  its queue. This
+discards the queued events and makes rdf_monitor_next_/2 fail, after
+which the monitor thread terminates. The  callback and queue are kept,
+as broadcasting threads may be using them,  and the queue is reopened
+if the monitor is registered again.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define QUEUE_BLOCK	0		/* Wait for space */
+#define QUEUE_DROP	1		/* Discard the event */
+#define QUEUE_COALESCE	2		/* Merge into lost(Count) */
+
+#define EV_UNDER_LOCK	EV_OLD_LITERAL	/* See free_literal_value() */
+#define QUEUE_POLL_MS	250		/* Check signals while waiting */
+
+typedef struct queued_event
+{ record_t		     record;	/* Recorded event (0: lost events) */
+  size_t		     lost;	/* # merged events if record is 0 */
+  int64_t		     queued;	/* wall_usec() when queued */
+} queued_event;
+
+typedef struct monitor_queue
+{ simpleMutex		     lock;	/* Guards the queue */
+  simpleCondition	     changed;	/* Signalled on put and get */
+  queued_event		    *events;	/* Ring buffer */
+  size_t		     size;	/* Allocated events */
+  size_t		     head;	/* Oldest event */
+  size_t		     count;	/* # queued events */
+  int			     policy;	/* QUEUE_* */
+  size_t		     lost;	/* # dropped or coalesced events */
+  int			     closed;	/* Mask was set to 0 */
+  int			     consumer;	/* A thread calls rdf_monitor_next_/2 */
+} monitor_queue;
+
+typedef struct broadcast_callback
+{ struct broadcast_callback *next;
+  predicate_t		     pred;
+  long			     mask;
+  monitor_queue		    *queue;	/* Queue of an async monitor */
+} broadcast_callback;
+
+static long joined_mask = 0L;
+static long batch_mask = 0L;
+static broadcast_callback *callback_list;
+static broadcast_callback *callback_tail;
+
+static int
+is_batch_callback(broadcast_callback *cb, long mask)
+{ return (cb->mask & MONITOR_BATCH) && (mask & EV_TRIPLES);
+}
+
+static void
+update_broadcast_masks(void)
+{ broadcast_callback *cb;
+  long joined = 0L, batch = 0L;
+
+  for(cb=callback_list; cb; cb = cb->next)
+  { if ( (cb->mask & MONITOR_BATCH) )
+    { batch  |= cb->mask & EV_TRIPLES;
+      joined |= cb->mask & ~(EV_TRIPLES|MONITOR_BATCH);
+    } else
+    { joined |= cb->mask;
+    }
+  }
+
+  joined_mask = joined;
+  batch_mask  = batch;
+  DEBUG(2, Sdprintf("Set mask to 0x%x, batch mask to 0x%x\n",
+		    joined_mask, batch_mask));
+}
+
+static monitor_queue *
+new_monitor_queue(size_t size, int policy)
+{ monitor_queue *mq;
+
+  if ( !(mq = PL_malloc(sizeof(*mq))) )
+    return NULL;
+  if ( !(mq->events = PL_malloc(size*sizeof(queued_event))) )
+  { PL_free(mq);
+    return NULL;
+  }
+  simpleMutexInit(&mq->lock);
+  simpleConditionInit(&mq->changed);
+  mq->size     = size;
+  mq->head     = 0;
+  mq->count    = 0;
+  mq->policy   = policy;
+  mq->lost     = 0;
+  mq->closed   = FALSE;
+  mq->consumer = TRUE;
+
+  return mq;
+}
+
+
+/* close_monitor_queue() discards the events and wakes up the monitor
+   thread, making rdf_monitor_next_/2 fail.
+*/
+
+static void
+close_monitor_queue(monitor_queue *mq)
+{ simpleMutexLock(&mq->lock);
+  if ( !mq->closed )
+  { for(; mq->count > 0; mq->count--)
+    { queued_event *e = &mq->events[mq->head];
+
+      if ( e->record )
+	PL_erase(e->record);
+      mq->head = (mq->head+1)%mq->size;
+    }
+    mq->closed = TRUE;
+    simpleConditionBroadcast(&mq->changed);
+  }
+  simpleMutexUnlock(&mq->lock);
+}
+
+
+/* reopen_monitor_queue() reopens a closed queue using a new size and
+   policy.  Returns TRUE if the caller must start a new monitor thread
+   and FALSE if the old one has not yet seen the queue was closed and
+   continues, or we are out of memory.
+*/
+
+static int
+reopen_monitor_queue(monitor_queue *mq, size_t size, int policy)
+{ queued_event *events;
+  int start;
+
+  if ( !(events = PL_malloc(size*sizeof(queued_event))) )
+    return FALSE;
+
+  simpleMutexLock(&mq->lock);
+  PL_free(mq->events);
+  mq->events = events;
+  mq->size   = size;
+  mq->head   = 0;
+  mq->count  = 0;
+  mq->policy = policy;
+  mq->closed = FALSE;
+  start = !mq->consumer;
+  mq->consumer = TRUE;
+  simpleMutexUnlock(&mq->lock);
+
+  return start;
+}
+
+
+static int
+queue_event(monitor_queue *mq, term_t term, int may_block)
+{ record_t r;
+  queued_event *e;
+
+  if ( mq->closed )
+    return TRUE;
+  if ( !(r = PL_record(term)) )
+    return FALSE;
+
+  simpleMutexLock(&mq->lock);
+  while ( mq->count == mq->size && mq->policy == QUEUE_BLOCK &&
+	  may_block && !mq->closed )
+    simpleConditionWait(&mq->changed, &mq->lock);
+
+  if ( mq->closed )
+  { simpleMutexUnlock(&mq->lock);
+    PL_erase(r);
+
+    return TRUE;
+  }
+
+  if ( mq->count == mq->size )
+  { if ( mq->policy != QUEUE_DROP )
+    { e = &mq->events[(mq->head+mq->count-1)%mq->size];
+
+      if ( e->record )
+      { PL_erase(e->record);
+	e->record = 0;
+	e->lost   = 1;
+	mq->lost++;
+      }
+      e->lost++;
+    }
+    mq->lost++;
+    simpleMutexUnlock(&mq->lock);
+    PL_erase(r);
+
+    return TRUE;
+  }
+
+  e = &mq->events[(mq->head+mq->count)%mq->size];
+  e->record = r;
+  e->lost   = 0;
+  e->queued = wall_usec();
+  mq->count++;
+  simpleConditionBroadcast(&mq->changed);
+  simpleMutexUnlock(&mq->lock);
+
+  return TRUE;
+}
+
+
+static int
+do_broadcast(term_t term, long mask, int batch)
+{ int may_block = !(mask & EV_UNDER_LOCK);
+
+  if ( callback_list )
+  { broadcast_callback *cb;
+
+    for(cb = callback_list; cb; cb = cb->next)
+    { qid_t qid;
+      term_t ex;
+
+      if ( !(cb->mask & mask) ||
+	   is_batch_callback(cb, mask) != batch )
+	continue;
+      if ( cb->queue )
+      { if ( !queue_event(cb->queue, term, may_block) )
+	  return FALSE;
+	continue;
+      }
+
+      if ( !(qid = PL_open_query(NULL, PL_Q_CATCH_EXCEPTION, cb->pred, term)) )
+	return FALSE;
+      if ( !PL_next_solution(qid) && (ex = PL_exception(qid)) )
+      { term_t av;
+
+	PL_cut_query(qid);
+
+	if ( (av = PL_new_term_refs(2)) &&
+	     PL_put_atom(av+0, ATOM_error) &&
+	     PL_put_term(av+1, ex) )
+	  PL_call_predicate(NULL, PL_Q_NORMAL,
+			    PL_predicate("print_message", 2, "user"),
+			    av);
+	return FALSE;
+      } else
+      { PL_close_query(qid);
+      }
+    }
+  }
+
+  return TRUE;
+}
+
+
+int
+rdf_is_broadcasting(broadcast_id id)
+{ return (joined_mask & id) != 0;
+}
+
+
+int
+rdf_broadcast(broadcast_id id, void *a1, void *a2)
+{ int rc = TRUE;
+
+  if ( (joined_mask & id) )
+  { fid_t fid;
+    term_t term;
+    functor_t funct;
+
+    if ( !(fid = PL_open_foreign_frame()) ||
+	 !(term = PL_new_term_ref()) )
+      return FALSE;
+
+    switch(id)
+    { case EV_ASSERT:
+      case EV_ASSERT_LOAD:
+	funct = FUNCTOR_assert4;
+        goto assert_retract;
+      case EV_RETRACT:
+	funct = FUNCTOR_retract4;
+      assert_retract:
+      { triple *t = a1;
+	term_t tmp;
+
+	if ( !(tmp = PL_new_term_refs(4)) ||
+	     !PL_put_atom(tmp+0, ID_ATOM(t->subject_id)) ||
+	     !PL_put_atom(tmp+1, t->predicate.r->name) ||
+	     !unify_object(tmp+2, t) ||
+	     !unify_graph(tmp+3, t) ||
+	     !PL_cons_functor_v(term, funct, tmp) )
+	  return FALSE;
+	break;
+      }
+      case EV_UPDATE:
+      { triple *t = a1;
+	triple *new = a2;
+	term_t tmp, a;
+	functor_t action;
+	int rc;
+
+	if ( !(tmp = PL_new_term_refs(5)) ||
+	     !(a = PL_new_term_ref()) ||
+	     !PL_put_atom(tmp+0, ID_ATOM(t->subject_id)) ||
+	     !PL_put_atom(tmp+1, t->predicate.r->name) ||
+	     !unify_object(tmp+2, t) ||
+	     !unify_graph(tmp+3, t) )
+	  return FALSE;
+
+	if ( t->subject_id != new->subject_id )
+	{ action = FUNCTOR_subject1;
+	  rc = PL_put_atom(a, ID_ATOM(new->subject_id));
+	} else if ( t->predicate.r != new->predicate.r )
+	{ action = FUNCTOR_predicate1;
+	  rc = PL_put_atom(a, new->predicate.r->name);
+	} else if ( !match_object(t, new, MATCH_QUAL) )
+	{ action = FUNCTOR_object1;
+	  rc = unify_object(a, new);
+	} else if ( !same_graph(t, new) )
+	{ action = FUNCTOR_graph1;
+	  rc = unify_graph(a, new);
+	} else
+	{ return TRUE;			/* no change */
+	}
+
+        if ( !rc ||
+	     !PL_cons_functor_v(tmp+4, action, a) ||
+	     !PL_cons_functor_v(term, FUNCTOR_update5, tmp) )
+	  return FALSE;
+	break;
+      }
+      case EV_NEW_LITERAL:
+      { literal *lit = a1;
+	term_t tmp;
+
+	if ( !(tmp = PL_new_term_refs(1)) ||
+	     !unify_literal(tmp, lit) ||
+	     !PL_cons_functor_v(term, FUNCTOR_new_literal1, tmp) )
+	  return FALSE;
+	break;
+      }
+      case EV_OLD_LITERAL:
+      { literal *lit = a1;
+	term_t tmp;
+
+	if ( !(tmp = PL_new_term_refs(1)) ||
+	     !unify_literal(tmp, lit) ||
+	     !PL_cons_functor_v(term, FUNCTOR_old_literal1, tmp) )
+	  return FALSE;
+	break;
+      }
+      case EV_LOAD:
+      { term_t ctx = (term_t)a1;
+	term_t be  = (term_t)a2;
+	term_t tmp;
+
+	if ( !(tmp = PL_new_term_refs(2)) ||
+	     !PL_put_term(tmp+0, be) ||		/* begin/end(graphs) */
+	     !PL_put_term(tmp+1, ctx) ||
+	     !PL_cons_functor_v(term, FUNCTOR_load2, tmp) )
+	  return FALSE;
+	break;
+      }
+      case EV_TRANSACTION:
+      { term_t ctx = (term_t)a1;
+	term_t be  = (term_t)a2;
+	term_t tmp;
+
+	if ( !(tmp = PL_new_term_refs(2)) ||
+	     !PL_put_term(tmp+0, be) ||		/* begin/end */
+	     !PL_put_term(tmp+1, ctx) ||
+	     !PL_cons_functor_v(term, FUNCTOR_transaction2, tmp) )
+	  return FALSE;
+	break;
+      }
+      case EV_CREATE_GRAPH:
+      { graph *g = a1;
+	term_t tmp;
+
+	if ( !(tmp = PL_new_term_refs(1)) ||
+	     !(PL_put_atom(tmp, g->name)) ||
+	     !PL_cons_functor_v(term, FUNCTOR_create_graph1, tmp) )
+	  return FALSE;
+	break;
+      }
+      default:
+	assert(0);
+    }
+
+    rc = do_broadcast(term, id, FALSE);
+
+    PL_discard_foreign_frame(fid);
+  }
+
+  return rc;
+}
+
+
+int
+rdf_is_broadcasting_batch(broadcast_id id)
+{ return (batch_mask & id) != 0;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A triple batch is the handle passed  to   batch  monitors.  It refers to
+the triples of the commit and is only   valid  while the monitors are
+running. For EV_UPDATE, triples holds  old/new   pairs.  The  handle is
+invalidated afterwards and released by atom-GC.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct triple_batch
+{ broadcast_id	id;			/* EV_* of the triples */
+  triple      **triples;		/* NULL if no longer valid */
+  size_t	count;			/* # triples */
+} triple_batch;
+
+static int
+release_triple_batch(atom_t symbol)
+{ triple_batch *b = PL_blob_data(symbol, NULL, NULL);
+
+  PL_free(b);
+
+  return TRUE;
+}
+
+static int
+write_triple_batch(IOSTREAM *s, atom_t symbol, int flags)
+{ triple_batch *b = PL_blob_data(symbol, NULL, NULL);
+
+  Sfprintf(s, "<rdf-triple-batch>(%p)", b);
+
+  return TRUE;
+}
+
+static PL_blob_t triple_batch_blob =
+{ PL_BLOB_MAGIC,
+  PL_BLOB_NOCOPY|PL_BLOB_UNIQUE,
+  "rdf_triple_batch",
+  release_triple_batch,
+  NULL,
+  write_triple_batch,
+  NULL
+};
+
+
+static int
+get_triple_batch(term_t t, triple_batch **bp)
+{ PL_blob_t *type;
+  void *data;
+
+  if ( PL_get_blob(t, &data, NULL, &type) && type == &triple_batch_blob )
+  { triple_batch *b = data;
+
+    if ( b->triples )
+    { *bp = b;
+      return TRUE;
+    }
+
+    return PL_existence_error("rdf_triple_batch", t);
+  }
+
+  return PL_type_error("rdf_triple_batch", t);
+}
+
+
+static int
+put_batch_event(term_t t, broadcast_id id)
+{ switch(id)
+  { case EV_ASSERT:
+      return PL_put_atom(t, ATOM_assert);
+    case EV_ASSERT_LOAD:
+      return PL_unify_term(t, PL_FUNCTOR, FUNCTOR_assert1,
+			        PL_ATOM, ATOM_load);
+    case EV_RETRACT:
+      return PL_put_atom(t, ATOM_retract);
+    case EV_UPDATE:
+      return PL_put_atom(t, ATOM_update);
+    default:
+      assert(0);
+      return FALSE;
+  }
+}
+
+
+/* rdf_broadcast_batch() broadcasts batch(Event, Batch) to the batch
+   monitors for id.  For EV_UPDATE, triples holds count/2 old/new pairs.
+*/
+
+int
+rdf_broadcast_batch(broadcast_id id, triple **triples, size_t count)
+{ int rc = TRUE;
+
+  if ( (batch_mask & id) && count > 0 )
+  { fid_t fid;
+    term_t term, av;
+    triple_batch *b;
+
+    if ( !(fid = PL_open_foreign_frame()) )
+      return FALSE;
+    if ( !(b = PL_malloc(sizeof(*b))) )
+    { PL_discard_foreign_frame(fid);
+      return PL_resource_error("memory");
+    }
+    b->id      = id;
+    b->triples = triples;
+    b->count   = count;
+
+    if ( !(term = PL_new_term_ref()) ||
+	 !(av = PL_new_term_refs(2)) ||
+	 !put_batch_event(av+0, id) ||
+	 !PL_unify_blob(av+1, b, sizeof(*b), &triple_batch_blob) )
+    { PL_free(b);
+      PL_discard_foreign_frame(fid);
+      return FALSE;
+    }
+
+    rc = ( PL_cons_functor_v(term, FUNCTOR_batch2, av) &&
+	   do_broadcast(term, id, TRUE) );
+
+    b->triples = NULL;			/* invalidate the handle */
+    b->count   = 0;
+    PL_discard_foreign_frame(fid);
+  }
+
+  return rc;
+}
+
+
+static int
+put_rdf_triple(term_t t, triple *t3)
+{ term_t av;
+
+  return ( (av = PL_new_term_refs(4)) &&
+	   PL_put_atom(av+0, ID_ATOM(t3->subject_id)) &&
+	   PL_put_atom(av+1, t3->predicate.r->name) &&
+	   unify_object(av+2, t3) &&
+	   unify_graph(av+3, t3) &&
+	   PL_cons_functor_v(t, FUNCTOR_rdf4, av) );
+}
+
+
+/** rdf_batch_triple(+Batch, -Triple) is nondet.
+
+    Enumerate the triples of a batch as rdf(S,P,O,G).  For an update
+    batch, Triple is update(Old, New).
+*/
+
+static foreign_t
+rdf_batch_triple(term_t batch, term_t triple_t, control_t h)
+{ triple_batch *b;
+  size_t i;
+  size_t step;
+  term_t tmp;
+  fid_t fid;
+
+  switch( PL_foreign_control(h) )
+  { case PL_FIRST_CALL:
+      i = 0;
+      break;
+    case PL_REDO:
+      i = PL_foreign_context(h);
+      break;
+    case PL_PRUNED:
+      return TRUE;
+    default:
+      assert(0);
+      return FALSE;
+  }
+
+  if ( !get_triple_batch(batch, &b) )
+    return FALSE;
+  step = (b->id == EV_UPDATE ? 2 : 1);
+  if ( !(tmp = PL_new_term_ref()) ||
+       !(fid = PL_open_foreign_frame()) )
+    return FALSE;
+
+  for(; i+step <= b->count; i += step)
+  { int rc;
+
+    if ( step == 2 )
+    { term_t av;
+
+      rc = ( (av = PL_new_term_refs(2)) &&
+	     put_rdf_triple(av+0, b->triples[i]) &&
+	     put_rdf_triple(av+1, b->triples[i+1]) &&
+	     PL_cons_functor_v(tmp, FUNCTOR_update2, av) );
+    } else
+    { rc = put_rdf_triple(tmp, b->triples[i]);
+    }
+
+    if ( rc && PL_unify(triple_t, tmp) )
+    { PL_close_foreign_frame(fid);
+      if ( i+step < b->count )
+	PL_retry(i+step);
+      return TRUE;
+    }
+    if ( PL_exception(0) )
+    { PL_close_foreign_frame(fid);
+      return FALSE;
+    }
+    PL_rewind_foreign_frame(fid);
+  }
+
+  PL_close_foreign_frame(fid);
+  return FALSE;
+}
+
+
+/** rdf_batch_size(+Batch, -Count) is det.
+
+    Count is the number of triples (or old/new pairs for an update
+    batch) in Batch.
+*/
+
+static foreign_t
+rdf_batch_size(term_t batch, term_t count)
+{ triple_batch *b;
+
+  if ( !get_triple_batch(batch, &b) )
+    return FALSE;
+
+  return PL_unify_int64(count, b->id == EV_UPDATE ? b->count/2 : b->count);
+}
+
+
+static int
+get_monitor_pred(term_t goal, predicate_t *pp)
+{ atom_t name;
+  module_t m = NULL;
+  term_t plain = PL_new_term_ref();
+
+  if ( !PL_strip_module(goal, &m, plain) ||
+       !PL_get_atom_ex(plain, &name) )
+    return FALSE;
+
+  *pp = PL_pred(PL_new_functor(name, 1), m);
+  return TRUE;
+}
+
+
+static broadcast_callback *
+find_callback(predicate_t p)
+{ broadcast_callback *cb;
+
+  for(cb=callback_list; cb; cb = cb->next)
+  { if ( cb->pred == p )
+      return cb;
+  }
+
+  return NULL;
+}
+
+
+static void
+add_callback(predicate_t p, long msk, monitor_queue *mq)
+{ broadcast_callback *cb = PL_malloc(sizeof(*cb));
+
+  cb->next  = NULL;
+  cb->mask  = msk;
+  cb->pred  = p;
+  cb->queue = mq;
+  if ( callback_list )
+  { callback_tail->next = cb;
+    callback_tail = cb;
+  } else
+  { callback_list = callback_tail = cb;
+  }
+  update_broadcast_masks();
+}
+
+
+static foreign_t
+rdf_monitor(term_t goal, term_t mask)
+{ broadcast_callback *cb;
+  predicate_t p;
+  long msk;
+
+  if ( !get_monitor_pred(goal, &p) ||
+       !PL_get_long_ex(mask, &msk) )
+    return FALSE;
+
+  if ( (cb=find_callback(p)) )
+  { if ( cb->queue )
+    { if ( msk == 0 )
+	close_monitor_queue(cb->queue);
+      else if ( cb->queue->closed )	/* use rdf_monitor_async_/4 */
+	return PL_permission_error("monitor", "rdf_monitor", goal);
+    }
+    cb->mask = msk;
+    update_broadcast_masks();
+  } else
+  { add_callback(p, msk, NULL);
+  }
+
+  return TRUE;
+}
+
+
+/** rdf_monitor_async_(:Goal, +Mask, +Size, +Policy) is semidet.
+
+    As rdf_monitor_/2, but events are queued.  Succeeds if a new
+    queue was created or a closed one was reopened, in which case the
+    caller must start a thread that calls rdf_monitor_next_/2.  The
+    queue of an existing async monitor is not changed, unless Mask is
+    0, which closes it.
+*/
+
+static foreign_t
+rdf_monitor_async(term_t goal, term_t mask, term_t size, term_t policy)
+{ broadcast_callback *cb;
+  monitor_queue *mq;
+  predicate_t p;
+  long msk;
+  int64_t sz;
+  atom_t a;
+  int pol;
+
+  if ( !get_monitor_pred(goal, &p) ||
+       !PL_get_long_ex(mask, &msk) ||
+       !PL_get_int64_ex(size, &sz) ||
+       !PL_get_atom_ex(policy, &a) )
+    return FALSE;
+  if ( sz < 1 )
+    return PL_domain_error("positive_integer", size);
+  if ( a == ATOM_block )
+    pol = QUEUE_BLOCK;
+  else if ( a == ATOM_drop )
+    pol = QUEUE_DROP;
+  else if ( a == ATOM_coalesce )
+    pol = QUEUE_COALESCE;
+  else
+    return PL_domain_error("rdf_monitor_queue_policy", policy);
+
+  if ( (cb=find_callback(p)) )
+  { int start = FALSE;
+
+    if ( !cb->queue )
+      return PL_permission_error("async", "rdf_monitor", goal);
+    if ( msk == 0 )
+      close_monitor_queue(cb->queue);
+    else if ( cb->queue->closed )
+      start = reopen_monitor_queue(cb->queue, (size_t)sz, pol);
+    cb->mask = msk;
+    update_broadcast_masks();
+    return start;
+  }
+  if ( msk == 0 )
+    return FALSE;
+
+  if ( !(mq = new_monitor_queue((size_t)sz, pol)) )
+    return PL_resource_error("memory");
+  add_callback(p, msk, mq);
+
+  return TRUE;
+}
+
+
+/** rdf_monitor_next_(:Goal, -Event) is det.
+
+    Wait for and remove the oldest event from the queue of the async
+    monitor Goal.  Event is lost(Count) if Count events were coalesced.
+    Fails if the queue is closed.  Signals are handled while waiting.
+*/
+
+static foreign_t
+rdf_monitor_next(term_t goal, term_t event)
+{ broadcast_callback *cb;
+  monitor_queue *mq;
+  queued_event e;
+  predicate_t p;
+
+  if ( !get_monitor_pred(goal, &p) )
+    return FALSE;
+  if ( !(cb=find_callback(p)) || !(mq=cb->queue) )
+    return PL_existence_error("rdf_monitor_queue", goal);
+
+  simpleMutexLock(&mq->lock);
+  while ( mq->count == 0 && !mq->closed )
+  { simpleConditionTimedWait(&mq->changed, &mq->lock, QUEUE_POLL_MS);
+    if ( mq->count == 0 && !mq->closed )
+    { int rc;
+
+      simpleMutexUnlock(&mq->lock);
+      rc = PL_handle_signals();
+      simpleMutexLock(&mq->lock);
+      if ( rc < 0 )
+      { mq->consumer = FALSE;
+	simpleMutexUnlock(&mq->lock);
+	return FALSE;
+      }
+    }
+  }
+  if ( mq->closed )
+  { mq->consumer = FALSE;
+    simpleMutexUnlock(&mq->lock);
+    return FALSE;
+  }
+  e = mq->events[mq->head];
+  mq->head = (mq->head+1)%mq->size;
+  mq->count--;
+  simpleConditionBroadcast(&mq->changed);
+  simpleMutexUnlock(&mq->lock);
+
+  if ( e.record )
+  { term_t tmp = PL_new_term_ref();
+    int rc = PL_recorded(e.record, tmp);
+
+    PL_erase(e.record);
+    return rc && PL_unify(event, tmp);
+  } else
+  { return PL_unify_term(event, PL_FUNCTOR, FUNCTOR_lost1,
+				  PL_INT64, (int64_t)e.lost);
+  }
+}
+
+
+/** rdf_monitor_queues_(-List) is det.
+
+    List holds a term queue(Goal, Depth, Lag, Lost) for each async
+    monitor.  Depth is the number of queued events, Lag the time in
+    seconds the oldest of them is waiting and Lost the number of events
+    that were dropped or coalesced.
+*/
+
+static foreign_t
+rdf_monitor_queues(term_t list)
+{ term_t tail = PL_copy_term_ref(list);
+  term_t head = PL_new_term_ref();
+  term_t av   = PL_new_term_refs(4);
+  broadcast_callback *cb;
+
+  for(cb=callback_list; cb; cb = cb->next)
+  { monitor_queue *mq;
+    atom_t name;
+    int arity;
+    module_t m;
+    size_t depth, lost;
+    double lag = 0.0;
+
+    if ( !(mq=cb->queue) || mq->closed )
+      continue;
+
+    simpleMutexLock(&mq->lock);
+    depth = mq->count;
+    lost  = mq->lost;
+    if ( depth > 0 )
+      lag = (double)(wall_usec() - mq->events[mq->head].queued)/1000000.0;
+    simpleMutexUnlock(&mq->lock);
+
+    PL_predicate_info(cb->pred, &name, &arity, &m);
+    if ( !PL_put_variable(av+0) ||
+	 !PL_unify_term(av+0, PL_FUNCTOR, FUNCTOR_colon2,
+				PL_ATOM, PL_module_name(m),
+				PL_ATOM, name) ||
+	 !PL_put_int64(av+1, depth) ||
+	 !PL_put_float(av+2, lag) ||
+	 !PL_put_int64(av+3, lost) ||
+	 !PL_unify_list(tail, head, tail) ||
+	 !PL_unify_term(head, PL_FUNCTOR, FUNCTOR_queue4,
+				PL_TERM, av+0,
+				PL_TERM, av+1,
+				PL_TERM, av+2,
+				PL_TERM, av+3) )
+      return FALSE;
+  }
+
+  return PL_unify_nil(tail);
+}
+
+
+static foreign_t
+rdf_set_predicate(term_t pred, term_t option)
+{ predicate *p;
+  rdf_db *db = rdf_current_db();
+  query *q = open_query(db);
+  int rc;
+
+  if ( !get_predicate(db, pred, &p, q) )
+  { rc = FALSE;
+    goto out;
+  }
+
+  if ( PL_is_functor(option, FUNCTOR_symmetric1) )
+  { int val;
+
+    if ( !get_bool_arg_ex(1, option, &val) )
+    { rc = FALSE;
+      goto out;
+    }
+
+    if ( val )
+      p->inverse_of = p;
+    else
+      p->inverse_of = NULL;
+
+    rc = TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_inverse_of1) )
+  { term_t a = PL_new_term_ref();
+    predicate *i;
+
+    _PL_get_arg(1, option, a);
+    if ( PL_get_nil(a) )
+    { if ( p->inverse_of )
+      { p->inverse_of->inverse_of = NULL;
+	p->inverse_of = NULL;
+      }
+    } else
+    { if ( !get_predicate(db, a, &i, q) )
+      { rc = FALSE;
+	goto out;
+      }
+
+      p->inverse_of = i;
+      i->inverse_of = p;
+    }
+    rc = TRUE;
+  } else if ( PL_is_functor(option, FUNCTOR_transitive1) )
+  { int val;
+
+    if ( !get_bool_arg_ex(1, option, &val) )
+      return FALSE;
+
+    p->transitive = val;
+
+    rc = TRUE;
+  } else
+    rc = PL_type_error("predicate_option", option);
+
+out:
+  close_query(q);
+  return rc;
+}
+
+
+#define PRED_PROPERTY_COUNT 9
+static functor_t predicate_key[PRED_PROPERTY_COUNT];
+
+static int
+unify_predicate_property(rdf_db *db, predicate *p, term_t option,
+			 functor_t f, query *q)
+{ if ( f == FUNCTOR_symmetric1 )
+    return PL_unify_term(option, PL_FUNCTOR, f,
+			 PL_BOOL, p->inverse_of == p ? TRUE : FALSE);
+  else if ( f == FUNCTOR_inverse_of1 )
+  { if ( p->inverse_of )
+      return PL_unify_term(option, PL_FUNCTOR, f,
+			   PL_ATOM, p->inverse_of->name);
+    else
+      return FALSE;
+  } else if ( f == FUNCTOR_transitive1 )
+  { return PL_unify_term(option, PL_FUNCTOR, f,
+			 PL_BOOL, p->transitive);
+  } else if ( f == FUNCTOR_triples1 )
+  { return PL_unify_term(option, PL_FUNCTOR, f,
+			 PL_LONG, p->triple_count);
+  } else if ( f == FUNCTOR_rdf_subject_branch_factor1 )
+  { return PL_unify_term(option, PL_FUNCTOR, f,
+		 PL_FLOAT, subject_branch_factor(db, p, q, DISTINCT_DIRECT));
+  } else if ( f == FUNCTOR_rdf_object_branch_factor1 )
+  { return PL_unify_term(option, PL_FUNCTOR, f,
+		 PL_FLOAT, object_branch_factor(db, p, q, DISTINCT_DIRECT));
+  } else if ( f == FUNCTOR_rdfs_subject_branch_factor1 )
+  { return PL_unify_term(option, PL_FUNCTOR, f,
+		 PL_FLOAT, subject_branch_factor(db, p, q, DISTINCT_SUB));
+  } else if ( f == FUNCTOR_rdfs_object_branch_factor1 )
+  { return PL_unify_term(option, PL_FUNCTOR, f,
+		 PL_FLOAT, object_branch_factor(db, p, q, DISTINCT_SUB));
+  } else
+  { assert(0);
+    return FALSE;
+  }
+}
 
-  if ( state->has_literal_state )
-  { literal **litp;
 
-    if ( (litp = skiplist_find_next(&state->literal_state)) )
-    { literal *lit = *litp;
+typedef struct enum_pred
+{ predicate *p;
+  int i;
+} enum_pred;
 
-      DEBUG(2, Sdprintf("next: ");
-	       print_literal(lit);
-	       Sdprintf("\n"));
 
-      switch(state->pattern.match)
-      { case STR_MATCH_PREFIX:
-	{ if ( !match_atoms(STR_MATCH_PREFIX, state->prefix, lit->value.string) )
-	  { DEBUG(1,
-		  Sdprintf("PREFIX: terminated literal iteration from ");
-		  print_literal(lit);
-		  Sdprintf("\n"));
-	    return FALSE;			/* no longer a prefix */
-	  }
+static foreign_t
+rdf_current_predicate(term_t name, control_t h)
+{ rdf_db *db = rdf_current_db();
+  predicate *p;
+  enum_pred *ep;
+  atom_t a;
+
+  switch( PL_foreign_control(h) )
+  { case PL_FIRST_CALL:
+      if ( PL_is_variable(name) )
+      { ep = rdf_malloc(db, sizeof(*ep));
+	ep->i  = 0;
+	ep->p  = NULL;
+	goto next;
+      } else if ( PL_get_atom_ex(name, &a) )
+      { predicate *p;
+
+	if ( (p=existing_predicate(db, a)) )
+	  return TRUE;
+      }
+      return FALSE;
+    case PL_REDO:
+      ep = PL_foreign_context_address(h);
+      goto next;
+    case PL_PRUNED:
+      ep = PL_foreign_context_address(h);
+      rdf_free(db, ep, sizeof(*ep));
+      return TRUE;
+    default:
+      assert(0);
+      return FALSE;
+  }
+
+next:
+  if ( !(p=ep->p) )
+  { while (!(p = db->predicates.blocks[MSB(ep->i)][ep->i]) )
+    { if ( ++ep->i >= db->predicates.bucket_count )
+	goto fail;
+    }
+  }
+
+  if ( !PL_unify_atom(name, p->name) )
+  { fail:
+    rdf_free(db, ep, sizeof(*ep));
+    return FALSE;
+  }
+
+  if ( !(ep->p = p->next) )
+  { if ( ++ep->i >= db->predicates.bucket_count )
+      goto fail;
+  }
+  PL_retry_address(ep);
+}
+
+
+static foreign_t
+rdf_predicate_property(term_t pred, term_t option, control_t h)
+{ predicate *p;
+  rdf_db *db = rdf_current_db();
+  query *q;
+
+  if ( !predicate_key[0] )
+  { int i = 0;
+
+    predicate_key[i++] = FUNCTOR_symmetric1;
+    predicate_key[i++] = FUNCTOR_inverse_of1;
+    predicate_key[i++] = FUNCTOR_transitive1;
+    predicate_key[i++] = FUNCTOR_triples1;
+    predicate_key[i++] = FUNCTOR_rdf_subject_branch_factor1;
+    predicate_key[i++] = FUNCTOR_rdf_object_branch_factor1;
+    predicate_key[i++] = FUNCTOR_rdfs_subject_branch_factor1;
+    predicate_key[i++] = FUNCTOR_rdfs_object_branch_factor1;
+    assert(i < PRED_PROPERTY_COUNT);
+  }
 
-	  break;
+  switch(PL_foreign_control(h))
+  { case PL_FIRST_CALL:
+    { functor_t f;
+      int rc;
+
+      q = open_query(db);
+      if ( PL_is_variable(option) )
+      { q->state.predprop.prop = 0;
+	if ( !get_predicate(db, pred, &q->state.predprop.pred, q) )
+	{ close_query(q);
+	  return FALSE;
 	}
-	case STR_MATCH_LE:
-	case STR_MATCH_BETWEEN:
-	{ if ( compare_literals(&state->lit_ex, lit) < 0 )
-	  { DEBUG(1,
-		  Sdprintf("LE/BETWEEN(");
-		  print_literal(state->lit_ex.literal);
-		  Sdprintf("): terminated literal iteration from ");
-		  print_literal(lit);
-		  Sdprintf("\n"));
-	    return FALSE;			/* no longer a prefix */
-	  }
+	goto redo;
+      } else if ( PL_get_functor(option, &f) )
+      { int n;
 
-	  break;
+	for(n=0; predicate_key[n]; n++)
+	{ if ( predicate_key[n] == f )
+	  { if ( !get_predicate(db, pred, &p, q) )
+	      return FALSE;
+	    rc = unify_predicate_property(db, p, option, f, q);
+	    goto out;
+	  }
+	}
+	rc = PL_domain_error("rdf_predicate_property", option);
+      } else
+	rc = PL_type_error("rdf_predicate_property", option);
+    out:
+      close_query(q);
+      return rc;
+    }
+    case PL_REDO:
+      q = PL_foreign_context_address(h);
+    redo:
+      for( ; predicate_key[q->state.predprop.prop]; q->state.predprop.prop++ )
+      { if ( unify_predicate_property(db,
+				      q->state.predprop.pred,
+				      option,
+				      predicate_key[q->state.predprop.prop],
+				      q) )
+	{ q->state.predprop.prop++;
+	  if ( predicate_key[q->state.predprop.prop] )
+	    PL_retry_address(q);
+	  return TRUE;
 	}
       }
-
-      init_cursor_from_literal(state, lit);
+      return FALSE;
+    case PL_PRUNED:
+      q = PL_foreign_context_address(h);
+      close_query(q);
+      return TRUE;
+    default:
+      assert(0);
       return TRUE;
-    }
   }
+}
 
-  if ( next_sub_property(state) )	/* redo search with alternative hash */
-  { if ( state->restart_lit )
-    { state->literal_state = state->restart_lit_state;
-      init_cursor_from_literal(state, state->restart_lit);
-    }
 
-    return TRUE;
+		 /*******************************
+		 *     TRANSITIVE RELATIONS	*
+		 *******************************/
+
+static visited *
+alloc_node_agenda(rdf_db *db, agenda *a)
+{ chunk *c;
+  int size;
+
+  if ( (c=a->chunk) )
+  { if ( c->used < c->size )
+    { visited *v = &c->nodes[c->used++];
+
+      return v;
+    }
   }
 
-  if ( (state->flags&MATCH_INVERSE) &&
-       inverse_partial_triple(p) )
-  { DEBUG(1, Sdprintf("Retrying inverse: "); print_triple(p, PRT_NL));
-    state->p_cloud = NULL;
-    init_triple_walker(tw, state->db, p, p->indexed);
+  size = (a->size == 0 ? 8 : 1024);
+  c = rdf_malloc(db, CHUNK_SIZE(size));
+  c->size = size;
+  c->used = 1;
+  c->next = a->chunk;
+  a->chunk = c;
 
-    return TRUE;
+  return &c->nodes[0];
+}
+
+
+static void
+empty_agenda(rdf_db *db, agenda *a)
+{ chunk *c, *n;
+
+  for(c=a->chunk; c; c = n)
+  { n = c->next;
+    rdf_free(db, c, CHUNK_SIZE(c->size));
   }
+  if ( a->hash )
+    rdf_free(db, a->hash, sizeof(visited*)*a->hash_size);
 
-  return FALSE;
+  if ( a->query )
+    close_query(a->query);
+}
+
+
+static void
+hash_agenda(rdf_db *db, agenda *a, int size)
+{ if ( a->hash )
+    rdf_free(db, a->hash, sizeof(*a->hash));
+  if ( size > 0 )
+  { visited *v;
+
+    a->hash = rdf_malloc(db, sizeof(visited*)*size);
+    memset(a->hash, 0, sizeof(visited*)*size);
+    a->hash_size = size;
+
+    for(v=a->head; v; v = v->next)
+    { int key = atom_hash(v->resource, MURMUR_SEED)&(size-1);
+
+      v->hash_link = a->hash[key];
+      a->hash[key] = v;
+    }
+  }
 }
 
 
 static int
-next_search_state(search_state *state)
-{ triple *t, *t2;
-  triple_walker *tw = &state->cursor;
-  triple *p = &state->pattern;
-  term_t retpred;
+in_agenda(agenda *a, atom_t resource)
+{ visited *v;
 
-  if ( (state->flags & MATCH_SUBPROPERTY) )
-  { retpred = state->realpred;
-    if ( retpred )
-    { if ( PL_is_variable(state->predicate) )
-      { if ( !PL_unify(state->predicate, retpred) )
-	  return FALSE;
-      }
-    } else
-    { if ( PL_is_variable(state->predicate) )
-	retpred = state->predicate;
+  if ( a->hash )
+  { int key = atom_hash(resource, MURMUR_SEED)&(a->hash_size-1);
+    v = a->hash[key];
+
+    for( ; v; v = v->hash_link )
+    { if ( v->resource == resource )
+	return TRUE;
     }
   } else
-  { retpred = state->predicate;
+  { v = a->head;
+
+    for( ; v; v = v->next )
+    { if ( v->resource == resource )
+	return TRUE;
+    }
   }
 
-  if ( (t2=state->prefetched) )
-  { state->prefetched = NULL;		/* retrying; to need to check */
-    goto retry;
+  return FALSE;
+}
+
+
+static visited *
+append_agenda(rdf_db *db, agenda *a, atom_t res, uintptr_t d)
+{ visited *v = a->head;
+
+  if ( in_agenda(a, res) )
+    return NULL;
+
+  db->agenda_created++;			/* statistics */
+
+  a->size++;
+  if ( !a->hash_size && a->size > 32 )
+    hash_agenda(db, a, 64);
+  else if ( a->size > a->hash_size * 4 )
+    hash_agenda(db, a, a->hash_size * 4);
+
+  v = alloc_node_agenda(db, a);
+  v->resource = res;
+  v->distance = d;
+  v->next = NULL;
+  if ( a->tail )
+  { a->tail->next = v;
+    a->tail = v;
+  } else
+  { a->head = a->tail = v;
   }
 
-  do
-  { while( (t = next_triple(tw)) )
-    { DEBUG(3, Sdprintf("Search: ");
-	       print_triple(t, PRT_SRC|PRT_GEN|PRT_NL|PRT_ADR));
+  if ( a->hash_size )
+  { int key = atom_hash(res, MURMUR_SEED)&(a->hash_size-1);
 
-      if ( (t2=is_candidate(state, t)) )
-      { int rc;
+    v->hash_link = a->hash[key];
+    a->hash[key] = v;
+  }
 
-      retry:
-	if ( (rc=unify_triple(state->subject, retpred, state->object,
-			      state->src, t2, p->inversed)) == FALSE )
-	  continue;
-	if ( rc == ERROR )
-	  return FALSE;			/* makes rdf/3 return FALSE */
+  return v;
+}
 
-	do
-	{ while( (t = next_triple(tw)) )
-	  { DEBUG(3, Sdprintf("Search (prefetch): ");
-		  print_triple(t, PRT_SRC|PRT_GEN|PRT_NL|PRT_ADR));
 
-	    if ( (t2=is_candidate(state, t)) )
-	    { state->prefetched = t2;
+static int
+can_reach_target(rdf_db *db, agenda *a, query *q)
+{ triple_walker tw;
+  int indexed = a->pattern.indexed;
+  int rc = FALSE;
+  triple *p;
 
-	      return TRUE;		/* non-deterministic */
-	    }
-	  }
-	} while(next_pattern(state));
+  if ( indexed & BY_S )			/* subj ---> */
+  { a->pattern.object.resource = a->target;
+    indexed |= BY_O;
+  } else
+  { a->pattern.subject_id = ATOM_ID(a->target);
+    indexed |= BY_S;
+  }
 
-	return TRUE;			/* deterministic */
-      }
+  init_triple_walker(&tw, db, &a->pattern, indexed);
+  while((p=next_triple(&tw)))
+  { if ( match_triples(db, p, &a->pattern, q, MATCH_SUBPROPERTY) )
+    { rc = TRUE;
+      break;
     }
-  } while(next_pattern(state));
+  }
+
+  if ( a->pattern.indexed & BY_S )
+  { a->pattern.object.resource = 0;
+  } else
+  { a->pattern.subject_id = 0;
+  }
 
-  return FALSE;
+  return rc;
 }
 
 
 
-static foreign_t
-rdf(term_t subject, term_t predicate, term_t object,
-    term_t src, term_t realpred, control_t h, unsigned flags)
-{ rdf_db *db = rdf_current_db();
-  search_state *state;
+static visited *
+bf_expand(rdf_db *db, agenda *a, atom_t resource, uintptr_t d, query *q)
+{ search_state state;
+  visited *rc = NULL;
 
-  switch(PL_foreign_control(h))
-  { case PL_FIRST_CALL:
-    { query *q = open_query(db);
+  state.pattern = a->pattern;		/* Structure copy */
+  state.flags   = MATCH_SUBPROPERTY|MATCH_INVERSE;
+  state.p_cloud = NULL;
+  state.query   = q;
+  state.db      = db;
 
-      state = &q->state.search;
-      state->query     = q;
-      state->db	       = db;
-      state->subject   = subject;
-      state->object    = object;
-      state->predicate = predicate;
-      state->src       = src;
-      state->realpred  = realpred;
-      state->flags     = flags;
-						/* clear the rest */
-      memset(&state->cursor, 0,
-	     (char*)&state->lit_ex - (char*)&state->cursor);
-      state->dup_answers.entries = NULL;	/* see add_tripleset() */
+  if ( state.pattern.indexed & BY_S )		/* subj ---> */
+  { state.pattern.subject_id = ATOM_ID(resource);
+  } else
+  { state.pattern.object.resource = resource;
+  }
 
-      if ( !init_search_state(state, q) )
-      { free_search_state(state);
-	return FALSE;
-      }
+  if ( a->target && can_reach_target(db, a, q) )
+    return append_agenda(db, a, a->target, d);
 
-      goto search;
-    }
-    case PL_REDO:
-    { int rc;
+  for(;;)
+  { int indexed = state.pattern.indexed;
+    triple *p;
 
-      state = PL_foreign_context_address(h);
-      assert(state->subject == subject);
+    init_triple_walker(&state.cursor, db, &state.pattern, indexed);
+    while((p=next_triple(&state.cursor)))
+    { if ( !alive_triple(a->query, p) )
+	continue;
 
-    search:
-      if ( (rc=next_search_state(state)) )
-      { if ( state->prefetched )
-	  return allow_retry_state(state);
-      }
+      if ( match_triples(db, p, &state.pattern, a->query, MATCH_SUBPROPERTY) )
+      { atom_t found;
+	visited *v;
 
-      free_search_state(state);
-      return rc;
-    }
-    case PL_PRUNED:
-    { state = PL_foreign_context_address(h);
+	if ( indexed & BY_S )
+	{ if ( p->object_is_literal )
+	    continue;
+	  found = p->object.resource;
+	} else
+	{ found = ID_ATOM(p->subject_id);
+	}
 
-      free_search_state(state);
-      return TRUE;
+	v = append_agenda(db, a, found, d);
+	if ( !rc )
+	  rc = v;
+	if ( found == a->target )
+	  return rc;
+      }
     }
-    default:
-      assert(0);
-      return FALSE;
+    if ( next_sub_property(&state) )
+      continue;
+    if ( inverse_partial_triple(&state.pattern) )
+    { state.p_cloud = NULL;
+      continue;
+    }
+    break;
   }
+					/* TBD: handle owl:sameAs */
+  return rc;
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-rdf(Subject, Predicate, Object)
-
-Search specifications:
-
-	Predicate:
+static int
+peek_agenda(rdf_db *db, agenda *a)
+{ if ( a->to_return )
+    return TRUE;
 
-		subPropertyOf(X) = P
+  while( a->to_expand )
+  { uintptr_t next_d = a->to_expand->distance+1;
 
-	Object:
+    if ( next_d >= a->max_d )
+      return FALSE;
 
-		literal(substring(X), L)
-		literal(word(X), L)
-		literal(exact(X), L)
-		literal(prefix(X), L)
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+    a->to_return = bf_expand(db, a,
+			     a->to_expand->resource,
+			     next_d,
+			     a->query);
+    a->to_expand = a->to_expand->next;
 
+    if ( a->to_return )
+      return TRUE;
+  }
 
-static foreign_t
-rdf3(term_t subject, term_t predicate, term_t object, control_t h)
-{ return rdf(subject, predicate, object, 0, 0, h,
-	     MATCH_EXACT);
+  return FALSE;
 }
 
-static foreign_t
-rdf4(term_t subject, term_t predicate, term_t object,
-     term_t src, control_t h)
-{ return rdf(subject, predicate, object, src, 0, h,
-	     MATCH_EXACT|MATCH_SRC);
-}
 
+static visited *
+next_agenda(rdf_db *db, agenda *a)
+{ if ( peek_agenda(db, a) )
+  { visited *v = a->to_return;
 
-static foreign_t
-rdf_has3(term_t subject, term_t predicate, term_t object, control_t h)
-{ return rdf(subject, predicate, object, 0, 0, h,
-	     MATCH_SUBPROPERTY|MATCH_INVERSE);
-}
+    a->to_return = a->to_return->next;
 
+    return v;
+  }
 
-static foreign_t
-rdf_has4(term_t subject, term_t predicate, term_t object,
-	term_t realpred, control_t h)
-{ return rdf(subject, predicate, object, 0, realpred, h,
-	     MATCH_SUBPROPERTY|MATCH_INVERSE);
+  return NULL;
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-rdf_estimate_complexity(+S,+P,+O,-C)
+rdf_reachable(+Subject, +Predicate, -Object)
+rdf_reachable(-Subject, +Predicate, ?Object)
+    Examine transitive relations, reporting all `Object' that can be
+    reached from `Subject' using Predicate without going into a loop
+    if the relation is cyclic.
+
+directly_attached() deals with the posibility that  the predicate is not
+defined and Subject and Object are  the   same.  Should  use clean error
+handling, but that means a lot of changes. For now this will do.
 
+TBD:	Implement bi-directional search if both Subject and Object are
+	given.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static foreign_t
-rdf_estimate_complexity(term_t subject, term_t predicate, term_t object,
-		        term_t complexity)
-{ triple t;
-  size_t c;
-  rdf_db *db = rdf_current_db();
-  int rc;
+static int
+directly_attached(term_t pred, term_t from, term_t to)
+{ if ( PL_is_atom(pred) && PL_is_atom(from) )
+    return PL_unify(to, from);
 
-  memset(&t, 0, sizeof(t));
-  if ( (rc=get_partial_triple(db, subject, predicate, object, 0, &t)) != TRUE )
-  { if ( rc == -1 )
-    { return FALSE;			/* error */
-    } else
-    { return PL_unify_integer(complexity, 0);	/* no predicate */
-    }
-  }
+  return FALSE;
+}
 
-  if ( t.indexed == BY_NONE )
-  { c = db->created - db->erased;		/* = totale triple count */
-#if 0
-  } else if ( t.indexed == BY_P )
-  { c = t.predicate.r->triple_count;		/* must sum over children */
-#endif
-  } else
-  { size_t key = triple_hash_key(&t, t.indexed);
-    int icol = ICOL(t.indexed);
-    triple_hash *hash = &db->hash[icol];
-    size_t count;
 
-    if ( !db->hash[icol].created )
-      create_triple_hashes(db, 1, &icol);
+static int
+unify_distance(term_t d, uintptr_t dist)
+{ if ( d )
+    return PL_unify_integer(d, dist);
 
-    c = 0;
-    for(count=hash->bucket_count_epoch; count <= hash->bucket_count; count *= 2)
-    { int entry = key%count;
-      triple_bucket *bucket = &hash->blocks[MSB(entry)][entry];
+  return TRUE;
+}
 
-      c += bucket->count;		/* TBD: compensate for resize */
-    }
-  }
 
-  rc = PL_unify_int64(complexity, c);
-  free_triple(db, &t, FALSE);
+static foreign_t
+rdf_reachable(term_t subj, term_t pred, term_t obj,
+	      term_t max_d, term_t d,
+	      control_t h)
+{ rdf_db *db = rdf_current_db();
+  query *q;
 
-  return rc;
-}
+  switch(PL_foreign_control(h))
+  { case PL_FIRST_CALL:
+    { visited *v;
+      agenda *a;
+      term_t target_term;
+      int is_det = FALSE;
 
+      if ( PL_is_variable(pred) )
+	return PL_instantiation_error(pred);
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-current_literal(?Literals)
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+      q = open_query(db);
+      a = &q->state.tr_search;
+      memset(a, 0, sizeof(*a));
+      a->query = q;
+
+      if ( max_d )
+      { long md;
+	atom_t inf;
+
+	if ( PL_get_atom(max_d, &inf) && inf == ATOM_infinite )
+	{ a->max_d = (uintptr_t)-1;
+	} else
+	{ if ( !PL_get_long_ex(max_d, &md) || md < 0 )
+	  { close_query(q);
+	    return FALSE;
+	  }
+	  a->max_d = md;
+	}
+      } else
+      { a->max_d = (uintptr_t)-1;
+      }
+
+      if ( !PL_is_variable(subj) )		/* subj .... obj */
+      { switch(get_partial_triple(db, subj, pred, 0, 0, &a->pattern))
+	{ case 0:
+	  { record_read(q, NULL, FALSE);
+	    close_query(q);
+	    return directly_attached(pred, subj, obj) &&
+		   unify_distance(d, 0);
+	  }
+	  case -1:
+	  { close_query(q);
+	    return FALSE;
+	  }
+	}
+	is_det = PL_is_ground(obj);
+	if ( a->pattern.object_is_literal )
+	{ close_query(q);
+	  return FALSE;			/* rdf_reachable(literal(...),?,?) */
+	}
+	target_term = obj;
+      } else if ( !PL_is_variable(obj) )	/* obj .... subj */
+      {	switch(get_partial_triple(db, 0, pred, obj, 0, &a->pattern))
+	{ case 0:
+	  { record_read(q, NULL, FALSE);
+	    close_query(q);
+	    return directly_attached(pred, obj, subj);
+	  }
+	  case -1:
+	  { close_query(q);
+	    return FALSE;
+	  }
+	}
+	if ( a->pattern.object_is_literal )
+	{ close_query(q);
+	  return FALSE;			/* rdf_reachable(-,+,literal(...)) */
+	}
+	target_term = subj;
+      } else
+      { close_query(q);
+	return PL_instantiation_error(subj);
+      }
 
-static foreign_t
-rdf_current_literal(term_t t, control_t h)
-{ rdf_db *db = rdf_current_db();
-  literal **data;
-  skiplist_enum *state;
-  int rc;
+      record_read(q, a->pattern.predicate.r, TRUE);
+      if ( (a->pattern.indexed & BY_S) )		/* subj ... */
+	append_agenda(db, a, ID_ATOM(a->pattern.subject_id), 0);
+      else
+	append_agenda(db, a, a->pattern.object.resource, 0);
+      a->to_return = a->head;
+      a->to_expand = a->head;
 
-  switch(PL_foreign_control(h))
-  { case PL_FIRST_CALL:
-      if ( PL_is_variable(t) )
-      { state = rdf_malloc(db, sizeof(*state));
+      while( (v=next_agenda(db, a)) )
+      { if ( PL_unify_atom(target_term, v->resource) )
+	{ if ( is_det )		/* mode(+, +, +) */
+	  { int rc = unify_distance(d, v->distance);
+	    empty_agenda(db, a);
+	    return rc;
+	  } else if ( unify_distance(d, v->distance) )
+	  {				/* mode(+, +, -) or mode(-, +, +) */
+	    if ( peek_agenda(db, a) )
+	      PL_retry_address(a);
 
-	data = skiplist_find_first(&db->literals, NULL, state);
-	goto next;
-      } else
-      { return FALSE;			/* TBD */
+	    empty_agenda(db, a);
+	    return TRUE;
+	  }
+	}
       }
+      empty_agenda(db, a);
+      return FALSE;
+    }
     case PL_REDO:
-      state = PL_foreign_context_address(h);
-      data  = skiplist_find_next(state);
-    next:
-      for(; data; data=skiplist_find_next(state))
-      { literal *lit = *data;
+    { agenda *a = PL_foreign_context_address(h);
+      term_t target_term;
+      visited *v;
 
-	if ( unify_literal(t, lit) )
-	{ PL_retry_address(state);
+      if ( !PL_is_variable(subj) )	/* +, +, - */
+	target_term = obj;
+      else
+	target_term = subj;		/* -, +, + */
+
+      while( (v=next_agenda(db, a)) )
+      { if ( PL_unify_atom(target_term, v->resource) &&
+	     unify_distance(d, v->distance) )
+	{ if ( peek_agenda(db, a) )
+	  { PL_retry_address(a);
+	  } else
+	  { empty_agenda(db, a);
+	    return TRUE;
+	  }
 	}
       }
 
-      rc = FALSE;
-      goto cleanup;
+      empty_agenda(db, a);
+      return FALSE;
+    }
     case PL_PRUNED:
-      rc = TRUE;
+    { agenda *a = PL_foreign_context_address(h);
 
-    cleanup:
-      state = PL_foreign_context_address(h);
-      rdf_free(db, state, sizeof(*state));
+      DEBUG(9, Sdprintf("Cutted; agenda = %p\n", a));
 
-      return rc;
+      empty_agenda(db, a);
+      return TRUE;
+    }
     default:
       assert(0);
       return FALSE;
   }
 }
 
+static foreign_t
+rdf_reachable3(term_t subj, term_t pred, term_t obj, control_t h)
+{ return rdf_reachable(subj, pred, obj, 0, 0, h);
+}
 
-static int
-update_triple(rdf_db *db, term_t action, triple *t, triple **updated, query *q)
-{ term_t a = PL_new_term_ref();
-  triple tmp, *new;
-					/* Create copy in local memory */
-  tmp = *t;
+static foreign_t
+rdf_reachable5(term_t subj, term_t pred, term_t obj, term_t max_d, term_t d,
+	       control_t h)
+{ return rdf_reachable(subj, pred, obj, max_d, d, h);
+}
 
-  if ( !PL_get_arg(1, action, a) )
-    return PL_type_error("rdf_action", action);
 
-  if ( PL_is_functor(action, FUNCTOR_subject1) )
-  { atom_t s;
+		 /*******************************
+		 *	     STATISTICS		*
+		 *******************************/
 
-    if ( !PL_get_atom_ex(a, &s) )
-      return FALSE;
-    if ( tmp.subject_id == ATOM_ID(s) )
-      return TRUE;			/* no change */
+static functor_t keys[16];		/* initialised in install_rdf_db() */
 
-    tmp.subject_id = ATOM_ID(s);
-  } else if ( PL_is_functor(action, FUNCTOR_predicate1) )
-  { predicate *p;
+static int
+unify_statistics(rdf_db *db, term_t key, functor_t f)
+{ int64_t v;
 
-    if ( !get_predicate(db, a, &p, q) )
-      return FALSE;
-    if ( tmp.predicate.r == p )
-      return TRUE;			/* no change */
+  if ( f == FUNCTOR_triples1 )
+  { v = db->created - db->erased;
+  } else if ( f == FUNCTOR_resources1 )
+  { v = db->resources.hash.count;
+  } else if ( f == FUNCTOR_predicates1 )
+  { v = db->predicates.count;
+  } else if ( f == FUNCTOR_graphs1 )
+  { v = db->graphs.count;
+  } else if ( f == FUNCTOR_indexed16 )
+  { int i;
+    term_t a = PL_new_term_ref();
 
-    tmp.predicate.r = p;
-  } else if ( PL_is_functor(action, FUNCTOR_object1) )
-  { triple t2;
+    if ( !PL_unify_functor(key, FUNCTOR_indexed16) )
+      return FALSE;
+    for(i=0; i<16; i++)
+    { if ( !PL_get_arg(i+1, key, a) ||
+	   !PL_unify_integer(a, db->indexed[i]) )
+	return FALSE;
+    }
 
-    memset(&t2, 0, sizeof(t2));
+    return TRUE;
+  } else if ( f == FUNCTOR_hash_quality1 )
+  { term_t tail, list = PL_new_term_ref();
+    term_t head = PL_new_term_ref();
+    term_t tmp = PL_new_term_ref();
+    term_t av = PL_new_term_refs(4);
+    int i;
 
-    if ( !get_object(db, a, &t2) )
-    { free_triple(db, &t2, FALSE);
+    if ( !PL_unify_functor(key, FUNCTOR_hash_quality1) )
       return FALSE;
-    }
-    if ( match_object(&t2, &tmp, MATCH_QUAL) )
-    { free_triple(db, &t2, FALSE);
-      return TRUE;
-    }
+    _PL_get_arg(1, key, list);
+    tail = PL_copy_term_ref(list);
 
-    if ( (tmp.object_is_literal = t2.object_is_literal) )
-    { tmp.object.literal = t2.object.literal;
-    } else
-    { tmp.object.resource = t2.object.resource;
+    for(i=1; i<INDEX_TABLES; i++)
+    { if ( db->hash[i].created )
+      { if ( !PL_unify_list(tail, head, tail) ||
+	     !PL_put_integer(av+0, col_index[i]) ||
+	     !PL_put_integer(av+1, db->hash[i].bucket_count) ||
+	     !PL_put_float(av+2, triple_hash_quality(db, i, 1024)) ||
+	     !PL_put_integer(av+3, MSB(db->hash[i].bucket_count)-
+				   MSB(db->hash[i].bucket_count_epoch)) ||
+	     !PL_cons_functor_v(tmp, FUNCTOR_hash4, av) ||
+	     !PL_unify(head, tmp) )
+	  return FALSE;
+      }
     }
-  } else if ( PL_is_functor(action, FUNCTOR_graph1) )
-  { triple t2;
 
-    if ( !get_graph(a, &t2) )
+    return PL_unify_nil(tail);
+  } else if ( f == FUNCTOR_searched_nodes1 )
+  { v = db->agenda_created;
+  } else if ( f == FUNCTOR_duplicates1 )
+  { if ( db->duplicates_up_to_date == FALSE )
       return FALSE;
-    if ( t2.graph_id == t->graph_id && t2.line == t->line )
-    { *updated = NULL;
-      return TRUE;
-    }
+    v = db->duplicates;
+  } else if ( f == FUNCTOR_literals1 )
+  { v = db->literals.count;
+  } else if ( f == FUNCTOR_frozen_triples1 )
+  { v = db->frozen.triples;
+  } else if ( f == FUNCTOR_triple_size2 )
+  { return PL_unify_term(key,
+			 PL_FUNCTOR, f,
+			   PL_INT64, (int64_t)TRIPLE_SIZE(db->indexes.slots),
+			   PL_INT64, (int64_t)db->indexes.overflowed);
+  } else if ( f == FUNCTOR_triples2 && PL_is_functor(key, f) )
+  { graph *src;
+    term_t a = PL_new_term_ref();
+    atom_t name;
 
-    tmp.graph_id = t2.graph_id;
-    tmp.line = t2.line;
-  } else
-    return PL_domain_error("rdf_action", action);
+    _PL_get_arg(1, key, a);
+    if ( !PL_get_atom_ex(a, &name) )
+      return FALSE;
+    if ( (src = existing_graph(db, name)) )
+      v = src->triple_count;
+    else
+      v = 0;
 
-  new = new_triple(db);
-  new->subject_id	 = tmp.subject_id;
-  new->predicate.r	 = tmp.predicate.r;
-  if ( (new->object_is_literal = tmp.object_is_literal) )
-  { if ( tmp.object.literal->shared )
-    { simpleMutexLock(&db->locks.literal);
-      new->object.literal = copy_literal(db, tmp.object.literal);
-      simpleMutexUnlock(&db->locks.literal);
-    } else
-    { new->object.literal = tmp.object.literal;
-    }
+    _PL_get_arg(2, key, a);
+    return PL_unify_int64(a, v);
+  } else if ( f == FUNCTOR_gc4 )
+  { return PL_unify_term(key,
+			 PL_FUNCTOR, f,
+			   PL_INT,   (int)db->gc.count,
+			   PL_INT64, (int64_t)db->gc.reclaimed_triples,
+			   PL_INT64, (int64_t)db->reindexed,
+			   PL_FLOAT, (double)db->gc.time);	/* time spent */
+  } else if ( f == FUNCTOR_group_commit2 )
+  { return PL_unify_term(key,
+			 PL_FUNCTOR, f,
+			   PL_INT64, (int64_t)db->queries.write.group.groups,
+			   PL_INT64, (int64_t)db->queries.write.group.commits);
   } else
-  { new->object.resource = tmp.object.resource;
+  { assert(0);
+    return FALSE;
   }
-  new->graph_id		 = tmp.graph_id;
-  new->line		 = tmp.line;
-
-  lock_atoms(db, new);
-
-  *updated = new;
 
-  return TRUE;
+  return PL_unify_term(key, PL_FUNCTOR, f, PL_INT64, v);
 }
 
-
-/** rdf_update(+Subject, +Predicate, +Object, +Action) is det.
-
-Update a triple. Please note this is actually erase+assert
-*/
-
 static foreign_t
-rdf_update5(term_t subject, term_t predicate, term_t object, term_t src,
-	    term_t action)
-{ triple t, *p;
-  int indexed = BY_SPO;
+rdf_statistics(term_t key, control_t h)
+{ int n;
   rdf_db *db = rdf_current_db();
-  int rc = TRUE;
-  size_t count;
-  triple_walker tw;
-  triple_buffer matches;
-  query *q = open_query(db);
 
-  memset(&t, 0, sizeof(t));
+  switch(PL_foreign_control(h))
+  { case PL_FIRST_CALL:
+    { functor_t f;
 
-  if ( !get_src(src, &t) ||
-       !get_triple(db, subject, predicate, object, &t, q) )
-  { close_query(q);
-    return FALSE;
+      if ( PL_is_variable(key) )
+      { n = 0;
+	goto redo;
+      } else if ( PL_get_functor(key, &f) )
+      { for(n=0; keys[n]; n++)
+	{ if ( keys[n] == f )
+	    return unify_statistics(db, key, f);
+	}
+	return PL_domain_error("rdf_statistics", key);
+      } else
+	return PL_type_error("rdf_statistics", key);
+    }
+    case PL_REDO:
+      n = (int)PL_foreign_context(h);
+    redo:
+      unify_statistics(db, key, keys[n]);
+      n++;
+      if ( keys[n] )
+	PL_retry(n);
+    case PL_PRUNED:
+      return TRUE;
+    default:
+      assert(0);
+      return TRUE;
   }
+}
 
-  init_triple_buffer(&matches);
-  init_triple_walker(&tw, db, &t, indexed);
-  while((p=next_triple(&tw)))
-  { if ( !(p=alive_triple(q, p)) )
-      continue;
 
-    if ( match_triples(db, p, &t, q, MATCH_EXACT) )
-      buffer_triple(&matches, p);
-  }
+/** rdf_generation(-Generation) is det.
 
-  if ( !is_empty_buffer(&matches) )
-  { triple_buffer replacements;
-    triple *new, **tp;
+    True when Generation is the current reading generation.  If we are
+    inside a modified transaction, Generation has the format Base+TrGen,
+    where TrGen expresses the generation inside the transaction.
+*/
 
-    count = matches.top-matches.base;
-    init_triple_buffer(&replacements);
-    for(tp=matches.base; tp<matches.top; tp++)
-    { new = NULL;
-      if ( !update_triple(db, action, *tp, &new, q) )
-      { rc = FALSE;
-	free_triple_buffer(&replacements);
-	goto out;
-      }
+static foreign_t
+rdf_generation(term_t t)
+{ rdf_db *db = rdf_current_db();
+  query *q = open_query(db);
+  int rc;
 
-      buffer_triple(&replacements, new);
-    }
+  if ( q->tr_gen > q->stack->tr_gen_base )
+  { assert(q->tr_gen < q->stack->tr_gen_max);
 
-    update_triples(q, matches.base, replacements.base, count);
-    free_triple_buffer(&replacements);
+    rc = PL_unify_term(t, PL_FUNCTOR, FUNCTOR_plus2,
+		            PL_INT64, q->rd_gen,
+		            PL_INT64, q->tr_gen - q->stack->tr_gen_base);
   } else
-  { count = 0;
+  { rc = PL_unify_int64(t, q->rd_gen);
   }
 
-out:
   close_query(q);
-  free_triple_buffer(&matches);
-  free_triple(db, &t, FALSE);
 
-  return (rc && count > 0) ? TRUE : FALSE;
+  return rc;
 }
 
 
-static foreign_t
-rdf_update(term_t subject, term_t predicate, term_t object, term_t action)
-{ return rdf_update5(subject, predicate, object, 0, action);
-}
+/** rdf_snapshot(-Snapshot) is det.
 
+    True when Snapshot is a handle to the current state of the database.
+*/
 
 static foreign_t
-rdf_retractall4(term_t subject, term_t predicate, term_t object, term_t src)
-{ triple t, *p;
-  rdf_db *db = rdf_current_db();
-  triple_walker tw;
-  triple_buffer buf;
-  query *q;
-
-  memset(&t, 0, sizeof(t));
-  switch( get_partial_triple(db, subject, predicate, object, src, &t) )
-  { case 0:				/* no such predicate */
-      return TRUE;
-    case -1:				/* error */
-      return FALSE;
-  }
-
-  if ( t.graph_id )		/* speedup for rdf_retractall(_,_,_,DB) */
-  { graph *gr = existing_graph(db, ID_ATOM(t.graph_id));
+rdf_snapshot(term_t t)
+{ rdf_db *db = rdf_current_db();
+  snapshot *s = new_snapshot(db);
 
-    if ( !gr || gr->triple_count == 0 )
-      return TRUE;
-  }
+  return unify_snapshot(t, s);
+}
 
-  init_triple_buffer(&buf);
-  q = open_query(db);
-  init_triple_walker(&tw, db, &t, t.indexed);
-  while((p=next_triple(&tw)))
-  { if ( !(p=alive_triple(q, p)) )
-      continue;
 
-    if ( match_triples(db, p, &t, q, MATCH_EXACT|MATCH_SRC) )
-    { if ( t.object_is_literal && t.object.literal->objtype == OBJ_TERM )
-      { fid_t fid = PL_open_foreign_frame();
-	int rc = unify_object(object, p);
-	PL_discard_foreign_frame(fid);
-	if ( !rc )
-	  continue;
-      }
+		 /*******************************
+		 *	      CHANGE LOG	*
+		 *******************************/
 
-      buffer_triple(&buf, p);
-    }
-  }
-  free_triple(db, &t, FALSE);
-  del_triples(q, buf.base, buf.top-buf.base);
-  close_query(q);
-  free_triple_buffer(&buf);
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The change log records the triples added and deleted and the graphs
+dropped, in generation order.  It is only maintained while there are
+subscriptions.  A  subscription  has  a  position:  the  generation
+upto which its owner has consumed the changes.  The log keeps
+
+  - All changes after the oldest position.  Older blocks are freed by
+    trim_changes().
+  - The triples it refers to.  oldest_query_geneneration() does not
+    pass the oldest position (db->changes.keep), such that GC keeps the
+    deleted triples, and not the oldest reindexed counter of the oldest
+    block (db->changes.reindex_keep), such that GC keeps the old
+    versions of triples that were reindexed after they were logged.
+
+Changes are appended by commit_triple_gen() and log_graph_drop() holding
+db->queries.write.lock.  Readers and trim_changes() hold db->locks.misc.
+As trim_changes() never frees the tail block, appending only needs the
+lock to link a new block.  Changes are published before incrementing
+the block's count and before the generation is advanced.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+static void
+log_change(rdf_db *db, int op, void *value, gen_t gen)
+{ change_block *b = db->changes.tail;
+  change *c;
 
-  return TRUE;
-}
+  if ( !b || b->count == CHANGE_BLOCK_SIZE )
+  { change_block *nb = rdf_malloc(db, sizeof(*nb));
 
+    nb->next      = NULL;
+    nb->reindexed = db->reindexed;
+    nb->count     = 0;
 
-static foreign_t
-rdf_retractall3(term_t subject, term_t predicate, term_t object)
-{ return rdf_retractall4(subject, predicate, object, 0);
+    simpleMutexLock(&db->locks.misc);
+    if ( b )
+      b->next = nb;
+    else
+      db->changes.head = nb;
+    db->changes.tail = nb;
+    if ( db->changes.head == nb )
+      db->changes.reindex_keep = nb->reindexed;
+    simpleMutexUnlock(&db->locks.misc);
+    b = nb;
+  }
+
+  c = &b->changes[b->count];
+  c->gen = gen;
+  c->op  = op;
+  if ( op == CHANGE_DROP )
+    c->value.graph = value;
+  else
+    c->value.triple = value;
+  MEMORY_BARRIER();
+  b->count++;
 }
 
 
-		 /*******************************
-		 *	     MONITOR		*
-		 *******************************/
-
-typedef struct broadcast_callback
-{ struct broadcast_callback *next;
-  predicate_t		     pred;
-  long			     mask;
-} broadcast_callback;
+/* log_graph_drop() is called by drop_graph() and swap_graphs() when
+   dropping g becomes visible at gen.  We log the drop rather than the
+   triples of the graph.
 
-static long joined_mask = 0L;
-static broadcast_callback *callback_list;
-static broadcast_callback *callback_tail;
+   MT: Caller must be hold db->queries.write.lock
+*/
 
-static int
-do_broadcast(term_t term, long mask)
-{ if ( callback_list )
-  { broadcast_callback *cb;
+void
+log_graph_drop(rdf_db *db, graph *g, gen_t gen)
+{ if ( db->changes.subscribers )
+    log_change(db, CHANGE_DROP, g, gen);
+}
 
-    for(cb = callback_list; cb; cb = cb->next)
-    { qid_t qid;
-      term_t ex;
 
-      if ( !(cb->mask & mask) )
-	continue;
+/* trim_changes() frees the blocks that only hold changes consumed
+   by all subscriptions.
 
-      if ( !(qid = PL_open_query(NULL, PL_Q_CATCH_EXCEPTION, cb->pred, term)) )
-	return FALSE;
-      if ( !PL_next_solution(qid) && (ex = PL_exception(qid)) )
-      { term_t av;
+   MT: Caller must hold db->locks.misc
+*/
 
-	PL_cut_query(qid);
+static void
+trim_changes(rdf_db *db)
+{ change_block *b;
 
-	if ( (av = PL_new_term_refs(2)) &&
-	     PL_put_atom(av+0, ATOM_error) &&
-	     PL_put_term(av+1, ex) )
-	  PL_call_predicate(NULL, PL_Q_NORMAL,
-			    PL_predicate("print_message", 2, "user"),
-			    av);
-	return FALSE;
-      } else
-      { PL_close_query(qid);
-      }
-    }
+  while( (b=db->changes.head) && b != db->changes.tail &&
+	 b->changes[b->count-1].gen <= db->changes.keep )
+  { db->changes.head = b->next;
+    rdf_free(db, b, sizeof(*b));
   }
 
-  return TRUE;
-}
-
-
-int
-rdf_is_broadcasting(broadcast_id id)
-{ return (joined_mask & id) != 0;
+  db->changes.reindex_keep = ( db->changes.head ? db->changes.head->reindexed
+						: GEN_MAX );
 }
 
 
-int
-rdf_broadcast(broadcast_id id, void *a1, void *a2)
-{ int rc = TRUE;
-
-  if ( (joined_mask & id) )
-  { fid_t fid;
-    term_t term;
-    functor_t funct;
-
-    if ( !(fid = PL_open_foreign_frame()) ||
-	 !(term = PL_new_term_ref()) )
-      return FALSE;
+/* MT: Caller must hold db->locks.misc
+*/
 
-    switch(id)
-    { case EV_ASSERT:
-      case EV_ASSERT_LOAD:
-	funct = FUNCTOR_assert4;
-        goto assert_retract;
-      case EV_RETRACT:
-	funct = FUNCTOR_retract4;
-      assert_retract:
-      { triple *t = a1;
-	term_t tmp;
+static void
+update_keep_changes(rdf_db *db)
+{ gen_t keep = GEN_MAX;
+  change_subscription *s;
 
-	if ( !(tmp = PL_new_term_refs(4)) ||
-	     !PL_put_atom(tmp+0, ID_ATOM(t->subject_id)) ||
-	     !PL_put_atom(tmp+1, t->predicate.r->name) ||
-	     !unify_object(tmp+2, t) ||
-	     !unify_graph(tmp+3, t) ||
-	     !PL_cons_functor_v(term, funct, tmp) )
-	  return FALSE;
-	break;
-      }
-      case EV_UPDATE:
-      { triple *t = a1;
-	triple *new = a2;
-	term_t tmp, a;
-	functor_t action;
-	int rc;
+  for(s=db->changes.subscriptions; s; s=s->next)
+  { if ( s->position < keep )
+      keep = s->position;
+  }
 
-	if ( !(tmp = PL_new_term_refs(5)) ||
-	     !(a = PL_new_term_ref()) ||
-	     !PL_put_atom(tmp+0, ID_ATOM(t->subject_id)) ||
-	     !PL_put_atom(tmp+1, t->predicate.r->name) ||
-	     !unify_object(tmp+2, t) ||
-	     !unify_graph(tmp+3, t) )
-	  return FALSE;
+  db->changes.keep = keep;
+  trim_changes(db);
+}
 
-	if ( t->subject_id != new->subject_id )
-	{ action = FUNCTOR_subject1;
-	  rc = PL_put_atom(a, ID_ATOM(new->subject_id));
-	} else if ( t->predicate.r != new->predicate.r )
-	{ action = FUNCTOR_predicate1;
-	  rc = PL_put_atom(a, new->predicate.r->name);
-	} else if ( !match_object(t, new, MATCH_QUAL) )
-	{ action = FUNCTOR_object1;
-	  rc = unify_object(a, new);
-	} else if ( !same_graph(t, new) )
-	{ action = FUNCTOR_graph1;
-	  rc = unify_graph(a, new);
-	} else
-	{ return TRUE;			/* no change */
-	}
 
-        if ( !rc ||
-	     !PL_cons_functor_v(tmp+4, action, a) ||
-	     !PL_cons_functor_v(term, FUNCTOR_update5, tmp) )
-	  return FALSE;
-	break;
-      }
-      case EV_NEW_LITERAL:
-      { literal *lit = a1;
-	term_t tmp;
+/* MT: Caller must hold db->queries.write.lock and db->locks.misc
+*/
 
-	if ( !(tmp = PL_new_term_refs(1)) ||
-	     !unify_literal(tmp, lit) ||
-	     !PL_cons_functor_v(term, FUNCTOR_new_literal1, tmp) )
-	  return FALSE;
-	break;
-      }
-      case EV_OLD_LITERAL:
-      { literal *lit = a1;
-	term_t tmp;
+static void
+free_change_log(rdf_db *db)
+{ change_block *b, *next;
 
-	if ( !(tmp = PL_new_term_refs(1)) ||
-	     !unify_literal(tmp, lit) ||
-	     !PL_cons_functor_v(term, FUNCTOR_old_literal1, tmp) )
-	  return FALSE;
-	break;
-      }
-      case EV_LOAD:
-      { term_t ctx = (term_t)a1;
-	term_t be  = (term_t)a2;
-	term_t tmp;
+  for(b=db->changes.head; b; b=next)
+  { next = b->next;
+    rdf_free(db, b, sizeof(*b));
+  }
+  db->changes.head = db->changes.tail = NULL;
+  db->changes.keep = GEN_MAX;
+  db->changes.reindex_keep = GEN_MAX;
+}
 
-	if ( !(tmp = PL_new_term_refs(2)) ||
-	     !PL_put_term(tmp+0, be) ||		/* begin/end(graphs) */
-	     !PL_put_term(tmp+1, ctx) ||
-	     !PL_cons_functor_v(term, FUNCTOR_load2, tmp) )
-	  return FALSE;
-	break;
-      }
-      case EV_TRANSACTION:
-      { term_t ctx = (term_t)a1;
-	term_t be  = (term_t)a2;
-	term_t tmp;
 
-	if ( !(tmp = PL_new_term_refs(2)) ||
-	     !PL_put_term(tmp+0, be) ||		/* begin/end */
-	     !PL_put_term(tmp+1, ctx) ||
-	     !PL_cons_functor_v(term, FUNCTOR_transaction2, tmp) )
-	  return FALSE;
-	break;
-      }
-      case EV_CREATE_GRAPH:
-      { graph *g = a1;
-	term_t tmp;
+/* The initial position is the current generation.  We hold the write
+   lock such that all changes after it are logged.
+*/
 
-	if ( !(tmp = PL_new_term_refs(1)) ||
-	     !(PL_put_atom(tmp, g->name)) ||
-	     !PL_cons_functor_v(term, FUNCTOR_create_graph1, tmp) )
-	  return FALSE;
-	break;
-      }
-      default:
-	assert(0);
-    }
+static change_subscription *
+new_change_subscription(rdf_db *db)
+{ change_subscription *s = rdf_malloc(db, sizeof(*s));
 
-    rc = do_broadcast(term, id);
+  s->db     = db;
+  s->symbol = 0;
+  s->prev   = NULL;
 
-    PL_discard_foreign_frame(fid);
+  simpleMutexLock(&db->queries.write.lock);
+  simpleMutexLock(&db->locks.misc);
+  s->position = db->queries.generation;
+  if ( (s->next = db->changes.subscriptions) )
+    s->next->prev = s;
+  db->changes.subscriptions = s;
+  db->changes.subscribers++;
+  update_keep_changes(db);
+  simpleMutexUnlock(&db->locks.misc);
+  simpleMutexUnlock(&db->queries.write.lock);
+
+  return s;
+}
+
+
+static void
+unlink_change_subscription(change_subscription *s)
+{ rdf_db *db = s->db;
+
+  if ( s->next )
+    s->next->prev = s->prev;
+  if ( s->prev )
+    s->prev->next = s->next;
+  else
+    db->changes.subscriptions = s->next;
+  db->changes.subscribers--;
+}
+
+
+static int
+free_change_subscription(change_subscription *s)
+{ rdf_db *db = s->db;
+  int rc;
+
+  simpleMutexLock(&db->queries.write.lock);
+  simpleMutexLock(&db->locks.misc);
+  if ( (rc=(s->symbol != 0)) )
+  { unlink_change_subscription(s);
+    s->symbol = 0;
+    if ( db->changes.subscribers == 0 )
+      free_change_log(db);
+    else
+      update_keep_changes(db);
   }
+  simpleMutexUnlock(&db->locks.misc);
+  simpleMutexUnlock(&db->queries.write.lock);
 
   return rc;
 }
 
 
-static foreign_t
-rdf_monitor(term_t goal, term_t mask)
-{ atom_t name;
-  broadcast_callback *cb;
-  predicate_t p;
-  long msk;
-  module_t m = NULL;
+static void
+erase_change_log(rdf_db *db)
+{ change_subscription *s;
+
+  simpleMutexLock(&db->queries.write.lock);
+  simpleMutexLock(&db->locks.misc);
+  while( (s=db->changes.subscriptions) )
+  { unlink_change_subscription(s);
+    s->symbol = 0;
+  }
+  free_change_log(db);
+  simpleMutexUnlock(&db->locks.misc);
+  simpleMutexUnlock(&db->queries.write.lock);
+}
 
-  PL_strip_module(goal, &m, goal);
 
-  if ( !PL_get_atom_ex(goal, &name) ||
-       !PL_get_long_ex(mask, &msk) )
-    return FALSE;
+static void
+acquire_change_subscription(atom_t symbol)
+{ change_subscription *s = PL_blob_data(symbol, NULL, NULL);
+  s->symbol = symbol;
+}
 
-  p = PL_pred(PL_new_functor(name, 1), m);
+static int
+release_change_subscription(atom_t symbol)
+{ change_subscription *s = PL_blob_data(symbol, NULL, NULL);
 
-  for(cb=callback_list; cb; cb = cb->next)
-  { if ( cb->pred == p )
-    { broadcast_callback *cb2;
-      cb->mask = msk;
+  free_change_subscription(s);
+  rdf_free(s->db, s, sizeof(*s));
+
+  return TRUE;
+}
+
+static int
+write_change_subscription(IOSTREAM *out, atom_t symbol, int flags)
+{ change_subscription *s = PL_blob_data(symbol, NULL, NULL);
+  char buf[64];
+
+  Sfprintf(out, "<rdf-change-subscription>(%p,%s)",
+	   s, gen_name(s->position, buf));
+
+  return TRUE;
+}
+
+static PL_blob_t change_subscription_blob =
+{ PL_BLOB_MAGIC,
+  PL_BLOB_NOCOPY|PL_BLOB_UNIQUE,
+  "rdf_change_subscription",
+  release_change_subscription,
+  NULL,
+  write_change_subscription,
+  acquire_change_subscription
+};
 
-      joined_mask = 0L;
-      for(cb2=callback_list; cb2; cb2 = cb2->next)
-	joined_mask |= cb2->mask;
-      DEBUG(2, Sdprintf("Set mask to 0x%x\n", joined_mask));
 
+static int
+get_change_subscription(term_t t, change_subscription **sp)
+{ PL_blob_t *type;
+  void *data;
+
+  if ( PL_get_blob(t, &data, NULL, &type) && type == &change_subscription_blob)
+  { change_subscription *s = data;
+
+    if ( s->symbol )
+    { *sp = s;
       return TRUE;
     }
-  }
 
-  cb = PL_malloc(sizeof(*cb));
-  cb->next = NULL;
-  cb->mask = msk;
-  cb->pred = p;
-  if ( callback_list )
-  { callback_tail->next = cb;
-    callback_tail = cb;
-  } else
-  { callback_list = callback_tail = cb;
+    return PL_existence_error("rdf_change_subscription", t);
   }
-  joined_mask |= msk;
 
-  return TRUE;
+  return PL_type_error("rdf_change_subscription", t);
 }
 
 
+/** rdf_subscribe_changes(-Subscription, -Generation) is det.
+
+    Create a subscription to the change log.  Generation is the current
+    generation.  Changes after it can be fetched using
+    rdf_changes_since/5.
+*/
 
 static foreign_t
-rdf_set_predicate(term_t pred, term_t option)
-{ predicate *p;
-  rdf_db *db = rdf_current_db();
-  query *q = open_query(db);
-  int rc;
+rdf_subscribe_changes(term_t subscription, term_t generation)
+{ rdf_db *db = rdf_current_db();
+  change_subscription *s = new_change_subscription(db);
+  gen_t position = s->position;
 
-  if ( !get_predicate(db, pred, &p, q) )
-  { rc = FALSE;
-    goto out;
+  if ( !PL_unify_blob(subscription, s, sizeof(*s), &change_subscription_blob) )
+  { free_change_subscription(s);
+    return FALSE;
   }
 
-  if ( PL_is_functor(option, FUNCTOR_symmetric1) )
-  { int val;
-
-    if ( !get_bool_arg_ex(1, option, &val) )
-    { rc = FALSE;
-      goto out;
-    }
+  return PL_unify_int64(generation, position);
+}
 
-    if ( val )
-      p->inverse_of = p;
-    else
-      p->inverse_of = NULL;
 
-    rc = TRUE;
-  } else if ( PL_is_functor(option, FUNCTOR_inverse_of1) )
-  { term_t a = PL_new_term_ref();
-    predicate *i;
+static foreign_t
+rdf_unsubscribe_changes(term_t subscription)
+{ change_subscription *s;
 
-    _PL_get_arg(1, option, a);
-    if ( PL_get_nil(a) )
-    { if ( p->inverse_of )
-      { p->inverse_of->inverse_of = NULL;
-	p->inverse_of = NULL;
-      }
-    } else
-    { if ( !get_predicate(db, a, &i, q) )
-      { rc = FALSE;
-	goto out;
-      }
+  if ( !get_change_subscription(subscription, &s) )
+    return FALSE;
+  if ( !free_change_subscription(s) )
+    return PL_existence_error("rdf_change_subscription", subscription);
 
-      p->inverse_of = i;
-      i->inverse_of = p;
-    }
-    rc = TRUE;
-  } else if ( PL_is_functor(option, FUNCTOR_transitive1) )
-  { int val;
+  return TRUE;
+}
 
-    if ( !get_bool_arg_ex(1, option, &val) )
-      return FALSE;
 
-    p->transitive = val;
+static int
+put_change(term_t t, change *c)
+{ term_t av;
 
-    rc = TRUE;
+  if ( c->op == CHANGE_DROP )
+  { return PL_unify_term(t, PL_FUNCTOR, FUNCTOR_dropped2,
+			      PL_INT64, (int64_t)c->gen,
+			      PL_ATOM, c->value.graph->name);
   } else
-    rc = PL_type_error("predicate_option", option);
+  { triple *t3 = c->value.triple;
 
-out:
-  close_query(q);
-  return rc;
+    return ( (av = PL_new_term_refs(5)) &&
+	     PL_put_int64(av+0, c->gen) &&
+	     PL_put_atom(av+1, ID_ATOM(t3->subject_id)) &&
+	     PL_put_atom(av+2, t3->predicate.r->name) &&
+	     unify_object(av+3, t3) &&
+	     unify_graph(av+4, t3) &&
+	     PL_cons_functor_v(t, c->op == CHANGE_ADD ? FUNCTOR_added5
+						      : FUNCTOR_deleted5,
+			       av) );
+  }
 }
 
 
-#define PRED_PROPERTY_COUNT 9
-static functor_t predicate_key[PRED_PROPERTY_COUNT];
+/* collect_changes() collects the changes  after   from  upto and including
+   upto into buf (if not NULL) and returns their number.  It stops before
+   a generation if there are already max changes.  *last is set to the
+   generation upto which the changes are complete.
 
-static int
-unify_predicate_property(rdf_db *db, predicate *p, term_t option,
-			 functor_t f, query *q)
-{ if ( f == FUNCTOR_symmetric1 )
-    return PL_unify_term(option, PL_FUNCTOR, f,
-			 PL_BOOL, p->inverse_of == p ? TRUE : FALSE);
-  else if ( f == FUNCTOR_inverse_of1 )
-  { if ( p->inverse_of )
-      return PL_unify_term(option, PL_FUNCTOR, f,
-			   PL_ATOM, p->inverse_of->name);
-    else
-      return FALSE;
-  } else if ( f == FUNCTOR_transitive1 )
-  { return PL_unify_term(option, PL_FUNCTOR, f,
-			 PL_BOOL, p->transitive);
-  } else if ( f == FUNCTOR_triples1 )
-  { return PL_unify_term(option, PL_FUNCTOR, f,
-			 PL_LONG, p->triple_count);
-  } else if ( f == FUNCTOR_rdf_subject_branch_factor1 )
-  { return PL_unify_term(option, PL_FUNCTOR, f,
-		 PL_FLOAT, subject_branch_factor(db, p, q, DISTINCT_DIRECT));
-  } else if ( f == FUNCTOR_rdf_object_branch_factor1 )
-  { return PL_unify_term(option, PL_FUNCTOR, f,
-		 PL_FLOAT, object_branch_factor(db, p, q, DISTINCT_DIRECT));
-  } else if ( f == FUNCTOR_rdfs_subject_branch_factor1 )
-  { return PL_unify_term(option, PL_FUNCTOR, f,
-		 PL_FLOAT, subject_branch_factor(db, p, q, DISTINCT_SUB));
-  } else if ( f == FUNCTOR_rdfs_object_branch_factor1 )
-  { return PL_unify_term(option, PL_FUNCTOR, f,
-		 PL_FLOAT, object_branch_factor(db, p, q, DISTINCT_SUB));
-  } else
-  { assert(0);
-    return FALSE;
+   MT: Caller must hold db->locks.misc
+*/
+
+static size_t
+collect_changes(rdf_db *db, gen_t from, gen_t upto, size_t max,
+		change *buf, size_t size, gen_t *last)
+{ change_block *b;
+  size_t n = 0;
+  gen_t prev = from;
+
+  *last = ( upto > from ? upto : from );
+  for(b=db->changes.head; b; b=b->next)
+  { size_t bcount = b->count;
+    change *c, *e;
+
+    if ( bcount == 0 || b->changes[bcount-1].gen <= from )
+      continue;
+
+    for(c=b->changes, e=c+bcount; c<e; c++)
+    { if ( c->gen <= from )
+	continue;
+      if ( c->gen > upto )
+	return n;
+      if ( n >= max && c->gen != prev )
+      { *last = prev;
+	return n;
+      }
+      if ( buf && n < size )
+	buf[n] = *c;
+      n++;
+      prev = c->gen;
+    }
   }
+
+  return n;
 }
 
 
-typedef struct enum_pred
-{ predicate *p;
-  int i;
-} enum_pred;
+/* order_changes() orders the changes of each generation in buf on
+   their operation: graph drops first, then deleted and finally added
+   triples.  A generation may hold changes of several commits (see
+   group_commit()) and swap_graphs() adds the copies in the generation
+   that drops their graphs.  Replaying the changes in this order gives
+   the state after the generation.  Returns FALSE if out of memory.
+*/
 
+static int
+change_rank(const change *c)
+{ switch(c->op)
+  { case CHANGE_DROP:	return 0;
+    case CHANGE_DELETE:	return 1;
+    default:		return 2;
+  }
+}
 
-static foreign_t
-rdf_current_predicate(term_t name, control_t h)
-{ rdf_db *db = rdf_current_db();
-  predicate *p;
-  enum_pred *ep;
-  atom_t a;
 
-  switch( PL_foreign_control(h) )
-  { case PL_FIRST_CALL:
-      if ( PL_is_variable(name) )
-      { ep = rdf_malloc(db, sizeof(*ep));
-	ep->i  = 0;
-	ep->p  = NULL;
-	goto next;
-      } else if ( PL_get_atom_ex(name, &a) )
-      { predicate *p;
+static int
+order_changes(change *buf, size_t count)
+{ change *tmp;
+  size_t i, j, n;
 
-	if ( (p=existing_predicate(db, a)) )
-	  return TRUE;
-      }
-      return FALSE;
-    case PL_REDO:
-      ep = PL_foreign_context_address(h);
-      goto next;
-    case PL_PRUNED:
-      ep = PL_foreign_context_address(h);
-      rdf_free(db, ep, sizeof(*ep));
-      return TRUE;
-    default:
-      assert(0);
-      return FALSE;
-  }
+  if ( count < 2 )
+    return TRUE;
+  if ( !(tmp = malloc(count*sizeof(*tmp))) )
+    return FALSE;
 
-next:
-  if ( !(p=ep->p) )
-  { while (!(p = db->predicates.blocks[MSB(ep->i)][ep->i]) )
-    { if ( ++ep->i >= db->predicates.bucket_count )
-	goto fail;
-    }
-  }
+  for(i=0, n=0; i<count; i=j)
+  { int rank;
 
-  if ( !PL_unify_atom(name, p->name) )
-  { fail:
-    rdf_free(db, ep, sizeof(*ep));
-    return FALSE;
-  }
+    for(j=i; j<count && buf[j].gen == buf[i].gen; j++)
+      ;
+    for(rank=0; rank<3; rank++)
+    { size_t k;
 
-  if ( !(ep->p = p->next) )
-  { if ( ++ep->i >= db->predicates.bucket_count )
-      goto fail;
+      for(k=i; k<j; k++)
+      { if ( change_rank(&buf[k]) == rank )
+	  tmp[n++] = buf[k];
+      }
+    }
   }
-  PL_retry_address(ep);
+  memcpy(buf, tmp, count*sizeof(*buf));
+  free(tmp);
+
+  return TRUE;
 }
 
 
+/** rdf_changes_since(+Subscription, +Since, -Changes, -Until, +Options)
+
+    Changes is a list of the changes after generation Since upto and
+    including generation Until, ordered on generation.  The changes
+    of a generation are ordered by order_changes().
+    Since must not be before the position of Subscription.  The position
+    is moved to Since, which implies that the changes upto Since may be
+    discarded.  Options:
+
+      * max_changes(+Count)
+      Return at most Count changes, unless the first generation
+      after Since has more.  All changes of a generation are returned
+      together.
+*/
+
 static foreign_t
-rdf_predicate_property(term_t pred, term_t option, control_t h)
-{ predicate *p;
-  rdf_db *db = rdf_current_db();
-  query *q;
+rdf_changes_since(term_t subscription, term_t since, term_t changes,
+		  term_t until, term_t options)
+{ change_subscription *s;
+  rdf_db *db;
+  int64_t from;
+  size_t max = (size_t)-1;
+  gen_t upto, last;
+  change *buf = NULL;
+  size_t count, i;
+  int rc;
 
-  if ( !predicate_key[0] )
-  { int i = 0;
+  if ( !get_change_subscription(subscription, &s) ||
+       !PL_get_int64_ex(since, &from) )
+    return FALSE;
+  if ( from < 0 )
+    return PL_domain_error("not_less_than_zero", since);
+  db = s->db;
 
-    predicate_key[i++] = FUNCTOR_symmetric1;
-    predicate_key[i++] = FUNCTOR_inverse_of1;
-    predicate_key[i++] = FUNCTOR_transitive1;
-    predicate_key[i++] = FUNCTOR_triples1;
-    predicate_key[i++] = FUNCTOR_rdf_subject_branch_factor1;
-    predicate_key[i++] = FUNCTOR_rdf_object_branch_factor1;
-    predicate_key[i++] = FUNCTOR_rdfs_subject_branch_factor1;
-    predicate_key[i++] = FUNCTOR_rdfs_object_branch_factor1;
-    assert(i < PRED_PROPERTY_COUNT);
-  }
+  if ( !PL_get_nil(options) )
+  { term_t tail = PL_copy_term_ref(options);
+    term_t head = PL_new_term_ref();
+    term_t arg  = PL_new_term_ref();
 
-  switch(PL_foreign_control(h))
-  { case PL_FIRST_CALL:
-    { functor_t f;
-      int rc;
+    while( PL_get_list(tail, head, tail) )
+    { if ( PL_is_functor(head, FUNCTOR_max_changes1) )
+      { int64_t n;
 
-      q = open_query(db);
-      if ( PL_is_variable(option) )
-      { q->state.predprop.prop = 0;
-	if ( !get_predicate(db, pred, &q->state.predprop.pred, q) )
-	{ close_query(q);
+	_PL_get_arg(1, head, arg);
+	if ( !PL_get_int64_ex(arg, &n) )
 	  return FALSE;
-	}
-	goto redo;
-      } else if ( PL_get_functor(option, &f) )
-      { int n;
-
-	for(n=0; predicate_key[n]; n++)
-	{ if ( predicate_key[n] == f )
-	  { if ( !get_predicate(db, pred, &p, q) )
-	      return FALSE;
-	    rc = unify_predicate_property(db, p, option, f, q);
-	    goto out;
-	  }
-	}
-	rc = PL_domain_error("rdf_predicate_property", option);
+	if ( n < 1 )
+	  return PL_domain_error("positive_integer", arg);
+	max = (size_t)n;
       } else
-	rc = PL_type_error("rdf_predicate_property", option);
-    out:
-      close_query(q);
-      return rc;
+	return PL_domain_error("rdf_changes_option", head);
     }
-    case PL_REDO:
-      q = PL_foreign_context_address(h);
-    redo:
-      for( ; predicate_key[q->state.predprop.prop]; q->state.predprop.prop++ )
-      { if ( unify_predicate_property(db,
-				      q->state.predprop.pred,
-				      option,
-				      predicate_key[q->state.predprop.prop],
-				      q) )
-	{ q->state.predprop.prop++;
-	  if ( predicate_key[q->state.predprop.prop] )
-	    PL_retry_address(q);
-	  return TRUE;
-	}
-      }
+    if ( !PL_get_nil_ex(tail) )
       return FALSE;
-    case PL_PRUNED:
-      q = PL_foreign_context_address(h);
-      close_query(q);
-      return TRUE;
-    default:
-      assert(0);
-      return TRUE;
   }
-}
 
+  upto = db->queries.generation;	/* all changes upto here are logged */
+  MEMORY_BARRIER();
 
-		 /*******************************
-		 *     TRANSITIVE RELATIONS	*
-		 *******************************/
+  simpleMutexLock(&db->locks.misc);
+  if ( !s->symbol )
+  { simpleMutexUnlock(&db->locks.misc);
+    return PL_existence_error("rdf_change_subscription", subscription);
+  }
+  if ( (gen_t)from < s->position )
+  { simpleMutexUnlock(&db->locks.misc);
+    return PL_permission_error("access", "rdf_changes", since);
+  }
+  if ( (gen_t)from > s->position )
+  { s->position = from;
+    update_keep_changes(db);
+  }
 
-static visited *
-alloc_node_agenda(rdf_db *db, agenda *a)
-{ chunk *c;
-  int size;
+  if ( (count=collect_changes(db, from, upto, max, NULL, 0, &last)) )
+  { if ( !(buf = malloc(count*sizeof(*buf))) )
+    { simpleMutexUnlock(&db->locks.misc);
+      return PL_resource_error("memory");
+    }
+    collect_changes(db, from, upto, max, buf, count, &last);
+  }
+  simpleMutexUnlock(&db->locks.misc);
+  if ( buf && !order_changes(buf, count) )
+  { free(buf);
+    return PL_resource_error("memory");
+  }
 
-  if ( (c=a->chunk) )
-  { if ( c->used < c->size )
-    { visited *v = &c->nodes[c->used++];
+  { term_t tail = PL_copy_term_ref(changes);
+    term_t head = PL_new_term_ref();
+    term_t tmp  = PL_new_term_ref();
 
-      return v;
+    rc = TRUE;
+    for(i=0; rc && i<count; i++)
+    { rc = ( PL_put_variable(tmp) &&
+	     put_change(tmp, &buf[i]) &&
+	     PL_unify_list(tail, head, tail) &&
+	     PL_unify(head, tmp) );
     }
+    rc = ( rc &&
+	   PL_unify_nil(tail) &&
+	   PL_unify_int64(until, last) );
   }
 
-  size = (a->size == 0 ? 8 : 1024);
-  c = rdf_malloc(db, CHUNK_SIZE(size));
-  c->size = size;
-  c->used = 1;
-  c->next = a->chunk;
-  a->chunk = c;
+  if ( buf )
+    free(buf);
 
-  return &c->nodes[0];
+  return rc;
 }
 
 
-static void
-empty_agenda(rdf_db *db, agenda *a)
-{ chunk *c, *n;
+		 /*******************************
+		 *	  CONTROL INDEXING	*
+		 *******************************/
 
-  for(c=a->chunk; c; c = n)
-  { n = c->next;
-    rdf_free(db, c, CHUNK_SIZE(c->size));
+/** rdf_set(+What)
+
+    Set aspect of the RDF database.  What is one of:
+
+      * hash(Which, Parameter, Value)
+
+    Where Parameter is one of =size=, =optimize_threshold= or
+    =avg_chain_len= and Which is one of =s=, =p=, etc.
+*/
+
+static int
+get_index_name(term_t t, int *index)
+{ int i;
+  char *s;
+
+  if ( !PL_get_chars(t, &s, CVT_ATOM|CVT_EXCEPTION) )
+    return FALSE;
+
+  for(i=1; i<INDEX_TABLES; i++)
+  { if ( strcmp(s, col_name[i]) == 0 )
+    { *index = i;
+      return TRUE;
+    }
   }
-  if ( a->hash )
-    rdf_free(db, a->hash, sizeof(visited*)*a->hash_size);
 
-  if ( a->query )
-    close_query(a->query);
+  PL_domain_error("index", t);
+  return FALSE;
 }
 
 
-static void
-hash_agenda(rdf_db *db, agenda *a, int size)
-{ if ( a->hash )
-    rdf_free(db, a->hash, sizeof(*a->hash));
-  if ( size > 0 )
-  { visited *v;
+static foreign_t
+rdf_set(term_t what)
+{ rdf_db *db = rdf_current_db();
 
-    a->hash = rdf_malloc(db, sizeof(visited*)*size);
-    memset(a->hash, 0, sizeof(visited*)*size);
-    a->hash_size = size;
+  if ( PL_is_functor(what, FUNCTOR_hash3) )
+  { term_t arg = PL_new_term_ref();
+    int index;
+    int value;
+    atom_t param;
 
-    for(v=a->head; v; v = v->next)
-    { int key = atom_hash(v->resource, MURMUR_SEED)&(size-1);
+    _PL_get_arg(1, what, arg);
+    if ( !get_index_name(arg, &index) )
+      return FALSE;
+
+    _PL_get_arg(3, what, arg);
+    if ( !PL_get_integer_ex(arg, &value) )
+      return FALSE;
+
+    _PL_get_arg(2, what, arg);
+    if ( !PL_get_atom_ex(arg, &param) )
+      return FALSE;
+
+    if ( param == ATOM_size )
+    { if ( size_triple_hash(db, index, value) )
+      { db->hash[index].user_size = MSB(value);
+	return TRUE;
+      }
+      if ( value <= 0 || MSB(value) >= MAX_TBLOCKS )
+	return PL_domain_error("hash_size", arg);
+						/* cannot shrink */
+      return PL_permission_error("size", "hash", arg);
+    } else if ( param == ATOM_optimize_threshold )
+    { if ( value >= 0 && value < 20 )
+	db->hash[index].optimize_threshold = value;
+      else
+	return PL_domain_error("optimize_threshold", arg);
+    } else if ( param == ATOM_average_chain_len )
+    { if ( value >= 0 && value < 20 )
+	db->hash[index].avg_chain_len = value;
+      return PL_domain_error("average_chain_len", arg);
+    } else
+      return PL_domain_error("rdf_hash_parameter", arg);
 
-      v->hash_link = a->hash[key];
-      a->hash[key] = v;
-    }
-  }
-}
+    return TRUE;
+  } else if ( PL_is_functor(what, FUNCTOR_gc_workers1) )
+  { term_t arg = PL_new_term_ref();
+    int value;
 
+    _PL_get_arg(1, what, arg);
+    if ( !PL_get_integer_ex(arg, &value) )
+      return FALSE;
+    if ( value < 0 || value > MAX_WORKERS )
+      return PL_domain_error("gc_workers", arg);
+    db->gc.workers = value;
 
-static int
-in_agenda(agenda *a, atom_t resource)
-{ visited *v;
+    return TRUE;
+  }
 
-  if ( a->hash )
-  { int key = atom_hash(resource, MURMUR_SEED)&(a->hash_size-1);
-    v = a->hash[key];
+  return PL_type_error("rdf_setting", what);
+}
 
-    for( ; v; v = v->hash_link )
-    { if ( v->resource == resource )
-	return TRUE;
-    }
-  } else
-  { v = a->head;
 
-    for( ; v; v = v->next )
-    { if ( v->resource == resource )
-	return TRUE;
-    }
-  }
+static foreign_t
+rdf_update_duplicates(void)
+{ rdf_db *db = rdf_current_db();
 
-  return FALSE;
+  return update_duplicates(db);
 }
 
 
-static visited *
-append_agenda(rdf_db *db, agenda *a, atom_t res, uintptr_t d)
-{ visited *v = a->head;
+/* get_index_list() translates a list of index names (e.g., [s,po]) into
+   a set of index columns.  Returns the number of columns or -1 on error.
+*/
 
-  if ( in_agenda(a, res) )
-    return NULL;
+static int
+get_index_list(term_t indexes, int *il)
+{ int ic = 0;
+  term_t tail = PL_copy_term_ref(indexes);
+  term_t head = PL_new_term_ref();
 
-  db->agenda_created++;			/* statistics */
+  while(PL_get_list_ex(tail, head, tail))
+  { char *s;
 
-  a->size++;
-  if ( !a->hash_size && a->size > 32 )
-    hash_agenda(db, a, 64);
-  else if ( a->size > a->hash_size * 4 )
-    hash_agenda(db, a, a->hash_size * 4);
+    if ( PL_get_chars(head, &s, CVT_ATOM|CVT_EXCEPTION) )
+    { int by = 0;
+      int i;
 
-  v = alloc_node_agenda(db, a);
-  v->resource = res;
-  v->distance = d;
-  v->next = NULL;
-  if ( a->tail )
-  { a->tail->next = v;
-    a->tail = v;
-  } else
-  { a->head = a->tail = v;
-  }
+      for(; *s; s++)
+      { switch(*s)
+	{ case 's': by |= BY_S; break;
+	  case 'p': by |= BY_P; break;
+	  case 'o': by |= BY_O; break;
+	  case 'g': by |= BY_G; break;
+	  default: PL_domain_error("rdf_index", head); return -1;
+	}
+      }
 
-  if ( a->hash_size )
-  { int key = atom_hash(res, MURMUR_SEED)&(a->hash_size-1);
+      if ( index_col[by] == ~0 )
+      { PL_existence_error("rdf_index", head);
+	return -1;
+      }
 
-    v->hash_link = a->hash[key];
-    a->hash[key] = v;
+      for(i=0; i<ic; i++)
+      { if ( il[i] == ICOL(by) )
+	  break;
+      }
+      if ( i == ic )
+	il[ic++] = ICOL(by);
+    } else
+      return -1;
   }
+  if ( !PL_get_nil_ex(tail) )
+    return -1;
 
-  return v;
+  return ic;
 }
 
 
-static int
-can_reach_target(rdf_db *db, agenda *a, query *q)
-{ triple_walker tw;
-  int indexed = a->pattern.indexed;
-  int rc = FALSE;
-  triple *p;
+/** rdf_warm_indexes(+List) is det.
+*/
 
-  if ( indexed & BY_S )			/* subj ---> */
-  { a->pattern.object.resource = a->target;
-    indexed |= BY_O;
-  } else
-  { a->pattern.subject_id = ATOM_ID(a->target);
-    indexed |= BY_S;
-  }
+static foreign_t
+rdf_warm_indexes(term_t indexes)
+{ int il[16];
+  int ic;
+  rdf_db *db = rdf_current_db();
 
-  init_triple_walker(&tw, db, &a->pattern, indexed);
-  while((p=next_triple(&tw)))
-  { if ( match_triples(db, p, &a->pattern, q, MATCH_SUBPROPERTY) )
-    { rc = TRUE;
-      break;
-    }
-  }
+  if ( (ic=get_index_list(indexes, il)) < 0 )
+    return FALSE;
 
-  if ( a->pattern.indexed & BY_S )
-  { a->pattern.object.resource = 0;
-  } else
-  { a->pattern.subject_id = 0;
-  }
+  create_triple_hashes(db, ic, il);
 
-  return rc;
+  return TRUE;
 }
 
 
+/** rdf_set_indexes_(+List) is det.
+ *  rdf_indexes_(-List) is det.
+ *
+ * Set or get the enabled indexes.  The set may only be changed as long
+ * as no triples have been added to the DB.
+*/
 
-static visited *
-bf_expand(rdf_db *db, agenda *a, atom_t resource, uintptr_t d, query *q)
-{ search_state state;
-  visited *rc = NULL;
+static foreign_t
+rdf_set_indexes(term_t indexes)
+{ int il[16];
+  int ic, i;
+  unsigned enabled = 0;
+  rdf_db *db = rdf_current_db();
 
-  state.pattern = a->pattern;		/* Structure copy */
-  state.flags   = MATCH_SUBPROPERTY|MATCH_INVERSE;
-  state.p_cloud = NULL;
-  state.query   = q;
-  state.db      = db;
+  if ( (ic=get_index_list(indexes, il)) < 0 )
+    return FALSE;
+  for(i=0; i<ic; i++)
+    enabled |= 1<<il[i];
 
-  if ( state.pattern.indexed & BY_S )		/* subj ---> */
-  { state.pattern.subject_id = ATOM_ID(resource);
-  } else
-  { state.pattern.object.resource = resource;
+  simpleMutexLock(&db->queries.write.lock);
+  if ( db->created > 0 || db->bulk_load.active )
+  { simpleMutexUnlock(&db->queries.write.lock);
+    return permission_error("set_indexes", "rdf_db", "default",
+			    "Database is not empty");
   }
+  set_index_set(db, enabled);
+  for(i=1; i<INDEX_TABLES; i++)
+  { db->hash[i].created = FALSE;	/* empty anyway; new slot */
+#ifdef COMPACT
+    free_overflow(db, &db->hash[i], FALSE);
+#endif
+  }
+  simpleMutexUnlock(&db->queries.write.lock);
 
-  if ( a->target && can_reach_target(db, a, q) )
-    return append_agenda(db, a, a->target, d);
-
-  for(;;)
-  { int indexed = state.pattern.indexed;
-    triple *p;
-
-    init_triple_walker(&state.cursor, db, &state.pattern, indexed);
-    while((p=next_triple(&state.cursor)))
-    { if ( !alive_triple(a->query, p) )
-	continue;
+  return TRUE;
+}
 
-      if ( match_triples(db, p, &state.pattern, a->query, MATCH_SUBPROPERTY) )
-      { atom_t found;
-	visited *v;
 
-	if ( indexed & BY_S )
-	{ if ( p->object_is_literal )
-	    continue;
-	  found = p->object.resource;
-	} else
-	{ found = ID_ATOM(p->subject_id);
-	}
+static foreign_t
+rdf_indexes(term_t indexes)
+{ rdf_db *db = rdf_current_db();
+  term_t tail = PL_copy_term_ref(indexes);
+  term_t head = PL_new_term_ref();
+  int i;
 
-	v = append_agenda(db, a, found, d);
-	if ( !rc )
-	  rc = v;
-	if ( found == a->target )
-	  return rc;
-      }
-    }
-    if ( next_sub_property(&state) )
-      continue;
-    if ( inverse_partial_triple(&state.pattern) )
-    { state.p_cloud = NULL;
-      continue;
+  for(i=1; i<INDEX_TABLES; i++)
+  { if ( (db->indexes.enabled & (1<<i)) )
+    { if ( !PL_unify_list(tail, head, tail) ||
+	   !PL_unify_atom_chars(head, col_name[i]) )
+	return FALSE;
     }
-    break;
   }
-					/* TBD: handle owl:sameAs */
-  return rc;
+
+  return PL_unify_nil(tail);
 }
 
 
-static int
-peek_agenda(rdf_db *db, agenda *a)
-{ if ( a->to_return )
-    return TRUE;
+		 /*******************************
+		 *	    BULK LOADING	*
+		 *******************************/
 
-  while( a->to_expand )
-  { uintptr_t next_d = a->to_expand->distance+1;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Bulk loading realises the "Enhance loading" item of the TODO file. While
+db->bulk_load.active is non-zero:
+
+  - link_triple_hash() adds new triples to db->by_none and to the
+    private db->bulk_load.chain rather than to the indexes and marks
+    them `unindexed'.
+  - add_triples() does not resize the hash tables.
+  - prelink_triple() does not mark duplicates.  As duplicates_up_to_date
+    is cleared, queries filter all answers.
+  - Triple walkers use the existing indexes and finally walk the chain.
+    Only patterns for an index that does not yet exist scan db->by_none.
+  - create_triple_hashes() merely records the requested indexes.
+
+When the last scope ends, the existing indexes are resized for the new
+triple count.  Next, we link the triples of the chain into them and
+create the requested indexes, sized for the complete database.  Walkers
+that started with the chain skip its triples in the index while they
+are linked.  Triples keep their `unindexed' flag until the chain has
+been reclaimed, i.e., no walker can use it.  Until then, GC does not
+reclaim them.
+
+We hold db->locks.gc while linking.  This keeps GC and
+create_triple_hashes() out and prevents a new bulk load scope from
+starting before the chain is linked.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-    if ( next_d >= a->max_d )
-      return FALSE;
+#define BULK_CHAIN_PREINIT 1024		/* Initial # slots of a chain */
+#define BULK_LINK_CHUNK	  10000		/* Link triples per write lock */
 
-    a->to_return = bf_expand(db, a,
-			     a->to_expand->resource,
-			     next_d,
-			     a->query);
-    a->to_expand = a->to_expand->next;
+static bulk_chain *
+new_bulk_chain(void)
+{ bulk_chain *bc = malloc(sizeof(*bc));
+  triple **block = malloc(BULK_CHAIN_PREINIT*sizeof(triple*));
+  int i;
 
-    if ( a->to_return )
-      return TRUE;
+  if ( !bc || !block )
+  { free(bc);
+    free(block);
+    return NULL;
   }
 
-  return FALSE;
+  memset(bc, 0, sizeof(*bc));
+  for(i=0; i<MSB(BULK_CHAIN_PREINIT); i++)
+    bc->blocks[i] = block;
+  bc->allocated = BULK_CHAIN_PREINIT;
+  simpleMutexInit(&bc->lock);
+
+  return bc;
 }
 
 
-static visited *
-next_agenda(rdf_db *db, agenda *a)
-{ if ( peek_agenda(db, a) )
-  { visited *v = a->to_return;
+/* finalize_bulk_chain() is called through deferred_finalize() if no
+   walker can use the chain.  The chain itself is freed by the caller.
+*/
 
-    a->to_return = a->to_return->next;
+static void
+finalize_bulk_chain(void *mem, void *client_data)
+{ bulk_chain *bc = mem;
+  rdf_db *db = client_data;
+  int i;
 
-    return v;
+  free(bc->blocks[0]);
+  for(i=MSB(BULK_CHAIN_PREINIT); i<MAX_TBLOCKS; i++)
+  { if ( bc->blocks[i] )
+      free(bc->blocks[i] + ((size_t)1<<(i-1)));
   }
-
-  return NULL;
+  free(bc->sorted);
+  simpleMutexDelete(&bc->lock);
+  ATOMIC_DEC(&db->bulk_load.chains);
 }
 
 
-/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-rdf_reachable(+Subject, +Predicate, -Object)
-rdf_reachable(-Subject, +Predicate, ?Object)
-    Examine transitive relations, reporting all `Object' that can be
-    reached from `Subject' using Predicate without going into a loop
-    if the relation is cyclic.
-
-directly_attached() deals with the posibility that  the predicate is not
-defined and Subject and Object are  the   same.  Should  use clean error
-handling, but that means a lot of changes. For now this will do.
-
-TBD:	Implement bi-directional search if both Subject and Object are
-	given.
-- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+/* append_bulk_chain() adds t to the chain.  Concurrent walkers only
+   see t after it is stored.  Returns FALSE if there is no memory.
+*/
 
 static int
-directly_attached(term_t pred, term_t from, term_t to)
-{ if ( PL_is_atom(pred) && PL_is_atom(from) )
-    return PL_unify(to, from);
+append_bulk_chain(bulk_chain *bc, triple *t)
+{ simpleMutexLock(&bc->lock);
+  if ( bc->count == bc->allocated )
+  { int i = MSB(bc->allocated);
+    triple **block = malloc(bc->allocated*sizeof(triple*));
+
+    if ( !block )
+    { simpleMutexUnlock(&bc->lock);
+      return FALSE;
+    }
+    bc->blocks[i] = block-bc->allocated;
+    bc->allocated *= 2;
+  }
+  bc->blocks[MSB(bc->count)][bc->count] = t;
+  MEMORY_BARRIER();			/* concurrent next_bulk_triple() */
+  bc->count++;
+  simpleMutexUnlock(&bc->lock);
 
-  return FALSE;
+  return TRUE;
 }
 
 
 static int
-unify_distance(term_t d, uintptr_t dist)
-{ if ( d )
-    return PL_unify_integer(d, dist);
+compare_triple_address(const void *p1, const void *p2)
+{ uintptr_t t1 = (uintptr_t)*(triple*const*)p1;
+  uintptr_t t2 = (uintptr_t)*(triple*const*)p2;
 
-  return TRUE;
+  return t1 < t2 ? -1 : t1 > t2 ? 1 : 0;
 }
 
 
-static foreign_t
-rdf_reachable(term_t subj, term_t pred, term_t obj,
-	      term_t max_d, term_t d,
-	      control_t h)
-{ rdf_db *db = rdf_current_db();
-  query *q;
-
-  switch(PL_foreign_control(h))
-  { case PL_FIRST_CALL:
-    { visited *v;
-      agenda *a;
-      term_t target_term;
-      int is_det = FALSE;
+/* link_bulk_chain() links the triples of the chain into the created
+   indexes.  The chain is complete.  We first publish a sorted copy for
+   in_bulk_chain() and then link the triples in chunks, holding the
+   write lock only for a chunk.  If there is no memory for the sorted
+   copy, walkers that use the chain skip all `unindexed' triples in the
+   index, which may miss triples of an older chain that is not yet
+   reclaimed.
 
-      if ( PL_is_variable(pred) )
-	return PL_instantiation_error(pred);
+   MT: Caller must hold db->locks.gc
+*/
 
-      q = open_query(db);
-      a = &q->state.tr_search;
-      memset(a, 0, sizeof(*a));
-      a->query = q;
+static void
+link_bulk_chain(rdf_db *db, bulk_chain *bc)
+{ triple **sorted;
+  size_t i;
 
-      if ( max_d )
-      { long md;
-	atom_t inf;
+  if ( bc->count == 0 )
+    return;
 
-	if ( PL_get_atom(max_d, &inf) && inf == ATOM_infinite )
-	{ a->max_d = (uintptr_t)-1;
-	} else
-	{ if ( !PL_get_long_ex(max_d, &md) || md < 0 )
-	  { close_query(q);
-	    return FALSE;
-	  }
-	  a->max_d = md;
-	}
-      } else
-      { a->max_d = (uintptr_t)-1;
-      }
+  if ( (sorted = malloc(bc->count*sizeof(triple*))) )
+  { for(i=0; i<bc->count; i++)
+      sorted[i] = bc->blocks[MSB(i)][i];
+    qsort(sorted, bc->count, sizeof(triple*), compare_triple_address);
+    bc->sorted = sorted;
+  }
+  MEMORY_BARRIER();
+  bc->linked = TRUE;			/* before the triples are in an index */
 
-      if ( !PL_is_variable(subj) )		/* subj .... obj */
-      { switch(get_partial_triple(db, subj, pred, 0, 0, &a->pattern))
-	{ case 0:
-	  { close_query(q);
-	    return directly_attached(pred, subj, obj) &&
-		   unify_distance(d, 0);
-	  }
-	  case -1:
-	  { close_query(q);
-	    return FALSE;
-	  }
-	}
-	is_det = PL_is_ground(obj);
-	if ( a->pattern.object_is_literal )
-	{ close_query(q);
-	  return FALSE;			/* rdf_reachable(literal(...),?,?) */
-	}
-	target_term = obj;
-      } else if ( !PL_is_variable(obj) )	/* obj .... subj */
-      {	switch(get_partial_triple(db, 0, pred, obj, 0, &a->pattern))
-	{ case 0:
-	  { close_query(q);
-	    return directly_attached(pred, obj, subj);
-	  }
-	  case -1:
-	  { close_query(q);
-	    return FALSE;
-	  }
-	}
-	if ( a->pattern.object_is_literal )
-	{ close_query(q);
-	  return FALSE;			/* rdf_reachable(-,+,literal(...)) */
-	}
-	target_term = subj;
-      } else
-      { close_query(q);
-	return PL_instantiation_error(subj);
-      }
+  for(i=0; i<bc->count; )
+  { size_t end = i+BULK_LINK_CHUNK;
 
-      if ( (a->pattern.indexed & BY_S) )		/* subj ... */
-	append_agenda(db, a, ID_ATOM(a->pattern.subject_id), 0);
-      else
-	append_agenda(db, a, a->pattern.object.resource, 0);
-      a->to_return = a->head;
-      a->to_expand = a->head;
+    if ( end > bc->count )
+      end = bc->count;
 
-      while( (v=next_agenda(db, a)) )
-      { if ( PL_unify_atom(target_term, v->resource) )
-	{ if ( is_det )		/* mode(+, +, +) */
-	  { int rc = unify_distance(d, v->distance);
-	    empty_agenda(db, a);
-	    return rc;
-	  } else if ( unify_distance(d, v->distance) )
-	  {				/* mode(+, +, -) or mode(-, +, +) */
-	    if ( peek_agenda(db, a) )
-	      PL_retry_address(a);
+    simpleMutexLock(&db->queries.write.lock);
+    for(; i<end; i++)
+    { triple *t = bc->blocks[MSB(i)][i];
+      int ic;
 
-	    empty_agenda(db, a);
-	    return TRUE;
-	  }
-	}
-      }
-      empty_agenda(db, a);
-      return FALSE;
-    }
-    case PL_REDO:
-    { agenda *a = PL_foreign_context_address(h);
-      term_t target_term;
-      visited *v;
+      for(ic=1; ic<INDEX_TABLES; ic++)
+      { triple_hash *hash = &db->hash[ic];
 
-      if ( !PL_is_variable(subj) )	/* +, +, - */
-	target_term = obj;
-      else
-	target_term = subj;		/* -, +, + */
+	if ( hash->created )
+	{ size_t key = triple_hash_key(t, col_index[ic]) % hash->bucket_count;
 
-      while( (v=next_agenda(db, a)) )
-      { if ( PL_unify_atom(target_term, v->resource) &&
-	     unify_distance(d, v->distance) )
-	{ if ( peek_agenda(db, a) )
-	  { PL_retry_address(a);
-	  } else
-	  { empty_agenda(db, a);
-	    return TRUE;
-	  }
+	  prepare_link(db, ic, t);
+	  link_triple_bucket(db, hash, key, t);	/* sync with GC */
+	  t->linked++;
 	}
       }
-
-      empty_agenda(db, a);
-      return FALSE;
-    }
-    case PL_PRUNED:
-    { agenda *a = PL_foreign_context_address(h);
-
-      DEBUG(9, Sdprintf("Cutted; agenda = %p\n", a));
-
-      empty_agenda(db, a);
-      return TRUE;
     }
-    default:
-      assert(0);
-      return FALSE;
+    simpleMutexUnlock(&db->queries.write.lock);
   }
 }
 
-static foreign_t
-rdf_reachable3(term_t subj, term_t pred, term_t obj, control_t h)
-{ return rdf_reachable(subj, pred, obj, 0, 0, h);
-}
 
-static foreign_t
-rdf_reachable5(term_t subj, term_t pred, term_t obj, term_t max_d, term_t d,
-	       control_t h)
-{ return rdf_reachable(subj, pred, obj, max_d, d, h);
+static void
+begin_bulk_load(rdf_db *db)
+{ simpleMutexLock(&db->locks.gc);
+  simpleMutexLock(&db->queries.write.lock);
+  simpleRWLockExclusive(&db->queries.write.link);
+  if ( db->bulk_load.active++ == 0 )
+  { db->bulk_load.requested = 0;
+    db->duplicates_up_to_date = FALSE;
+    if ( (db->bulk_load.chain = new_bulk_chain()) )
+      ATOMIC_INC(&db->bulk_load.chains);
+  }
+  simpleRWUnlockExclusive(&db->queries.write.link);
+  simpleMutexUnlock(&db->queries.write.lock);
+  simpleMutexUnlock(&db->locks.gc);
 }
 
 
-		 /*******************************
-		 *	     STATISTICS		*
-		 *******************************/
+static void
+end_bulk_load(rdf_db *db, int count, int *ic)
+{ bulk_chain *bc = NULL;
+  int last = FALSE;
+  int requested = 0;
+  int i;
 
-static functor_t keys[16];		/* initialised in install_rdf_db() */
+  if ( db->bulk_load.active == 1 )	/* most likely the last */
+    rdf_create_gc_thread(db);
 
-static int
-unify_statistics(rdf_db *db, term_t key, functor_t f)
-{ int64_t v;
+  simpleMutexLock(&db->locks.gc);
+  simpleMutexLock(&db->queries.write.lock);
+  simpleRWLockExclusive(&db->queries.write.link);
+  for(i=0; i<count; i++)
+    db->bulk_load.requested |= 1<<ic[i];
+  if ( db->bulk_load.active > 0 && --db->bulk_load.active == 0 )
+  { resize_triple_hashes(db, 0, TRUE);
+    bc = db->bulk_load.chain;
+    requested = db->bulk_load.requested;
+    db->bulk_load.requested = 0;
+    last = TRUE;
+  }
+  simpleRWUnlockExclusive(&db->queries.write.link);
+  simpleMutexUnlock(&db->queries.write.lock);
 
-  if ( f == FUNCTOR_triples1 )
-  { v = db->created - db->erased;
-  } else if ( f == FUNCTOR_resources1 )
-  { v = db->resources.hash.count;
-  } else if ( f == FUNCTOR_predicates1 )
-  { v = db->predicates.count;
-  } else if ( f == FUNCTOR_graphs1 )
-  { v = db->graphs.count;
-  } else if ( f == FUNCTOR_indexed16 )
-  { int i;
-    term_t a = PL_new_term_ref();
+  if ( bc )
+  { link_bulk_chain(db, bc);
+    db->bulk_load.chain = NULL;
+    deferred_finalize(&db->defer_all, bc, finalize_bulk_chain, db);
+  }
+  simpleMutexUnlock(&db->locks.gc);
 
-    if ( !PL_unify_functor(key, FUNCTOR_indexed16) )
-      return FALSE;
-    for(i=0; i<16; i++)
-    { if ( !PL_get_arg(i+1, key, a) ||
-	   !PL_unify_integer(a, db->indexed[i]) )
-	return FALSE;
+  if ( last )
+  { int il[INDEX_TABLES];
+    int mx = 0;
+
+    for(i=1; i<INDEX_TABLES; i++)
+    { if ( (requested & (1<<i)) )
+	il[mx++] = i;
     }
+    create_triple_hashes(db, mx, il);
 
-    return TRUE;
-  } else if ( f == FUNCTOR_hash_quality1 )
-  { term_t tail, list = PL_new_term_ref();
-    term_t head = PL_new_term_ref();
-    term_t tmp = PL_new_term_ref();
-    term_t av = PL_new_term_refs(4);
-    int i;
+    if ( db->maintain_duplicates )
+      start_duplicate_admin(db);
+  }
+}
 
-    if ( !PL_unify_functor(key, FUNCTOR_hash_quality1) )
-      return FALSE;
-    _PL_get_arg(1, key, list);
-    tail = PL_copy_term_ref(list);
 
-    for(i=1; i<INDEX_TABLES; i++)
-    { if ( db->hash[i].created )
-      { if ( !PL_unify_list(tail, head, tail) ||
-	     !PL_put_integer(av+0, col_index[i]) ||
-	     !PL_put_integer(av+1, db->hash[i].bucket_count) ||
-	     !PL_put_float(av+2, triple_hash_quality(db, i, 1024)) ||
-	     !PL_put_integer(av+3, MSB(db->hash[i].bucket_count)-
-				   MSB(db->hash[i].bucket_count_epoch)) ||
-	     !PL_cons_functor_v(tmp, FUNCTOR_hash4, av) ||
-	     !PL_unify(head, tmp) )
-	  return FALSE;
-      }
-    }
+/** rdf_begin_bulk_load_ is det.
+ *  rdf_end_bulk_load_(+Indexes) is det.
+ *
+ * Enter and leave a bulk load scope.  Indexes is a list of index names
+ * as accepted by rdf_warm_indexes/1 that must be created when the last
+ * scope is left.
+*/
 
-    return PL_unify_nil(tail);
-  } else if ( f == FUNCTOR_searched_nodes1 )
-  { v = db->agenda_created;
-  } else if ( f == FUNCTOR_duplicates1 )
-  { if ( db->duplicates_up_to_date == FALSE )
-      return FALSE;
-    v = db->duplicates;
-  } else if ( f == FUNCTOR_literals1 )
-  { v = db->literals.count;
-  } else if ( f == FUNCTOR_triples2 && PL_is_functor(key, f) )
-  { graph *src;
-    term_t a = PL_new_term_ref();
-    atom_t name;
+static foreign_t
+rdf_begin_bulk_load(void)
+{ begin_bulk_load(rdf_current_db());
 
-    _PL_get_arg(1, key, a);
-    if ( !PL_get_atom_ex(a, &name) )
-      return FALSE;
-    if ( (src = existing_graph(db, name)) )
-      v = src->triple_count;
-    else
-      v = 0;
+  return TRUE;
+}
 
-    _PL_get_arg(2, key, a);
-    return PL_unify_int64(a, v);
-  } else if ( f == FUNCTOR_gc4 )
-  { return PL_unify_term(key,
-			 PL_FUNCTOR, f,
-			   PL_INT,   (int)db->gc.count,
-			   PL_INT64, (int64_t)db->gc.reclaimed_triples,
-			   PL_INT64, (int64_t)db->reindexed,
-			   PL_FLOAT, (double)db->gc.time);	/* time spent */
-  } else
-  { assert(0);
+
+static foreign_t
+rdf_end_bulk_load(term_t indexes)
+{ int il[16];
+  int ic;
+  rdf_db *db = rdf_current_db();
+
+  if ( (ic=get_index_list(indexes, il)) < 0 )
+  { end_bulk_load(db, 0, il);
     return FALSE;
   }
 
-  return PL_unify_term(key, PL_FUNCTOR, f, PL_INT64, v);
-}
+  end_bulk_load(db, ic, il);
+
+  return TRUE;
+}
+
+
+		 /*******************************
+		 *	   FROZEN GRAPHS	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A frozen graph is a compact, read-only index for the committed triples of
+a graph, typically created after loading a  large graph that is not (or
+rarely) modified.  It is an array of   triple identifiers sorted on the
+S,P,O hash keys. The keys are stored  in   three  columns and two arrays
+of positions provide the P,O,S and O,S,P  orders. Together, these answer
+all patterns on S, P and O using binary search (see next_frozen_triple()).
+
+GC unlinks the frozen triples from all   indexes except for db->by_none
+after all queries that started before the   graph was frozen have ended
+(see publish_frozen_graph()). This saves the memory   of the hash chains
+and the time to walk them. The  triples   themselves  are not modified
+and still follow the generation logic. New triples for the graph are
+added to the normal indexes. If a frozen  triple becomes garbage, GC
+marks it dead in the bitmap of the frozen graph before it is reclaimed.
+A frozen graph without live triples is discarded.
+
+Freezing a graph that is already frozen   creates a new frozen graph that
+includes the triples added after  the   previous  freeze.  The previous
+version is kept for the walkers that   started before the new one was
+published.
+
+All data of a frozen graph is allocated as a single block.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-static foreign_t
-rdf_statistics(term_t key, control_t h)
-{ int n;
-  rdf_db *db = rdf_current_db();
+typedef struct frozen_sort
+{ unsigned int	key[3];			/* keys in sort order */
+  uintptr_t	value;			/* T_ID() of triple or position */
+} frozen_sort;
 
-  switch(PL_foreign_control(h))
-  { case PL_FIRST_CALL:
-    { functor_t f;
+#ifdef COMPACT
+#define FROZEN_TRIPLE(v) ((triple_id)(v))
+#else
+#define FROZEN_TRIPLE(v) ((triple*)(v))
+#endif
 
-      if ( PL_is_variable(key) )
-      { n = 0;
-	goto redo;
-      } else if ( PL_get_functor(key, &f) )
-      { for(n=0; keys[n]; n++)
-	{ if ( keys[n] == f )
-	    return unify_statistics(db, key, f);
-	}
-	return PL_domain_error("rdf_statistics", key);
-      } else
-	return PL_type_error("rdf_statistics", key);
-    }
-    case PL_REDO:
-      n = (int)PL_foreign_context(h);
-    redo:
-      unify_statistics(db, key, keys[n]);
-      n++;
-      if ( keys[n] )
-	PL_retry(n);
-    case PL_PRUNED:
-      return TRUE;
-    default:
-      assert(0);
-      return TRUE;
+
+static int
+compare_frozen_sort(const void *p1, const void *p2)
+{ const frozen_sort *f1 = p1;
+  const frozen_sort *f2 = p2;
+  int i;
+
+  for(i=0; i<3; i++)
+  { if ( f1->key[i] != f2->key[i] )
+      return f1->key[i] < f2->key[i] ? -1 : 1;
   }
-}
 
+  return f1->value < f2->value ? -1 : f1->value > f2->value ? 1 : 0;
+}
 
-/** rdf_generation(-Generation) is det.
 
-    True when Generation is the current reading generation.  If we are
-    inside a modified transaction, Generation has the format Base+TrGen,
-    where TrGen expresses the generation inside the transaction.
+/* new_frozen_graph() creates a frozen graph from fs[], where the keys
+   are in S,P,O order and the value is T_ID() of the triple.  fs[] is
+   used as scratch space for creating the other orders.
 */
 
-static foreign_t
-rdf_generation(term_t t)
-{ rdf_db *db = rdf_current_db();
-  query *q = open_query(db);
-  int rc;
+static frozen_graph *
+new_frozen_graph(graph *g, frozen_sort *fs, size_t count)
+{ size_t words = (count+31)/32;
+  frozen_graph *fg;
+  uint32_t *p;
+  int perm, k;
+  size_t i;
 
-  if ( q->tr_gen > q->stack->tr_gen_base )
-  { assert(q->tr_gen < q->stack->tr_gen_max);
+  if ( !(fg = malloc(sizeof(*fg) + count*sizeof(fg->triples[0]) +
+		     (5*count+words)*sizeof(uint32_t))) )
+    return NULL;
 
-    rc = PL_unify_term(t, PL_FUNCTOR, FUNCTOR_plus2,
-		            PL_INT64, q->rd_gen,
-		            PL_INT64, q->tr_gen - q->stack->tr_gen_base);
-  } else
-  { rc = PL_unify_int64(t, q->rd_gen);
+  memset(fg, 0, sizeof(*fg));
+  fg->graph = g;
+  fg->count = count;
+  fg->alive = count;
+  fg->triples = (void*)(fg+1);
+  p = (uint32_t*)(fg->triples+count);
+  for(k=0; k<3; k++)
+  { fg->keys[k] = p;		       p += count;
+  }
+  fg->order[FROZEN_POS] = p;	       p += count;
+  fg->order[FROZEN_OSP] = p;	       p += count;
+  fg->dead = p;
+  memset(fg->dead, 0, words*sizeof(uint32_t));
+
+  qsort(fs, count, sizeof(*fs), compare_frozen_sort);
+  for(i=0; i<count; i++)
+  { fg->triples[i] = FROZEN_TRIPLE(fs[i].value);
+    for(k=0; k<3; k++)
+      fg->keys[k][i] = fs[i].key[k];
   }
 
-  close_query(q);
+  for(perm=FROZEN_POS; perm<=FROZEN_OSP; perm++)
+  { for(i=0; i<count; i++)
+    { for(k=0; k<3; k++)
+	fs[i].key[k] = fg->keys[FROZEN_COL(perm, k)][i];
+      fs[i].value = i;
+    }
+    qsort(fs, count, sizeof(*fs), compare_frozen_sort);
+    for(i=0; i<count; i++)
+      fg->order[perm][i] = (uint32_t)fs[i].value;
+  }
 
-  return rc;
+  return fg;
 }
 
 
-/** rdf_snapshot(-Snapshot) is det.
-
-    True when Snapshot is a handle to the current state of the database.
+/* free_frozen_graph() frees fg and the older versions it replaced after
+   all running walkers have finished.
 */
 
-static foreign_t
-rdf_snapshot(term_t t)
-{ rdf_db *db = rdf_current_db();
-  snapshot *s = new_snapshot(db);
+static void
+free_frozen_graph(rdf_db *db, frozen_graph *fg)
+{ frozen_graph *older;
 
-  return unify_snapshot(t, s);
+  for( ; fg; fg=older)
+  { older = fg->replaced;
+    deferred_free(&db->defer_triples, fg);
+  }
 }
 
 
-		 /*******************************
-		 *	  CONTROL INDEXING	*
-		 *******************************/
+/* discard_frozen_graph() removes fg from the database.  The memory is
+   reclaimed after all running walkers have finished.
+*/
 
-/** rdf_set(+What)
+static void
+discard_frozen_graph(rdf_db *db, frozen_graph *fg)
+{ frozen_graph **fp;
 
-    Set aspect of the RDF database.  What is one of:
+  simpleMutexLock(&db->queries.write.lock);
+  for(fp=&db->frozen.head; *fp; fp=&(*fp)->next)
+  { if ( *fp == fg )
+    { *fp = fg->next;
+      break;
+    }
+  }
+  if ( fg->graph->frozen == fg )
+    fg->graph->frozen = NULL;
+  db->frozen.triples -= fg->count;
+  simpleMutexUnlock(&db->queries.write.lock);
 
-      * hash(Which, Parameter, Value)
+  free_frozen_graph(db, fg);
+}
 
-    Where Parameter is one of =size=, =optimize_threshold= or
-    =avg_chain_len= and Which is one of =s=, =p=, etc.
+
+/* kill_frozen_triple() is called by GC if a frozen triple is unlinked
+   from db->by_none, i.e., before the triple is reclaimed.  We mark it
+   dead in the frozen graph of its graph and in the older versions that
+   may still be used by walkers.  A triple that is flagged frozen is
+   normally part of the current frozen graph of its graph.  If not,
+   e.g., because the frozen graph was discarded, there is nothing to do.
+   MT: Caller must hold db->locks.gc
 */
 
-static int
-get_index_name(term_t t, int *index)
-{ int i;
-  char *s;
+static void
+kill_frozen_triple(rdf_db *db, triple *t)
+{ graph *g = existing_graph(db, ID_ATOM(t->graph_id));
+  frozen_graph *fg;
 
-  if ( !PL_get_chars(t, &s, CVT_ATOM|CVT_EXCEPTION) )
-    return FALSE;
+  if ( !g || !(fg=g->frozen) )
+    return;
 
-  for(i=1; i<INDEX_TABLES; i++)
-  { if ( strcmp(s, col_name[i]) == 0 )
-    { *index = i;
-      return TRUE;
+  for( ; fg; fg=fg->replaced )
+  { size_t i;
+
+    if ( frozen_member(fg, t, &i) && !frozen_is_dead(fg, (uint32_t)i) )
+    { fg->dead[i/32] |= 1U<<(i%32);
+      if ( --fg->alive == 0 && fg == g->frozen )
+      { discard_frozen_graph(db, fg);
+	return;
+      }
     }
   }
+}
 
-  PL_domain_error("index", t);
-  return FALSE;
+
+/* retire_frozen_graphs() frees the versions replaced by a frozen graph
+   that was published before gen.  It is called at the end of a GC cycle
+   that started at gen.  This cycle has unlinked the triples of these
+   frozen graphs from the indexes and no walker that started before gen
+   is active.
+   MT: Caller must hold db->locks.gc
+*/
+
+static void
+retire_frozen_graphs(rdf_db *db, gen_t gen)
+{ frozen_graph *fg;
+
+  if ( db->frozen.unlink_gen && db->frozen.unlink_gen <= gen )
+    db->frozen.unlink_gen = 0;
+
+  simpleMutexLock(&db->queries.write.lock);
+  for(fg=db->frozen.head; fg; fg=fg->next)
+  { if ( fg->replaced && fg->gen <= gen )
+    { frozen_graph *old = fg->replaced;
+
+      fg->replaced = NULL;
+      free_frozen_graph(db, old);
+    }
+  }
+  simpleMutexUnlock(&db->queries.write.lock);
 }
 
 
-static foreign_t
-rdf_set(term_t what)
-{ rdf_db *db = rdf_current_db();
+/* publish_frozen_graph() makes fg the frozen graph of g and flags its
+   triples.  Walkers that start at fg->gen or later use fg and skip its
+   triples in the hash chains.  Older walkers use the version fg
+   replaces, if any, and find the other triples in the hash chains.  GC
+   unlinks the triples from the hash chains and frees the replaced
+   version when no older walker can be active (see gc_hash_chain() and
+   retire_frozen_graphs()).
+   MT: Caller must hold db->locks.gc
+*/
 
-  if ( PL_is_functor(what, FUNCTOR_hash3) )
-  { term_t arg = PL_new_term_ref();
-    int index;
-    int value;
-    atom_t param;
+static void
+publish_frozen_graph(rdf_db *db, graph *g, frozen_graph *fg)
+{ frozen_graph *old, **fp;
+  size_t i;
 
-    _PL_get_arg(1, what, arg);
-    if ( !get_index_name(arg, &index) )
-      return FALSE;
+  simpleMutexLock(&db->queries.write.lock);
+  fg->gen = db->queries.generation+1;
+  if ( (old=g->frozen) )
+  { for(fp=&db->frozen.head; *fp != old; fp=&(*fp)->next)
+      ;
+    fg->next = old->next;
+    fg->replaced = old;
+    db->frozen.triples -= old->count;
+  } else
+  { fp = &db->frozen.head;
+    fg->next = db->frozen.head;
+  }
+  MEMORY_BARRIER();
+  *fp = fg;
+  g->frozen = fg;
+  db->frozen.triples += fg->count;
+  db->frozen.unlink_gen = fg->gen;
+  for(i=0; i<fg->count; i++)
+    fetch_triple(db, fg->triples[i])->frozen = TRUE;
+  simpleMutexUnlock(&db->queries.write.lock);
+}
 
-    _PL_get_arg(3, what, arg);
-    if ( !PL_get_integer_ex(arg, &value) )
-      return FALSE;
 
-    _PL_get_arg(2, what, arg);
-    if ( !PL_get_atom_ex(arg, &param) )
-      return FALSE;
+/* freeze_graph() freezes the triples of g.  The candidates are the
+   committed and alive triples of g and the triples that are already
+   frozen.  The latter may have died, but they are still visible to
+   older queries.
 
-    if ( param == ATOM_size )
-    { if ( size_triple_hash(db, index, value) )
-      { db->hash[index].user_size = MSB(value);
-	return TRUE;
+   We hold db->locks.gc during the whole process.  This avoids that GC
+   reclaims triples we are considering and serialises with the creation
+   of new indexes.
+*/
+
+static int
+freeze_graph(rdf_db *db, graph *g)
+{ atom_id gid = ATOM_ID(g->name);
+  frozen_sort *fs = NULL;
+  size_t size = 0, count = 0;
+  frozen_graph *fg;
+  triple *t, *last;
+  lifespan span;
+
+  simpleMutexLock(&db->locks.gc);
+  simpleMutexLock(&db->queries.write.lock);
+  last = fetch_triple(db, db->by_none.tail);
+  simpleMutexUnlock(&db->queries.write.lock);
+
+  enter_scan(&db->defer_all);
+  for(t=fetch_triple(db, db->by_none.head);
+      t;
+      t=triple_follow_hash(db, t, ICOL(BY_NONE)))
+  { if ( t->graph_id == gid &&
+	 !t->reindexed && !t->unindexed &&
+	 ( t->frozen ||
+	   ( triple_lifespan(db, t, &span)->died == GEN_MAX &&
+	     t->lifespan.born < GEN_TBASE ) ) )
+    { if ( count == size )
+      { size_t newsize = (size ? size*2 : 1024);
+	frozen_sort *new = realloc(fs, newsize*sizeof(*fs));
+
+	if ( !new )
+	  goto nomem;
+	fs = new;
+	size = newsize;
       }
-      if ( value <= 0 || MSB(value) >= MAX_TBLOCKS )
-	return PL_domain_error("hash_size", arg);
-						/* cannot shrink */
-      return PL_permission_error("size", "hash", arg);
-    } else if ( param == ATOM_optimize_threshold )
-    { if ( value >= 0 && value < 20 )
-	db->hash[index].optimize_threshold = value;
-      else
-	return PL_domain_error("optimize_threshold", arg);
-    } else if ( param == ATOM_average_chain_len )
-    { if ( value >= 0 && value < 20 )
-	db->hash[index].avg_chain_len = value;
-      return PL_domain_error("average_chain_len", arg);
-    } else
-      return PL_domain_error("rdf_hash_parameter", arg);
+      frozen_triple_keys(t, fs[count].key);
+      fs[count].value = (uintptr_t)T_ID(t);
+      count++;
+    }
+    if ( t == last )
+      break;
+  }
 
+  if ( count == 0 )
+  { exit_scan(&db->defer_all);
+    simpleMutexUnlock(&db->locks.gc);
     return TRUE;
   }
+  if ( !(fg=new_frozen_graph(g, fs, count)) )
+    goto nomem;
+  free(fs);
 
-  return PL_type_error("rdf_setting", what);
-}
+  publish_frozen_graph(db, g, fg);
+  exit_scan(&db->defer_all);
+  simpleMutexUnlock(&db->locks.gc);
 
+  DEBUG(1, Sdprintf("Froze %ld triples of %s\n",
+		    (long)count, PL_atom_chars(g->name)));
 
-static foreign_t
-rdf_update_duplicates(void)
-{ rdf_db *db = rdf_current_db();
+  return TRUE;
 
-  return update_duplicates(db);
+nomem:
+  exit_scan(&db->defer_all);
+  simpleMutexUnlock(&db->locks.gc);
+  if ( fs )
+    free(fs);
+
+  return PL_resource_error("memory");
 }
 
 
-/** rdf_warm_indexes(+List) is det.
+/* load_frozen_graph() freezes the triples that rdf_load_db_/3 is about
+   to add to g if g has no triples.  The triples are registered such
+   that we know their id.  Because they are flagged frozen,
+   link_triple_hash() only adds them to db->by_none.  They are not
+   visible before add_triples() sets their lifespan.  If we run out
+   of memory the triples are simply not frozen and FALSE is returned
+   without raising an exception.
 */
 
-static foreign_t
-rdf_warm_indexes(term_t indexes)
-{ int il[16];
-  int ic = 0;
-  term_t tail = PL_copy_term_ref(indexes);
-  term_t head = PL_new_term_ref();
-  rdf_db *db = rdf_current_db();
-
-  while(PL_get_list_ex(tail, head, tail))
-  { char *s;
-
-    if ( PL_get_chars(head, &s, CVT_ATOM|CVT_EXCEPTION) )
-    { int by = 0;
-      int i;
+static int
+load_frozen_graph(rdf_db *db, graph *g, triple **triples, size_t count)
+{ frozen_sort *fs;
+  frozen_graph *fg;
+  size_t i;
 
-      for(; *s; s++)
-      { switch(*s)
-	{ case 's': by |= BY_S; break;
-	  case 'p': by |= BY_P; break;
-	  case 'o': by |= BY_O; break;
-	  case 'g': by |= BY_G; break;
-	  default: return PL_domain_error("rdf_index", head);
-	}
-      }
+  if ( count == 0 || g->frozen || g->triple_count > 0 ||
+       db->bulk_load.active )
+    return TRUE;
 
-      if ( index_col[by] == ~0 )
-	return PL_existence_error("rdf_index", head);
+  if ( !(fs = malloc(count*sizeof(*fs))) )
+    return FALSE;
+  for(i=0; i<count; i++)
+  { triple *t = triples[i];
 
-      for(i=0; i<ic; i++)
-      { if ( il[i] == by )
-	  break;
-      }
-      if ( i == ic )
-	il[ic++] = by;
-    } else
-      return 0;
+    register_triple(db, t);
+    frozen_triple_keys(t, fs[i].key);
+    fs[i].value = (uintptr_t)T_ID(t);
   }
-  if ( !PL_get_nil_ex(tail) )
+  fg = new_frozen_graph(g, fs, count);
+  free(fs);
+  if ( !fg )
     return FALSE;
 
-  create_triple_hashes(db, ic, il);
+  simpleMutexLock(&db->locks.gc);
+  publish_frozen_graph(db, g, fg);
+  simpleMutexUnlock(&db->locks.gc);
 
   return TRUE;
 }
 
 
+static void
+erase_frozen_graphs(rdf_db *db)
+{ frozen_graph *fg, *next;
+
+  for(fg=db->frozen.head; fg; fg=next)
+  { frozen_graph *old, *older;
+
+    next = fg->next;
+    fg->graph->frozen = NULL;
+    for(old=fg->replaced; old; old=older)
+    { older = old->replaced;
+      free(old);
+    }
+    free(fg);
+  }
+  db->frozen.head       = NULL;
+  db->frozen.triples    = 0;
+  db->frozen.unlink_gen = 0;
+}
+
+
+/** rdf_freeze_graph_(+Graph) is det.
+ *
+ * Freeze the committed triples of Graph.  See freeze_graph().
+*/
+
+static foreign_t
+rdf_freeze_graph(term_t graph_name)
+{ rdf_db *db = rdf_current_db();
+  atom_t gn;
+  graph *g;
+
+  if ( !PL_get_atom_ex(graph_name, &gn) )
+    return FALSE;
+  if ( db->bulk_load.active )
+    return permission_error("freeze", "rdf_graph", PL_atom_chars(gn),
+			    "Bulk load in progress");
+  if ( !(g=existing_graph(db, gn)) || g->erased )
+    return TRUE;
+
+  return freeze_graph(db, g);
+}
+
+
 		 /*******************************
 		 *	       RESET		*
 		 *******************************/
@@ -8729,16 +15473,28 @@ erase_triples(rdf_db *db)
     free_triple(db, t, FALSE);		/* ? */
   }
   db->by_none.head = db->by_none.tail = 0;
+  if ( db->bulk_load.chain )		/* its triples are gone */
+    db->bulk_load.chain->count = 0;
+  erase_frozen_graphs(db);
 
   for(i=BY_S; i<INDEX_TABLES; i++)
   { triple_hash *hash = &db->hash[i];
 
     reset_triple_hash(db, hash);
+#ifdef COMPACT
+    free_overflow(db, hash, FALSE);
+#endif
   }
   reset_triple_array(db);
+  set_index_set(db, db->indexes.enabled);
+  db->indexes.overflowed = 0;
+#ifdef COMPACT
+  db->indexes.relayout_done = 0;
+#endif
 
   db->created = 0;
   db->erased = 0;
+  db->committed = 0;
   memset(db->indexed, 0, sizeof(db->indexed));
   db->duplicates = 0;
   db->queries.generation = 0;
@@ -8785,6 +15541,7 @@ reset_db(rdf_db *db)
   suspend_gc(db);
   simpleMutexLock(&db->locks.duplicates);
   erase_snapshots(db);
+  erase_change_log(db);
   erase_triples(db);
   erase_predicates(db);
   erase_resources(&db->resources);
@@ -8977,6 +15734,7 @@ install_rdf_db(void)
   MKFUNCTOR(predicate, 1);
   MKFUNCTOR(object, 1);
   MKFUNCTOR(graph, 1);
+  MKFUNCTOR(graph, 3);
   MKFUNCTOR(indexed, 16);
   MKFUNCTOR(exact, 1);
   MKFUNCTOR(plain, 1);
@@ -8991,6 +15749,9 @@ install_rdf_db(void)
   MKFUNCTOR(searched_nodes, 1);
   MKFUNCTOR(duplicates, 1);
   MKFUNCTOR(literals, 1);
+  MKFUNCTOR(triple_size, 2);
+  MKFUNCTOR(frozen_triples, 1);
+  MKFUNCTOR(group_commit, 2);
   MKFUNCTOR(symmetric, 1);
   MKFUNCTOR(transitive, 1);
   MKFUNCTOR(inverse_of, 1);
@@ -9001,6 +15762,20 @@ install_rdf_db(void)
   MKFUNCTOR(rdfs_subject_branch_factor, 1);
   MKFUNCTOR(rdfs_object_branch_factor, 1);
   MKFUNCTOR(gc, 4);
+  MKFUNCTOR(buckets, 1);
+  MKFUNCTOR(time, 1);
+  MKFUNCTOR(gc_workers, 1);
+  MKFUNCTOR(added, 5);
+  MKFUNCTOR(deleted, 5);
+  MKFUNCTOR(dropped, 2);
+  MKFUNCTOR(max_changes, 1);
+  MKFUNCTOR(batch, 2);
+  MKFUNCTOR(assert, 1);
+  MKFUNCTOR(rdf, 3);
+  MKFUNCTOR(rdf, 4);
+  MKFUNCTOR(update, 2);
+  MKFUNCTOR(lost, 1);
+  MKFUNCTOR(queue, 4);
   MKFUNCTOR(graphs, 1);
   MKFUNCTOR(assert, 4);
   MKFUNCTOR(retract, 4);
@@ -9011,6 +15786,7 @@ install_rdf_db(void)
   MKFUNCTOR(load, 2);
   MKFUNCTOR(begin, 1);
   MKFUNCTOR(end, 1);
+  MKFUNCTOR(abort, 1);
   MKFUNCTOR(create_graph, 1);
   MKFUNCTOR(hash_quality, 1);
   MKFUNCTOR(hash, 3);
@@ -9033,6 +15809,19 @@ install_rdf_db(void)
   ATOM_error		  = PL_new_atom("error");
   ATOM_infinite		  = PL_new_atom("infinite");
   ATOM_snapshot		  = PL_new_atom("snapshot");
+  ATOM_isolation	  = PL_new_atom("isolation");
+  ATOM_serializable	  = PL_new_atom("serializable");
+  ATOM_retry		  = PL_new_atom("retry");
+  ATOM_since		  = PL_new_atom("since");
+  ATOM_compress		  = PL_new_atom("compress");
+  ATOM_cpu_count	  = PL_new_atom("cpu_count");
+  ATOM_assert		  = PL_new_atom("assert");
+  ATOM_retract		  = PL_new_atom("retract");
+  ATOM_update		  = PL_new_atom("update");
+  ATOM_load		  = PL_new_atom("load");
+  ATOM_block		  = PL_new_atom("block");
+  ATOM_drop		  = PL_new_atom("drop");
+  ATOM_coalesce		  = PL_new_atom("coalesce");
   ATOM_true		  = PL_new_atom("true");
   ATOM_size		  = PL_new_atom("size");
   ATOM_optimize_threshold = PL_new_atom("optimize_threshold");
@@ -9052,6 +15841,9 @@ install_rdf_db(void)
   keys[i++] = FUNCTOR_literals1;
   keys[i++] = FUNCTOR_triples2;
   keys[i++] = FUNCTOR_gc4;
+  keys[i++] = FUNCTOR_triple_size2;
+  keys[i++] = FUNCTOR_frozen_triples1;
+  keys[i++] = FUNCTOR_group_commit2;
   keys[i++] = 0;
   assert(i<=16);
 
@@ -9068,23 +15860,41 @@ install_rdf_db(void)
   PL_register_foreign("rdf_retractall",	4, rdf_retractall4, 0);
   PL_register_foreign("rdf",		3, rdf3,	    NDET);
   PL_register_foreign("rdf",		4, rdf4,	    NDET);
+  PL_register_foreign("rdf_triples",	3, rdf_triples,	    NDET);
   PL_register_foreign("rdf_has",	4, rdf_has4,	    NDET);
   PL_register_foreign("rdf_has",	3, rdf_has3,	    NDET);
   PL_register_foreign("rdf_gc_",	0, rdf_gc,	    0);
   PL_register_foreign("rdf_add_gc_time",1, rdf_add_gc_time, 0);
   PL_register_foreign("rdf_gc_info_",   1, rdf_gc_info,	    0);
+  PL_register_foreign("rdf_set_gc_budget_", 1, rdf_set_gc_budget, 0);
   PL_register_foreign("rdf_statistics_",1, rdf_statistics,  NDET);
   PL_register_foreign("rdf_set",        1, rdf_set,         0);
   PL_register_foreign("rdf_update_duplicates",
 					0, rdf_update_duplicates, 0);
   PL_register_foreign("rdf_warm_indexes",
 					1, rdf_warm_indexes,0);
+  PL_register_foreign("rdf_set_indexes_",
+					1, rdf_set_indexes, 0);
+  PL_register_foreign("rdf_indexes_",	1, rdf_indexes,	    0);
+  PL_register_foreign("rdf_begin_bulk_load_",
+					0, rdf_begin_bulk_load, 0);
+  PL_register_foreign("rdf_end_bulk_load_",
+					1, rdf_end_bulk_load, 0);
+  PL_register_foreign("rdf_freeze_graph_",
+					1, rdf_freeze_graph, 0);
   PL_register_foreign("rdf_generation", 1, rdf_generation,  0);
   PL_register_foreign("rdf_snapshot",   1, rdf_snapshot,    0);
   PL_register_foreign("rdf_delete_snapshot", 1, rdf_delete_snapshot, 0);
+  PL_register_foreign("rdf_subscribe_changes", 2, rdf_subscribe_changes, 0);
+  PL_register_foreign("rdf_unsubscribe_changes", 1, rdf_unsubscribe_changes, 0);
+  PL_register_foreign("rdf_changes_since", 5, rdf_changes_since, 0);
   PL_register_foreign("rdf_match_label",3, match_label,     0);
   PL_register_foreign("rdf_save_db_",   3, rdf_save_db,     0);
+  PL_register_foreign("rdf_save_db_",   4, rdf_save_db4,    0);
   PL_register_foreign("rdf_load_db_",   3, rdf_load_db,     0);
+  PL_register_foreign("rdf_load_db_",   4, rdf_load_db4,    0);
+  PL_register_foreign("rdf_db_file_graphs_", 2, rdf_db_file_graphs, 0);
+  PL_register_foreign("rdf_sink_api_",  1, rdf_sink_api_,   0);
   PL_register_foreign("rdf_reachable",  3, rdf_reachable3,  NDET);
   PL_register_foreign("rdf_reachable",  5, rdf_reachable5,  NDET);
   PL_register_foreign("rdf_reset_db_",  0, rdf_reset_db,    0);
@@ -9099,14 +15909,24 @@ install_rdf_db(void)
   PL_register_foreign("rdf_graph_",     2, rdf_graph,       NDET);
   PL_register_foreign("rdf_create_graph",  1, rdf_create_graph, 0);
   PL_register_foreign("rdf_destroy_graph", 1, rdf_destroy_graph, 0);
+  PL_register_foreign("rdf_drop_graph_", 1, rdf_drop_graph, 0);
+  PL_register_foreign("rdf_clone_graph", 2, rdf_clone_graph, 0);
+  PL_register_foreign("rdf_swap_graphs_", 3, rdf_swap_graphs, 0);
   PL_register_foreign("rdf_set_graph_source", 3, rdf_set_graph_source, 0);
   PL_register_foreign("rdf_graph_source_", 3, rdf_graph_source, 0);
   PL_register_foreign("rdf_estimate_complexity",
 					4, rdf_estimate_complexity, 0);
+  PL_register_foreign("rdf_query_",	3, rdf_query, 0);
+  PL_register_foreign("rdf_count",	4, rdf_count, 0);
   PL_register_foreign("rdf_transaction", 3, rdf_transaction, META);
   PL_register_foreign("rdf_active_transactions_",
 					1, rdf_active_transactions, 0);
   PL_register_foreign("rdf_monitor_",   2, rdf_monitor,     META);
+  PL_register_foreign("rdf_monitor_async_", 4, rdf_monitor_async, META);
+  PL_register_foreign("rdf_monitor_next_", 2, rdf_monitor_next, META);
+  PL_register_foreign("rdf_monitor_queues_", 1, rdf_monitor_queues, 0);
+  PL_register_foreign("rdf_batch_triple", 2, rdf_batch_triple, NDET);
+  PL_register_foreign("rdf_batch_size", 2, rdf_batch_size,  0);
 /*PL_register_foreign("rdf_broadcast_", 2, rdf_broadcast,   0);*/
 #ifdef WITH_MD5
   PL_register_foreign("rdf_md5",	2, rdf_md5,	    0);
@@ -59,6 +59,7 @@ supposed to be local to the SWI-Prolog kernel are declared using
 #include <SWI-Prolog.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
 #include "atom.h"
 #include "deferfree.h"
 #include "debug.h"
@@ -144,7 +145,7 @@ typedef struct lifespan
 #define BY_SPOG	(BY_S|BY_P|BY_O|BY_G)	/* 15 */
 
 /* (*) INDEX_TABLES must be consistent with index_col[] in rdf_db.c */
-#define INDEX_TABLES		        10	/* (*)  */
+#define INDEX_TABLES		        14	/* (*)  */
 #define INITIAL_TABLE_SIZE		1024
 #define INITIAL_RESOURCE_TABLE_SIZE	8192
 #define INITIAL_PREDICATE_TABLE_SIZE	64
@@ -152,6 +153,8 @@ typedef struct lifespan
 
 #define DUPLICATE_ADMIN_THRESHOLD	1024
 
+#define LINK_STRIPES	64		/* Bucket locks per index (2^N) */
+
 #define MAX_HASH_FACTOR 8		/* factor to trigger re-hash */
 #define MIN_HASH_FACTOR 4		/* factor after re-hash */
 
@@ -203,6 +206,7 @@ typedef struct predicate
   size_t	    distinct_count[2];  /* Triple count at last update */
   size_t	    distinct_subjects[2];/* # distinct subject values */
   size_t	    distinct_objects[2];/* # distinct object values */
+  gen_t		    modified;		/* Last committed change */
 } predicate;
 
 #define MAX_PBLOCKS 32
@@ -235,6 +239,11 @@ typedef struct predicate_cloud
 } predicate_cloud;
 
 
+typedef struct graph_drop
+{ struct graph_drop *older;		/* Previous drop of the graph */
+  gen_t		gen;			/* Generation of the drop */
+} graph_drop;
+
 typedef struct graph
 { struct graph *next;			/* next in table */
   atom_t	name;			/* name of the graph */
@@ -242,6 +251,9 @@ typedef struct graph
   double	modified;		/* Modified time of source URL */
   int		triple_count;		/* # triples associated to it */
   unsigned	erased;			/* Graph is destroyed */
+  struct frozen_graph *frozen;		/* Frozen (sorted) triples */
+  graph_drop   *drops;			/* Drops not yet handled by GC */
+  gen_t		committed;		/* Generation of last change */
 #ifdef WITH_MD5
   unsigned	md5 : 1;		/* do/don't record MD5 */
   md5_byte_t	digest[16];		/* MD5 digest */
@@ -256,6 +268,7 @@ typedef struct graph_hash_table
   size_t	bucket_count;		/* Allocated #buckets */
   size_t	bucket_count_epoch;	/* Initial bucket count */
   size_t	count;			/* Total #predicates */
+  size_t	dropped;		/* # graph_drop records */
 } graph_hash_table;
 
 typedef struct literal
@@ -304,15 +317,6 @@ typedef struct triple
 #else
   struct triple *reindexed;		/* Remapped by optimize_triple_hash() */
 #endif
-					/* indexing */
-  union
-  { literal	end;			/* end for between(X,Y) patterns */
-#ifdef COMPACT
-    triple_id	next[INDEX_TABLES];	/* hash-table next identifier */
-#else
-    struct triple*next[INDEX_TABLES];	/* hash-table next links */
-#endif
-  } tp;					/* triple or pattern */
 					/* smaller objects (e.g., flags) */
   uint32_t      line;			/* graph-line number */
   unsigned	object_is_literal : 1;	/* Object is a literal */
@@ -327,9 +331,27 @@ typedef struct triple
   unsigned	loaded : 1;		/* for EV_ASSERT_LOAD */
   unsigned	erased : 1;		/* Consistency of erased */
   unsigned	lingering : 1;		/* Deleted; waiting for GC */
-					/* Total: 32 */
+  unsigned	unindexed : 1;		/* Loaded in a bulk_chain */
+  unsigned	overflow : 1;		/* Uses triple_hash.overflow */
+  unsigned	slots : 4;		/* # allocated tp.next[] slots */
+  unsigned	frozen : 1;		/* Member of a frozen_graph */
+					/* Total: 28 */
+					/* indexing (must be last) */
+  union
+  { literal	end;			/* end for between(X,Y) patterns */
+#ifdef COMPACT
+    triple_id	next[INDEX_TABLES];	/* hash-table next identifier */
+#else
+    struct triple*next[INDEX_TABLES];	/* hash-table next links */
+#endif
+  } tp;					/* triple or pattern */
 } triple;
 
+/* Allocated triples only have tp.next[] slots for the indexes that
+   existed when they were allocated (see triple_link() in rdf_db.c) */
+#define TRIPLE_SIZE(slots) \
+	(offsetof(triple, tp.next) + (slots)*sizeof(((triple*)0)->tp.next[0]))
+
 
 typedef struct active_transaction
 { struct active_transaction *parent;
@@ -378,16 +400,112 @@ typedef struct triple_hash
   unsigned int	user_size;		/* User selected size as 2^N */
   unsigned int	optimize_threshold;	/* # resizes to leave behind */
   unsigned int	avg_chain_len;		/* Accepted average chain length */
+  simpleMutex	stripes[LINK_STRIPES];	/* Bucket N uses N%LINK_STRIPES */
+  size_t	gc_bucket;		/* GC cursor: bucket to collect */
+#ifdef COMPACT
+  triple_id	gc_prev;		/* GC cursor: resume after */
+  triple_id    *overflow[MAX_TBLOCKS];	/* Links of triples without slot */
+  size_t	overflow_size;		/* Allocated size of overflow */
+#else
+  struct triple *gc_prev;		/* GC cursor: resume after */
+#endif
 } triple_hash;
 
+typedef struct bulk_chain
+{ triple      **blocks[MAX_TBLOCKS];	/* Dynamic array of loaded triples */
+  size_t	count;			/* # triples in the chain */
+  size_t	allocated;		/* # allocated slots */
+  triple      **sorted;			/* Sorted copy (see end_bulk_load()) */
+  int		linked;			/* Triples are added to the indexes */
+  simpleMutex	lock;			/* Guards appending */
+} bulk_chain;
+
 typedef struct triple_walker
 { size_t	unbounded_hash;		/* The unbounded hash-key */
   int		icol;			/* index column */
   size_t	bcount;			/* Current bucket count */
   triple       *current;		/* Our current location */
   struct rdf_db *db;			/* the array of triples */
+  struct
+  { int		state;			/* FROZEN_WALK_* */
+    int		which;			/* BY_* that is bound */
+    triple     *pattern;		/* Pattern we walk */
+    size_t	object_hash;		/* Hash of literal (literal walker) */
+    struct frozen_graph *next;		/* Next frozen graph to walk */
+    struct frozen_graph *current;	/* Frozen graph we are walking */
+    int		perm;			/* Permutation used (FROZEN_*) */
+    size_t	here;			/* Current position */
+    size_t	end;			/* End of matching range */
+    unsigned int key[3];		/* S,P,O keys of the pattern */
+    gen_t	gen;			/* Generation at which we started */
+  } frozen;
+  struct
+  { bulk_chain *chain;			/* Bulk loaded triples to walk */
+    size_t	here;			/* Next triple of the chain */
+  } bulk;
 } triple_walker;
 
+		 /*******************************
+		 *	   FROZEN GRAPHS	*
+		 *******************************/
+
+#define FROZEN_SPO	0		/* Sort orders of a frozen graph */
+#define FROZEN_POS	1
+#define FROZEN_OSP	2
+
+
+		 /*******************************
+		 *	     CHANGE LOG		*
+		 *******************************/
+
+#define CHANGE_BLOCK_SIZE 1024		/* Changes per change_block */
+
+#define CHANGE_ADD	0		/* Triple was added */
+#define CHANGE_DELETE	1		/* Triple was deleted */
+#define CHANGE_DROP	2		/* Graph was dropped */
+
+typedef struct change
+{ gen_t		gen;			/* Generation of the change */
+  int		op;			/* CHANGE_* */
+  union
+  { triple     *triple;			/* CHANGE_ADD and CHANGE_DELETE */
+    struct graph *graph;		/* CHANGE_DROP */
+  } value;
+} change;
+
+typedef struct change_block
+{ struct change_block *next;		/* Next (younger) block */
+  gen_t		reindexed;		/* db->reindexed when created */
+  size_t	count;			/* # used changes */
+  change	changes[CHANGE_BLOCK_SIZE];
+} change_block;
+
+typedef struct change_subscription
+{ struct change_subscription *next;	/* List of subscriptions */
+  struct change_subscription *prev;
+  struct rdf_db *db;			/* Subscribed database */
+  gen_t		position;		/* Changes upto here are consumed */
+  atom_t	symbol;			/* Associated Prolog handle */
+} change_subscription;
+
+typedef struct frozen_graph
+{ struct frozen_graph *next;		/* Next in db->frozen.head */
+  struct frozen_graph *replaced;	/* Older version still in use */
+  struct graph *graph;			/* Graph we belong to */
+  gen_t		gen;			/* Walkers started here use us */
+  size_t	count;			/* # triples */
+  size_t	alive;			/* # triples that are not dead */
+#ifdef COMPACT
+  triple_id    *triples;		/* Triples in SPO order */
+#else
+  struct triple **triples;		/* Triples in SPO order */
+#endif
+  unsigned int *keys[3];		/* S,P,O hash keys in SPO order */
+  uint32_t     *order[3];		/* POS and OSP order (positions) */
+  uint32_t     *dead;			/* Bitmap of GC'ed positions */
+} frozen_graph;
+
+
 #define MAX_BLOCKS 20			/* allows for 2M threads */
 
 typedef struct per_thread
@@ -404,10 +522,31 @@ typedef struct query_admin
   struct
   { simpleMutex	lock;			/* Locks writing triples */
     simpleMutex generation_lock;	/* Interlocked fix of generations */
+    simpleRWLock link;			/* Shared while linking triples */
+    gen_t	modified;		/* Last committed change */
+    gen_t	hierarchy_modified;	/* Last committed subPropertyOf */
+    gen_t	dropped;		/* Last committed graph drop */
+    int		transactions;		/* # open transactions */
+    size_t	commit_seq;		/* Odd while applying a group */
+    struct
+    { simpleMutex lock;			/* Guards the queue */
+      simpleCondition done;		/* Signalled after a group */
+      struct commit_request *head;	/* Queue of waiting commits */
+      struct commit_request *tail;
+      int	  leader;		/* A thread is applying a group */
+      size_t	  groups;		/* # generation steps */
+      size_t	  commits;		/* # commits applied in groups */
+    } group;				/* group commit (see query.c) */
   } write;				/* write administration */
 } query_admin;
 
 
+#define GC_BUDGET_NONE	  0		/* Complete GC cycles */
+#define GC_BUDGET_BUCKETS 1		/* Max buckets per GC slice */
+#define GC_BUDGET_TIME	  2		/* Max microseconds per GC slice */
+
+#define GC_SLICE_BINS	  24		/* Slice durations up to 2^23 usec */
+
 #define JOINED_DEFER 1
 
 #ifdef JOINED_DEFER
@@ -424,6 +563,7 @@ typedef struct rdf_db
 #endif
   size_t	created;		/* #triples created */
   size_t	erased;			/* #triples erased */
+  size_t	committed;		/* #committed triples not erased */
   gen_t		reindexed;		/* #triples reindexed (gc_hash_chain) */
   size_t	indexed[16];		/* Count calls (2**4 possible indices) */
   resource_db	resources;		/* admin of used resources */
@@ -448,6 +588,30 @@ typedef struct rdf_db
 
   int		resetting;		/* We are in rdf_reset_db() */
 
+  struct
+  { int		active;			/* # active rdf_bulk_load/2 scopes */
+    int		requested;		/* Mask (1<<icol) of wanted indexes */
+    bulk_chain *chain;			/* Triples that are not indexed */
+    int		chains;			/* # chains that are not reclaimed */
+  } bulk_load;
+
+  struct
+  { unsigned	enabled;		/* Mask (1<<icol) of usable indexes */
+    int		alt[16];		/* Index used for a BY_* pattern */
+    int		slot[INDEX_TABLES];	/* tp.next[] slot of an index */
+    int		slots;			/* # assigned slots */
+    size_t	overflowed;		/* # triples using overflow links */
+#ifdef COMPACT
+    triple_id	relayout_done;		/* relayout_triples() did upto here */
+#endif
+  } indexes;
+
+  struct
+  { frozen_graph *head;			/* List of frozen graphs */
+    size_t	triples;		/* # frozen triples */
+    gen_t	unlink_gen;		/* GC must unlink frozen from here */
+  } frozen;
+
   struct
   { int		count;			/* # garbage collections */
     int		busy;			/* Processing a GC */
@@ -458,6 +622,21 @@ typedef struct rdf_db
     size_t	uncollectable;		/* # uncollectable erased at last GC */
     gen_t	last_gen;		/* Oldest generation at last-GC */
     gen_t	last_reindex_gen;	/* Oldest reindexed at last GC */
+    struct
+    { int	active;			/* A GC cycle is in progress */
+      int	icol;			/* Index being collected */
+      gen_t	gen;			/* Oldest generation at start */
+      gen_t	reindex_gen;		/* Oldest reindexed at start */
+      size_t	collected;		/* Collected from db->by_none */
+      size_t	uncollectable;		/* Uncollectable in db->by_none */
+    } cycle;				/* Incremental GC cycle */
+    struct
+    { int	unit;			/* GC_BUDGET_* */
+      int64_t	amount;			/* Buckets or microseconds */
+    } budget;				/* Work per GC slice */
+    size_t	slices[GC_SLICE_BINS];	/* Slices taking < 2^N usec */
+    int64_t	max_slice;		/* Longest slice in usec */
+    int		workers;		/* Max GC workers (0: cpu_count) */
   } gc;
 
   struct
@@ -465,6 +644,7 @@ typedef struct rdf_db
     simpleMutex misc;			/* general DB locks */
     simpleMutex gc;			/* DB garbage collection lock */
     simpleMutex duplicates;		/* Duplicate init lock */
+    simpleMutex overflow;		/* Growing triple_hash.overflow */
   } locks;
 
   struct
@@ -473,6 +653,15 @@ typedef struct rdf_db
     gen_t     keep;			/* generation to keep */
   } snapshots;
 
+  struct
+  { change_block *head;			/* Oldest block of the change log */
+    change_block *tail;			/* Block we append to */
+    change_subscription *subscriptions;	/* Active subscriptions */
+    int		subscribers;		/* # active subscriptions */
+    gen_t	keep;			/* Oldest subscriber position */
+    gen_t	reindex_keep;		/* Oldest reindexed to keep */
+  } changes;				/* change log (rdf_changes_since/5) */
+
   skiplist      literals;		/* (shared) literals */
 } rdf_db;
 
@@ -591,14 +780,20 @@ COMMON(void *)	rdf_malloc(rdf_db *db, size_t size);
 COMMON(void)	rdf_free(rdf_db *db, void *ptr, size_t size);
 COMMON(int)	prelink_triple(rdf_db *db, triple *t, query *q);
 COMMON(int)	link_triple(rdf_db *db, triple *t, query *q);
-COMMON(int)	postlink_triple(rdf_db *db, triple *t, query *q);
+COMMON(void)	link_triples(rdf_db *db, triple **triples, size_t count,
+			     query *q);
 COMMON(void)	erase_triple(rdf_db *db, triple *t, query *q);
 COMMON(void)	add_triple_consequences(rdf_db *db, triple *t, query *q);
 COMMON(void)	del_triple_consequences(rdf_db *db, triple *t, query *q);
+COMMON(void)	commit_triple_gen(rdf_db *db, triple *t, gen_t gen);
+COMMON(void)	log_graph_drop(rdf_db *db, struct graph *g, gen_t gen);
 COMMON(predicate *) lookup_predicate(rdf_db *db, atom_t name);
 COMMON(rdf_db*)	rdf_current_db(void);
 COMMON(int)	rdf_broadcast(broadcast_id id, void *a1, void *a2);
 COMMON(int)	rdf_is_broadcasting(broadcast_id id);
+COMMON(int)	rdf_broadcast_batch(broadcast_id id, triple **triples,
+				    size_t count);
+COMMON(int)	rdf_is_broadcasting_batch(broadcast_id id);
 COMMON(void)	consider_triple_rehash(rdf_db *db, size_t extra);
 COMMON(int)	rdf_create_gc_thread(rdf_db *db);
 
@@ -33,6 +33,7 @@
 
 	    rdf/3,			% ?Subject, ?Predicate, ?Object
 	    rdf/4,			% ?Subject, ?Predicate, ?Object, ?DB
+	    rdf_triples/3,		% +Pattern, +Max, -Triples
 	    rdf_has/3,			% ?Subject, +Pred, ?Obj
 	    rdf_has/4,			% ?Subject, +Pred, ?Obj, -RealPred
 	    rdf_reachable/3,		% ?Subject, +Pred, ?Object
@@ -58,10 +59,15 @@
 	    rdf_active_transaction/1,	% ?Id
 
 	    rdf_monitor/2,		% :Goal, +Options
+	    rdf_batch_triple/2,		% +Batch, -Triple
+	    rdf_batch_size/2,		% +Batch, -Count
 
 	    rdf_save_db/1,		% +File
 	    rdf_save_db/2,		% +File, +DB
+	    rdf_save_db/3,		% +File, +DB, +Options
 	    rdf_load_db/1,		% +File
+	    rdf_load_db/2,		% +File, +Options
+	    rdf_db_file_graphs/2,	% +File, -Graphs
 	    rdf_reset_db/0,
 
 	    rdf_node/1,			% -Id
@@ -78,6 +84,8 @@
 	    rdf_save/2,			% +File, +Options
 	    rdf_unload/1,		% +File
 	    rdf_unload_graph/1,		% +Graph
+	    rdf_clone_graph/2,		% +From, +To
+	    rdf_swap_graphs/2,		% +Graph1, +Graph2
 
 	    rdf_md5/2,			% +DB, -MD5
 	    rdf_atom_md5/3,		% +Text, +Times, -MD5
@@ -98,7 +106,13 @@
 	    rdf_snapshot/1,		% -Snapshot
 	    rdf_delete_snapshot/1,	% +Snapshot
 	    rdf_current_snapshot/1,	% +Snapshot
+	    rdf_subscribe_changes/2,	% -Subscription, -Generation
+	    rdf_unsubscribe_changes/1,	% +Subscription
+	    rdf_changes_since/4,	% +Subscription, +Since, -Changes, -Until
+	    rdf_changes_since/5,	% +Subscription, +Since, -Changes, -Until, +Opts
 	    rdf_estimate_complexity/4,	% +S,+P,+O,-Count
+	    rdf_count/4,		% ?S,?P,?O,-Count
+	    rdf_query/2,		% +Patterns, -Rows
 
 	    rdf_save_subject/3,		% +Stream, +Subject, +DB
 	    rdf_save_header/2,		% +Out, +Options
@@ -124,6 +138,12 @@
 
 	    rdf_warm_indexes/0,
 	    rdf_warm_indexes/1,		% +Indexed
+	    rdf_set_indexes/1,		% +Indexes
+	    rdf_set_gc_budget/1,	% +Budget
+	    rdf_indexes/1,		% -Indexes
+	    rdf_bulk_load/1,		% :Goal
+	    rdf_bulk_load/2,		% :Goal, +Options
+	    rdf_freeze_graph/1,		% +Graph
 	    rdf_update_duplicates/0,
 
 	    rdf_debug/1,		% Set verbosity
@@ -170,6 +190,8 @@
 	rdf_transaction(0),
 	rdf_transaction(0, +),
 	rdf_transaction(0, +, +),
+	rdf_bulk_load(0),
+	rdf_bulk_load(0, +),
 	rdf_monitor(1, +),
 	rdf_save(+, :),
 	rdf_load(+, :).
@@ -213,8 +235,13 @@
 		       convert_typed_literal(callable),
 		       document_language(atom)
 		     ]).
+:- predicate_options(rdf_bulk_load/2, 2,
+		     [ indexes(list(atom))
+		     ]).
 :- predicate_options(rdf_transaction/3, 3,
-		     [ snapshot(any)
+		     [ snapshot(any),
+		       isolation(oneof([snapshot,serializable])),
+		       retry(nonneg)
 		     ]).
 
 :- multifile
@@ -607,6 +634,7 @@ mk_global(NS:Local, Global) :-
 	rdf_assert(r,r,o),
 	rdf_retractall(r,r,o),
 	rdf(r,r,o,?),
+	rdf_triples(t,+,-),
 	rdf_assert(r,r,o,+),
 	rdf_retractall(r,r,o,?),
 	rdf_reachable(r,r,o),
@@ -623,6 +651,8 @@ mk_global(NS:Local, Global) :-
 	rdf_set_predicate(r, t),
 	rdf_predicate_property(r, -),
 	rdf_estimate_complexity(r,r,r,-),
+	rdf_count(r,r,o,-),
+	rdf_query(t,-),
 	rdf_print_predicate_cloud(r,+).
 
 %%	rdf_equal(?Resource1, ?Resource2)
@@ -744,6 +774,21 @@ lang_equal(Lang1, Lang2) :-
 %	@param Source is a term Graph:Line.  If Source is instatiated,
 %	passing an atom is the same as passing Atom:_.
 
+%%	rdf_triples(+Pattern, +Max, -Triples) is nondet.
+%
+%	Batch version of rdf/3 and rdf/4 for  processing large result
+%	sets. Pattern is a term rdf(S,P,O) or rdf(S,P,O,G) that is
+%	matched as the corresponding call to   rdf/3 or rdf/4. Triples
+%	is unified with a list of at  most Max matching triples, each
+%	represented as a ground term of the same   arity as Pattern.
+%	Backtracking resumes the search  and   returns  the next batch.
+%	The last batch is returned  deterministically. For example:
+%
+%	  ==
+%	  forall(rdf_triples(rdf(S,P,O), 10000, Triples),
+%		 process_triples(Triples))
+%	  ==
+
 
 %%	rdf_has(?Subject, +Predicate, ?Object) is nondet.
 %
@@ -1078,7 +1123,8 @@ rdf_gc_loop(CPU) :-
 
 %%	rdf_gc(-CPU) is det.
 %
-%	Run RDF GC one time. CPU is  the   amount  of CPU time spent. We
+%	Run one slice of the RDF GC.  The size of a slice is controlled
+%	by rdf_set_gc_budget/1. CPU is  the   amount  of CPU time spent. We
 %	update this in Prolog because portable access to thread specific
 %	CPU is really hard in C.
 
@@ -1099,7 +1145,9 @@ rdf_gc(CPU) :-
 %	collection as long as it is considered `useful'.
 %
 %	Using rdf_gc/0 should only be  needed   to  ensure a fully clean
-%	database for analysis purposes such as leak detection.
+%	database for analysis purposes such as leak detection.  It runs
+%	GC slices until the current GC cycle is completed and no garbage
+%	is left.
 
 rdf_gc :-
 	has_garbage, !,
@@ -1118,6 +1166,28 @@ has_garbage :-
 has_garbage(Info) :- arg(2, Info, Garbage),     Garbage > 0.
 has_garbage(Info) :- arg(3, Info, Reindexed),   Reindexed > 0.
 has_garbage(Info) :- arg(4, Info, Optimizable), Optimizable > 0.
+has_garbage(Info) :- arg(9, Info, Cursor),      Cursor \== idle.
+
+%%	rdf_set_gc_budget(+Budget) is det.
+%
+%	Limit the work done by a single GC slice.  Garbage collection is
+%	performed in _cycles_.  A cycle walks all index tables, but it
+%	is split into slices such that the GC thread never holds the
+%	database for too long.  Budget is one of:
+%
+%	  * infinite
+%	  Complete a GC cycle in one slice.  This is the default.
+%	  * buckets(+Count)
+%	  Process at most Count hash buckets per slice.
+%	  * time(+Microseconds)
+%	  Stop a slice after about Microseconds wall time.
+%
+%	The longest slice and the distribution of slice durations are
+%	available as gc_slices(Longest, Histogram) in the 10th argument
+%	of the term returned by rdf_gc_info_/1.
+
+rdf_set_gc_budget(Budget) :-
+	rdf_set_gc_budget_(Budget).
 
 %%	consider_gc(+CPU) is semidet.
 %
@@ -1132,8 +1202,11 @@ consider_gc(_CPU) :-
 				 _KeepGen,	% Oldest active generation
 				 _LastGCGen,    % Oldest active gen at last GC
 				 _ReindexGen,
-				 _LastGCReindexGen))
-	->  (   (Garbage+Reindexed) * 5 > Triples
+				 _LastGCReindexGen,
+				 Cursor,	% GC cycle in progress
+				 _Slices))
+	->  (   Cursor \== idle
+	    ;	(Garbage+Reindexed) * 5 > Triples
 	    ;	Optimizable > 4
 	    )
 	;   print_message(error, rdf(invalid_gc_info)),
@@ -1172,6 +1245,22 @@ consider_gc(_CPU) :-
 %	  * gc(GCCount, ReclaimedTriples, ReindexedTriples, Time)
 %	  Information about the garbage collector.
 %
+%	  * triple_size(-Bytes, -Pending)
+%	  Bytes is the memory used by a triple, including the links
+%	  for the indexes that have been created.  Pending is the number
+%	  of triples that were added before the last index was created.
+%	  These use an additional 4 bytes per newer index until they are
+%	  relaid out by the garbage collector.
+%
+%	  * frozen_triples(-Count)
+%	  Number of triples in frozen graphs.  See rdf_freeze_graph/1.
+%
+%	  * group_commit(-Groups, -Commits)
+%	  Commits is the number of modifications outside a transaction
+%	  (including committing a transaction) and Groups is the number
+%	  of generation steps used for them.  Concurrent commits are
+%	  applied as a group using a single generation.
+%
 %	  * searched_nodes(-Count)
 %	  Number of nodes expanded by rdf_reachable/3 and
 %	  rdf_reachable/5.
@@ -1187,6 +1276,13 @@ consider_gc(_CPU) :-
 %	  * triples_by_graph(Graph, Count)
 %	  This statistics is produced for each named graph. See
 %	  =triples= for the interpretation of this value.
+%
+%	  * monitor_queue(Goal, Depth, Lag, Lost)
+%	  This statistics is produced for each monitor registered with
+%	  the async(Size) option of rdf_monitor/2. Depth is the number
+%	  of queued events, Lag the time in seconds the oldest queued
+%	  event is waiting and Lost the number of events that were
+%	  dropped or coalesced.
 
 rdf_statistics(graphs(Count)) :-
 	rdf_statistics_(graphs(Count)).
@@ -1204,6 +1300,12 @@ rdf_statistics(gc(Count, Reclaimed, Reindexed, Time)) :-
 	rdf_statistics_(gc(Count, Reclaimed, Reindexed, Time)).
 rdf_statistics(searched_nodes(Count)) :-
 	rdf_statistics_(searched_nodes(Count)).
+rdf_statistics(triple_size(Bytes, Pending)) :-
+	rdf_statistics_(triple_size(Bytes, Pending)).
+rdf_statistics(frozen_triples(Count)) :-
+	rdf_statistics_(frozen_triples(Count)).
+rdf_statistics(group_commit(Groups, Commits)) :-
+	rdf_statistics_(group_commit(Groups, Commits)).
 rdf_statistics(lookup(Index, Count)) :-
 	functor(Indexed, indexed, 16),
 	rdf_statistics_(Indexed),
@@ -1217,6 +1319,9 @@ rdf_statistics(hash_quality(Index, Size, Quality,Optimize)) :-
 	index(Index, Place).
 rdf_statistics(triples_by_graph(Graph, Count)) :-
 	rdf_graph_(Graph, Count).
+rdf_statistics(monitor_queue(Goal, Depth, Lag, Lost)) :-
+	rdf_monitor_queues_(Queues),
+	member(queue(Goal, Depth, Lag, Lost), Queues).
 
 index(rdf(-,-,-,-), 0).
 index(rdf(+,-,-,-), 1).
@@ -1357,6 +1462,69 @@ rdf_current_snapshot(Term) :-
 	current_blob(Term, rdf_snapshot).
 
 
+		 /*******************************
+		 *	     CHANGE LOG		*
+		 *******************************/
+
+%%	rdf_subscribe_changes(-Subscription, -Generation) is det.
+%
+%	Subscribe to the changes of the RDF  store. Generation is the
+%	current generation (see rdf_generation/1). While there are
+%	subscriptions, committed changes are  recorded   in  a  change
+%	log. The log, as well as the   deleted triples it refers to, is
+%	kept until all subscriptions have consumed  the changes using
+%	rdf_changes_since/4. A subscription exists until it is deleted
+%	using rdf_unsubscribe_changes/1 or it is garbage collected.
+
+%%	rdf_unsubscribe_changes(+Subscription) is det.
+%
+%	Delete a subscription created  by   rdf_subscribe_changes/2.  If
+%	this was the last subscription, the change log is discarded.
+
+%%	rdf_changes_since(+Subscription, +Since, -Changes, -Until) is det.
+%%	rdf_changes_since(+Subscription, +Since, -Changes, -Until,
+%%			  +Options) is det.
+%
+%	Changes is a list of the  changes committed after generation
+%	Since upto and including generation Until,  ordered on their
+%	generation.  Each change is one of
+%
+%	  - added(Gen, S, P, O, G)
+%	  The triple rdf(S,P,O,G) was added in generation Gen.
+%	  - deleted(Gen, S, P, O, G)
+%	  The triple rdf(S,P,O,G) was deleted in generation Gen.
+%	  - dropped(Gen, G)
+%	  Graph G was dropped in generation Gen (see rdf_unload_graph/1).
+%	  Its triples are not reported individually.
+%
+%	Calling this predicate informs the  store   that  the changes
+%	upto Since have been consumed. Since must   be the generation
+%	returned by rdf_subscribe_changes/2 or a   later generation. A
+%	consumer typically calls this predicate   repeatedly, passing
+%	Until of the previous call as Since.  Options:
+%
+%	  - max_changes(+Count)
+%	  Return at most Count changes.   All  changes of a generation
+%	  are returned together, so the  list   is  longer if the first
+%	  generation after Since has more than Count changes.
+%
+%	Changes inside transactions  are   reported  when the outermost
+%	transaction commits, all using the generation of the commit.
+%	Several commits may share a generation.   Within a generation,
+%	the dropped/2 changes come first,  followed   by  the deleted/5
+%	and finally the added/5 changes.  Applying  the changes in the
+%	order of the list gives the state   after the generation.  For
+%	example, rdf_swap_graphs/2 reports  dropped(Gen,   G1)  and
+%	dropped(Gen, G2), followed by the triples of both graphs added
+%	to the other graph, all in the same generation Gen.
+%
+%	@error	permission_error(access, rdf_changes, Since) if Since is
+%		before the position of Subscription.
+
+rdf_changes_since(Subscription, Since, Changes, Until) :-
+	rdf_changes_since(Subscription, Since, Changes, Until, []).
+
+
 		 /*******************************
 		 *	    TRANSACTION		*
 		 *******************************/
@@ -1394,6 +1562,26 @@ rdf_current_snapshot(Term) :-
 %	  atom =true=, which implies that an anonymous snapshot is
 %	  created at the current state of the store.  Modifications
 %	  due to executing Goal are only visible to Goal.
+%
+%	  * isolation(+Level)
+%	  One of =snapshot= (default) or =serializable=.  Using
+%	  =snapshot=, Goal sees the store as it was when the
+%	  transaction started and its modifications are committed
+%	  regardless of concurrent transactions.  Using =serializable=,
+%	  the commit fails if a concurrent transaction modified a
+%	  predicate that Goal read using rdf/3, rdf/4, rdf_has/3,
+%	  rdf_reachable/3, rdf_update/4 or rdf_retractall/4 (an unbound
+%	  predicate counts as reading all predicates), or deleted a
+%	  triple that Goal deleted.  The test is conservative and may
+%	  report conflicts for transactions that do not overlap.  This
+%	  option only applies to the outermost transaction.  Monitors
+%	  (see rdf_monitor/2) receive transaction(abort(0), Id) rather
+%	  than transaction(end(0), Id) for a conflicting commit.
+%
+%	  * retry(+Count)
+%	  If a serializable transaction conflicts, discard its changes
+%	  and run Goal again, at most Count times.  Default is 0,
+%	  making rdf_transaction/3 fail on a conflict.
 
 rdf_transaction(Goal) :-
 	rdf_transaction(Goal, user, []).
@@ -1416,10 +1604,78 @@ rdf_active_transaction(Id) :-
 %%	rdf_monitor(:Goal, +Options)
 %
 %	Call Goal if specified actions occur on the database.
+%
+%	If Options contains =batch=, the triple  events (=assert=,
+%	assert(load), =retract= and =update=)  are   not  passed  per
+%	triple. Instead, Goal is called once   per commit with a term
+%	batch(Event, Batch), where Event is  the   name  of the event.
+%	Batch is a handle that is only   valid  while Goal is running.
+%	Use rdf_batch_triple/2 and rdf_batch_size/2 to access it.
+%
+%	If Options contains async(Size), Goal  is   not  called by the
+%	thread that modifies the database.  Instead,   events  are copied
+%	into a queue that holds at most  Size events and a dedicated
+%	thread calls Goal. What happens if  the   queue  is full is
+%	determined by the option queue_policy(Policy):
+%
+%	  - block
+%	  The modifying thread waits until there is space (default).
+%	  Goal may not modify the database.  The old_literal event is
+%	  raised while the store is locked; if the queue is full, it
+%	  is coalesced rather than waiting.
+%	  - drop
+%	  The event is discarded.
+%	  - coalesce
+%	  The event is merged with the youngest queued event into
+%	  lost(Count), telling Goal that Count events were not
+%	  delivered.
+%
+%	The queues appear in rdf_statistics/1  as monitor_queue(Goal,
+%	Depth, Lag, Lost). The options =batch= and async(Size) cannot
+%	be combined, and a monitor cannot switch between synchronous
+%	and asynchronous delivery.  Registering an asynchronous monitor
+%	again with an empty mask (e.g., [-all]) discards its queued
+%	events and terminates its thread.  Registering it again using
+%	async(Size) restarts it.
 
 rdf_monitor(Goal, Options) :-
-	monitor_mask(Options, 0xffff, Mask),
-	rdf_monitor_(Goal, Mask).
+	partition(async_option, Options, AsyncOptions, MaskOptions),
+	monitor_mask(MaskOptions, 0xffff, Mask),
+	(   memberchk(async(Size), AsyncOptions)
+	->  option(queue_policy(Policy), AsyncOptions, block),
+	    must_be(positive_integer, Size),
+	    must_be(oneof([block,drop,coalesce]), Policy),
+	    (   Mask /\ 0x10000 =:= 0
+	    ->  true
+	    ;   domain_error(rdf_monitor_options, Options)
+	    ),
+	    (   rdf_monitor_async_(Goal, Mask, Size, Policy)
+	    ->  thread_create(monitor_queue_loop(Goal), _,
+			      [ detached(true)
+			      ])
+	    ;   true
+	    )
+	;   rdf_monitor_(Goal, Mask)
+	).
+
+async_option(async(_)).
+async_option(queue_policy(_)).
+
+%%	monitor_queue_loop(:Goal)
+%
+%	Thread that calls Goal for the events queued for an
+%	asynchronous monitor.  Terminates if the queue is closed.
+
+monitor_queue_loop(Goal) :-
+	repeat,
+	(   rdf_monitor_next_(Goal, Event)
+	->  (   catch(call(Goal, Event), E, (print_message(error, E), fail))
+	    ->  true
+	    ;   true
+	    ),
+	    fail
+	;   !
+	).
 
 monitor_mask([], Mask, Mask).
 monitor_mask([H|T], Mask0, Mask) :-
@@ -1457,6 +1713,20 @@ monitor_mask(reset,	   0x2000).
 monitor_mask(unload,	   0x1000).
 					% mask for all
 monitor_mask(all,	   0xffff).
+					% delivery flags
+monitor_mask(batch,	   0x10000).
+
+%%	rdf_batch_triple(+Batch, -Triple) is nondet.
+%
+%	True when Triple is a triple of  a batch passed to a monitor
+%	registered with the =batch= option. Triple is rdf(S,P,O,G),
+%	or update(Old, New) for an =update= batch, where Old and New
+%	are rdf(S,P,O,G) terms.
+
+%%	rdf_batch_size(+Batch, -Count) is det.
+%
+%	Count is the number of triples in Batch,  or the number of
+%	Old/New pairs for an =update= batch.
 
 %rdf_broadcast(Term, MaskName) :-
 %%	monitor_mask(MaskName, Mask),
@@ -1472,20 +1742,9 @@ monitor_mask(all,	   0xffff).
 %	Warm all indexes.  See rdf_warm_indexes/1.
 
 rdf_warm_indexes :-
-	findall(Index, rdf_index(Index), Indexes),
+	rdf_indexes(Indexes),
 	rdf_warm_indexes(Indexes).
 
-rdf_index(s).
-rdf_index(p).
-rdf_index(o).
-rdf_index(sp).
-rdf_index(o).
-rdf_index(po).
-rdf_index(spo).
-rdf_index(g).
-rdf_index(sg).
-rdf_index(pg).
-
 %%	rdf_warm_indexes(+Indexes) is det.
 %
 %	Create the named indexes.  Normally,   the  RDF database creates
@@ -1493,6 +1752,102 @@ rdf_index(pg).
 %	serves two purposes: it provides an   explicit  way to make sure
 %	that the required indexes  are   present  and  creating multiple
 %	indexes at the same time is more efficient.
+%
+%	Indexes that are not enabled (see rdf_set_indexes/1) are ignored.
+%
+%	Indexes for large databases are   created  using multiple threads,
+%	up to the value of the Prolog flag =cpu_count=.  Other threads may
+%	continue modifying the database while the indexes are created.
+
+
+%%	rdf_set_indexes(+Indexes) is det.
+%
+%	Set the indexes that are maintained  by the RDF database. Indexes
+%	is a list of index names. Each name is  a combination of the
+%	letters =s=, =p=, =o= and =g=: s, p, o, g, sp, so, po, spo, sg,
+%	pg, og, spg and pog. Queries whose index is not enabled use the
+%	best enabled index that covers part of the pattern and filter the
+%	result. Each enabled index costs one link per triple. The default
+%	is [s,p,o,sp,po,spo,g,sg,pg].  Enabling =so=, =og= or =pog= speeds
+%	up rdf(S,-,O), rdf(-,-,O,G) and rdf(-,P,O,G).
+%
+%	This predicate may only be called  before the first triple is
+%	added to the database or after rdf_reset_db/0.  Enabled indexes
+%	are created lazily, on the first query that needs them.
+%
+%	@error permission_error(set_indexes, rdf_db, default) if the
+%	database is not empty.
+
+rdf_set_indexes(Indexes) :-
+	must_be(list(atom), Indexes),
+	rdf_set_indexes_(Indexes).
+
+%%	rdf_indexes(-Indexes) is det.
+%
+%	Indexes is a list of the names of the enabled indexes.
+%
+%	@see rdf_set_indexes/1.
+
+rdf_indexes(Indexes) :-
+	rdf_indexes_(Indexes).
+
+
+		 /*******************************
+		 *	    BULK LOAD		*
+		 *******************************/
+
+%%	rdf_bulk_load(:Goal) is semidet.
+%%	rdf_bulk_load(:Goal, +Options) is semidet.
+%
+%	Run Goal in bulk load mode. Triples   added while Goal is running
+%	are not indexed and  no  duplicate   administration  is  done.
+%	Queries use the existing indexes and scan the triples added in
+%	this mode. Queries that need an index that does not yet exist
+%	scan all triples. After Goal completes, the existing indexes are
+%	resized once and the new triples are added to them.
+%	Options:
+%
+%	  * indexes(+List)
+%	  Indexes to create after Goal completes, using the names of
+%	  rdf_warm_indexes/1.  Default is no additional indexes.
+%
+%	Bulk load scopes may be nested and be  active in multiple threads
+%	concurrently. The indexes are   completed  when the last scope
+%	terminates.
+
+rdf_bulk_load(Goal) :-
+	rdf_bulk_load(Goal, []).
+
+rdf_bulk_load(Goal, Options) :-
+	option(indexes(Indexes), Options, []),
+	must_be(list, Indexes),
+	setup_call_cleanup(rdf_begin_bulk_load_,
+			   once(Goal),
+			   rdf_end_bulk_load_(Indexes)).
+
+%%	rdf_freeze_graph(+Graph) is det.
+%
+%	Freeze the triples of Graph into a compact read-only index. The
+%	frozen triples are sorted on subject, predicate and object and
+%	removed from the hash indexes, which saves memory and makes
+%	queries on large, stable graphs faster. Graph can still be
+%	modified: new triples are indexed as usual and deleted triples
+%	are removed from the frozen index by the garbage collector.
+%	Calling rdf_freeze_graph/1 again includes triples added after
+%	the previous call.  Does nothing if Graph does not exist.
+%
+%	Triples added in a transaction that is not yet committed are not
+%	frozen. Queries that run while the graph is being frozen are
+%	not affected: they keep using the indexes that were in place
+%	when they started.  The memory of the hash indexes is reclaimed
+%	by the garbage collector after these queries have completed.
+%
+%	@error permission_error(freeze, rdf_graph, Graph) if called from
+%	within rdf_bulk_load/2.
+
+rdf_freeze_graph(Graph) :-
+	must_be(atom, Graph),
+	rdf_freeze_graph_(Graph).
 
 
 		 /*******************************
@@ -1548,6 +1903,17 @@ rdf_update_duplicates_thread :-
 %	is supplied only triples flagged to originate from that database
 %	are  added.  Files  created  this  way    can  be  loaded  using
 %	rdf_load_db/1.
+%
+%	The format is determined by the Prolog flag =rdf_triple_format=.
+%	The default (3) is a compact stream of triples.  Version 4 adds
+%	a graph directory and stores the triples in blocks per graph,
+%	which can be compressed (see rdf_save_db/3).  This allows for
+%	loading selected graphs (see rdf_load_db/2) and reading the
+%	graphs of a file without loading it (see rdf_db_file_graphs/2).
+%	Uncompressed version 4 files are larger than version 3 files.
+%	Both are fully loaded: all triples are created and indexed as
+%	usual.  Graphs that are frozen (see rdf_freeze_graph/1) are
+%	frozen again when loaded into an empty graph.
 
 :- create_prolog_flag(rdf_triple_format, 3, [type(integer)]).
 
@@ -1570,6 +1936,46 @@ rdf_save_db(File, Graph) :-
 	    ),
 	    close(Out)).
 
+%%	rdf_save_db(+File, ?Graph, +Options) is det.
+%
+%	As rdf_save_db/2, saving all graphs if Graph is unbound.
+%	Options:
+%
+%	  * version(+Version)
+%	  Format to use.  Default is the flag =rdf_triple_format=.
+%	  * compress(+Boolean)
+%	  If =true=, compress each block of triples independently.
+%	  This implies version 4 and requires rdf_db to be compiled
+%	  with zlib.  Default is =false=.
+%	  * since(+Snapshot)
+%	  Save a delta: only the triples that were added or deleted
+%	  after Snapshot was created using rdf_snapshot/1.  Loading
+%	  the delta using rdf_load_db/1 into a store that holds the
+%	  state of Snapshot reproduces the current state.  Deltas use
+%	  version 3 and Snapshot may not be created inside a
+%	  transaction.
+
+rdf_save_db(File, Graph, Options) :-
+	option(compress(Compress), Options, false),
+	must_be(boolean, Compress),
+	(   Compress == true
+	->  Default = 4
+	;   option(since(_), Options)
+	->  Default = 3
+	;   current_prolog_flag(rdf_triple_format, Default)
+	),
+	option(version(Version), Options, Default),
+	(   option(since(Snapshot), Options)
+	->  SaveOptions = [compress(Compress), since(Snapshot)]
+	;   SaveOptions = [compress(Compress)]
+	),
+	setup_call_cleanup(
+	    open(File, write, Out, [type(binary)]),
+	    ( set_stream(Out, record_position(false)),
+	      rdf_save_db_(Out, Graph, Version, SaveOptions)
+	    ),
+	    close(Out)).
+
 
 %%	rdf_load_db_no_admin(+File, +Id, -Graphs) is det.
 %
@@ -1598,12 +2004,48 @@ check_loaded_cache(DB, Graphs, _) :-
 
 %%	rdf_load_db(+File) is det.
 %
-%	Load triples from a file created using rdf_save_db/2.
+%	Load triples from a file created using rdf_save_db/2.  If File
+%	is a delta saved using the since(Snapshot) option of
+%	rdf_save_db/3, the triples deleted since Snapshot are deleted
+%	before the new triples are added.  A chain of deltas is applied
+%	by loading the base file followed by each delta in order.
 
 rdf_load_db(File) :-
 	uri_file_name(URL, File),
 	rdf_load_db_no_admin(File, URL, _Graphs).
 
+%%	rdf_load_db(+File, +Options) is det.
+%
+%	As rdf_load_db/1.  Options:
+%
+%	  * graphs(+List)
+%	  Only load the triples of the graphs in List.  For files
+%	  saved in version 4, the blocks of other graphs are not
+%	  read.
+
+rdf_load_db(File, Options) :-
+	option(graphs(Graphs), Options), !,
+	must_be(list(atom), Graphs),
+	uri_file_name(URL, File),
+	open(File, read, In, [type(binary)]),
+	set_stream(In, record_position(false)),
+	call_cleanup(rdf_load_db_(In, URL, _, Graphs), close(In)).
+rdf_load_db(File, _) :-
+	rdf_load_db(File).
+
+%%	rdf_db_file_graphs(+File, -Graphs) is det.
+%
+%	Read the graph directory of File, which must be saved in version
+%	4.  Graphs is a list of graph(Name, Triples, MD5), where MD5 is
+%	[] if the digest is not stored.  MD5 can be compared to
+%	rdf_md5/2 without loading the file.
+
+rdf_db_file_graphs(File, Graphs) :-
+	setup_call_cleanup(
+	    open(File, read, In, [type(binary)]),
+	    rdf_db_file_graphs_(In, Graphs),
+	    close(In)).
+
 
 		 /*******************************
 		 *	    LOADING RDF		*
@@ -1641,7 +2083,11 @@ rdf_load_db(File) :-
 %	    of the number of cores and the number of inputs.  Higher
 %	    values can be useful when loading inputs from (slow)
 %	    network connections.  Using 1 (one) does not use
-%	    separate worker threads.
+%	    separate worker threads.  If FileOrList is a single
+%	    N-Triples or N-Quads file, the file is split into Jobs
+%	    chunks that are loaded concurrently.  Such a load commits
+%	    the triples in batches rather than in a single transaction,
+%	    so other threads may see a partially loaded graph.
 %
 %	    * format(+Format)
 %	    Specify the source format explicitly. Normally this is
@@ -1678,6 +2124,15 @@ rdf_load_db(File) :-
 %	    also print_message/2.
 %
 %	Other options are forwarded to process_rdf/3.
+%
+%	Turtle, TriG, N-Triples and N-Quads documents are parsed in C and
+%	added to the store without the duplicate check of rdf_assert/4:
+%	a statement that appears twice in the document is stored twice
+%	(see rdf_graph_property/2 for the triple count of the graph).
+%	All triples of Turtle and TriG documents,
+%	including those of the named graphs of a TriG document, record
+%	the line of their statement in their graph, i.e., rdf/4 returns
+%	the graph as Graph:Line.
 
 :- dynamic
 	rdf_loading/3.				% Graph, Queue, Thread
@@ -1710,7 +2165,8 @@ rdf_load_noagc(List, M, Options) :-
 	(   Jobs =:= 1
 	->  forall(member(Spec, Inputs),
 		   rdf_load_one(Spec, M, Options))
-	;   maplist(load_goal(Options, M), Inputs, Goals),
+	;   select_option(concurrent(_), Options, FileOptions, _),
+	    maplist(load_goal(FileOptions, M), Inputs, Goals),
 	    concurrent(Jobs, Goals, [])
 	).
 rdf_load_noagc(One, M, Options) :-
@@ -2151,11 +2607,22 @@ warn_deprecated_unload(Graph) :-
 %
 %	Remove Graph from the RDF store.  Succeeds silently if the named
 %	graph does not exist.
+%
+%	If possible, the triples are killed in a single step that takes
+%	constant time.  They are erased  later   by  the  garbage
+%	collector.  This is not possible  inside   a  transaction, if
+%	retract events are monitored (see  rdf_monitor/2, including
+%	monitors using the =batch= option), if the graph
+%	is frozen or if it contains rdfs:subPropertyOf triples.  In that
+%	case the triples are retracted one by one.
 
 rdf_unload_graph(Graph) :-
 	must_be(atom, Graph),
 	(   rdf_graph(Graph)
-	->  rdf_transaction(do_unload(Graph), unload(Graph))
+	->  (   rdf_drop_graph_(Graph)
+	    ->  rdf_destroy_graph(Graph)
+	    ;   rdf_transaction(do_unload(Graph), unload(Graph))
+	    )
 	;   true
 	).
 
@@ -2167,6 +2634,47 @@ do_unload(Graph) :-
 	),
 	rdf_destroy_graph(Graph).
 
+%%	rdf_clone_graph(+From, +To) is det.
+%
+%	Add a copy of all triples of  From   to  To.  The copies share
+%	literals and resources with the  original   triples,  which makes
+%	this much cheaper than asserting them.   The  triples themselves
+%	are copied: the time and memory needed  are proportional to the
+%	number of triples in From.  Later  changes   to  either graph do
+%	not affect the other.
+%
+%	@error permission_error(clone_to, rdf_graph, To) if To has
+%	triples.
+
+%%	rdf_swap_graphs(+Graph1, +Graph2) is det.
+%
+%	Exchange the triples of Graph1 and Graph2,  as well as their
+%	source and modification time. Readers see either the old or the
+%	new state.  A typical use is to load a new version of a graph
+%	in a temporary graph and  swap  it  with   the  graph  in  use,
+%	after which the temporary graph is unloaded.
+%
+%	If possible, the swap is performed in a single generation step
+%	without retracting triples (see rdf_unload_graph/1 for the
+%	conditions).  Else, or if another thread modified one of the
+%	graphs while the swap was in progress, it is performed in a
+%	transaction.
+%
+%	The swap copies the triples of  both   graphs  (see
+%	rdf_clone_graph/2): it takes time proportional to the number of
+%	triples in both graphs and the  original   triples  use memory
+%	until the garbage collector reclaims them  after all queries that
+%	started before the swap have completed.
+
+rdf_swap_graphs(Graph1, Graph2) :-
+	must_be(atom, Graph1),
+	must_be(atom, Graph2),
+	(   rdf_swap_graphs_(Graph1, Graph2, true)
+	->  true
+	;   rdf_transaction(rdf_swap_graphs_(Graph1, Graph2, false),
+			    swap_graphs(Graph1, Graph2))
+	).
+
 		 /*******************************
 		 *	   GRAPH QUERIES	*
 		 *******************************/
@@ -3418,6 +3926,12 @@ rdf_url_namespace(URL, Prefix) :-
 %	    their current location.  Leaving cells at their current
 %	    location reduces memory fragmentation and slows down
 %	    access.
+%
+%	  * gc_workers(+Count)
+%	  Use at most Count threads to collect an index table.  Large
+%	  tables are split into bucket ranges that are collected
+%	  concurrently.  The default 0 uses up to the Prolog flag
+%	  =cpu_count= threads.  1 disables concurrent collection.
 
 %%	rdf_md5(+Graph, -MD5) is det.
 %
@@ -3459,6 +3973,47 @@ rdf_url_namespace(URL, Prefix) :-
 %	query  optimisation.  See  also    rdf_predicate_property/2  and
 %	rdf_statistics/1 for additional information to help optimizers.
 
+%%	rdf_count(?Subject, ?Predicate, ?Object, -Count) is det.
+%
+%	Count is the number of solutions of rdf(Subject, Predicate,
+%	Object). This is the same as the  goal below, but avoids creating
+%	the answers.  If the pattern  only   specifies  the predicate or
+%	nothing at all, the count is  normally   taken  from  the triple
+%	counts maintained by the store  rather   than  by enumerating the
+%	triples.  See also rdf_estimate_complexity/4.
+%
+%	  ==
+%	  aggregate_all(count, rdf(Subject, Predicate, Object), Count)
+%	  ==
+
+%%	rdf_query(+Patterns, -Rows) is det.
+%
+%	Evaluate the conjunction of  the   triple  patterns  in Patterns
+%	(a  basic  graph  pattern)   inside    the   database.  Patterns
+%	is a list of terms rdf(S,P,O)   and  rdf(S,P,O,G), where each
+%	argument is either a variable or ground.  The patterns match as
+%	rdf/3 and rdf/4. Rows is a list   of solutions, where each
+%	solution is a list of the  values   for  the variables in Patterns
+%	in the order of term_variables/2. For example:
+%
+%	  ==
+%	  ?- Patterns = [ rdf(X, rdf:type, foaf:'Person'),
+%			  rdf(X, foaf:name, N)
+%			],
+%	     rdf_query(Patterns, Rows),
+%	     term_variables(Patterns, Vars),
+%	     forall(member(Vars, Rows), ...)
+%	  ==
+%
+%	The join order is computed from the same statistics as used by
+%	rdf_estimate_complexity/4 and rdf_predicate_property/2. Joins
+%	are executed as index nested loops  or,   if  many probes are
+%	needed, as hash joins.
+
+rdf_query(Patterns, Rows) :-
+	term_variables(Patterns, Vars),
+	rdf_query_(Patterns, Vars, Rows).
+
 %%	rdf_debug(+Level) is det.
 %
 %	Set debugging to Level.  Level is an integer 0..9.  Default is
@@ -38,6 +38,8 @@
 :- use_module(library(option)).
 :- use_module(library(http/http_open)).
 :- use_module(library(semweb/rdf_db)).
+:- use_module(library(aggregate)).
+:- use_module(library(thread)).
 :- use_foreign_library(foreign(ntriples)).
 
 /** <module> Process files in the RDF N-Triples format
@@ -264,19 +266,96 @@ init_state(In, Options, State) :-
 
 %%	rdf_db:rdf_load_stream(+Format, +Stream, :Options) is semidet.
 %
-%	Plugin rule that supports loading the =ntriples= format.
-
-rdf_db:rdf_load_stream(ntriples, Stream, _Module:Options) :-
+%	Plugin rule that supports loading the =ntriples= and =nquads=
+%	formats.  The triples are added directly to the database by
+%	ntriples_load_db/3.  If Options contains concurrent(Jobs), Jobs
+%	> 1 and Stream is a repositionable file, the file is split into
+%	Jobs chunks at line boundaries that are loaded concurrently (see
+%	load_ntriples_concurrent/5).  Otherwise the triples are added in
+%	a single transaction, so the load is atomic.
+
+rdf_db:rdf_load_stream(Format, Stream, _Module:Options) :-
+	nt_format(Format),
 	rdf_db:graph(Options, Graph),
-	rdf_transaction((  rdf_process_ntriples(Stream, assert_triples, Options),
-			   rdf_set_graph(Graph, modified(false))
-			),
-			parse(Graph)).
+	init_state(stream(Stream), Options, State),
+	nt_state_anon_prefix(State, Prefix),
+	nt_state_on_error(State, OnError),
+	LoadOptions = [ graph(Graph),
+			anon_prefix(Prefix),
+			on_error(OnError)
+		      ],
+	(   option(concurrent(Jobs), Options),
+	    Jobs > 1,
+	    stream_property(Stream, reposition(true)),
+	    stream_property(Stream, file_name(File))
+	->  stream_property(Stream, encoding(Enc)),
+	    load_ntriples_concurrent(File, Enc, Jobs, LoadOptions, Errors)
+	;   rdf_transaction(( ntriples_load_db(Stream, -1,
+					       [ error_count(Errors)
+					       | LoadOptions
+					       ]),
+			      rdf_set_graph(Graph, modified(false))
+			    ),
+			    parse(Graph))
+	),
+	option(error_count(Errors), Options, _).
+
+nt_format(ntriples).
+nt_format(nquads).
+
+%%	load_ntriples_concurrent(+File, +Encoding, +Jobs, +LoadOptions,
+%%				 -Errors) is det.
+%
+%	Split File into Jobs chunks of about  the same size and load the
+%	chunks using concurrent/3. A chunk holds   all  lines that start
+%	inside its byte range. This works  for   all  encodings  we accept
+%	because a newline byte cannot be part of a multibyte sequence.
+%
+%	The workers do not use a transaction.  The triple sink of each
+%	worker commits the triples in batches of a fixed size as they are
+%	parsed (see rdf_sink.h), so the memory needed does not depend on
+%	the size of the file.  As a consequence the load is not atomic:
+%	other threads see the graph grow and if a chunk raises an error,
+%	the batches committed before remain in the store.
+
+load_ntriples_concurrent(File, Enc, Jobs, LoadOptions, Errors) :-
+	option(graph(Graph), LoadOptions),
+	size_file(File, Size),
+	ChunkSize is max(1, (Size+Jobs-1)//Jobs),
+	findall(load_ntriples_chunk(File, Enc, Start, End, LoadOptions, _),
+		( between(1, Jobs, I),
+		  Start is (I-1)*ChunkSize,
+		  Start < Size,
+		  End is min(Size, I*ChunkSize)
+		),
+		Goals),
+	concurrent(Jobs, Goals, []),
+	rdf_set_graph(Graph, modified(false)),
+	aggregate_all(sum(E),
+		      member(load_ntriples_chunk(_,_,_,_,_,E), Goals),
+		      Errors).
+
+load_ntriples_chunk(File, Enc, Start, End, LoadOptions, Errors) :-
+	setup_call_cleanup(
+	    open(File, read, In, [encoding(Enc)]),
+	    ( seek_line(In, Start),
+	      ntriples_load_db(In, End,
+			       [ error_count(Errors)
+			       | LoadOptions
+			       ])
+	    ),
+	    close(In)).
+
+%%	seek_line(+Stream, +Offset) is det.
+%
+%	Position Stream at the start of  the   first  line that starts at
+%	or after Offset.
 
-assert_triples([], _).
-assert_triples([rdf(S,P,O)|T], Graph) :-
-	rdf_assert(S,P,O,Graph),
-	assert_triples(T, Graph).
+seek_line(_, 0) :- !.
+seek_line(In, Offset) :-
+	Before is Offset - 1,
+	seek(In, Before, bof, _),
+	skip(In, 0'\n).
 
 %%	rdf_db:rdf_file_type(+Extension, -Format)
 %
@@ -285,3 +364,5 @@ assert_triples([rdf(S,P,O)|T], Graph) :-
 
 rdf_db:rdf_file_type(nt,       ntriples).
 rdf_db:rdf_file_type(ntriples, ntriples).
+rdf_db:rdf_file_type(nq,       nquads).
+rdf_db:rdf_file_type(nquads,   nquads).
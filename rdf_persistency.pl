@@ -717,6 +717,8 @@ monitor(create_graph(Graph)) :-
 	journal_fd(Graph, Fd),
 	open_transaction(Graph, Fd),
 	sync_journal(Graph, Fd).
+monitor(transaction(abort(N), Id)) :- !,
+	abort_transaction(Id, N).
 monitor(transaction(BE, Id)) :-
 	monitor_transaction(Id, BE).
 
@@ -771,6 +773,26 @@ monitor_transaction(reset, end(L)) :-
 	retractall(current_transaction_id(_,_)).
 
 
+%%	abort_transaction(+Id, +Level) is det.
+%
+%	The commit of a transaction was rejected because it conflicts
+%	with a concurrent transaction.  Nothing was changed.  Close the
+%	journal transactions as empty and undo the blocking done for
+%	the begin event.
+
+abort_transaction(log(_), N) :- !,
+	ignore(monitor_transaction(log(-), end(N))).
+abort_transaction(log(_, _), N) :- !,
+	ignore(monitor_transaction(log(-), end(N))).
+abort_transaction(load_journal(DB), _) :- !,
+	retractall(blocked_db(DB, journal)).
+abort_transaction(parse(URI), _) :- !,
+	retractall(blocked_db(URI, parse)).
+abort_transaction(unload(DB), _) :- !,
+	retractall(blocked_db(DB, unload)).
+abort_transaction(_, _).
+
+
 %%	check_nested(+Level) is semidet.
 %
 %	True if we must log this transaction.   This  is always the case
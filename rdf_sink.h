@@ -0,0 +1,74 @@
+/*  Part of SWI-Prolog
+
+    Author:        Jan Wielemaker
+    E-mail:        J.Wielemaker@vu.nl
+    WWW:           http://www.swi-prolog.org
+    Copyright (C): 2013, VU University Amsterdam
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA
+*/
+
+#ifndef RDF_SINK_H_INCLUDED
+#define RDF_SINK_H_INCLUDED
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+The triple sink allows parsers that live  in another shared object (e.g.,
+turtle.so) to add triples directly to the   store without creating rdf/3
+or rdf/4 terms that must be decoded again by rdf_assert/4. rdf_db.so does
+not export C symbols. Instead, the  parser   obtains  the  address of a
+function table by calling rdf_db:rdf_sink_api_/1.
+
+Usage:
+
+    rdf_sink *s = api->open();
+    api->add_resource(s, S, P, O, G, Line);	(repeat)
+    api->add_literal(s, S, P, Value, Qualifier, LangOrType, G, Line);
+    api->close(s, TRUE);
+
+The sink collects triples and adds   them  in batches using add_triples()
+on behalf of the calling thread. This implies they become part of the
+current transaction if any.  The  caller   keeps  ownership  of  the atom
+handles it passes; the store registers the atoms it retains.
+
+The sink does not perform the duplicate   check  of rdf_assert/4, i.e.,
+it behaves as rdf_load_db/3. All functions return FALSE on failure.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define RDF_SINK_API_VERSION	1
+
+#define RDF_SINK_PLAIN		0x0	/* Same as Q_NONE, Q_TYPE and Q_LANG */
+#define RDF_SINK_TYPE		0x1
+#define RDF_SINK_LANG		0x2
+
+#define RDF_SINK_NO_LINE	0
+
+typedef struct rdf_sink rdf_sink;	/* Opaque, defined in rdf_db.c */
+
+typedef struct rdf_sink_api
+{ int		version;		/* RDF_SINK_API_VERSION */
+  rdf_sink     *(*open)(void);
+  int		(*add_resource)(rdf_sink *s,
+				atom_t subject, atom_t predicate,
+				atom_t object,
+				atom_t graph, unsigned long line);
+  int		(*add_literal)(rdf_sink *s,
+			       atom_t subject, atom_t predicate,
+			       atom_t value, int qualifier, atom_t lang_or_type,
+			       atom_t graph, unsigned long line);
+  int		(*close)(rdf_sink *s, int flush);
+} rdf_sink_api;
+
+#endif /*RDF_SINK_H_INCLUDED*/
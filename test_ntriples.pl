@@ -33,12 +33,14 @@
 	  ]).
 :- include(local_test).
 :- use_module(library(semweb/rdf_ntriples)).
+:- use_module(library(semweb/rdf_db)).
 :- use_module(library(plunit)).
 :- use_module(library(memfile)).
 
 test_ntriples :-
 	run_tests([ positive,
-		    negative
+		    negative,
+		    concurrent_load
 		  ]).
 
 atom_triple(Atom, Triple) :-
@@ -117,3 +119,34 @@ test(lang, error(syntax_error('fullstop (.) expected'))) :-
 	atom_triple('<a> <b> "hello"@e$ .', _).
 
 :- end_tests(negative).
+
+:- begin_tests(concurrent_load, [cleanup(rdf_reset_db)]).
+
+ntriples_file(File) :-
+	tmp_file_stream(text, File, Out),
+	forall(between(1, 1000, I),
+	       format(Out, '<http://example.org/s~d> <http://example.org/p> "~d" .~n',
+		      [I, I])),
+	close(Out).
+
+%	load_state(+File, +Options, -State)
+%
+%	State is the sorted list of triples after loading File into an
+%	empty database.
+
+load_state(File, Options, State) :-
+	rdf_reset_db,
+	rdf_load(File, [format(ntriples), graph(g), silent(true)|Options]),
+	findall(rdf(S,P,O,G), rdf(S,P,O,G), Triples),
+	msort(Triples, State).
+
+test(concurrent, State == State0) :-
+	ntriples_file(File),
+	call_cleanup(( load_state(File, [], State0),
+		       load_state(File, [concurrent(4)], State)
+		     ),
+		     delete_file(File)),
+	length(State, Count),
+	assertion(Count == 1000).
+
+:- end_tests(concurrent_load).
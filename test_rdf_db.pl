@@ -34,9 +34,11 @@
 :- include(local_test).
 :- use_module(library(semweb/rdf_db)).
 :- use_module(library(semweb/rdfs)).
+:- use_module(library(semweb/turtle)).
 :- use_module(library(xsdp_types)).
 :- use_module(library(lists)).
 :- use_module(library(plunit)).
+:- use_module(library(memfile)).
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 RDF-DB test file.  A test is a clause of the form:
@@ -54,7 +56,31 @@ available test sets. The public goals are:
 test_rdf_db :-
 	test,
 	run_tests([ lang_matches,
-		    lit_ranges
+		    lit_ranges,
+		    load_turtle,
+		    bulk_load,
+		    index_threads,
+		    index_set,
+		    relayout,
+		    freeze_graph,
+		    save_db_v4,
+		    load_db_threads,
+		    save_db_blocks,
+		    save_db_delta,
+		    group_commit,
+		    serializable,
+		    concurrent_link,
+		    deferred_free,
+		    gc_budget,
+		    gc_workers,
+		    drop_graph,
+		    clone_graph,
+		    changes_since,
+		    batch_monitor,
+		    async_monitor,
+		    rdf_query,
+		    rdf_triples,
+		    rdf_count
 		  ]).
 
 
@@ -1042,6 +1068,88 @@ blocked(Reason) :-
 		 *	      UNIT TESTS	*
 		 *******************************/
 
+%	db_state(-State)
+%
+%	State is the sorted list of rdf(S,P,O,G) terms for all triples.
+
+db_state(State) :-
+	findall(rdf(S,P,O,G), rdf(S,P,O,G), Triples),
+	msort(Triples, State).
+
+%	same_as_scan(+Query)
+%
+%	True if calling the rdf/4 term Query finds the same triples as
+%	filtering all triples of the database.
+
+same_as_scan(Query) :-
+	findall(Query, Query, Found0),
+	msort(Found0, Found),
+	db_state(All),
+	include(subsumes_term(Query), All, Expected),
+	assertion(Found == Expected).
+
+%	numbered_triples(+From, +To, +Predicate, +Graph)
+%
+%	Add s<I> Predicate literal(I) to Graph for each I in From..To.
+
+numbered_triples(From, To, P, G) :-
+	forall(between(From, To, I),
+	       (   atom_concat(s, I, S),
+		   rdf_assert(S, P, literal(I), G)
+	       )).
+
+%	numbered_indexed(+From, +To, +Predicate)
+%
+%	True if s<I> Predicate literal(I) is found for each I in
+%	From..To, both from its subject and from its object.
+
+numbered_indexed(From, To, P) :-
+	Count is To-From+1,
+	aggregate_all(count,
+		      ( between(From, To, I),
+			atom_concat(s, I, S),
+			rdf(S, P, literal(I))
+		      ), BySubject),
+	aggregate_all(count,
+		      ( between(From, To, I),
+			rdf(_, P, literal(I))
+		      ), ByObject),
+	assertion(BySubject == Count),
+	assertion(ByObject == Count).
+
+%	save_reload(+SaveOptions, +LoadOptions, -State0, -State)
+%
+%	Save the database using rdf_save_db/3, load it into an empty
+%	database using rdf_load_db/2 and return the state before and
+%	after.
+
+save_reload(SaveOptions, LoadOptions, State0, State) :-
+	db_state(State0),
+	tmp_file(rdf, File),
+	rdf_save_db(File, _, SaveOptions),
+	rdf_reset_db,
+	call_cleanup(rdf_load_db(File, LoadOptions),
+		     delete_file(File)),
+	db_state(State).
+
+%	run_threads(:Goal, +Count)
+%
+%	Run call(Goal, I) for I in 1..Count, each in its own thread, and
+%	wait for all threads to succeed.
+
+:- meta_predicate
+	run_threads(1, +).
+
+run_threads(Goal, Count) :-
+	findall(Id,
+		( between(1, Count, I),
+		  thread_create(call(Goal, I), Id, [])
+		), Ids),
+	forall(member(Id, Ids),
+	       (   thread_join(Id, Status),
+		   assertion(Status == true)
+	       )).
+
 :- begin_tests(lang_matches).
 
 test(lang_matches, true) :-
@@ -1098,3 +1206,1091 @@ test(bt, [setup(integers), cleanup(rdf_reset_db), all(X==[6,7,8])]) :-
 	bt(6,8, X).
 
 :- end_tests(lit_ranges).
+
+:- begin_tests(load_turtle, [cleanup(rdf_reset_db)]).
+
+%	load_atom(+Format, +Text)
+%
+%	Load the document Text in Format into the graph =g=.
+
+load_atom(Format, Text) :-
+	rdf_reset_db,
+	setup_call_cleanup(
+	    atom_to_memory_file(Text, MF),
+	    setup_call_cleanup(
+		open_memory_file(MF, read, In),
+		rdf_load(stream(In), [format(Format), graph(g), silent(true)]),
+		close(In)),
+	    free_memory_file(MF)).
+
+test(duplicates, Count == 2) :-
+	load_atom(turtle,
+		  '<http://e.org/s> <http://e.org/p> <http://e.org/o>, <http://e.org/o> .\n'),
+	rdf_graph_property(g, triples(Count)).
+test(lines) :-
+	load_atom(turtle,
+		  '<http://e.org/s> <http://e.org/p> "1" .\n\c
+		   <http://e.org/s> <http://e.org/p> "2" .\n'),
+	rdf(_, _, literal('1'), g:Line1),
+	rdf(_, _, literal('2'), g:Line2),
+	assertion(Line1 < Line2).
+test(trig_lines) :-
+	load_atom(trig,
+		  '<http://e.org/g> {\n\c
+		     <http://e.org/s> <http://e.org/p> <http://e.org/o> .\n\c
+		   }\n'),
+	rdf('http://e.org/s', 'http://e.org/p', 'http://e.org/o', Graph),
+	assertion(Graph = 'http://e.org/g':_).
+test(trig_duplicates, Count == 2) :-
+	load_atom(trig,
+		  '<http://e.org/g> {\n\c
+		     <http://e.org/s> <http://e.org/p> <http://e.org/o> .\n\c
+		     <http://e.org/s> <http://e.org/p> <http://e.org/o> .\n\c
+		   }\n'),
+	rdf_graph_property('http://e.org/g', triples(Count)).
+
+:- end_tests(load_turtle).
+
+:- begin_tests(bulk_load, [cleanup(rdf_reset_db)]).
+
+test(query, [setup(rdf_reset_db)]) :-
+	numbered_triples(1, 100, p, g),
+	rdf_bulk_load(( numbered_triples(101, 200, p, g),
+			aggregate_all(count, rdf(_, p, _), Count0),
+			assertion(Count0 == 200),
+			numbered_indexed(1, 200, p)
+		      )),
+	aggregate_all(count, rdf(_, p, _, g), Count),
+	assertion(Count == 200),
+	numbered_indexed(1, 200, p).
+test(duplicates, [setup(rdf_reset_db), Objects == [literal(1)]]) :-
+	numbered_triples(1, 10, p, g),
+	rdf_bulk_load(( numbered_triples(1, 10, p, g2),
+			findall(O, rdf(s1, p, O), Objects0),
+			assertion(Objects0 == [literal(1)])
+		      )),
+	findall(O, rdf(s1, p, O), Objects).
+test(indexes, [setup(rdf_reset_db)]) :-
+	rdf_bulk_load(numbered_triples(1, 100, p, g), [indexes([o, po])]),
+	numbered_indexed(1, 100, p).
+test(nested, [setup(rdf_reset_db)]) :-
+	rdf_bulk_load(( numbered_triples(1, 50, p, g),
+			rdf_bulk_load(numbered_triples(51, 100, p, g))
+		      )),
+	numbered_indexed(1, 100, p).
+test(threads, [setup(rdf_reset_db)]) :-
+	thread_create(rdf_bulk_load(numbered_triples(1, 100, p, g)), Id1, []),
+	thread_create(rdf_bulk_load(numbered_triples(101, 200, p, g)), Id2, []),
+	thread_join(Id1, Status1),
+	thread_join(Id2, Status2),
+	assertion(Status1 == true),
+	assertion(Status2 == true),
+	numbered_indexed(1, 200, p).
+test(fail, [setup(rdf_reset_db), fail]) :-
+	rdf_bulk_load(( numbered_triples(1, 10, p, g),
+			fail
+		      )).
+
+:- end_tests(bulk_load).
+
+:- begin_tests(index_threads, [cleanup(rdf_reset_db)]).
+
+%	Indexes are created by one thread per 100,000 triples, so we
+%	need a large database to test concurrent index creation.
+
+index_data :-
+	rdf_reset_db,
+	rdf_transaction(numbered_triples(1, 250000, p, user)).
+
+test(warm, [setup(index_data)]) :-
+	thread_create(numbered_triples(1, 1000, q, user), Id, []),
+	rdf_warm_indexes([spo, po]),
+	thread_join(Id, Status),
+	assertion(Status == true),
+	numbered_indexed(1, 250000, p),
+	numbered_indexed(1, 1000, q).
+
+:- end_tests(index_threads).
+
+:- begin_tests(index_set, [cleanup(default_indexes)]).
+
+index_set_data(Indexes) :-
+	rdf_reset_db,
+	rdf_set_indexes(Indexes),
+	forall(between(1, 20, I),
+	       (   atom_concat(s, I, S),
+		   P is I mod 3, atom_concat(p, P, Pred),
+		   O is I mod 5, atom_concat(o, O, Obj),
+		   G is I mod 2, atom_concat(g, G, Graph),
+		   rdf_assert(S, Pred, Obj, Graph)
+	       )).
+
+default_indexes :-
+	rdf_reset_db,
+	rdf_set_indexes([s,p,sp,o,po,spo,g,sg,pg]).
+
+index_query(rdf(s1, _, _, _)).
+index_query(rdf(_, p1, _, _)).
+index_query(rdf(_, _, o1, _)).
+index_query(rdf(_, _, _, g1)).
+index_query(rdf(s1, p1, _, _)).
+index_query(rdf(s1, _, o1, _)).
+index_query(rdf(_, p1, o1, _)).
+index_query(rdf(s1, p1, o1, _)).
+index_query(rdf(s1, _, _, g1)).
+index_query(rdf(_, p1, _, g1)).
+index_query(rdf(_, _, o1, g1)).
+index_query(rdf(s1, p1, _, g1)).
+index_query(rdf(_, p1, o1, g1)).
+index_query(rdf(s1, p1, o1, g1)).
+
+same_queries :-
+	forall(index_query(Q), same_as_scan(Q)).
+
+test(default, [setup(index_set_data([s,p,sp,o,po,spo,g,sg,pg]))]) :-
+	same_queries.
+test(minimal, [setup(index_set_data([s]))]) :-
+	same_queries.
+test(extra, [setup(index_set_data([s,so,og,pog]))]) :-
+	same_queries,
+	rdf_warm_indexes,
+	same_queries.
+test(indexes, Indexes == [s,so,og]) :-
+	rdf_reset_db,
+	rdf_set_indexes([og,s,so]),
+	rdf_indexes(Indexes).
+test(not_empty, [ setup(default_indexes),
+		  error(permission_error(set_indexes, rdf_db, default))
+		]) :-
+	rdf_assert(s, p, o),
+	rdf_set_indexes([s]).
+
+:- end_tests(index_set).
+
+:- begin_tests(relayout, [cleanup(rdf_reset_db)]).
+
+%	Triples that were added before an index was created use an
+%	overflow link for it until GC relays them out.
+
+relayout_data :-
+	rdf_reset_db,
+	numbered_triples(1, 1000, p, g1),
+	numbered_triples(1, 1000, q, g2).
+
+relayout_queries :-
+	same_as_scan(rdf(s1, _, _, _)),
+	same_as_scan(rdf(_, q, _, _)),
+	same_as_scan(rdf(_, _, literal(1), _)),
+	same_as_scan(rdf(_, _, _, g1)),
+	same_as_scan(rdf(s1, q, _, g2)),
+	numbered_indexed(1, 1000, p),
+	numbered_indexed(1, 1000, q).
+
+test(relayout, [setup(relayout_data)]) :-
+	db_state(State0),
+	rdf_warm_indexes,
+	relayout_queries,
+	rdf_retractall(_, q, _, g2),
+	numbered_triples(1, 1000, q, g2),
+	rdf_gc,
+	relayout_queries,
+	db_state(State),
+	assertion(State == State0),
+	rdf_statistics(triple_size(_, Pending)),
+	assertion(Pending == 0).
+
+:- end_tests(relayout).
+
+:- begin_tests(freeze_graph, [cleanup(rdf_reset_db)]).
+
+freeze_data :-
+	rdf_reset_db,
+	numbered_triples(1, 100, p, g),
+	numbered_triples(1, 100, q, g),
+	numbered_triples(1, 10, p, g2).
+
+freeze_queries :-
+	same_as_scan(rdf(s1, _, _, _)),
+	same_as_scan(rdf(_, q, _, _)),
+	same_as_scan(rdf(_, _, literal(1), _)),
+	same_as_scan(rdf(_, _, _, g)),
+	same_as_scan(rdf(s1, p, _, g)),
+	same_as_scan(rdf(_, p, literal(5), g2)).
+
+test(queries, [setup(freeze_data)]) :-
+	db_state(State0),
+	rdf_freeze_graph(g),
+	rdf_statistics(frozen_triples(Frozen)),
+	assertion(Frozen == 200),
+	db_state(State),
+	assertion(State == State0),
+	freeze_queries.
+test(modify, [setup(freeze_data)]) :-
+	rdf_freeze_graph(g),
+	rdf_retractall(s1, _, _, g),
+	rdf_assert(s1, r, o, g),
+	findall(P-O, rdf(s1, P, O, g), Pairs),
+	assertion(Pairs == [r-o]),
+	freeze_queries,
+	rdf_gc,
+	freeze_queries.
+test(refreeze, [setup(freeze_data)]) :-
+	rdf_freeze_graph(g),
+	rdf_assert(s1, r, o, g),
+	rdf_freeze_graph(g),
+	rdf_statistics(frozen_triples(Frozen)),
+	assertion(Frozen == 201),
+	freeze_queries.
+test(running_query, [setup(freeze_data), Count == 200]) :-
+	flag(freeze_graph, _, 0),
+	aggregate_all(count,
+		      ( rdf(_, _, _, g),
+			flag(freeze_graph, N, N+1),
+			(   N == 0
+			->  rdf_freeze_graph(g)
+			;   true
+			)
+		      ), Count).
+test(no_graph, [setup(freeze_data)]) :-
+	rdf_freeze_graph(nograph),
+	rdf_statistics(frozen_triples(Frozen)),
+	assertion(Frozen == 0).
+test(bulk_load, [ setup(freeze_data),
+		  error(permission_error(freeze, rdf_graph, g))
+		]) :-
+	rdf_bulk_load(rdf_freeze_graph(g)).
+
+:- end_tests(freeze_graph).
+
+:- begin_tests(save_db_v4, [cleanup(rdf_reset_db)]).
+
+v4_data :-
+	rdf_reset_db,
+	forall(data(Type, Value),
+	       (   rdf_assert(Type, value, literal(Value), g1),
+		   rdf_assert(Type, lang, literal(lang(en, Type)), g2),
+		   rdf_assert(Type, typed, literal(type(Type, Type)), g2)
+	       )),
+	numbered_triples(1, 100, p, g3).
+
+test(round_trip, [setup(v4_data), State == State0]) :-
+	save_reload([version(4)], [], State0, State).
+test(graphs, [setup(v4_data)]) :-
+	save_reload([version(4)], [graphs([g2])], State0, State),
+	findall(rdf(S,P,O,g2), member(rdf(S,P,O,g2), State0), G2),
+	assertion(State == G2).
+test(empty, [setup(rdf_reset_db), State == []]) :-
+	save_reload([version(4)], [], _, State).
+
+:- end_tests(save_db_v4).
+
+:- begin_tests(load_db_threads, [cleanup(rdf_reset_db)]).
+
+%	Version 4 files are decoded by one thread per 65,536 triples.
+
+threads_data :-
+	rdf_reset_db,
+	rdf_transaction(( numbered_triples(1, 100000, p, g1),
+			  numbered_triples(1, 100000, q, g2),
+			  forall(between(1, 1000, I),
+				 (   atom_concat(s, I, S),
+				     rdf_assert(S, r, literal(lang(en, S)), g3),
+				     rdf_assert(S, t, literal(type(t, S)), g3)
+				 ))
+			)).
+
+test(round_trip, [setup(threads_data), State == State0]) :-
+	db_state(State0),
+	tmp_file(rdf, File),
+	current_prolog_flag(rdf_triple_format, Version),
+	setup_call_cleanup(set_prolog_flag(rdf_triple_format, 4),
+			   rdf_save_db(File),
+			   set_prolog_flag(rdf_triple_format, Version)),
+	rdf_reset_db,
+	call_cleanup(rdf_load_db(File), delete_file(File)),
+	db_state(State).
+
+:- end_tests(load_db_threads).
+
+:- begin_tests(save_db_blocks, [cleanup(rdf_reset_db)]).
+
+blocks_data :-
+	rdf_reset_db,
+	numbered_triples(1, 1000, p, g1),
+	numbered_triples(1, 10, q, g2),
+	rdf_assert(s, p, literal(lang(en, hello)), g2).
+
+test(compress, [setup(blocks_data), State == State0]) :-
+	save_reload([compress(true)], [], State0, State).
+test(directory, [setup(blocks_data)]) :-
+	tmp_file(rdf, File),
+	rdf_save_db(File, _, [version(4)]),
+	call_cleanup(rdf_db_file_graphs(File, Graphs0),
+		     delete_file(File)),
+	msort(Graphs0, Graphs),
+	assertion(Graphs = [graph(g1, 1000, _), graph(g2, 11, _)]),
+	forall(member(graph(G, _, MD5), Graphs),
+	       (   MD5 == []
+	       ->  true
+	       ;   rdf_md5(G, MD5)
+	       )).
+test(select, [setup(blocks_data)]) :-
+	save_reload([compress(true)], [graphs([g2])], State0, State),
+	findall(rdf(S,P,O,g2), member(rdf(S,P,O,g2), State0), G2),
+	assertion(State == G2).
+
+:- end_tests(save_db_blocks).
+
+:- begin_tests(save_db_delta, [cleanup(rdf_reset_db)]).
+
+delta_data :-
+	rdf_reset_db,
+	forall(between(1, 10, I),
+	       rdf_assert(s, p, literal(I), g1)),
+	rdf_assert(s, q, o, g2).
+
+test(round_trip, [setup(delta_data), State == State1]) :-
+	tmp_file(rdf, Base),
+	tmp_file(rdf, Delta),
+	rdf_save_db(Base),
+	rdf_snapshot(Snapshot),
+	rdf_retractall(s, p, literal(3)),
+	rdf_retractall(s, q, o),
+	rdf_assert(s, p, literal(11), g1),
+	rdf_assert(s, r, o, g3),
+	rdf_save_db(Delta, _, [since(Snapshot)]),
+	db_state(State1),
+	rdf_reset_db,
+	rdf_load_db(Base),
+	rdf_load_db(Delta),
+	delete_file(Base),
+	delete_file(Delta),
+	db_state(State).
+test(version, [ setup(delta_data),
+		error(domain_error(rdf_db_save_version, 4))
+	      ]) :-
+	tmp_file(rdf, Delta),
+	rdf_snapshot(Snapshot),
+	rdf_assert(s, r, o, g3),
+	call_cleanup(rdf_save_db(Delta, _, [since(Snapshot), version(4)]),
+		     delete_file(Delta)).
+
+:- end_tests(save_db_delta).
+
+:- begin_tests(group_commit, [cleanup(rdf_reset_db)]).
+
+%	update_subject(+Thread)
+%
+%	Replace the object of t<Thread> p 100 times, each time using an
+%	assert followed by a retract.  Only literal(100) remains if the
+%	commits of each thread are applied in order.
+
+update_subject(Thread) :-
+	atom_concat(t, Thread, S),
+	forall(between(1, 100, I),
+	       (   rdf_assert(S, p, literal(I)),
+		   J is I-1,
+		   rdf_retractall(S, p, literal(J))
+	       )).
+
+%	transaction_predicate(+Thread)
+%
+%	Add 200 triples for the predicate u<Thread> using 20
+%	transactions.
+
+transaction_predicate(Thread) :-
+	atom_concat(u, Thread, P),
+	forall(between(1, 20, I),
+	       (   From is I*10-9,
+		   To is I*10,
+		   rdf_transaction(numbered_triples(From, To, P, user))
+	       )).
+
+test(order, [setup(rdf_reset_db)]) :-
+	rdf_statistics(group_commit(Groups0, Commits0)),
+	run_threads(update_subject, 4),
+	findall(S-O, rdf(S, p, O), Pairs0),
+	msort(Pairs0, Pairs),
+	assertion(Pairs == [ t1-literal(100), t2-literal(100),
+			     t3-literal(100), t4-literal(100)
+			   ]),
+	rdf_statistics(group_commit(Groups, Commits)),
+	assertion(Commits-Commits0 >= 400),
+	assertion(Groups-Groups0 =< Commits-Commits0).
+test(transactions, [setup(rdf_reset_db)]) :-
+	run_threads(transaction_predicate, 4),
+	forall(between(1, 4, T),
+	       (   atom_concat(u, T, P),
+		   aggregate_all(count, rdf(_, P, _), Count),
+		   assertion(Count == 200)
+	       )).
+
+:- end_tests(group_commit).
+
+:- begin_tests(serializable, [cleanup(rdf_reset_db)]).
+
+:- dynamic
+	transaction_event/1.
+
+transaction_monitor(transaction(BE, serializable)) :- !,
+	assertz(transaction_event(BE)).
+transaction_monitor(_).
+
+%	read_and_assert(+Concurrent)
+%
+%	Read the values of x/p and add x/q.  If Concurrent is =true=,
+%	another thread adds a value for x/p before we commit.
+
+read_and_assert(Concurrent) :-
+	findall(O, rdf(x, p, O), _),
+	(   Concurrent == true
+	->  thread_create(rdf_assert(x, p, 2), Id, []),
+	    thread_join(Id, Status),
+	    assertion(Status == true)
+	;   true
+	),
+	rdf_assert(x, q, 1).
+
+conflict_data :-
+	rdf_reset_db,
+	retractall(transaction_event(_)),
+	rdf_assert(x, p, 1).
+
+test(no_conflict, [setup(conflict_data)]) :-
+	rdf_transaction(read_and_assert(false), serializable,
+			[isolation(serializable)]),
+	assertion(rdf(x, q, 1)).
+test(snapshot, [setup(conflict_data)]) :-
+	rdf_transaction(read_and_assert(true), serializable, []),
+	assertion(rdf(x, p, 2)),
+	assertion(rdf(x, q, 1)).
+test(conflict, [ setup(conflict_data),
+		 cleanup((rdf_monitor(transaction_monitor, [-all]),
+			  rdf_reset_db))
+	       ]) :-
+	rdf_monitor(transaction_monitor, [-all, +transaction]),
+	\+ rdf_transaction(read_and_assert(true), serializable,
+			   [isolation(serializable)]),
+	assertion(rdf(x, p, 2)),
+	assertion(\+ rdf(x, q, 1)),
+	findall(BE, transaction_event(BE), Events),
+	assertion(Events == [begin(0), abort(0)]).
+test(retry, [setup(conflict_data)]) :-
+	flag(serializable_runs, _, 0),
+	rdf_transaction(( flag(serializable_runs, N, N+1),
+			  (   N == 0
+			  ->  read_and_assert(true)
+			  ;   read_and_assert(false)
+			  )
+			), serializable,
+			[isolation(serializable), retry(1)]),
+	flag(serializable_runs, Runs, Runs),
+	assertion(Runs == 2),
+	assertion(rdf(x, q, 1)).
+
+:- end_tests(serializable).
+
+:- begin_tests(concurrent_link, [cleanup(rdf_reset_db)]).
+
+%	link_graph(+Thread)
+%
+%	Add s<I> p literal(I) for I in 1..5000 to graph g<Thread> in
+%	chunks of 100 triples.
+
+link_graph(Thread) :-
+	atom_concat(g, Thread, G),
+	forall(between(1, 50, I),
+	       (   From is I*100-99,
+		   To is I*100,
+		   rdf_transaction(numbered_triples(From, To, p, G))
+	       )).
+
+test(link, [setup(rdf_reset_db)]) :-
+	rdf_warm_indexes,
+	run_threads(link_graph, 4),
+	forall(between(1, 4, T),
+	       (   atom_concat(g, T, G),
+		   aggregate_all(count, rdf(_, p, _, G), Count),
+		   assertion(Count == 5000)
+	       )),
+	aggregate_all(count,
+		      ( between(1, 5000, I),
+			atom_concat(s, I, S),
+			rdf(S, _, _, _)
+		      ), BySubject),
+	assertion(BySubject == 20000),
+	aggregate_all(count,
+		      ( between(1, 5000, I),
+			rdf(_, _, literal(I), _)
+		      ), ByObject),
+	assertion(ByObject == 20000),
+	same_as_scan(rdf(s1, p, literal(1), _)).
+
+:- end_tests(concurrent_link).
+
+:- begin_tests(deferred_free, [cleanup(rdf_reset_db)]).
+
+%	Readers keep scanning while the main thread deletes triples and
+%	literals and collects them.  Memory may only be freed after all
+%	scans that can see it have finished.
+
+reader(_) :-
+	forall(between(1, 200, _),
+	       (   aggregate_all(count, rdf(_, p, _), _),
+		   aggregate_all(count, rdf(_, _, literal(prefix(v), _)), _)
+	       )).
+
+writer(Round) :-
+	forall(between(1, 100, I),
+	       (   format(atom(V), 'v~w_~w', [Round, I]),
+		   rdf_assert(s, p, literal(V))
+	       )),
+	rdf_retractall(s, p, _),
+	rdf_gc.
+
+test(reclaim, [setup(rdf_reset_db)]) :-
+	findall(Id,
+		( between(1, 2, I),
+		  thread_create(reader(I), Id, [])
+		), Ids),
+	forall(between(1, 20, Round), writer(Round)),
+	forall(member(Id, Ids),
+	       (   thread_join(Id, Status),
+		   assertion(Status == true)
+	       )),
+	assertion(\+ rdf(s, p, _)),
+	rdf_assert(s, p, literal(v)),
+	assertion(rdf(s, p, literal(prefix(v), _))).
+
+:- end_tests(deferred_free).
+
+:- begin_tests(gc_budget, [cleanup((rdf_set_gc_budget(infinite), rdf_reset_db))]).
+
+gc_data :-
+	rdf_reset_db,
+	numbered_triples(1, 1000, p, g),
+	numbered_triples(1, 1000, q, g),
+	rdf_retractall(_, q, _).
+
+%	gc_budget(+Budget)
+%
+%	Run GC to completion using slices of at most Budget and verify
+%	that all garbage is collected.
+
+gc_budget(Budget) :-
+	rdf_set_gc_budget(Budget),
+	rdf_gc,
+	rdf_db:rdf_gc_info_(Info),
+	arg(2, Info, Garbage),
+	arg(9, Info, Cursor),
+	arg(10, Info, Slices),
+	assertion(Garbage == 0),
+	assertion(Cursor == idle),
+	assertion(Slices = gc_slices(_, _)),
+	assertion(\+ rdf(_, q, _)),
+	numbered_indexed(1, 1000, p).
+
+test(buckets, [setup(gc_data)]) :-
+	gc_budget(buckets(10)).
+test(time, [setup(gc_data)]) :-
+	gc_budget(time(100)).
+test(infinite, [setup(gc_data)]) :-
+	gc_budget(infinite).
+test(type, error(type_error(rdf_gc_budget, slices(10)))) :-
+	rdf_set_gc_budget(slices(10)).
+test(domain, error(domain_error(positive_integer, 0))) :-
+	rdf_set_gc_budget(buckets(0)).
+
+:- end_tests(gc_budget).
+
+:- begin_tests(gc_workers, [cleanup((rdf_set(gc_workers(0)), rdf_reset_db))]).
+
+%	Index tables are collected by one thread per 65,536 buckets, so
+%	we need a large database to test parallel GC.
+
+gc_workers_data :-
+	rdf_reset_db,
+	rdf_transaction(( numbered_triples(1, 150000, p, g),
+			  numbered_triples(150001, 300000, q, g)
+			)),
+	rdf_warm_indexes([s, o, po]),
+	rdf_set(gc_workers(4)),
+	rdf_retractall(_, q, _).
+
+test(collect, [setup(gc_workers_data)]) :-
+	rdf_gc,
+	rdf_db:rdf_gc_info_(Info),
+	arg(2, Info, Garbage),
+	assertion(Garbage == 0),
+	assertion(\+ rdf(_, q, _)),
+	numbered_indexed(1, 150000, p).
+test(range, error(domain_error(gc_workers, 100))) :-
+	rdf_set(gc_workers(100)).
+
+:- end_tests(gc_workers).
+
+:- begin_tests(drop_graph, [cleanup(rdf_reset_db)]).
+
+drop_data :-
+	rdf_reset_db,
+	numbered_triples(1, 10, p, g),
+	rdf_assert(x, p, y, g2).
+
+test(unload, [setup(drop_data)]) :-
+	rdf_unload_graph(g),
+	assertion(\+ rdf(_, _, _, g)),
+	assertion(\+ rdf_graph(g)),
+	rdf_statistics(triples(Count)),
+	assertion(Count == 1),
+	assertion(rdf(x, p, y, g2)).
+test(snapshot, [setup(drop_data), Count == 10]) :-
+	rdf_snapshot(Snapshot),
+	rdf_unload_graph(g),
+	rdf_transaction(aggregate_all(count, rdf(_, _, _, g), Count),
+			drop_graph, [snapshot(Snapshot)]),
+	rdf_delete_snapshot(Snapshot).
+test(running_query, [setup(drop_data), Count == 10]) :-
+	flag(drop_graph, _, 0),
+	aggregate_all(count,
+		      ( rdf(_, p, _, g),
+			flag(drop_graph, N, N+1),
+			(   N == 0
+			->  rdf_unload_graph(g)
+			;   true
+			)
+		      ), Count),
+	assertion(\+ rdf(_, _, _, g)).
+test(reuse, [setup(drop_data)]) :-
+	rdf_unload_graph(g),
+	rdf_assert(new, p, o, g),
+	findall(S, rdf(S, _, _, g), Subjects),
+	assertion(Subjects == [new]),
+	rdf_gc,
+	findall(S, rdf(S, _, _, g), Subjects2),
+	assertion(Subjects2 == [new]),
+	rdf_statistics(triples_by_graph(g, Count)),
+	assertion(Count == 1).
+test(transaction, [setup(drop_data)]) :-
+	rdf_transaction(rdf_unload_graph(g)),
+	assertion(\+ rdf(_, _, _, g)),
+	assertion(rdf(x, p, y, g2)).
+
+:- end_tests(drop_graph).
+
+:- begin_tests(clone_graph, [cleanup(rdf_reset_db)]).
+
+graph_state(G, State) :-
+	findall(rdf(S,P,O), rdf(S, P, O, G), Triples),
+	msort(Triples, State).
+
+clone_data :-
+	rdf_reset_db,
+	numbered_triples(1, 10, p, g1).
+
+test(clone, [setup(clone_data)]) :-
+	graph_state(g1, State0),
+	rdf_clone_graph(g1, g2),
+	graph_state(g1, State1),
+	graph_state(g2, Clone),
+	assertion(State1 == State0),
+	assertion(Clone == State0),
+	rdf_retractall(s1, p, _, g1),
+	rdf_assert(new, p, o, g1),
+	graph_state(g2, Clone1),
+	assertion(Clone1 == State0),
+	rdf_retractall(s2, p, _, g2),
+	graph_state(g1, State2),
+	assertion(memberchk(rdf(s2, p, literal(2)), State2)),
+	assertion(memberchk(rdf(new, p, o), State2)),
+	assertion(\+ memberchk(rdf(s1, p, literal(1)), State2)).
+test(not_empty, [ setup(clone_data),
+		  error(permission_error(clone_to, rdf_graph, g2))
+		]) :-
+	rdf_assert(x, p, y, g2),
+	rdf_clone_graph(g1, g2).
+test(swap, [setup(clone_data)]) :-
+	rdf_assert(x, p, y, g2),
+	graph_state(g1, State1),
+	graph_state(g2, State2),
+	rdf_swap_graphs(g1, g2),
+	graph_state(g1, Swapped1),
+	graph_state(g2, Swapped2),
+	assertion(Swapped1 == State2),
+	assertion(Swapped2 == State1).
+
+:- end_tests(clone_graph).
+
+:- begin_tests(changes_since, [cleanup(rdf_reset_db)]).
+
+%	apply_changes(+Changes, +State0, -State)
+%
+%	Replay a list of changes from rdf_changes_since/5 on a sorted
+%	list of rdf(S,P,O,G) terms.
+
+apply_changes([], State0, State) :-
+	msort(State0, State).
+apply_changes([H|T], State0, State) :-
+	apply_change(H, State0, State1),
+	apply_changes(T, State1, State).
+
+apply_change(added(_, S, P, O, G), State, [rdf(S,P,O,G)|State]).
+apply_change(deleted(_, S, P, O, G), State0, State) :-
+	selectchk(rdf(S,P,O,G), State0, State).
+apply_change(dropped(_, G), State0, State) :-
+	exclude(in_graph(G), State0, State).
+
+in_graph(G, rdf(_,_,_,G)).
+
+%	drops_first(+Changes)
+%
+%	True if the dropped/2 changes of each generation precede its
+%	added/5 and deleted/5 changes.
+
+drops_first([]).
+drops_first([H|T]) :-
+	(   H = dropped(_, _)
+	->  true
+	;   arg(1, H, Gen),
+	    \+ memberchk(dropped(Gen, _), T)
+	),
+	drops_first(T).
+
+swap_data :-
+	rdf_reset_db,
+	rdf_assert(a, p, literal(1), g1),
+	rdf_assert(b, p, literal(2), g1),
+	rdf_assert(c, q, literal(3), g2).
+
+test(swap, [setup(swap_data)]) :-
+	rdf_subscribe_changes(Sub, Gen0),
+	db_state(State0),
+	rdf_swap_graphs(g1, g2),
+	rdf_assert(d, q, literal(4), g2),
+	rdf_changes_since(Sub, Gen0, Changes, _Until, []),
+	rdf_unsubscribe_changes(Sub),
+	assertion(drops_first(Changes)),
+	apply_changes(Changes, State0, State),
+	db_state(State1),
+	assertion(State == State1).
+test(max_changes, [setup(swap_data)]) :-
+	rdf_subscribe_changes(Sub, Gen0),
+	db_state(State0),
+	rdf_swap_graphs(g1, g2),
+	rdf_changes_since(Sub, Gen0, Changes, Until, [max_changes(1)]),
+	rdf_changes_since(Sub, Until, More, _, []),
+	rdf_unsubscribe_changes(Sub),
+	assertion(More == []),
+	apply_changes(Changes, State0, State),
+	db_state(State1),
+	assertion(State == State1).
+
+:- end_tests(changes_since).
+
+:- begin_tests(batch_monitor, [cleanup(rdf_reset_db)]).
+
+:- dynamic
+	batch/3.
+
+batch_monitor(batch(Event, Batch)) :-
+	rdf_batch_size(Batch, Size),
+	findall(T, rdf_batch_triple(Batch, T), Triples),
+	assertz(batch(Event, Size, Triples)).
+
+watch_batches(Mask) :-
+	rdf_reset_db,
+	retractall(batch(_,_,_)),
+	rdf_monitor(batch_monitor, [-all, +Mask, batch]).
+
+no_batch_monitor :-
+	rdf_monitor(batch_monitor, [-all]),
+	rdf_reset_db.
+
+batch_triples(Event, Size, Triples) :-
+	findall(S-T, batch(Event, S, T), Pairs),
+	pairs_keys_values(Pairs, Sizes, Lists),
+	sum_list(Sizes, Size),
+	append(Lists, Triples0),
+	msort(Triples0, Triples).
+
+test(transaction, [ setup(watch_batches(assert)),
+		    cleanup(no_batch_monitor)
+		  ]) :-
+	rdf_transaction(forall(between(1, 3, I),
+			       rdf_assert(s, p, literal(I), g))),
+	findall(E-S, batch(E, S, _), Batches),
+	assertion(Batches == [assert-3]),
+	batch_triples(assert, _, Triples),
+	assertion(Triples == [ rdf(s,p,literal(1),g),
+			       rdf(s,p,literal(2),g),
+			       rdf(s,p,literal(3),g)
+			     ]).
+test(update, [ setup(watch_batches(update)),
+	       cleanup(no_batch_monitor)
+	     ]) :-
+	rdf_assert(s, p, literal(1), g),
+	rdf_update(s, p, literal(1), object(literal(2))),
+	batch_triples(update, Size, Triples),
+	assertion(Size == 1),
+	assertion(Triples == [ update(rdf(s,p,literal(1),g),
+				      rdf(s,p,literal(2),g))
+			     ]).
+test(unload, [ setup(watch_batches(retract)),
+	       cleanup(no_batch_monitor)
+	     ]) :-
+	rdf_assert(s, p, literal(1), g),
+	rdf_assert(s, p, literal(2), g),
+	rdf_assert(s, p, literal(3), g2),
+	rdf_unload_graph(g),
+	batch_triples(retract, Size, Triples),
+	assertion(Size == 2),
+	assertion(Triples == [ rdf(s,p,literal(1),g),
+			       rdf(s,p,literal(2),g)
+			     ]),
+	assertion(rdf(s, p, literal(3))).
+
+:- end_tests(batch_monitor).
+
+:- begin_tests(async_monitor, [cleanup(rdf_reset_db)]).
+
+:- dynamic
+	async_event/1.
+
+async_monitor(Event) :-
+	assertz(async_event(Event)).
+
+watch_async(Options) :-
+	rdf_reset_db,
+	retractall(async_event(_)),
+	rdf_monitor(async_monitor, [-all, +assert|Options]).
+
+no_async_monitor :-
+	rdf_monitor(async_monitor, [-all]),
+	rdf_reset_db.
+
+%	delivered(-Count)
+%
+%	Count is the number of assert events delivered, including the
+%	events reported as lost(N) by the =coalesce= policy.
+
+delivered(Count) :-
+	aggregate_all(count, async_event(assert(_,_,_,_)), Asserts),
+	aggregate_all(sum(N), async_event(lost(N)), Lost),
+	Count is Asserts+Lost.
+
+%	wait_delivered(+Count)
+%
+%	Wait until Count events are delivered.  Use with
+%	call_with_time_limit/2.
+
+wait_delivered(Count) :-
+	delivered(Count), !.
+wait_delivered(Count) :-
+	sleep(0.01),
+	wait_delivered(Count).
+
+assert_triples(N) :-
+	forall(between(1, N, I),
+	       rdf_assert(s, p, literal(I))).
+
+test(deliver, [ setup(watch_async([async(100)])),
+		cleanup(no_async_monitor)
+	      ]) :-
+	assert_triples(3),
+	call_with_time_limit(10, wait_delivered(3)),
+	findall(O, async_event(assert(s,p,O,_)), Objects),
+	assertion(Objects == [literal(1), literal(2), literal(3)]).
+test(block, [ setup(watch_async([async(1), queue_policy(block)])),
+	      cleanup(no_async_monitor)
+	    ]) :-
+	assert_triples(20),
+	call_with_time_limit(10, wait_delivered(20)),
+	assertion(\+ async_event(lost(_))).
+test(coalesce, [ setup(watch_async([async(1), queue_policy(coalesce)])),
+		 cleanup(no_async_monitor)
+	       ]) :-
+	assert_triples(20),
+	call_with_time_limit(10, wait_delivered(20)).
+test(stop, [ setup(watch_async([async(100)])),
+	     cleanup(no_async_monitor)
+	   ]) :-
+	rdf_monitor(async_monitor, [-all]),
+	assertion(\+ rdf_statistics(monitor_queue(_:async_monitor, _, _, _))),
+	assert_triples(3),
+	sleep(0.1),
+	assertion(\+ async_event(_)),
+	rdf_monitor(async_monitor, [-all, +assert, async(100)]),
+	assertion(rdf_statistics(monitor_queue(_:async_monitor, _, _, _))),
+	rdf_assert(s, p, o),
+	call_with_time_limit(10, wait_delivered(1)).
+
+:- end_tests(async_monitor).
+
+:- begin_tests(rdf_query, [ setup(query_data),
+			    cleanup(rdf_reset_db)
+			  ]).
+
+query_data :-
+	rdf_reset_db,
+	forall(between(1, 500, I),
+	       (   atom_concat(p, I, P),
+		   G is I mod 3,
+		   atom_concat(g, G, Graph),
+		   rdf_assert(P, type, person, Graph),
+		   rdf_assert(P, name, literal(I)),
+		   K is (I*7) mod 500 + 1,
+		   atom_concat(p, K, Known),
+		   rdf_assert(P, knows, Known)
+	       )),
+	rdf_assert(amsterdam, type, city),
+	rdf_assert(paris, type, city).
+
+%	same_as_conjunction(+Patterns)
+%
+%	True if rdf_query/2 on Patterns yields the same rows as calling
+%	the patterns as a conjunction of rdf/3 and rdf/4 goals.
+
+same_as_conjunction(Patterns) :-
+	rdf_query(Patterns, Rows0),
+	term_variables(Patterns, Vars),
+	list_to_conj(Patterns, Goal),
+	findall(Vars, Goal, Expected0),
+	msort(Rows0, Rows),
+	msort(Expected0, Expected),
+	assertion(Rows == Expected).
+
+list_to_conj([], true).
+list_to_conj([H], H) :- !.
+list_to_conj([H|T], (H,G)) :-
+	list_to_conj(T, G).
+
+test(join) :-
+	same_as_conjunction([rdf(X, type, person), rdf(X, name, _)]).
+test(cycle) :-
+	same_as_conjunction([rdf(X, knows, Y), rdf(Y, knows, X)]).
+test(chain) :-
+	same_as_conjunction([ rdf(_X, knows, Y), rdf(Y, knows, Z),
+			      rdf(Z, name, literal(42))
+			    ]).
+test(graph) :-
+	same_as_conjunction([rdf(X, type, person, g1), rdf(X, name, _)]).
+test(ground) :-
+	same_as_conjunction([rdf(p1, type, person), rdf(p1, name, _)]).
+test(product) :-
+	same_as_conjunction([rdf(_, type, city), rdf(_, type, city)]).
+test(empty) :-
+	same_as_conjunction([rdf(X, type, city), rdf(X, name, _)]).
+test(rows, Rows == [[amsterdam], [paris]]) :-
+	rdf_query([rdf(X, type, city)], Rows0),
+	assertion(var(X)),
+	msort(Rows0, Rows).
+
+:- end_tests(rdf_query).
+
+:- begin_tests(rdf_triples, [ setup(triples_data),
+			      cleanup(rdf_reset_db)
+			    ]).
+
+triples_data :-
+	rdf_reset_db,
+	numbered_triples(1, 25, p, g1),
+	numbered_triples(1, 10, q, g2),
+	numbered_triples(1, 5, q, g3).
+
+%	same_batches(+Pattern, +Max)
+%
+%	True if the batches of rdf_triples/3 hold at most Max triples
+%	and together hold the answers of calling Pattern.
+
+same_batches(Pattern, Max) :-
+	findall(Batch, rdf_triples(Pattern, Max, Batch), Batches),
+	forall(member(Batch, Batches),
+	       (   length(Batch, Len),
+		   assertion(between(1, Max, Len))
+	       )),
+	append(Batches, Triples0),
+	msort(Triples0, Triples),
+	findall(Pattern, Pattern, Expected0),
+	msort(Expected0, Expected),
+	assertion(Triples == Expected).
+
+test(all) :-
+	same_batches(rdf(_, _, _), 7).
+test(predicate) :-
+	same_batches(rdf(_, p, _), 10).
+test(duplicates) :-
+	same_batches(rdf(_, q, _), 3).
+test(graph) :-
+	same_batches(rdf(_, _, _, g2), 4).
+test(graphs) :-
+	same_batches(rdf(_, q, _, _), 4).
+test(one) :-
+	same_batches(rdf(_, _, _), 1).
+test(sizes, Sizes == [10, 10, 5]) :-
+	findall(Len,
+		( rdf_triples(rdf(_, p, _), 10, Batch),
+		  length(Batch, Len)
+		), Sizes).
+test(last, Triples == [rdf(s1, p, literal(1)), rdf(s1, q, literal(1))]) :-
+	rdf_triples(rdf(s1, _, _), 10, Triples0),
+	msort(Triples0, Triples).
+test(none, fail) :-
+	rdf_triples(rdf(nosubject, _, _), 10, _).
+test(max, error(domain_error(positive_integer, 0))) :-
+	rdf_triples(rdf(_, _, _), 0, _).
+
+:- end_tests(rdf_triples).
+
+:- begin_tests(rdf_count, [cleanup(rdf_reset_db)]).
+
+count_data :-
+	rdf_reset_db,
+	forall(between(1, 100, I),
+	       (   G is I mod 2,
+		   atom_concat(g, G, Graph),
+		   atom_concat(s, I, S),
+		   rdf_assert(s, p, literal(I), Graph),
+		   rdf_assert(S, q, o, Graph)
+	       )),
+	rdf_assert(s, r, o).
+
+%	same_count(?S, ?P, ?O)
+%
+%	True if rdf_count/4 agrees with counting the answers of rdf/3.
+
+same_count(S, P, O) :-
+	rdf_count(S, P, O, Count),
+	aggregate_all(count, rdf(S, P, O), Expected),
+	assertion(Count == Expected).
+
+same_counts :-
+	same_count(_, _, _),
+	same_count(s, _, _),
+	same_count(_, p, _),
+	same_count(_, q, _),
+	same_count(_, q, o),
+	same_count(_, _, o),
+	same_count(s, p, literal(42)),
+	same_count(_, nopred, _),
+	same_count(nosubject, _, _).
+
+test(counts, [setup(count_data)]) :-
+	same_counts.
+test(retract, [setup(count_data)]) :-
+	rdf_retractall(s, p, literal(1)),
+	rdf_retractall(_, q, o, g0),
+	same_counts.
+test(transaction, [setup(count_data)]) :-
+	rdf_transaction(( rdf_assert(s, p, literal(101)),
+			  rdf_retractall(_, q, o, g1),
+			  same_counts
+			)),
+	same_counts.
+test(unload, [setup(count_data)]) :-
+	rdf_unload_graph(g1),
+	same_counts,
+	rdf_gc,
+	same_counts.
+test(total, [setup(count_data), Count == 201]) :-
+	rdf_count(_, _, _, Count).
+
+:- end_tests(rdf_count).
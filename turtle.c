@@ -41,6 +41,7 @@
 #include <wchar.h>
 #include <assert.h>
 #include "murmur.h"
+#include "rdf_sink.h"
 #include "turtle_chars.c"
 
 #ifdef __WINDOWS__
@@ -225,6 +226,9 @@ typedef struct turtle_state
   size_t	count;			/* Counted triples */
   term_t	head;			/* Head of triple list */
   term_t	tail;			/* Tail of triple list */
+  rdf_sink     *sink;			/* Add directly to the RDF store */
+  atom_t	sink_graph;		/* Graph if there is no current graph */
+  unsigned long	sink_line;		/* Line where statement started */
 } turtle_state;
 
 
@@ -1236,6 +1240,29 @@ o_name(object *o, char *buf)
 }
 
 
+/* bnode_name() returns the name for a blank node if an anon_prefix
+   is specified.  The name is only valid until the next call.
+*/
+
+static const wchar_t *
+bnode_name(turtle_state *ts, resource *r)
+{ if ( !ts->bnode.buffer )
+  { size_t plen = wcslen(ts->bnode.prefix);
+
+    ts->bnode.buffer = malloc((plen+64)*sizeof(wchar_t));
+    if ( !ts->bnode.buffer )
+    { PL_resource_error("memory");
+      return NULL;
+    }
+    wcscpy(ts->bnode.buffer, ts->bnode.prefix);
+    ts->bnode.prefix_end = &ts->bnode.buffer[plen];
+  }
+  swprintf(ts->bnode.prefix_end, 64, L"%ld", (long)r->v.bnode_id);
+
+  return ts->bnode.buffer;
+}
+
+
 static int
 put_resource(turtle_state *ts, term_t t, resource *r)
 { switch ( r->type )
@@ -1246,18 +1273,12 @@ put_resource(turtle_state *ts, term_t t, resource *r)
     }
     case R_BNODE:
     { if ( ts->bnode.prefix )
-      { if ( !ts->bnode.buffer )
-	{ size_t plen = wcslen(ts->bnode.prefix);
-
-	  ts->bnode.buffer = malloc((plen+64)*sizeof(wchar_t));
-	  if ( !ts->bnode.buffer )
-	    return PL_resource_error("memory");
-	  wcscpy(ts->bnode.buffer, ts->bnode.prefix);
-	  ts->bnode.prefix_end = &ts->bnode.buffer[plen];
-	}
-	swprintf(ts->bnode.prefix_end, 64, L"%ld", (long)r->v.bnode_id);
+      { const wchar_t *name;
+
+	if ( !(name=bnode_name(ts, r)) )
+	  return FALSE;
 	PL_put_variable(t);
-	return PL_unify_wchars(t, PL_ATOM, (size_t)-1, ts->bnode.buffer);
+	return PL_unify_wchars(t, PL_ATOM, (size_t)-1, name);
       } else
       { return ( PL_put_int64(t, r->v.bnode_id) &&
 		 PL_cons_functor_v(t, FUNCTOR_node1, t)
@@ -1326,12 +1347,121 @@ put_graph(turtle_state *ts, term_t g)
 }
 
 
+		 /*******************************
+		 *	   DIRECT LOADING	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+If turtle_load_db/3 is used, triples are  not   turned  into rdf/3 or
+rdf/4 terms, but passed to the   triple  sink provided by rdf_db.so (see
+rdf_sink.h). The atoms returned by resource_atom() are registered and
+must be released using PL_unregister_atom() after the triple is added.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static rdf_sink_api *sink_api;
+
+static int
+get_sink_api(rdf_sink_api **api)
+{ if ( !sink_api )
+  { static predicate_t pred;
+    term_t av;
+    void *ptr;
+
+    if ( !pred )
+      pred = PL_predicate("rdf_sink_api_", 1, "rdf_db");
+
+    if ( !(av = PL_new_term_ref()) ||
+	 !PL_call_predicate(NULL, PL_Q_PASS_EXCEPTION, pred, av) ||
+	 !PL_get_pointer(av, &ptr) )
+      return FALSE;
+    if ( ((rdf_sink_api*)ptr)->version != RDF_SINK_API_VERSION )
+      return PL_existence_error("rdf_sink_api", av);
+
+    sink_api = ptr;
+  }
+
+  *api = sink_api;
+  return TRUE;
+}
+
+
+static atom_t
+resource_atom(turtle_state *ts, resource *r)
+{ if ( r->type == R_RESOURCE )
+  { if ( !r->v.r.handle )
+      r->v.r.handle = PL_new_atom_wchars(wcslen(r->v.r.name), r->v.r.name);
+    PL_register_atom(r->v.r.handle);
+
+    return r->v.r.handle;
+  } else
+  { const wchar_t *name;
+
+    if ( (name=bnode_name(ts, r)) )
+      return PL_new_atom_wchars(wcslen(name), name);
+
+    return 0;
+  }
+}
+
+
+static int
+sink_triple(turtle_state *ts, resource *s, resource *p, object *o)
+{ atom_t sa = 0, pa = 0, oa = 0, lt = 0, ga;
+  unsigned long line;
+  int rc;
+
+  if ( ts->current_graph )
+  { IOPOS *pos;
+
+    ga   = resource_atom(ts, ts->current_graph);
+    line = ((pos=ts->input->position) ? pos->lineno : RDF_SINK_NO_LINE);
+  } else
+  { ga   = ts->sink_graph;
+    line = ts->sink_line;
+    PL_register_atom(ga);
+  }
+
+  if ( !(sa=resource_atom(ts, s)) ||
+       !(pa=resource_atom(ts, p)) )
+  { rc = FALSE;
+  } else if ( o->type == O_RESOURCE )
+  { if ( (oa=resource_atom(ts, o->value.r)) )
+      rc = sink_api->add_resource(ts->sink, sa, pa, oa, ga, line);
+    else
+      rc = FALSE;
+  } else
+  { int qualifier = RDF_SINK_PLAIN;
+
+    oa = PL_new_atom_wchars(o->value.l.len, o->value.l.string);
+    if ( o->value.l.lang )
+    { qualifier = RDF_SINK_LANG;
+      lt = PL_new_atom_wchars(wcslen(o->value.l.lang), o->value.l.lang);
+    } else if ( o->value.l.type )
+    { qualifier = RDF_SINK_TYPE;
+      lt = resource_atom(ts, o->value.l.type);
+    }
+
+    rc = sink_api->add_literal(ts->sink, sa, pa, oa, qualifier, lt, ga, line);
+  }
+
+  PL_unregister_atom(ga);
+  if ( sa ) PL_unregister_atom(sa);
+  if ( pa ) PL_unregister_atom(pa);
+  if ( oa ) PL_unregister_atom(oa);
+  if ( lt ) PL_unregister_atom(lt);
+
+  return rc;
+}
+
+
 static int
 got_triple(turtle_state *ts, resource *s, resource *p, object *o)
 { if ( ts->count++ == 0 && ts->format == D_AUTO )
     set_format(ts, D_TURTLE);
 
-  if ( ts->tail )
+  if ( ts->sink )
+  { return sink_triple(ts, s, p, o);
+  } else if ( ts->tail )
   { term_t av = PL_new_term_refs(4);
     functor_t rdff = (ts->current_graph ? FUNCTOR_rdf4 : FUNCTOR_rdf3);
 
@@ -3058,6 +3188,81 @@ turtle_parse(term_t parser, term_t triples, term_t options)
 }
 
 
+/** turtle_load_db(+Parser, +Graph, +Options) is det.
+ *
+ * Parse the entire document and add the triples directly to the RDF
+ * store using the triple sink of rdf_db.so. Triples for which the
+ * document does not specify a graph are added to Graph.  The only
+ * option processed is count(-Count).  The parser must have an
+ * anon_prefix.
+*/
+
+static foreign_t
+turtle_load_db(term_t parser, term_t graph, term_t options)
+{ turtle_state *ts;
+  rdf_sink_api *api;
+
+  if ( get_turtle_parser(parser, &ts) &&
+       get_sink_api(&api) )
+  { term_t opt   = PL_new_term_ref();
+    term_t arg   = PL_new_term_ref();
+    term_t opts  = PL_copy_term_ref(options);
+    term_t count = 0;
+    atom_t g;
+    int rc;
+
+    if ( !PL_get_atom_ex(graph, &g) )
+      return FALSE;
+    if ( !ts->bnode.prefix )
+      return PL_existence_error("anon_prefix", parser);
+
+    while(PL_get_list_ex(opts, opt, opts))
+    { atom_t name;
+      int arity;
+
+      if ( PL_get_name_arity(opt, &name, &arity) )
+      { if ( arity == 1 )
+	{ _PL_get_arg(1, opt, arg);
+
+	  if ( name == ATOM_count )			/* COUNT */
+	    count = PL_copy_term_ref(arg);
+	  continue;			/* ignore unknown option */
+	}
+      }
+
+      return PL_type_error("option", opt);
+    }
+    if ( PL_exception(0) || !PL_get_nil_ex(opts) )
+      return FALSE;
+
+    if ( !(ts->sink = api->open()) )
+      return PL_resource_error("memory");
+    ts->sink_graph = g;
+
+    do
+    { IOPOS *pos;
+
+      ts->sink_line = ((pos=ts->input->position) ? pos->lineno
+						 : RDF_SINK_NO_LINE);
+      statement(ts);
+    } while( !PL_exception(0) && !Sfeof(ts->input) );
+
+    rc = api->close(ts->sink, !PL_exception(0));
+    ts->sink = NULL;
+    ts->sink_graph = 0;
+
+    if ( !rc || PL_exception(0) )
+      return FALSE;
+    if ( count && !PL_unify_int64(count, (int64_t)ts->count) )
+      return FALSE;
+
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
 /** turtle_graph(+Parser, -Graph) is semidet.
  *
  * True when Graph is the current graph of Parser
@@ -3496,6 +3701,7 @@ install_turtle(void)
   PL_register_foreign("create_turtle_parser",  3, create_turtle_parser,  0);
   PL_register_foreign("destroy_turtle_parser", 1, destroy_turtle_parser, 0);
   PL_register_foreign("turtle_parse",          3, turtle_parse,          0);
+  PL_register_foreign("turtle_load_db",        3, turtle_load_db,        0);
   PL_register_foreign("turtle_prefixes",       2, turtle_prefixes,       0);
   PL_register_foreign("turtle_base",           2, turtle_base,           0);
   PL_register_foreign("turtle_error_count",    2, turtle_error_count,    0);
@@ -362,23 +362,32 @@ rdf_db:rdf_load_stream(trig, Stream, Options) :-
 load_turtle_stream(Stream, _Module:Options) :-
 	rdf_db:graph(Options, Graph),
 	atom_concat('__', Graph, BNodePrefix),
-	rdf_transaction((  rdf_process_turtle(Stream, assert_triples,
-					      [ anon_prefix(BNodePrefix)
-					      | Options
-					      ]),
+	rdf_transaction((  load_turtle_db(Stream, Graph,
+					  [ anon_prefix(BNodePrefix)
+					  | Options
+					  ]),
 			   rdf_set_graph(Graph, modified(false))
 			),
 			parse(Graph)).
 
-assert_triples([], _).
-assert_triples([H|T], Location) :-
-	assert_triple(H, Location),
-	assert_triples(T, Location).
+%%	load_turtle_db(+Stream, +Graph, +Options) is det.
+%
+%	Load Stream into the RDF database.  Unlike rdf_process_turtle/3,
+%	the parser adds the triples directly   to the database, avoiding
+%	the creation of rdf/3 and rdf/4 terms. Triples for which the
+%	document does not specify a graph are added to Graph.
 
-assert_triple(rdf(S,P,O), Location) :-
-	rdf_assert(S,P,O,Location).
-assert_triple(rdf(S,P,O,G), _) :-
-	rdf_assert(S,P,O,G).
+load_turtle_db(Stream, Graph, Options) :-
+	setup_call_cleanup(
+	    ( open_input(stream(Stream), In, Close),
+	      create_turtle_parser(Parser, In, Options)
+	    ),
+	    ( turtle_load_db(Parser, Graph, Options),
+	      post_options(Parser, Options)
+	    ),
+	    ( destroy_turtle_parser(Parser),
+	      call(Close)
+	    )).
 
 
 rdf_db:rdf_file_type(ttl,  turtle).